@@ -0,0 +1,759 @@
+/*
+ * dlm-load: scriptable load generator for a DLM lockspace, the
+ * non-interactive counterpart of dlm-test.c.
+ *
+ * N threads lock, optionally convert, then unlock resources picked
+ * among M, and the latency of every request is added to a log2
+ * histogram per operation. It measures the raw cost of the DLM, to
+ * be set against what src/v2/bench/dlm_bench reports for the libvirt
+ * driver on top of it.
+ *
+ * Against the kernel DLM (dlm_controld running, as root):
+ *
+ *   cc -o dlm-load dlm-load.c -ldlm -lpthread
+ *
+ * Against the in-process stand-in of the driver benchmarks, with
+ * the same latency model as dlm_bench (-R and -J):
+ *
+ *   cc -DWITH_FAKE_DLM -I../../../src/v2/bench -o dlm-load \
+ *      dlm-load.c ../../../src/v2/bench/fake_dlm.c -lpthread
+ *
+ * Resources 0 to H-1 are hot, shared by every thread, the others
+ * are split between the threads. A lock goes to a hot resource with
+ * the contention probability, so 0 means no two threads ever compete.
+ *
+ * New locks wait in the queue unless -N is given, conversions never
+ * do: a conversion denied with EAGAIN is counted and the lock is
+ * unlocked as is, which keeps threads from deadlocking on converts.
+ *
+ * With the async API every thread keeps -q requests in flight, the
+ * next request of a slot being issued from the AST of the previous
+ * one, as the libvirt driver does. The sync API uses the _wait calls.
+ */
+
+#define _REENTRANT // for `dlm_ls_pthread_init`
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libdlm.h>
+
+#ifdef WITH_FAKE_DLM
+#include "fake_dlm.h"
+#endif
+
+#define LOCKSPACE_NAME "load"
+#define LOCKSPACE_MODE 0600
+#define NAME_LEN 32
+#define MAX_DEPTH 256
+#define BUCKETS 32      /* log2 of microseconds */
+
+enum {
+    OP_LOCK,
+    OP_CONVERT,
+    OP_UNLOCK,
+    OP_LAST
+};
+
+static const char *op_names[OP_LAST] = { "lock", "convert", "unlock" };
+
+static const struct {
+    const char *name;
+    int mode;
+} modes[] = {
+    { "nl", LKM_NLMODE },
+    { "cr", LKM_CRMODE },
+    { "cw", LKM_CWMODE },
+    { "pr", LKM_PRMODE },
+    { "pw", LKM_PWMODE },
+    { "ex", LKM_EXMODE },
+};
+
+#define NMODES (sizeof(modes) / sizeof(modes[0]))
+
+struct histogram {
+    unsigned long long count;
+    unsigned long long errors;
+    unsigned long long denied;      /* EAGAIN of LKF_NOQUEUE */
+    unsigned long long sum;         /* microseconds */
+    unsigned long long max;
+    unsigned long long buckets[BUCKETS];
+};
+
+struct thread;
+
+/* One chain of lock, convert, unlock requests */
+struct slot {
+    struct thread *thread;
+    struct dlm_lksb lksb;
+    char name[NAME_LEN];
+    int op;
+    int mode;
+    unsigned long long start;
+};
+
+struct thread {
+    pthread_t tid;
+    unsigned int index;
+    unsigned int seed;
+    unsigned long long ops;         /* lock cycles started */
+    struct histogram hist[OP_LAST];
+
+    /* async: slots still running */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int running;
+    struct slot slots[MAX_DEPTH];
+};
+
+static struct {
+    const char *lockspace;
+    unsigned int threads;
+    unsigned int resources;
+    unsigned int hot;
+    unsigned int contention;        /* percent of locks on hot resources */
+    unsigned int convert;           /* percent of locks converted */
+    unsigned int weights[NMODES];   /* mode mix of new locks */
+    unsigned int total_weight;
+    unsigned long long ops;         /* per thread, 0 for no limit */
+    unsigned int duration;          /* seconds, 0 for no limit */
+    bool async;
+    unsigned int depth;
+    bool noqueue;
+    unsigned int rtt;               /* stand-in only, microseconds */
+    unsigned int jitter;
+    unsigned int nodes;
+
+    dlm_lshandle_t ls;
+    unsigned long long deadline;
+    volatile bool stop;
+} load = {
+    .lockspace = LOCKSPACE_NAME,
+    .threads = 4,
+    .resources = 64,
+    .hot = 1,
+    .contention = 0,
+    .convert = 0,
+    .weights = { 0, 0, 0, 0, 0, 1 },
+    .total_weight = 1,
+    .ops = 10000,
+    .duration = 0,
+    .async = false,
+    .depth = 1,
+    .noqueue = false,
+    .rtt = 200,
+    .jitter = 0,
+    .nodes = 1,
+};
+
+static unsigned long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void hist_add(struct histogram *hist, unsigned long long us)
+{
+    unsigned int bucket = 0;
+
+    while (bucket < BUCKETS - 1 && (1ULL << bucket) <= us)
+        bucket++;
+
+    hist->count++;
+    hist->sum += us;
+    hist->buckets[bucket]++;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+static void hist_merge(struct histogram *to, const struct histogram *from)
+{
+    unsigned int i;
+
+    to->count += from->count;
+    to->errors += from->errors;
+    to->denied += from->denied;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+    for (i = 0; i < BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+}
+
+/* Upper bound of the bucket holding the @permille quantile */
+static unsigned long long hist_quantile(const struct histogram *hist,
+                                        unsigned int permille)
+{
+    unsigned long long rank, seen = 0;
+    unsigned int i;
+
+    if (!hist->count)
+        return 0;
+
+    rank = (hist->count * permille + 999) / 1000;
+    for (i = 0; i < BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+            return i ? (1ULL << i) - 1 : 0;
+    }
+
+    return hist->max;
+}
+
+static unsigned int pick(unsigned int *seed, unsigned int max)
+{
+    return rand_r(seed) % max;
+}
+
+static int pick_mode(struct thread *thread)
+{
+    unsigned int w = pick(&thread->seed, load.total_weight);
+    unsigned int i;
+
+    for (i = 0; i < NMODES; i++) {
+        if (w < load.weights[i])
+            return modes[i].mode;
+        w -= load.weights[i];
+    }
+
+    return LKM_EXMODE;
+}
+
+static void pick_name(struct thread *thread, char *name)
+{
+    unsigned int cold = load.resources - load.hot;
+    unsigned int per_thread = cold / load.threads;
+    unsigned int res;
+
+    if (!per_thread || pick(&thread->seed, 100) < load.contention)
+        res = pick(&thread->seed, load.hot);
+    else
+        res = load.hot + thread->index * per_thread +
+              pick(&thread->seed, per_thread);
+
+    snprintf(name, NAME_LEN, "load-%u", res);
+}
+
+/* Is there still a lock cycle to start */
+static bool more(struct thread *thread)
+{
+    if (load.stop)
+        return false;
+    if (load.deadline && now_us() >= load.deadline) {
+        load.stop = true;
+        return false;
+    }
+    return !load.ops || thread->ops < load.ops;
+}
+
+/* Outcome of a request, true if its lock is held afterwards */
+static bool account(struct thread *thread, int op, int error,
+                    unsigned long long start)
+{
+    struct histogram *hist = &thread->hist[op];
+
+    if (error == EAGAIN && (op == OP_CONVERT || load.noqueue)) {
+        hist->denied++;
+        return op == OP_CONVERT;
+    }
+    if (error) {
+        hist->errors++;
+        if (hist->errors == 1)
+            fprintf(stderr, "thread %u: %s: %s\n", thread->index,
+                    op_names[op], strerror(error));
+        return op == OP_CONVERT;
+    }
+
+    hist_add(hist, now_us() - start);
+    return op != OP_UNLOCK;
+}
+
+/* Mode to convert a lock granted in @mode to */
+static int convert_mode(struct thread *thread, int mode)
+{
+    int to;
+
+    do {
+        to = pick_mode(thread);
+    } while (to == mode && load.total_weight != load.weights[mode]);
+
+    return to == mode ? LKM_NLMODE : to;
+}
+
+static void run_sync(struct thread *thread)
+{
+    struct dlm_lksb lksb;
+    char name[NAME_LEN];
+    unsigned long long start;
+    int mode, flags, ret, error;
+
+    while (more(thread)) {
+        thread->ops++;
+        pick_name(thread, name);
+        mode = pick_mode(thread);
+        flags = load.noqueue ? LKF_NOQUEUE : 0;
+
+        memset(&lksb, 0, sizeof(lksb));
+        start = now_us();
+        ret = dlm_ls_lock_wait(load.ls, mode, &lksb, flags, name,
+                               strlen(name), 0, NULL, NULL, NULL);
+        error = ret ? errno : lksb.sb_status;
+        if (!account(thread, OP_LOCK, error, start))
+            continue;
+
+        if (pick(&thread->seed, 100) < load.convert) {
+            mode = convert_mode(thread, mode);
+            start = now_us();
+            ret = dlm_ls_lock_wait(load.ls, mode, &lksb,
+                                   LKF_CONVERT | LKF_NOQUEUE, name,
+                                   strlen(name), 0, NULL, NULL, NULL);
+            error = ret ? errno : lksb.sb_status;
+            account(thread, OP_CONVERT, error, start);
+        }
+
+        start = now_us();
+        ret = dlm_ls_unlock_wait(load.ls, lksb.sb_lkid, 0, &lksb);
+        error = ret ? errno : (lksb.sb_status == EUNLOCK ? 0 : lksb.sb_status);
+        account(thread, OP_UNLOCK, error, start);
+    }
+}
+
+static void slot_ast(void *arg);
+
+static void slot_done(struct slot *slot)
+{
+    struct thread *thread = slot->thread;
+
+    pthread_mutex_lock(&thread->mutex);
+    if (--thread->running == 0)
+        pthread_cond_signal(&thread->cond);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
+/*
+ * Issue the next request of @slot. Runs in the thread of the slot
+ * at first, then in the AST thread, never at the same time.
+ */
+static void slot_next(struct slot *slot)
+{
+    struct thread *thread = slot->thread;
+    int ret;
+
+    for (;;) {
+        switch (slot->op) {
+        case OP_LOCK:
+            pthread_mutex_lock(&thread->mutex);
+            if (!more(thread)) {
+                pthread_mutex_unlock(&thread->mutex);
+                slot_done(slot);
+                return;
+            }
+            thread->ops++;
+            pick_name(thread, slot->name);
+            slot->mode = pick_mode(thread);
+            pthread_mutex_unlock(&thread->mutex);
+
+            memset(&slot->lksb, 0, sizeof(slot->lksb));
+            slot->start = now_us();
+            ret = dlm_ls_lock(load.ls, slot->mode, &slot->lksb,
+                              load.noqueue ? LKF_NOQUEUE : 0,
+                              slot->name, strlen(slot->name), 0,
+                              slot_ast, slot, NULL, NULL);
+            break;
+
+        case OP_CONVERT:
+            slot->start = now_us();
+            ret = dlm_ls_lock(load.ls, slot->mode, &slot->lksb,
+                              LKF_CONVERT | LKF_NOQUEUE,
+                              slot->name, strlen(slot->name), 0,
+                              slot_ast, slot, NULL, NULL);
+            break;
+
+        default:
+            slot->start = now_us();
+            ret = dlm_ls_unlock(load.ls, slot->lksb.sb_lkid, 0,
+                                &slot->lksb, slot);
+            break;
+        }
+
+        if (ret == 0)
+            return;
+
+        /* Refused at once, no AST will come */
+        pthread_mutex_lock(&thread->mutex);
+        if (account(thread, slot->op, errno, slot->start))
+            slot->op = OP_UNLOCK;
+        else
+            slot->op = OP_LOCK;
+        pthread_mutex_unlock(&thread->mutex);
+    }
+}
+
+static void slot_ast(void *arg)
+{
+    struct slot *slot = arg;
+    struct thread *thread = slot->thread;
+    int status = slot->lksb.sb_status;
+    bool held;
+
+    if (slot->op == OP_UNLOCK && status == EUNLOCK)
+        status = 0;
+
+    pthread_mutex_lock(&thread->mutex);
+    held = account(thread, slot->op, status, slot->start);
+
+    if (!held) {
+        slot->op = OP_LOCK;
+    } else if (slot->op == OP_LOCK &&
+               pick(&thread->seed, 100) < load.convert) {
+        slot->op = OP_CONVERT;
+        slot->mode = convert_mode(thread, slot->mode);
+    } else {
+        slot->op = OP_UNLOCK;
+    }
+    pthread_mutex_unlock(&thread->mutex);
+
+    slot_next(slot);
+}
+
+static void run_async(struct thread *thread)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&thread->mutex);
+    thread->running = load.depth;
+    pthread_mutex_unlock(&thread->mutex);
+
+    for (i = 0; i < load.depth; i++) {
+        thread->slots[i].thread = thread;
+        thread->slots[i].op = OP_LOCK;
+        slot_next(&thread->slots[i]);
+    }
+
+    pthread_mutex_lock(&thread->mutex);
+    while (thread->running)
+        pthread_cond_wait(&thread->cond, &thread->mutex);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
+static void *thread_main(void *arg)
+{
+    struct thread *thread = arg;
+
+    if (load.async)
+        run_async(thread);
+    else
+        run_sync(thread);
+
+    return NULL;
+}
+
+static void report(struct thread *threads, unsigned long long wall)
+{
+    struct histogram total[OP_LAST];
+    unsigned long long lo;
+    unsigned int i, j;
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < load.threads; i++)
+        for (j = 0; j < OP_LAST; j++)
+            hist_merge(&total[j], &threads[i].hist[j]);
+
+    printf("# lockspace=%s threads=%u resources=%u hot=%u contention=%u%% "
+           "convert=%u%% api=%s depth=%u noqueue=%d wall=%.3fs\n",
+           load.lockspace, load.threads, load.resources, load.hot,
+           load.contention, load.convert, load.async ? "async" : "sync",
+           load.async ? load.depth : 1, load.noqueue, wall / 1e6);
+    printf("%-8s %10s %10s %8s %8s %10s %10s %10s %10s\n",
+           "op", "count", "ops/s", "errors", "denied",
+           "mean(us)", "p50(us)", "p99(us)", "max(us)");
+
+    for (j = 0; j < OP_LAST; j++) {
+        printf("%-8s %10llu %10.1f %8llu %8llu %10.1f %10llu %10llu %10llu\n",
+               op_names[j], total[j].count,
+               wall ? total[j].count * 1e6 / wall : 0,
+               total[j].errors, total[j].denied,
+               total[j].count ? (double)total[j].sum / total[j].count : 0,
+               hist_quantile(&total[j], 500), hist_quantile(&total[j], 990),
+               total[j].max);
+    }
+
+    for (j = 0; j < OP_LAST; j++) {
+        if (!total[j].count)
+            continue;
+        printf("# %s latency histogram\n", op_names[j]);
+        for (i = 0; i < BUCKETS; i++) {
+            if (!total[j].buckets[i])
+                continue;
+            lo = i ? 1ULL << (i - 1) : 0;
+            printf("  [%10llu, %10llu) us %10llu\n",
+                   lo, 1ULL << i, total[j].buckets[i]);
+        }
+    }
+
+#ifdef WITH_FAKE_DLM
+    {
+        fake_dlm_stats stats;
+
+        fake_dlm_get_stats(&stats);
+        printf("# stand-in: queued=%llu denied=%llu basts=%llu\n",
+               stats.queued, stats.denied, stats.basts);
+    }
+#endif
+}
+
+/* "ex=50,pr=40,cr=10" */
+static int parse_mix(char *arg)
+{
+    char *tok, *save = NULL, *eq, *end;
+    unsigned long w;
+    unsigned int i;
+
+    memset(load.weights, 0, sizeof(load.weights));
+    load.total_weight = 0;
+
+    for (tok = strtok_r(arg, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (!(eq = strchr(tok, '=')))
+            return -1;
+        *eq = '\0';
+
+        for (i = 0; i < NMODES; i++)
+            if (strcmp(tok, modes[i].name) == 0)
+                break;
+        if (i == NMODES)
+            return -1;
+
+        errno = 0;
+        w = strtoul(eq + 1, &end, 10);
+        if (errno || *end || end == eq + 1 || w > 1000000)
+            return -1;
+
+        load.weights[i] += w;
+        load.total_weight += w;
+    }
+
+    return load.total_weight ? 0 : -1;
+}
+
+static int parse_uint(const char *arg, unsigned int *value,
+                      unsigned int min, unsigned int max)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(arg, &end, 10);
+    if (errno || *end || end == arg || v < min || v > max) {
+        fprintf(stderr, "invalid number '%s'\n", arg);
+        return -1;
+    }
+
+    *value = v;
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "\n"
+            "Usage:\n"
+            "  %s [options]\n"
+            "\n"
+            "Options:\n"
+            "  -l <name>      Lockspace, created if needed (default %s)\n"
+            "  -t <n>         Threads (default %u)\n"
+            "  -m <n>         Resources (default %u)\n"
+            "  -H <n>         Hot resources shared by all threads (default %u)\n"
+            "  -c <percent>   Locks taken on a hot resource (default %u)\n"
+            "  -k <percent>   Locks converted before the unlock (default %u)\n"
+            "  -M <mix>       Weighted modes of new locks, like ex=50,pr=40,cr=10\n"
+            "                 (default ex=1)\n"
+            "  -n <ops>       Lock cycles per thread, 0 for no limit (default %llu)\n"
+            "  -d <seconds>   Stop after that long, 0 for no limit (default %u)\n"
+            "  -a             Use the asynchronous API\n"
+            "  -q <n>         Requests in flight per thread with -a (default %u)\n"
+            "  -N             Do not queue new locks (LKF_NOQUEUE)\n"
+#ifdef WITH_FAKE_DLM
+            "  -R <usec>      Stand-in round trip (default %u)\n"
+            "  -J <usec>      Stand-in random extra delay (default %u)\n"
+            "  -C <n>         Stand-in cluster nodes (default %u)\n"
+#endif
+            "\n",
+            argv0, load.lockspace, load.threads, load.resources, load.hot,
+            load.contention, load.convert, load.ops, load.duration,
+            load.depth
+#ifdef WITH_FAKE_DLM
+            , load.rtt, load.jitter, load.nodes
+#endif
+            );
+}
+
+int main(int argc, char *argv[])
+{
+    struct thread *threads = NULL;
+    unsigned long long start, errors;
+    bool created = false;
+    unsigned int i;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    while ((c = getopt(argc, argv, "hl:t:m:H:c:k:M:n:d:aq:NR:J:C:")) != -1) {
+        switch (c) {
+        case 'l':
+            load.lockspace = optarg;
+            break;
+        case 't':
+            if (parse_uint(optarg, &load.threads, 1, 4096) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'm':
+            if (parse_uint(optarg, &load.resources, 1, UINT32_MAX) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'H':
+            if (parse_uint(optarg, &load.hot, 1, UINT32_MAX) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'c':
+            if (parse_uint(optarg, &load.contention, 0, 100) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'k':
+            if (parse_uint(optarg, &load.convert, 0, 100) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'M':
+            if (parse_mix(optarg) < 0) {
+                fprintf(stderr, "invalid mode mix\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            errno = 0;
+            load.ops = strtoull(optarg, NULL, 10);
+            if (errno) {
+                fprintf(stderr, "invalid number '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            if (parse_uint(optarg, &load.duration, 0, 86400) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'a':
+            load.async = true;
+            break;
+        case 'q':
+            if (parse_uint(optarg, &load.depth, 1, MAX_DEPTH) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'N':
+            load.noqueue = true;
+            break;
+        case 'R':
+            if (parse_uint(optarg, &load.rtt, 0, UINT32_MAX) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'J':
+            if (parse_uint(optarg, &load.jitter, 0, UINT32_MAX) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'C':
+            if (parse_uint(optarg, &load.nodes, 1, 64) < 0)
+                return EXIT_FAILURE;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (load.hot > load.resources)
+        load.hot = load.resources;
+    if (!load.ops && !load.duration) {
+        fprintf(stderr, "either -n or -d must be set\n");
+        return EXIT_FAILURE;
+    }
+
+#ifdef WITH_FAKE_DLM
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(load.nodes, 1) < 0) {
+        fprintf(stderr, "fake_dlm_set_nodes: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < FAKE_DLM_OP_LAST; i++)
+        fake_dlm_set_latency(i, load.rtt, load.jitter);
+#endif
+
+    load.ls = dlm_open_lockspace(load.lockspace);
+    if (!load.ls) {
+        load.ls = dlm_create_lockspace(load.lockspace, LOCKSPACE_MODE);
+        if (!load.ls) {
+            fprintf(stderr, "dlm_create_lockspace: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        created = true;
+    }
+
+    /* Delivers the ASTs of the async API */
+    if (dlm_ls_pthread_init(load.ls)) {
+        fprintf(stderr, "dlm_ls_pthread_init: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    if (!(threads = calloc(load.threads, sizeof(*threads)))) {
+        fprintf(stderr, "calloc: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    start = now_us();
+    if (load.duration)
+        load.deadline = start + load.duration * 1000000ULL;
+
+    for (i = 0; i < load.threads; i++) {
+        threads[i].index = i;
+        threads[i].seed = i + 1;
+        pthread_mutex_init(&threads[i].mutex, NULL);
+        pthread_cond_init(&threads[i].cond, NULL);
+        if ((errno = pthread_create(&threads[i].tid, NULL,
+                                    thread_main, threads + i))) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+            load.stop = true;
+            while (i--)
+                pthread_join(threads[i].tid, NULL);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < load.threads; i++)
+        pthread_join(threads[i].tid, NULL);
+
+    report(threads, now_us() - start);
+
+    for (errors = 0, i = 0; i < load.threads; i++)
+        errors += threads[i].hist[OP_LOCK].errors;
+    ret = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ cleanup:
+    free(threads);
+    if (created)
+        dlm_release_lockspace(load.lockspace, load.ls, 1);
+    else
+        dlm_close_lockspace(load.ls);
+
+    return ret;
+}
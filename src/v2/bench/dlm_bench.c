@@ -0,0 +1,807 @@
+/*
+ * dlm_bench.c: microbenchmarks of the DLM lock driver
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Drives the driver through its virLockDriver table, the way the
+ * QEMU driver does, on top of fake_dlm.c. It is built inside the
+ * libvirt tree like virtdlmd, with the driver compiled in and the
+ * stand-in linked instead of libdlm and libcpg:
+ *
+ *   dlm_bench.c fake_dlm.c lock_driver_dlm.c dlm_protocol.c dlm_trace.c
+ *   dlm_stats.c dlm_recorder.c -DDLM_CLUSTER_NAME_PATH='"/"'
+ *
+ * The driver insists on running as root.
+ */
+
+#include <config.h>
+
+#include <sys/stat.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fake_dlm.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virgettext.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+VIR_LOG_INIT("locking.dlm_bench")
+
+typedef enum {
+    VIR_DLM_BENCH_OP_START,     /* new, add the disks, acquire */
+    VIR_DLM_BENCH_OP_STOP,      /* release, free */
+    VIR_DLM_BENCH_OP_PAUSE,     /* release keeping the state */
+    VIR_DLM_BENCH_OP_RESUME,    /* acquire given the state */
+
+    VIR_DLM_BENCH_OP_LAST
+} virDLMBenchOp;
+
+VIR_ENUM_DECL(virDLMBenchOp)
+VIR_ENUM_IMPL(virDLMBenchOp, VIR_DLM_BENCH_OP_LAST,
+              "start", "stop", "pause", "resume")
+
+typedef enum {
+    VIR_DLM_BENCH_SCENARIO_START,
+    VIR_DLM_BENCH_SCENARIO_STOP,
+    VIR_DLM_BENCH_SCENARIO_PAUSE,   /* pause and resume */
+    VIR_DLM_BENCH_SCENARIO_SHARED,  /* start with shared images only */
+
+    VIR_DLM_BENCH_SCENARIO_LAST
+} virDLMBenchScenario;
+
+VIR_ENUM_DECL(virDLMBenchScenario)
+VIR_ENUM_IMPL(virDLMBenchScenario, VIR_DLM_BENCH_SCENARIO_LAST,
+              "start", "stop", "pause", "shared")
+
+typedef struct _virDLMBenchVM virDLMBenchVM;
+typedef virDLMBenchVM *virDLMBenchVMPtr;
+struct _virDLMBenchVM {
+    virLockManager man;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    char name[32];
+    char *state;    /* while paused */
+    bool running;
+};
+
+typedef struct _virDLMBenchSamples virDLMBenchSamples;
+typedef virDLMBenchSamples *virDLMBenchSamplesPtr;
+struct _virDLMBenchSamples {
+    unsigned long long *ns;
+    size_t nns;
+    size_t failed;
+    unsigned long long wall;    /* nanoseconds spent in the runs */
+};
+
+typedef struct _virDLMBenchWorker virDLMBenchWorker;
+typedef virDLMBenchWorker *virDLMBenchWorkerPtr;
+struct _virDLMBenchWorker {
+    virThread thread;
+    size_t index;
+    virDLMBenchOp op;
+    bool shared;            /* every disk is a shared image */
+    virDLMBenchSamples samples;
+};
+
+static struct {
+    unsigned int vms;
+    unsigned int disks;         /* per VM */
+    unsigned int threads;
+    unsigned int sharedPercent; /* of the disks which are shared images */
+    unsigned int images;        /* shared images to pick from */
+    unsigned int iterations;
+    unsigned int rtt;           /* microseconds */
+    unsigned int jitter;
+    unsigned int nodes;
+
+    virDLMBenchVMPtr vm;
+    bool scenarios[VIR_DLM_BENCH_SCENARIO_LAST];
+    virDLMBenchSamples results[VIR_DLM_BENCH_OP_LAST];
+    char *firstError;
+} bench = {
+    .vms = 100,
+    .disks = 2,
+    .threads = 4,
+    .sharedPercent = 0,
+    .images = 4,
+    .iterations = 10,
+    .rtt = 200,
+    .jitter = 0,
+    .nodes = 3,
+};
+
+static bool quit;
+
+static unsigned long long
+virDLMBenchNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+virDLMBenchEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+}
+
+static void
+virDLMBenchError(void)
+{
+    /* Only the first one, the others are most likely the same */
+    if (!bench.firstError)
+        ignore_value(VIR_STRDUP(bench.firstError, virGetLastErrorMessage()));
+    virResetLastError();
+}
+
+/*
+ * Disk @disk of @vm is a shared image picked at random with a
+ * probability of sharedPercent, or with @shared, and its own
+ * exclusive disk otherwise.
+ */
+static int
+virDLMBenchAddDisks(virDLMBenchVMPtr vm,
+                    size_t index,
+                    bool shared,
+                    unsigned int *seed)
+{
+    char *path = NULL;
+    unsigned int flags;
+    size_t i;
+    int rv = -1;
+
+    for (i = 0; i < bench.disks; i++) {
+        if (shared || rand_r(seed) % 100 < bench.sharedPercent) {
+            flags = VIR_LOCK_MANAGER_RESOURCE_SHARED;
+            if (virAsprintf(&path, "/dev/bench/image-%u",
+                            rand_r(seed) % bench.images) < 0)
+                goto cleanup;
+        } else {
+            flags = 0;
+            if (virAsprintf(&path, "/dev/bench/vm-%zu-disk-%zu",
+                            index, i) < 0)
+                goto cleanup;
+        }
+
+        if (virLockDriverImpl.drvAddResource(&vm->man,
+                                             VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                             path, 0, NULL, flags) < 0)
+            goto cleanup;
+
+        VIR_FREE(path);
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(path);
+    return rv;
+}
+
+static int
+virDLMBenchStart(virDLMBenchVMPtr vm,
+                 size_t index,
+                 bool shared,
+                 unsigned int *seed)
+{
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = vm->name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "id",
+          .value = { .ui = index + 1 },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_INT,
+          .key = "pid",
+          .value = { .iv = getpid() },
+        },
+    };
+
+    memcpy(params[0].value.uuid, vm->uuid, VIR_UUID_BUFLEN);
+
+    vm->man.driver = &virLockDriverImpl;
+    vm->man.privateData = NULL;
+
+    if (virLockDriverImpl.drvNew(&vm->man,
+                                 VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN,
+                                 ARRAY_CARDINALITY(params), params, 0) < 0 ||
+        virDLMBenchAddDisks(vm, index, shared, seed) < 0 ||
+        virLockDriverImpl.drvAcquire(&vm->man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) < 0) {
+        if (vm->man.privateData)
+            virLockDriverImpl.drvFree(&vm->man);
+        vm->man.privateData = NULL;
+        return -1;
+    }
+
+    vm->running = true;
+    return 0;
+}
+
+static int
+virDLMBenchStop(virDLMBenchVMPtr vm)
+{
+    int rv;
+
+    rv = virLockDriverImpl.drvRelease(&vm->man, NULL, 0);
+    virLockDriverImpl.drvFree(&vm->man);
+    vm->man.privateData = NULL;
+    vm->running = false;
+    VIR_FREE(vm->state);
+
+    return rv;
+}
+
+static int
+virDLMBenchRunOne(virDLMBenchWorkerPtr worker,
+                  size_t index,
+                  unsigned int *seed)
+{
+    virDLMBenchVMPtr vm = bench.vm + index;
+
+    switch (worker->op) {
+    case VIR_DLM_BENCH_OP_START:
+        if (vm->running)
+            return 0;
+        return virDLMBenchStart(vm, index, worker->shared, seed);
+
+    case VIR_DLM_BENCH_OP_STOP:
+        if (!vm->running)
+            return 0;
+        return virDLMBenchStop(vm);
+
+    case VIR_DLM_BENCH_OP_PAUSE:
+        VIR_FREE(vm->state);
+        return virLockDriverImpl.drvRelease(&vm->man, &vm->state, 0);
+
+    case VIR_DLM_BENCH_OP_RESUME:
+        return virLockDriverImpl.drvAcquire(&vm->man, vm->state, 0,
+                                            VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                            NULL);
+
+    case VIR_DLM_BENCH_OP_LAST:
+        break;
+    }
+
+    return -1;
+}
+
+/* Every worker takes one VM out of bench.threads */
+static void
+virDLMBenchWorkerRun(void *opaque)
+{
+    virDLMBenchWorkerPtr worker = opaque;
+    virDLMBenchSamplesPtr samples = &worker->samples;
+    unsigned int seed = worker->index + 1;
+    unsigned long long start;
+    size_t i;
+
+    for (i = worker->index; i < bench.vms; i += bench.threads) {
+        start = virDLMBenchNow();
+        if (virDLMBenchRunOne(worker, i, &seed) < 0) {
+            virDLMBenchError();
+            samples->failed++;
+            continue;
+        }
+        samples->ns[samples->nns++] = virDLMBenchNow() - start;
+    }
+}
+
+/*
+ * Apply @op to every VM from bench.threads threads, adding the
+ * latencies to the results unless it is only a preparation step.
+ */
+static int
+virDLMBenchRun(virDLMBenchOp op,
+               bool shared,
+               bool record)
+{
+    virDLMBenchWorkerPtr workers = NULL;
+    virDLMBenchSamplesPtr result = &bench.results[op];
+    unsigned long long start;
+    size_t i;
+    int rv = -1;
+
+    if (VIR_ALLOC_N(workers, bench.threads) < 0)
+        return -1;
+
+    for (i = 0; i < bench.threads; i++) {
+        workers[i].index = i;
+        workers[i].op = op;
+        workers[i].shared = shared;
+        if (VIR_ALLOC_N(workers[i].samples.ns,
+                        bench.vms / bench.threads + 1) < 0)
+            goto cleanup;
+    }
+
+    start = virDLMBenchNow();
+
+    for (i = 0; i < bench.threads; i++) {
+        if (virThreadCreate(&workers[i].thread, true,
+                            virDLMBenchWorkerRun, workers + i) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to create benchmark thread"));
+            while (i--)
+                virThreadJoin(&workers[i].thread);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < bench.threads; i++)
+        virThreadJoin(&workers[i].thread);
+
+    if (record) {
+        result->wall += virDLMBenchNow() - start;
+        for (i = 0; i < bench.threads; i++) {
+            if (VIR_REALLOC_N(result->ns,
+                              result->nns + workers[i].samples.nns) < 0)
+                goto cleanup;
+            memcpy(result->ns + result->nns, workers[i].samples.ns,
+                   workers[i].samples.nns * sizeof(*result->ns));
+            result->nns += workers[i].samples.nns;
+            result->failed += workers[i].samples.failed;
+        }
+    }
+
+    rv = 0;
+ cleanup:
+    for (i = 0; i < bench.threads; i++)
+        VIR_FREE(workers[i].samples.ns);
+    VIR_FREE(workers);
+    return rv;
+}
+
+static int
+virDLMBenchScenarioRun(virDLMBenchScenario scenario)
+{
+    bool shared = scenario == VIR_DLM_BENCH_SCENARIO_SHARED;
+
+    switch (scenario) {
+    case VIR_DLM_BENCH_SCENARIO_START:
+    case VIR_DLM_BENCH_SCENARIO_SHARED:
+        if (virDLMBenchRun(VIR_DLM_BENCH_OP_START, shared, true) < 0 ||
+            virDLMBenchRun(VIR_DLM_BENCH_OP_STOP, shared, false) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_BENCH_SCENARIO_STOP:
+        if (virDLMBenchRun(VIR_DLM_BENCH_OP_START, shared, false) < 0 ||
+            virDLMBenchRun(VIR_DLM_BENCH_OP_STOP, shared, true) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_BENCH_SCENARIO_PAUSE:
+        if (virDLMBenchRun(VIR_DLM_BENCH_OP_START, shared, false) < 0 ||
+            virDLMBenchRun(VIR_DLM_BENCH_OP_PAUSE, shared, true) < 0 ||
+            virDLMBenchRun(VIR_DLM_BENCH_OP_RESUME, shared, true) < 0 ||
+            virDLMBenchRun(VIR_DLM_BENCH_OP_STOP, shared, false) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_BENCH_SCENARIO_LAST:
+        break;
+    }
+
+    return 0;
+}
+
+static int
+virDLMBenchCompare(const void *a,
+                   const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The nearest rank, in microseconds, of @permille of the sorted @samples */
+static double
+virDLMBenchPercentile(virDLMBenchSamplesPtr samples,
+                      unsigned int permille)
+{
+    size_t rank;
+
+    if (!samples->nns)
+        return 0;
+
+    rank = (samples->nns * permille + 999) / 1000;
+    if (rank > 0)
+        rank--;
+
+    return samples->ns[rank] / 1000.0;
+}
+
+static void
+virDLMBenchReport(void)
+{
+    virDLMBenchSamplesPtr samples;
+    fake_dlm_stats stats;
+    size_t i;
+
+    fake_dlm_get_stats(&stats);
+
+    printf("# vms=%u disks=%u threads=%u shared=%u%% images=%u "
+           "iterations=%u rtt=%uus jitter=%uus nodes=%u\n",
+           bench.vms, bench.disks, bench.threads, bench.sharedPercent,
+           bench.images, bench.iterations, bench.rtt, bench.jitter,
+           bench.nodes);
+    printf("%-8s %10s %10s %10s %10s %10s %10s %8s\n",
+           "op", "count", "ops/s", "p50(us)", "p99(us)", "p999(us)",
+           "max(us)", "failed");
+
+    for (i = 0; i < VIR_DLM_BENCH_OP_LAST; i++) {
+        samples = &bench.results[i];
+        if (!samples->nns && !samples->failed)
+            continue;
+
+        qsort(samples->ns, samples->nns, sizeof(*samples->ns),
+              virDLMBenchCompare);
+
+        printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f %8zu\n",
+               virDLMBenchOpTypeToString(i), samples->nns,
+               samples->wall ? samples->nns * 1e9 / samples->wall : 0,
+               virDLMBenchPercentile(samples, 500),
+               virDLMBenchPercentile(samples, 990),
+               virDLMBenchPercentile(samples, 999),
+               samples->nns ? samples->ns[samples->nns - 1] / 1000.0 : 0,
+               samples->failed);
+    }
+
+    printf("# dlm: lock=%llu convert=%llu unlock=%llu adopt=%llu "
+           "queued=%llu denied=%llu basts=%llu\n",
+           stats.requests[FAKE_DLM_OP_LOCK],
+           stats.requests[FAKE_DLM_OP_CONVERT],
+           stats.requests[FAKE_DLM_OP_UNLOCK],
+           stats.requests[FAKE_DLM_OP_ADOPT],
+           stats.queued, stats.denied, stats.basts);
+
+    if (bench.firstError)
+        printf("# first error: %s\n", bench.firstError);
+}
+
+/*
+ * Without a configuration file of the user, the driver gets one of
+ * its own so that the record file of the host is left alone.
+ */
+static int
+virDLMBenchConfig(char **dir,
+                  char **configFile,
+                  const char *extra)
+{
+    char *content = NULL;
+    int rv = -1;
+
+    if (VIR_STRDUP(*dir, "/tmp/dlm-bench-XXXXXX") < 0)
+        return -1;
+
+    if (!mkdtemp(*dir)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create a temporary directory"));
+        VIR_FREE(*dir);
+        return -1;
+    }
+
+    if (!(*configFile = virFileBuildPath(*dir, "dlm", ".conf")))
+        goto cleanup;
+
+    if (virAsprintf(&content,
+                    "lockspace_name = \"dlm_bench\"\n"
+                    "lock_record_file = \"%s/DLMlocks.txt\"\n"
+                    "%s",
+                    *dir, extra ? extra : "") < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(*configFile, content, 0600) < 0) {
+        virReportSystemError(errno, _("unable to write '%s'"), *configFile);
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(content);
+    return rv;
+}
+
+static int
+virDLMBenchParseScenarios(const char *arg)
+{
+    char **names = NULL;
+    size_t i;
+    int scenario;
+    int rv = -1;
+
+    memset(bench.scenarios, 0, sizeof(bench.scenarios));
+
+    if (STREQ(arg, "all")) {
+        for (i = 0; i < VIR_DLM_BENCH_SCENARIO_LAST; i++)
+            bench.scenarios[i] = true;
+        return 0;
+    }
+
+    if (!(names = virStringSplit(arg, ",", 0)))
+        return -1;
+
+    for (i = 0; names[i]; i++) {
+        if ((scenario = virDLMBenchScenarioTypeFromString(names[i])) < 0) {
+            fprintf(stderr, _("unknown scenario '%s'\n"), names[i]);
+            goto cleanup;
+        }
+        bench.scenarios[scenario] = true;
+    }
+
+    rv = 0;
+ cleanup:
+    virStringListFree(names);
+    return rv;
+}
+
+static void
+virDLMBenchUsage(const char *argv0)
+{
+    fprintf(stderr,
+            _("\n"
+              "Usage:\n"
+              "  %s [options]\n"
+              "\n"
+              "Options:\n"
+              "  -h | --help               Display program help\n"
+              "  -f | --config <file>      Driver configuration file (default: a scratch one)\n"
+              "  -s | --scenario <list>    Comma separated list of start, stop, pause, shared\n"
+              "                            or all (default all)\n"
+              "  -m | --vms <n>            Domains (default %u)\n"
+              "  -d | --disks <n>          Disks per domain (default %u)\n"
+              "  -t | --threads <n>        Threads calling the driver (default %u)\n"
+              "  -S | --shared <percent>   Disks which are shared images (default %u)\n"
+              "  -I | --images <n>         Shared images (default %u)\n"
+              "  -i | --iterations <n>     Runs of every scenario (default %u)\n"
+              "  -r | --rtt <usec>         DLM round trip (default %u)\n"
+              "  -j | --jitter <usec>      Random extra delay of the DLM (default %u)\n"
+              "  -n | --nodes <n>          Nodes of the simulated cluster (default %u)\n"
+              "  -c | --caching            Enable lock_caching\n"
+              "  -g | --grace <msec>       Set release_grace_period\n"
+              "\n"),
+            argv0, bench.vms, bench.disks, bench.threads,
+            bench.sharedPercent, bench.images, bench.iterations,
+            bench.rtt, bench.jitter, bench.nodes);
+}
+
+static int
+virDLMBenchParseUInt(const char *arg,
+                     unsigned int *value,
+                     bool positive)
+{
+    if (virStrToLong_ui(arg, NULL, 10, value) < 0 ||
+        (positive && *value == 0)) {
+        fprintf(stderr, _("invalid number '%s'\n"), arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *configFile = NULL;
+    char *scratchConfig = NULL;
+    char *scratchDir = NULL;
+    char *extra = NULL;
+    bool caching = false;
+    unsigned int grace = 0;
+    virThread eventThread;
+    size_t i, j;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    struct option opts[] = {
+        { "config", required_argument, NULL, 'f' },
+        { "scenario", required_argument, NULL, 's' },
+        { "vms", required_argument, NULL, 'm' },
+        { "disks", required_argument, NULL, 'd' },
+        { "threads", required_argument, NULL, 't' },
+        { "shared", required_argument, NULL, 'S' },
+        { "images", required_argument, NULL, 'I' },
+        { "iterations", required_argument, NULL, 'i' },
+        { "rtt", required_argument, NULL, 'r' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "nodes", required_argument, NULL, 'n' },
+        { "caching", no_argument, NULL, 'c' },
+        { "grace", required_argument, NULL, 'g' },
+        { "help", no_argument, NULL, 'h' },
+        { 0, 0, 0, 0 },
+    };
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < VIR_DLM_BENCH_SCENARIO_LAST; i++)
+        bench.scenarios[i] = true;
+
+    while ((c = getopt_long(argc, argv, "hf:s:m:d:t:S:I:i:r:j:n:cg:",
+                            opts, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            configFile = optarg;
+            break;
+        case 's':
+            if (virDLMBenchParseScenarios(optarg) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'm':
+            if (virDLMBenchParseUInt(optarg, &bench.vms, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'd':
+            if (virDLMBenchParseUInt(optarg, &bench.disks, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 't':
+            if (virDLMBenchParseUInt(optarg, &bench.threads, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'S':
+            if (virDLMBenchParseUInt(optarg, &bench.sharedPercent, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'I':
+            if (virDLMBenchParseUInt(optarg, &bench.images, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'i':
+            if (virDLMBenchParseUInt(optarg, &bench.iterations, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'r':
+            if (virDLMBenchParseUInt(optarg, &bench.rtt, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'j':
+            if (virDLMBenchParseUInt(optarg, &bench.jitter, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'n':
+            if (virDLMBenchParseUInt(optarg, &bench.nodes, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'c':
+            caching = true;
+            break;
+        case 'g':
+            if (virDLMBenchParseUInt(optarg, &grace, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'h':
+            virDLMBenchUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            virDLMBenchUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (bench.threads > bench.vms)
+        bench.threads = bench.vms;
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(bench.nodes, 1) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to simulate the cluster"));
+        goto cleanup;
+    }
+    for (i = 0; i < FAKE_DLM_OP_LAST; i++)
+        fake_dlm_set_latency(i, bench.rtt, bench.jitter);
+
+    if (!configFile) {
+        if (virAsprintf(&extra, "lock_caching = %d\n"
+                        "release_grace_period = %u\n",
+                        caching, grace) < 0 ||
+            virDLMBenchConfig(&scratchDir, &scratchConfig, extra) < 0)
+            goto cleanup;
+        configFile = scratchConfig;
+    }
+
+    /* The grace period and the caching need an event loop */
+    if (virThreadCreate(&eventThread, false, virDLMBenchEventLoop, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create the event loop thread"));
+        goto cleanup;
+    }
+
+    if (virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, configFile,
+                                  VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+        goto cleanup;
+
+    if (VIR_ALLOC_N(bench.vm, bench.vms) < 0)
+        goto cleanup;
+
+    for (i = 0; i < bench.vms; i++) {
+        bench.vm[i].uuid[0] = 0xbe;
+        bench.vm[i].uuid[1] = 0x4c;
+        for (j = 0; j < sizeof(i); j++)
+            bench.vm[i].uuid[VIR_UUID_BUFLEN - 1 - j] = (i >> (8 * j)) & 0xff;
+        snprintf(bench.vm[i].name, sizeof(bench.vm[i].name),
+                 "bench-%zu", i);
+    }
+
+    for (i = 0; i < bench.iterations; i++) {
+        for (j = 0; j < VIR_DLM_BENCH_SCENARIO_LAST; j++) {
+            if (bench.scenarios[j] &&
+                virDLMBenchScenarioRun(j) < 0)
+                goto cleanup;
+        }
+    }
+
+    virDLMBenchReport();
+
+    ret = EXIT_SUCCESS;
+
+ cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    if (bench.vm) {
+        for (i = 0; i < bench.vms; i++) {
+            if (bench.vm[i].running)
+                ignore_value(virDLMBenchStop(bench.vm + i));
+        }
+    }
+
+    virLockDriverImpl.drvDeinit();
+    quit = true;
+
+    for (i = 0; i < VIR_DLM_BENCH_OP_LAST; i++)
+        VIR_FREE(bench.results[i].ns);
+    VIR_FREE(bench.vm);
+    VIR_FREE(bench.firstError);
+    VIR_FREE(extra);
+    VIR_FREE(scratchConfig);
+    if (scratchDir) {
+        ignore_value(virFileDeleteTree(scratchDir));
+        VIR_FREE(scratchDir);
+    }
+
+    return ret;
+}
@@ -0,0 +1,688 @@
+/*
+ * dlm_check.c: functional checks of the DLM lock driver
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Runs the driver on top of fake_dlm.c through scenarios where
+ * another node must, or must not, get a disk. The driver is node 1,
+ * node 2 only exists through fake_dlm_remote_* and tries the disks
+ * with LKF_NOQUEUE. Each scenario starts the driver with its own
+ * configuration, and may stop and start it again:
+ *
+ *  - grace-shutdown: a lock kept for the grace period of its domain
+ *    is released when the driver shuts down.
+ *  - grace-crash: the same when the driver could not release it
+ *    before going away, the next driver releases it.
+ *  - cache-shutdown, cache-crash: the same for a cached lock, which
+ *    is given up while the driver runs when the other node queues
+ *    for it, but would no longer be once the driver is gone.
+ *  - region-shared-pr, region-shared-cw: a writable region of a disk
+ *    and the whole disk shared in either shared_disk_lock_mode
+ *    exclude each other.
+ *  - node-down: a domain of the other node is restarted here once
+ *    that node failed, its orphans being dropped by the DLM recovery
+ *    without the driver purging anything.
+ *
+ * Built like dlm_bench, and as root as well:
+ *
+ *   dlm_check.c fake_dlm.c lock_driver_dlm.c dlm_protocol.c
+ *   dlm_trace.c dlm_stats.c dlm_recorder.c -DDLM_CLUSTER_NAME_PATH='"/"'
+ *
+ * Exits with 0 if every scenario passed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include <libdlm.h>
+
+#include "fake_dlm.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "vircrypto.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virgettext.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+#define VIR_DLM_CHECK_LOCKSPACE "dlm_check"
+#define VIR_DLM_CHECK_REMOTE 2
+
+VIR_LOG_INIT("locking.dlm_check")
+
+typedef struct _virDLMCheckScenario virDLMCheckScenario;
+struct _virDLMCheckScenario {
+    const char *name;
+    const char *config;     /* appended to the configuration */
+    int (*run)(void);
+};
+
+static struct {
+    char *dir;
+    char *configFile;
+    char *recordFile;
+    const virDLMCheckScenario *scenario;
+} check;
+
+static bool quit;
+
+static void
+virDLMCheckEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+}
+
+static int
+virDLMCheckDiskPath(size_t disk,
+                    char **path)
+{
+    return virAsprintf(path, "/dev/check/%s-disk-%zu",
+                       check.scenario->name, disk);
+}
+
+static int
+virDLMCheckStart(void)
+{
+    char *content = NULL;
+    int rv = -1;
+
+    if (virAsprintf(&content,
+                    "lockspace_name = \"%s\"\n"
+                    "lock_record_file = \"%s\"\n"
+                    "%s",
+                    VIR_DLM_CHECK_LOCKSPACE, check.recordFile,
+                    check.scenario->config) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(check.configFile, content, 0600) < 0) {
+        virReportSystemError(errno, _("unable to write '%s'"),
+                             check.configFile);
+        goto cleanup;
+    }
+
+    if (virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, check.configFile,
+                                  VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(content);
+    return rv;
+}
+
+static void
+virDLMCheckStop(void)
+{
+    virLockDriverImpl.drvDeinit();
+}
+
+/* Lock manager of domain @id, without any resource */
+static int
+virDLMCheckNew(virLockManagerPtr man,
+               unsigned int id)
+{
+    char name[32];
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "id",
+          .value = { .ui = id },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_INT,
+          .key = "pid",
+          .value = { .iv = getpid() },
+        },
+    };
+
+    snprintf(name, sizeof(name), "check-%u", id);
+    params[0].value.uuid[0] = 0x5c;
+    params[0].value.uuid[1] = 0x4e;
+    params[0].value.uuid[VIR_UUID_BUFLEN - 1] = id;
+
+    memset(man, 0, sizeof(*man));
+    man->driver = &virLockDriverImpl;
+
+    return virLockDriverImpl.drvNew(man, VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN,
+                                    ARRAY_CARDINALITY(params), params, 0);
+}
+
+/* Lock manager of domain @id, with its disks from 0 to @ndisks */
+static int
+virDLMCheckManager(virLockManagerPtr man,
+                   unsigned int id,
+                   size_t ndisks)
+{
+    char *path = NULL;
+    size_t i;
+    int rv = -1;
+
+    if (virDLMCheckNew(man, id) < 0)
+        return -1;
+
+    for (i = 0; i < ndisks; i++) {
+        if (virDLMCheckDiskPath(i, &path) < 0 ||
+            virLockDriverImpl.drvAddResource(man,
+                                             VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                             path, 0, NULL, 0) < 0)
+            goto cleanup;
+        VIR_FREE(path);
+    }
+
+    rv = 0;
+ cleanup:
+    if (rv < 0)
+        virLockDriverImpl.drvFree(man);
+    VIR_FREE(path);
+    return rv;
+}
+
+/* Domain @id starts and stops with its disks from 0 to @ndisks */
+static int
+virDLMCheckRunDomain(unsigned int id,
+                     size_t ndisks)
+{
+    virLockManager man;
+    int rv = -1;
+
+    if (virDLMCheckManager(&man, id, ndisks) < 0)
+        return -1;
+
+    if (virLockDriverImpl.drvAcquire(&man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) < 0 ||
+        virLockDriverImpl.drvRelease(&man, NULL, 0) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    virLockDriverImpl.drvFree(&man);
+    return rv;
+}
+
+/*
+ * The remote node tries @name in @mode, and gives it back at once.
+ * Fails unless it got it as @expectGranted says.
+ */
+static int
+virDLMCheckRemote(const char *name,
+                  int mode,
+                  bool expectGranted,
+                  const char *step)
+{
+    char *hash = NULL;
+    uint32_t lkid;
+    bool granted = false;
+    int rv = -1;
+
+    if (virCryptoHashString(VIR_CRYPTO_HASH_SHA256, name, &hash) < 0)
+        return -1;
+
+    if (fake_dlm_remote_lock(VIR_DLM_CHECK_REMOTE, VIR_DLM_CHECK_LOCKSPACE,
+                             hash, mode, LKF_NOQUEUE, &lkid) < 0) {
+        if (errno != EAGAIN) {
+            virReportSystemError(errno, _("remote node unable to lock '%s'"),
+                                 name);
+            goto cleanup;
+        }
+    } else {
+        ignore_value(fake_dlm_remote_unlock(lkid));
+        granted = true;
+    }
+
+    if (granted != expectGranted) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("%s: remote node %s '%s'"), step,
+                       granted ? _("got") : _("was refused"), name);
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(hash);
+    return rv;
+}
+
+static int
+virDLMCheckRemoteDisk(size_t disk,
+                      bool expectGranted,
+                      const char *step)
+{
+    char *path = NULL;
+    int rv;
+
+    if (virDLMCheckDiskPath(disk, &path) < 0)
+        return -1;
+
+    rv = virDLMCheckRemote(path, LKM_EXMODE, expectGranted, step);
+    VIR_FREE(path);
+    return rv;
+}
+
+static int
+virDLMCheckGraceShutdown(void)
+{
+    if (virDLMCheckStart() < 0)
+        return -1;
+
+    if (virDLMCheckRunDomain(1, 1) < 0 ||
+        virDLMCheckRemoteDisk(0, false, _("grace period")) < 0) {
+        virDLMCheckStop();
+        return -1;
+    }
+
+    virDLMCheckStop();
+
+    return virDLMCheckRemoteDisk(0, true, _("driver stopped"));
+}
+
+/* The driver goes away without unlocking anything, as on a crash */
+static int
+virDLMCheckGraceCrash(void)
+{
+    int rv = -1;
+
+    if (virDLMCheckStart() < 0)
+        return -1;
+
+    if (virDLMCheckRunDomain(1, 1) < 0) {
+        virDLMCheckStop();
+        return -1;
+    }
+
+    fake_dlm_set_fault(FAKE_DLM_OP_UNLOCK, 1000, EIO, false);
+    virDLMCheckStop();
+    fake_dlm_set_fault(FAKE_DLM_OP_UNLOCK, 0, 0, false);
+    virResetLastError();
+
+    if (virDLMCheckRemoteDisk(0, false, _("driver gone")) < 0 ||
+        virDLMCheckStart() < 0)
+        return -1;
+
+    if (virDLMCheckRemoteDisk(0, true, _("driver restarted")) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    virDLMCheckStop();
+    return rv;
+}
+
+/* The remote node waits for @disk, and gives it back once granted */
+static int
+virDLMCheckRemoteWait(size_t disk)
+{
+    char *path = NULL;
+    char *hash = NULL;
+    unsigned long long deadline;
+    uint32_t lkid;
+    int rv = -1;
+
+    if (virDLMCheckDiskPath(disk, &path) < 0 ||
+        virCryptoHashString(VIR_CRYPTO_HASH_SHA256, path, &hash) < 0)
+        goto cleanup;
+
+    if (fake_dlm_remote_lock(VIR_DLM_CHECK_REMOTE, VIR_DLM_CHECK_LOCKSPACE,
+                             hash, LKM_EXMODE, 0, &lkid) < 0) {
+        virReportSystemError(errno, _("remote node unable to lock '%s'"),
+                             path);
+        goto cleanup;
+    }
+
+    deadline = time(NULL) + 10;
+    while (fake_dlm_lock_mode(lkid) != LKM_EXMODE) {
+        if (time(NULL) > deadline) {
+            virReportError(VIR_ERR_OPERATION_TIMEOUT,
+                           _("cached '%s' was not given up"), path);
+            ignore_value(fake_dlm_remote_unlock(lkid));
+            goto cleanup;
+        }
+        usleep(100);
+    }
+    ignore_value(fake_dlm_remote_unlock(lkid));
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(path);
+    VIR_FREE(hash);
+    return rv;
+}
+
+static int
+virDLMCheckCacheShutdown(void)
+{
+    if (virDLMCheckStart() < 0)
+        return -1;
+
+    /* Given up on request while the driver runs */
+    if (virDLMCheckRunDomain(1, 1) < 0 ||
+        virDLMCheckRemoteDisk(0, false, _("cached")) < 0 ||
+        virDLMCheckRemoteWait(0) < 0 ||
+        virDLMCheckRunDomain(1, 1) < 0 ||
+        virDLMCheckRemoteDisk(0, false, _("cached again")) < 0) {
+        virDLMCheckStop();
+        return -1;
+    }
+
+    virDLMCheckStop();
+
+    return virDLMCheckRemoteDisk(0, true, _("driver stopped"));
+}
+
+static int
+virDLMCheckCacheCrash(void)
+{
+    int rv = -1;
+
+    if (virDLMCheckStart() < 0)
+        return -1;
+
+    if (virDLMCheckRunDomain(1, 1) < 0 ||
+        virDLMCheckRemoteDisk(0, false, _("cached")) < 0) {
+        virDLMCheckStop();
+        return -1;
+    }
+
+    fake_dlm_set_fault(FAKE_DLM_OP_UNLOCK, 1000, EIO, false);
+    virDLMCheckStop();
+    fake_dlm_set_fault(FAKE_DLM_OP_UNLOCK, 0, 0, false);
+    virResetLastError();
+
+    if (virDLMCheckRemoteDisk(0, false, _("driver gone")) < 0 ||
+        virDLMCheckStart() < 0)
+        return -1;
+
+    if (virDLMCheckRemoteDisk(0, true, _("driver restarted")) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    virDLMCheckStop();
+    return rv;
+}
+
+/*
+ * A writable region of disk 0 against the whole disk written by the
+ * remote node in @sharedMode, whoever comes first.
+ */
+static int
+virDLMCheckRegion(int sharedMode)
+{
+    virLockManager man;
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_ULONG,
+          .key = VIR_LOCK_MANAGER_DLM_PARAM_OFFSET,
+          .value = { .ul = 0 },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_ULONG,
+          .key = VIR_LOCK_MANAGER_DLM_PARAM_LENGTH,
+          .value = { .ul = 4096 },
+        },
+    };
+    char *path = NULL;
+    char *hash = NULL;
+    uint32_t lkid;
+    bool held = false;
+    bool started = false;
+    int rv = -1;
+
+    if (virDLMCheckDiskPath(0, &path) < 0 ||
+        virCryptoHashString(VIR_CRYPTO_HASH_SHA256, path, &hash) < 0 ||
+        virDLMCheckStart() < 0)
+        goto cleanup;
+    started = true;
+
+    if (virDLMCheckNew(&man, 1) < 0)
+        goto cleanup;
+
+    if (virLockDriverImpl.drvAddResource(&man,
+                                         VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                         path, ARRAY_CARDINALITY(params),
+                                         params, 0) < 0)
+        goto release;
+
+    if (fake_dlm_remote_lock(VIR_DLM_CHECK_REMOTE, VIR_DLM_CHECK_LOCKSPACE,
+                             hash, sharedMode, LKF_NOQUEUE, &lkid) != 0) {
+        virReportSystemError(errno, _("remote node unable to lock '%s'"),
+                             path);
+        goto release;
+    }
+
+    if (virLockDriverImpl.drvAcquire(&man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) == 0) {
+        held = true;
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("region acquired while the disk is shared"));
+        ignore_value(fake_dlm_remote_unlock(lkid));
+        goto release;
+    }
+    virResetLastError();
+    ignore_value(fake_dlm_remote_unlock(lkid));
+
+    if (virLockDriverImpl.drvAcquire(&man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) < 0)
+        goto release;
+    held = true;
+
+    if (virDLMCheckRemote(path, sharedMode, false, _("region held")) < 0)
+        goto release;
+
+    rv = 0;
+ release:
+    if (held &&
+        virLockDriverImpl.drvRelease(&man, NULL, 0) < 0)
+        rv = -1;
+    virLockDriverImpl.drvFree(&man);
+ cleanup:
+    if (started)
+        virDLMCheckStop();
+    VIR_FREE(path);
+    VIR_FREE(hash);
+    return rv;
+}
+
+static int
+virDLMCheckRegionSharedPR(void)
+{
+    return virDLMCheckRegion(LKM_PRMODE);
+}
+
+static int
+virDLMCheckRegionSharedCW(void)
+{
+    return virDLMCheckRegion(LKM_CWMODE);
+}
+
+static int
+virDLMCheckNodeDown(void)
+{
+    virLockManager man;
+    char *path = NULL;
+    char *hash = NULL;
+    uint32_t lkid;
+    bool started = false;
+    bool created = false;
+    bool down = false;
+    int rv = -1;
+
+    if (virDLMCheckDiskPath(0, &path) < 0 ||
+        virCryptoHashString(VIR_CRYPTO_HASH_SHA256, path, &hash) < 0 ||
+        virDLMCheckStart() < 0)
+        goto cleanup;
+    started = true;
+
+    /* The domain runs on the other node */
+    if (fake_dlm_remote_lock(VIR_DLM_CHECK_REMOTE, VIR_DLM_CHECK_LOCKSPACE,
+                             hash, LKM_EXMODE, LKF_PERSISTENT | LKF_NOQUEUE,
+                             &lkid) != 0) {
+        virReportSystemError(errno, _("remote node unable to lock '%s'"),
+                             path);
+        goto cleanup;
+    }
+
+    if (virDLMCheckManager(&man, 1, 1) < 0)
+        goto cleanup;
+    created = true;
+
+    if (virLockDriverImpl.drvAcquire(&man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) == 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("domain started while running on the other node"));
+        ignore_value(virLockDriverImpl.drvRelease(&man, NULL, 0));
+        goto cleanup;
+    }
+    virResetLastError();
+
+    if (fake_dlm_node_down(VIR_DLM_CHECK_REMOTE) < 0) {
+        virReportSystemError(errno, "%s", _("unable to fail the other node"));
+        goto cleanup;
+    }
+    down = true;
+
+    if (virLockDriverImpl.drvAcquire(&man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) < 0 ||
+        virLockDriverImpl.drvRelease(&man, NULL, 0) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    if (created)
+        virLockDriverImpl.drvFree(&man);
+    if (down)
+        ignore_value(fake_dlm_node_up(VIR_DLM_CHECK_REMOTE));
+    if (started)
+        virDLMCheckStop();
+    VIR_FREE(path);
+    VIR_FREE(hash);
+    return rv;
+}
+
+static const virDLMCheckScenario scenarios[] = {
+    { "grace-shutdown", "release_grace_period = 600000\n",
+      virDLMCheckGraceShutdown },
+    { "grace-crash", "release_grace_period = 600000\n",
+      virDLMCheckGraceCrash },
+    { "cache-shutdown", "lock_caching = 1\n",
+      virDLMCheckCacheShutdown },
+    { "cache-crash", "lock_caching = 1\n",
+      virDLMCheckCacheCrash },
+    { "region-shared-pr", "shared_disk_lock_mode = \"pr\"\n",
+      virDLMCheckRegionSharedPR },
+    { "region-shared-cw", "shared_disk_lock_mode = \"cw\"\n",
+      virDLMCheckRegionSharedCW },
+    { "node-down", "purge_peer_orphans = \"departed\"\n",
+      virDLMCheckNodeDown },
+};
+
+int
+main(int argc ATTRIBUTE_UNUSED, char **argv)
+{
+    virThread eventThread;
+    size_t failed = 0;
+    size_t i;
+    int ret = EXIT_FAILURE;
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(VIR_DLM_CHECK_REMOTE, 1) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to simulate the cluster"));
+        goto cleanup;
+    }
+
+    /* A scratch configuration keeps the record file of the host alone */
+    if (VIR_STRDUP(check.dir, "/tmp/dlm-check-XXXXXX") < 0)
+        goto cleanup;
+    if (!mkdtemp(check.dir)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create a temporary directory"));
+        VIR_FREE(check.dir);
+        goto cleanup;
+    }
+
+    if (!(check.configFile = virFileBuildPath(check.dir, "dlm", ".conf")) ||
+        !(check.recordFile = virFileBuildPath(check.dir, "DLMlocks", ".txt")))
+        goto cleanup;
+
+    /* Grace periods and asynchronous calls need an event loop */
+    if (virThreadCreate(&eventThread, false, virDLMCheckEventLoop, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create the event loop thread"));
+        goto cleanup;
+    }
+
+    for (i = 0; i < ARRAY_CARDINALITY(scenarios); i++) {
+        check.scenario = scenarios + i;
+        if (check.scenario->run() < 0) {
+            printf("%-16s FAIL %s\n", check.scenario->name,
+                   virGetLastErrorMessage());
+            virResetLastError();
+            failed++;
+        } else {
+            printf("%-16s ok\n", check.scenario->name);
+        }
+    }
+
+    if (failed == 0)
+        ret = EXIT_SUCCESS;
+
+ cleanup:
+    if (ret != EXIT_SUCCESS && failed == 0)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    quit = true;
+
+    VIR_FREE(check.configFile);
+    VIR_FREE(check.recordFile);
+    if (check.dir) {
+        ignore_value(virFileDeleteTree(check.dir));
+        VIR_FREE(check.dir);
+    }
+
+    return ret;
+}
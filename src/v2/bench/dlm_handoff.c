@@ -0,0 +1,601 @@
+/*
+ * dlm_handoff.c: migration handoff check of the DLM lock driver
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Plays the lock side of a migration on top of fake_dlm.c, with the
+ * driver as the destination. The driver keeps its state in a global
+ * and the stand-in simulates a single local node, so the source is
+ * node 2, which makes through fake_dlm_remote_* the DLM requests its
+ * own driver would, and node 3 is a third party trying to take the
+ * disks with LKF_NOQUEUE at every step:
+ *
+ *  - switchover: the destination queues its locks behind the source,
+ *    which converts its own to NL at switchover. The third party
+ *    must be refused throughout, until the destination releases the
+ *    resumed domain.
+ *  - fail-before: the migration fails before the switchover and the
+ *    destination releases the domain which never resumed. Once the
+ *    source stops too, the third party must get every disk.
+ *  - fail-after: the same after the switchover, the destination got
+ *    the locks but never resumed the domain.
+ *
+ * Built like dlm_bench, and as root as well:
+ *
+ *   dlm_handoff.c fake_dlm.c lock_driver_dlm.c dlm_protocol.c
+ *   dlm_trace.c dlm_stats.c dlm_recorder.c -DDLM_CLUSTER_NAME_PATH='"/"'
+ *
+ * Exits with 0 if every scenario passed.
+ */
+
+#include <config.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <libdlm.h>
+
+#include "fake_dlm.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "vircrypto.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virgettext.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+#define VIR_DLM_HANDOFF_LOCKSPACE "dlm_handoff"
+#define VIR_DLM_HANDOFF_SOURCE 2
+#define VIR_DLM_HANDOFF_THIRD 3
+
+/* What the source hands out: only its node matters to the handoff */
+#define VIR_DLM_HANDOFF_STATE "dlm:1:2"
+
+VIR_LOG_INIT("locking.dlm_handoff")
+
+typedef enum {
+    VIR_DLM_HANDOFF_SWITCHOVER,
+    VIR_DLM_HANDOFF_FAIL_BEFORE,
+    VIR_DLM_HANDOFF_FAIL_AFTER,
+
+    VIR_DLM_HANDOFF_LAST
+} virDLMHandoffScenario;
+
+VIR_ENUM_DECL(virDLMHandoffScenario)
+VIR_ENUM_IMPL(virDLMHandoffScenario, VIR_DLM_HANDOFF_LAST,
+              "switchover", "fail-before", "fail-after")
+
+static struct {
+    unsigned int disks;
+    unsigned int rtt;
+    unsigned int jitter;
+
+    virDLMHandoffScenario scenario;
+    uint32_t *sourceLocks;
+    size_t nsourceLocks;
+} handoff = {
+    .disks = 4,
+    .rtt = 300,
+    .jitter = 100,
+};
+
+static bool quit;
+
+static unsigned long long
+virDLMHandoffNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+virDLMHandoffEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+}
+
+static int
+virDLMHandoffDiskPath(size_t disk,
+                      char **path)
+{
+    return virAsprintf(path, "/dev/handoff/%s-disk-%zu",
+                       virDLMHandoffScenarioTypeToString(handoff.scenario),
+                       disk);
+}
+
+/* Lock manager of the incoming domain, as the QEMU driver makes one */
+static int
+virDLMHandoffManager(virLockManagerPtr man)
+{
+    char name[32];
+    char *path = NULL;
+    size_t i;
+    int rv = -1;
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "id",
+          .value = { .ui = handoff.scenario + 1 },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_INT,
+          .key = "pid",
+          .value = { .iv = getpid() },
+        },
+    };
+
+    snprintf(name, sizeof(name), "handoff-%s",
+             virDLMHandoffScenarioTypeToString(handoff.scenario));
+    params[0].value.uuid[0] = 0x4a;
+    params[0].value.uuid[1] = 0x0f;
+    params[0].value.uuid[VIR_UUID_BUFLEN - 1] = handoff.scenario;
+
+    memset(man, 0, sizeof(*man));
+    man->driver = &virLockDriverImpl;
+
+    if (virLockDriverImpl.drvNew(man, VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN,
+                                 ARRAY_CARDINALITY(params), params, 0) < 0)
+        return -1;
+
+    for (i = 0; i < handoff.disks; i++) {
+        if (virDLMHandoffDiskPath(i, &path) < 0 ||
+            virLockDriverImpl.drvAddResource(man,
+                                             VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                             path, 0, NULL, 0) < 0)
+            goto cleanup;
+        VIR_FREE(path);
+    }
+
+    rv = 0;
+ cleanup:
+    if (rv < 0)
+        virLockDriverImpl.drvFree(man);
+    VIR_FREE(path);
+    return rv;
+}
+
+/*
+ * Node @nodeid requests every disk in @mode, returns the number of
+ * locks granted, kept in @lkids if given and else unlocked at once.
+ */
+static ssize_t
+virDLMHandoffRemoteLock(unsigned int nodeid,
+                        int mode,
+                        uint32_t flags,
+                        uint32_t *lkids)
+{
+    char *path = NULL;
+    char *name = NULL;
+    uint32_t lkid;
+    ssize_t granted = 0;
+    size_t i;
+    int rv;
+
+    for (i = 0; i < handoff.disks; i++) {
+        if (virDLMHandoffDiskPath(i, &path) < 0 ||
+            virCryptoHashString(VIR_CRYPTO_HASH_SHA256, path, &name) < 0)
+            goto error;
+
+        if ((rv = fake_dlm_remote_lock(nodeid, VIR_DLM_HANDOFF_LOCKSPACE,
+                                       name, mode, flags, &lkid)) < 0) {
+            if (errno != EAGAIN) {
+                virReportSystemError(errno, _("node %u unable to lock '%s'"),
+                                     nodeid, path);
+                goto error;
+            }
+        } else if (rv > 0) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("node %u queued on '%s'"), nodeid, path);
+            ignore_value(fake_dlm_remote_unlock(lkid));
+            goto error;
+        } else {
+            if (lkids)
+                lkids[granted] = lkid;
+            else
+                ignore_value(fake_dlm_remote_unlock(lkid));
+            granted++;
+        }
+
+        VIR_FREE(path);
+        VIR_FREE(name);
+    }
+
+    return granted;
+
+ error:
+    VIR_FREE(path);
+    VIR_FREE(name);
+    return -1;
+}
+
+/* The third party tries every disk, expecting to get all or none */
+static int
+virDLMHandoffCheckThird(bool expectGranted,
+                        const char *step)
+{
+    ssize_t granted;
+
+    if ((granted = virDLMHandoffRemoteLock(VIR_DLM_HANDOFF_THIRD,
+                                           LKM_EXMODE, LKF_NOQUEUE,
+                                           NULL)) < 0)
+        return -1;
+
+    if (granted != (expectGranted ? handoff.disks : 0)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("%s: third party got %zd of %u disks, expected %s"),
+                       step, granted, handoff.disks,
+                       expectGranted ? _("all") : _("none"));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+virDLMHandoffSourceStart(void)
+{
+    ssize_t granted;
+
+    if (VIR_ALLOC_N(handoff.sourceLocks, handoff.disks) < 0)
+        return -1;
+
+    if ((granted = virDLMHandoffRemoteLock(VIR_DLM_HANDOFF_SOURCE,
+                                           LKM_EXMODE,
+                                           LKF_PERSISTENT | LKF_NOQUEUE,
+                                           handoff.sourceLocks)) < 0)
+        return -1;
+
+    handoff.nsourceLocks = granted;
+    if (granted != handoff.disks) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("source got %zd of %u disks"),
+                       granted, handoff.disks);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The source pauses the domain and releases with a lock state */
+static int
+virDLMHandoffSourceSwitchover(void)
+{
+    size_t i;
+
+    for (i = 0; i < handoff.nsourceLocks; i++) {
+        if (fake_dlm_remote_convert(handoff.sourceLocks[i], LKM_NLMODE, 0) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("source unable to release a lock"));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+virDLMHandoffSourceStop(void)
+{
+    size_t i;
+
+    for (i = 0; i < handoff.nsourceLocks; i++)
+        ignore_value(fake_dlm_remote_unlock(handoff.sourceLocks[i]));
+    VIR_FREE(handoff.sourceLocks);
+    handoff.nsourceLocks = 0;
+}
+
+/*
+ * The destination starts the incoming domain, and waits until the
+ * DLM queued its requests behind the source.
+ */
+static int
+virDLMHandoffRegister(void)
+{
+    virLockManager man;
+    fake_dlm_stats stats;
+    unsigned long long queued;
+    unsigned long long deadline;
+    int rv;
+
+    fake_dlm_get_stats(&stats);
+    queued = stats.queued + handoff.disks;
+
+    if (virDLMHandoffManager(&man) < 0)
+        return -1;
+
+    rv = virLockDriverImpl.drvAcquire(&man, VIR_DLM_HANDOFF_STATE,
+                                      VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY,
+                                      VIR_DOMAIN_LOCK_FAILURE_DEFAULT, NULL);
+    virLockDriverImpl.drvFree(&man);
+    if (rv < 0)
+        return -1;
+
+    deadline = virDLMHandoffNow() + 10 * 1000000000ull;
+    for (;;) {
+        fake_dlm_get_stats(&stats);
+        if (stats.queued >= queued)
+            return 0;
+        if (virDLMHandoffNow() > deadline) {
+            virReportError(VIR_ERR_OPERATION_TIMEOUT, "%s",
+                           _("the destination did not queue its locks"));
+            return -1;
+        }
+        usleep(100);
+    }
+}
+
+/* The destination resumes the domain, or gives up on it */
+static int
+virDLMHandoffDestination(bool resume)
+{
+    virLockManager man;
+    int rv = -1;
+
+    if (virDLMHandoffManager(&man) < 0)
+        return -1;
+
+    if (resume &&
+        virLockDriverImpl.drvAcquire(&man, VIR_DLM_HANDOFF_STATE, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) < 0)
+        goto cleanup;
+
+    if (resume &&
+        virDLMHandoffCheckThird(false, _("domain resumed")) < 0)
+        goto cleanup;
+
+    if (virLockDriverImpl.drvRelease(&man, NULL, 0) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    virLockDriverImpl.drvFree(&man);
+    return rv;
+}
+
+static int
+virDLMHandoffRun(virDLMHandoffScenario scenario)
+{
+    int rv = -1;
+
+    handoff.scenario = scenario;
+
+    if (virDLMHandoffSourceStart() < 0 ||
+        virDLMHandoffRegister() < 0 ||
+        virDLMHandoffCheckThird(false, _("locks queued")) < 0)
+        goto cleanup;
+
+    switch (scenario) {
+    case VIR_DLM_HANDOFF_SWITCHOVER:
+        if (virDLMHandoffSourceSwitchover() < 0 ||
+            virDLMHandoffCheckThird(false, _("switchover")) < 0 ||
+            virDLMHandoffDestination(true) < 0)
+            goto cleanup;
+        virDLMHandoffSourceStop();
+        break;
+
+    case VIR_DLM_HANDOFF_FAIL_BEFORE:
+        if (virDLMHandoffDestination(false) < 0 ||
+            virDLMHandoffCheckThird(false, _("source still running")) < 0)
+            goto cleanup;
+        virDLMHandoffSourceStop();
+        break;
+
+    case VIR_DLM_HANDOFF_FAIL_AFTER:
+        if (virDLMHandoffSourceSwitchover() < 0 ||
+            virDLMHandoffCheckThird(false, _("switchover")) < 0 ||
+            virDLMHandoffDestination(false) < 0)
+            goto cleanup;
+        break;
+
+    case VIR_DLM_HANDOFF_LAST:
+        break;
+    }
+
+    /* Nothing of the destination may be left behind */
+    if (virDLMHandoffCheckThird(true, _("migration over")) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    virDLMHandoffSourceStop();
+    return rv;
+}
+
+static int
+virDLMHandoffParseUInt(const char *arg,
+                       unsigned int *value,
+                       bool positive)
+{
+    if (virStrToLong_ui(arg, NULL, 10, value) < 0 ||
+        (positive && *value == 0)) {
+        fprintf(stderr, _("invalid number '%s'\n"), arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+virDLMHandoffUsage(const char *argv0)
+{
+    fprintf(stderr,
+            _("\n"
+              "Usage:\n"
+              "  %s [options]\n"
+              "\n"
+              "Options:\n"
+              "  -h | --help               Display program help\n"
+              "  -d | --disks <n>          Disks of the migrated domain (default %u)\n"
+              "  -r | --rtt <usec>         DLM round trip (default %u)\n"
+              "  -j | --jitter <usec>      Random extra delay of the DLM (default %u)\n"
+              "\n"),
+            argv0, handoff.disks, handoff.rtt, handoff.jitter);
+}
+
+int
+main(int argc, char **argv)
+{
+    char *configFile = NULL;
+    char *dir = NULL;
+    char *recordFile = NULL;
+    char *content = NULL;
+    virThread eventThread;
+    size_t failed = 0;
+    size_t i;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    struct option opts[] = {
+        { "disks", required_argument, NULL, 'd' },
+        { "rtt", required_argument, NULL, 'r' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { 0, 0, 0, 0 },
+    };
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    while ((c = getopt_long(argc, argv, "hd:r:j:", opts, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            if (virDLMHandoffParseUInt(optarg, &handoff.disks, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'r':
+            if (virDLMHandoffParseUInt(optarg, &handoff.rtt, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'j':
+            if (virDLMHandoffParseUInt(optarg, &handoff.jitter, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'h':
+            virDLMHandoffUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            virDLMHandoffUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(VIR_DLM_HANDOFF_THIRD, 1) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to simulate the cluster"));
+        goto cleanup;
+    }
+    for (i = 0; i < FAKE_DLM_OP_LAST; i++)
+        fake_dlm_set_latency(i, handoff.rtt, handoff.jitter);
+
+    /* A scratch configuration keeps the record file of the host alone */
+    if (VIR_STRDUP(dir, "/tmp/dlm-handoff-XXXXXX") < 0)
+        goto cleanup;
+    if (!mkdtemp(dir)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create a temporary directory"));
+        VIR_FREE(dir);
+        goto cleanup;
+    }
+
+    if (!(configFile = virFileBuildPath(dir, "dlm", ".conf")) ||
+        !(recordFile = virFileBuildPath(dir, "DLMlocks", ".txt")))
+        goto cleanup;
+
+    if (virAsprintf(&content,
+                    "lockspace_name = \"%s\"\n"
+                    "lock_record_file = \"%s\"\n",
+                    VIR_DLM_HANDOFF_LOCKSPACE, recordFile) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(configFile, content, 0600) < 0) {
+        virReportSystemError(errno, _("unable to write '%s'"), configFile);
+        goto cleanup;
+    }
+
+    /* The handoff needs an event loop for its ASTs */
+    if (virThreadCreate(&eventThread, false, virDLMHandoffEventLoop, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create the event loop thread"));
+        goto cleanup;
+    }
+
+    if (virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, configFile,
+                                  VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+        goto cleanup;
+
+    printf("# disks=%u rtt=%uus jitter=%uus\n",
+           handoff.disks, handoff.rtt, handoff.jitter);
+
+    for (i = 0; i < VIR_DLM_HANDOFF_LAST; i++) {
+        if (virDLMHandoffRun(i) < 0) {
+            printf("%-12s FAIL %s\n", virDLMHandoffScenarioTypeToString(i),
+                   virGetLastErrorMessage());
+            virResetLastError();
+            failed++;
+        } else {
+            printf("%-12s ok\n", virDLMHandoffScenarioTypeToString(i));
+        }
+    }
+
+    if (failed == 0)
+        ret = EXIT_SUCCESS;
+
+ cleanup:
+    if (ret != EXIT_SUCCESS && failed == 0)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    virLockDriverImpl.drvDeinit();
+    quit = true;
+
+    VIR_FREE(content);
+    VIR_FREE(configFile);
+    VIR_FREE(recordFile);
+    if (dir) {
+        ignore_value(virFileDeleteTree(dir));
+        VIR_FREE(dir);
+    }
+
+    return ret;
+}
@@ -0,0 +1,855 @@
+/*
+ * dlm_replay.c: replay of a trace of the DLM lock driver
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Feeds the calls recorded by the trace_file setting of the driver
+ * back to it, on top of fake_dlm.c, at their original pace or
+ * faster, and compares the outcome and latency of every kind of
+ * call with the recorded ones. It is built like dlm_bench:
+ *
+ *   dlm_replay.c fake_dlm.c lock_driver_dlm.c dlm_protocol.c
+ *   dlm_trace.c dlm_stats.c dlm_recorder.c -DDLM_CLUSTER_NAME_PATH='"/"'
+ *
+ * The calls of a domain are made in their recorded order by one
+ * thread, the domains being spread over the threads. Resources are
+ * named after their recorded digest, which keeps them apart as in
+ * the original run.
+ */
+
+#include <config.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "dlm_trace.h"
+#include "fake_dlm.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virgettext.h"
+#include "virhash.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+VIR_LOG_INIT("locking.dlm_replay")
+
+typedef struct _virDLMReplayCall virDLMReplayCall;
+typedef virDLMReplayCall *virDLMReplayCallPtr;
+struct _virDLMReplayCall {
+    virDLMTraceRecord record;
+    size_t seq;                 /* position in the trace */
+    unsigned long long ns;      /* replayed duration */
+    int result;
+    bool skipped;               /* its domain was not replayed */
+};
+
+typedef struct _virDLMReplayDomain virDLMReplayDomain;
+typedef virDLMReplayDomain *virDLMReplayDomainPtr;
+struct _virDLMReplayDomain {
+    virLockManager man;
+    char name[VIR_UUID_STRING_BUFLEN];
+    char *state;                /* from the last release asking for it */
+    size_t worker;
+};
+
+typedef struct _virDLMReplayWorker virDLMReplayWorker;
+typedef virDLMReplayWorker *virDLMReplayWorkerPtr;
+struct _virDLMReplayWorker {
+    virThread thread;
+    size_t *calls;              /* indexes in replay.calls, in order */
+    size_t ncalls;
+    unsigned long long lag;     /* most nanoseconds behind the schedule */
+};
+
+/* Completion of an asynchronous call, waited for by its worker */
+typedef struct _virDLMReplayWaiter virDLMReplayWaiter;
+typedef virDLMReplayWaiter *virDLMReplayWaiterPtr;
+struct _virDLMReplayWaiter {
+    virMutex lock;
+    virCond cond;
+    bool done;
+    int result;
+    char *state;
+};
+
+static struct {
+    double speed;               /* 0 to replay as fast as possible */
+    unsigned int threads;
+    unsigned int rtt;           /* microseconds */
+    unsigned int jitter;
+    unsigned int nodes;
+
+    virDLMReplayCallPtr calls;
+    size_t ncalls;
+    virHashTablePtr domains;
+    virDLMReplayWorkerPtr workers;
+    unsigned long long start;   /* when the replay started */
+    char *firstError;
+} replay = {
+    .speed = 1,
+    .threads = 8,
+    .rtt = 200,
+    .jitter = 0,
+    .nodes = 3,
+};
+
+static bool quit;
+
+static unsigned long long
+virDLMReplayNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+virDLMReplayEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+}
+
+static void
+virDLMReplayError(void)
+{
+    /* Only the first one, the others are most likely the same */
+    if (!replay.firstError)
+        ignore_value(VIR_STRDUP(replay.firstError, virGetLastErrorMessage()));
+    virResetLastError();
+}
+
+static int
+virDLMReplayCompare(const void *a,
+                    const void *b)
+{
+    const virDLMReplayCall *x = a;
+    const virDLMReplayCall *y = b;
+
+    if (x->record.time != y->record.time)
+        return x->record.time < y->record.time ? -1 : 1;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Read the whole trace, in the order the calls were made: the
+ * record of an asynchronous call is only written on its completion.
+ */
+static int
+virDLMReplayLoad(const char *path)
+{
+    virDLMTracePtr trace = NULL;
+    virDLMReplayCall call;
+    int rc;
+    int rv = -1;
+
+    if (!(trace = virDLMTraceOpenRead(path)))
+        return -1;
+
+    memset(&call, 0, sizeof(call));
+
+    while ((rc = virDLMTraceRead(trace, &call.record)) > 0) {
+        if (call.record.call >= VIR_DLM_TRACE_CALL_LAST)
+            continue;
+
+        call.seq = replay.ncalls;
+        if (VIR_APPEND_ELEMENT(replay.calls, replay.ncalls, call) < 0)
+            goto cleanup;
+    }
+    if (rc < 0)
+        goto cleanup;
+
+    qsort(replay.calls, replay.ncalls, sizeof(*replay.calls),
+          virDLMReplayCompare);
+
+    rv = 0;
+ cleanup:
+    virDLMTraceClose(trace);
+    return rv;
+}
+
+/* Give every domain of the trace to a thread, round robin */
+static int
+virDLMReplayAssign(void)
+{
+    virDLMReplayDomainPtr dom;
+    virDLMReplayWorkerPtr worker;
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    size_t ndomains = 0;
+    size_t i;
+
+    if (!(replay.domains = virHashCreate(64, virHashValueFree)) ||
+        VIR_ALLOC_N(replay.workers, replay.threads) < 0)
+        return -1;
+
+    for (i = 0; i < replay.ncalls; i++) {
+        virUUIDFormat(replay.calls[i].record.uuid, uuidstr);
+
+        if (!(dom = virHashLookup(replay.domains, uuidstr))) {
+            if (VIR_ALLOC(dom) < 0)
+                return -1;
+            memcpy(dom->name, uuidstr, sizeof(uuidstr));
+            dom->worker = ndomains++ % replay.threads;
+            if (virHashAddEntry(replay.domains, uuidstr, dom) < 0) {
+                VIR_FREE(dom);
+                return -1;
+            }
+        }
+
+        worker = replay.workers + dom->worker;
+        if (VIR_APPEND_ELEMENT_COPY(worker->calls, worker->ncalls, i) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+virDLMReplayComplete(virLockManagerPtr man ATTRIBUTE_UNUSED,
+                     int result,
+                     char *state,
+                     void *opaque)
+{
+    virDLMReplayWaiterPtr waiter = opaque;
+
+    if (result < 0)
+        virDLMReplayError();
+
+    virMutexLock(&waiter->lock);
+    waiter->done = true;
+    waiter->result = result;
+    waiter->state = state;
+    virCondSignal(&waiter->cond);
+    virMutexUnlock(&waiter->lock);
+}
+
+/*
+ * Make the asynchronous call @record of @dom and wait for its
+ * completion, the next calls of the domain depend on it.
+ */
+static int
+virDLMReplayAsync(virDLMReplayDomainPtr dom,
+                  virDLMTraceRecordPtr record)
+{
+    virDLMReplayWaiter waiter;
+    int rv;
+
+    memset(&waiter, 0, sizeof(waiter));
+    if (virMutexInit(&waiter.lock) < 0)
+        return -1;
+    if (virCondInit(&waiter.cond) < 0) {
+        virMutexDestroy(&waiter.lock);
+        return -1;
+    }
+
+    if (record->call == VIR_DLM_TRACE_CALL_ACQUIRE_ASYNC)
+        rv = virLockDriverImpl.drvAcquireAsync(&dom->man,
+                                               record->state ? dom->state : NULL,
+                                               record->flags, record->action,
+                                               virDLMReplayComplete, &waiter);
+    else
+        rv = virLockDriverImpl.drvReleaseAsync(&dom->man, record->flags,
+                                               virDLMReplayComplete, &waiter);
+
+    if (rv == 0) {
+        virMutexLock(&waiter.lock);
+        while (!waiter.done)
+            ignore_value(virCondWait(&waiter.cond, &waiter.lock));
+        virMutexUnlock(&waiter.lock);
+        rv = waiter.result;
+
+        if (record->call == VIR_DLM_TRACE_CALL_RELEASE_ASYNC) {
+            VIR_FREE(dom->state);
+            VIR_STEAL_PTR(dom->state, waiter.state);
+        }
+        VIR_FREE(waiter.state);
+    }
+
+    virCondDestroy(&waiter.cond);
+    virMutexDestroy(&waiter.lock);
+    return rv;
+}
+
+static int
+virDLMReplayNew(virDLMReplayDomainPtr dom,
+                virDLMTraceRecordPtr record)
+{
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = dom->name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "id",
+          .value = { .ui = record->id ? record->id : 1 },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_INT,
+          .key = "pid",
+          .value = { .iv = getpid() },
+        },
+    };
+
+    memcpy(params[0].value.uuid, record->uuid, VIR_UUID_BUFLEN);
+
+    /* A domain the trace did not see freed */
+    if (dom->man.privateData)
+        virLockDriverImpl.drvFree(&dom->man);
+
+    dom->man.driver = &virLockDriverImpl;
+    dom->man.privateData = NULL;
+
+    if (virLockDriverImpl.drvNew(&dom->man, record->type,
+                                 ARRAY_CARDINALITY(params), params,
+                                 record->flags) < 0) {
+        if (dom->man.privateData)
+            virLockDriverImpl.drvFree(&dom->man);
+        dom->man.privateData = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+virDLMReplayResource(virDLMReplayDomainPtr dom,
+                     virDLMTraceRecordPtr record)
+{
+    char name[VIR_DLM_TRACE_DIGEST_LEN * 2 + 1];
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_ULONG,
+          .key = VIR_LOCK_MANAGER_DLM_PARAM_OFFSET,
+          .value = { .ul = record->offset },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_ULONG,
+          .key = VIR_LOCK_MANAGER_DLM_PARAM_LENGTH,
+          .value = { .ul = record->length },
+        },
+    };
+    size_t nparams = record->length ? ARRAY_CARDINALITY(params) : 0;
+    size_t i;
+
+    for (i = 0; i < VIR_DLM_TRACE_DIGEST_LEN; i++)
+        snprintf(name + i * 2, 3, "%02x", record->digest[i]);
+
+    if (record->call == VIR_DLM_TRACE_CALL_ADD_RESOURCE)
+        return virLockDriverImpl.drvAddResource(&dom->man, record->type,
+                                                name, nparams, params,
+                                                record->flags);
+
+    return virLockDriverImpl.drvUpdateResource(&dom->man, record->type,
+                                               name, nparams, params,
+                                               record->flags);
+}
+
+static int
+virDLMReplayOne(virDLMReplayCallPtr call)
+{
+    virDLMTraceRecordPtr record = &call->record;
+    virDLMReplayDomainPtr dom;
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    char *state = NULL;
+    int rv;
+
+    virUUIDFormat(record->uuid, uuidstr);
+    dom = virHashLookup(replay.domains, uuidstr);
+
+    if (record->call == VIR_DLM_TRACE_CALL_NEW)
+        return virDLMReplayNew(dom, record);
+
+    /* Its creation failed, or was not traced */
+    if (!dom->man.privateData) {
+        call->skipped = true;
+        return 0;
+    }
+
+    switch ((virDLMTraceCall) record->call) {
+    case VIR_DLM_TRACE_CALL_FREE:
+        virLockDriverImpl.drvFree(&dom->man);
+        dom->man.privateData = NULL;
+        VIR_FREE(dom->state);
+        return 0;
+
+    case VIR_DLM_TRACE_CALL_ADD_RESOURCE:
+    case VIR_DLM_TRACE_CALL_UPDATE_RESOURCE:
+        return virDLMReplayResource(dom, record);
+
+    case VIR_DLM_TRACE_CALL_ACQUIRE:
+        /* It would close the lockspace of the whole replay */
+        return virLockDriverImpl.drvAcquire(&dom->man,
+                                            record->state ? dom->state : NULL,
+                                            record->flags &
+                                            ~VIR_LOCK_MANAGER_ACQUIRE_RESTRICT,
+                                            record->action, NULL);
+
+    case VIR_DLM_TRACE_CALL_RELEASE:
+        VIR_FREE(dom->state);
+        return virLockDriverImpl.drvRelease(&dom->man,
+                                            record->state ? &dom->state : NULL,
+                                            record->flags);
+
+    case VIR_DLM_TRACE_CALL_INQUIRE:
+        rv = virLockDriverImpl.drvInquire(&dom->man,
+                                          record->state ? &state : NULL,
+                                          record->flags);
+        VIR_FREE(state);
+        return rv;
+
+    case VIR_DLM_TRACE_CALL_ACQUIRE_ASYNC:
+    case VIR_DLM_TRACE_CALL_RELEASE_ASYNC:
+        return virDLMReplayAsync(dom, record);
+
+    case VIR_DLM_TRACE_CALL_NEW:
+    case VIR_DLM_TRACE_CALL_LAST:
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Make the calls of the domains of @worker, each one no sooner than
+ * its offset in the trace divided by replay.speed.
+ */
+static void
+virDLMReplayWorkerRun(void *opaque)
+{
+    virDLMReplayWorkerPtr worker = opaque;
+    virDLMReplayCallPtr call;
+    unsigned long long first = replay.calls[0].record.time;
+    unsigned long long due, now;
+    struct timespec ts;
+    size_t i;
+
+    for (i = 0; i < worker->ncalls; i++) {
+        call = replay.calls + worker->calls[i];
+
+        if (replay.speed > 0) {
+            due = replay.start +
+                  (call->record.time - first) / replay.speed;
+            now = virDLMReplayNow();
+            if (due > now) {
+                ts.tv_sec = (due - now) / 1000000000ull;
+                ts.tv_nsec = (due - now) % 1000000000ull;
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                    ;
+            } else if (now - due > worker->lag) {
+                worker->lag = now - due;
+            }
+        }
+
+        now = virDLMReplayNow();
+        if ((call->result = virDLMReplayOne(call)) < 0)
+            virDLMReplayError();
+        call->ns = virDLMReplayNow() - now;
+    }
+}
+
+static int
+virDLMReplayRun(void)
+{
+    size_t i;
+
+    replay.start = virDLMReplayNow();
+
+    for (i = 0; i < replay.threads; i++) {
+        if (virThreadCreate(&replay.workers[i].thread, true,
+                            virDLMReplayWorkerRun, replay.workers + i) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to create replay thread"));
+            while (i--)
+                virThreadJoin(&replay.workers[i].thread);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < replay.threads; i++)
+        virThreadJoin(&replay.workers[i].thread);
+
+    return 0;
+}
+
+/* Release the domains the trace left running */
+static int
+virDLMReplayStop(void *payload,
+                 const void *name ATTRIBUTE_UNUSED,
+                 void *opaque ATTRIBUTE_UNUSED)
+{
+    virDLMReplayDomainPtr dom = payload;
+
+    if (dom->man.privateData) {
+        ignore_value(virLockDriverImpl.drvRelease(&dom->man, NULL, 0));
+        virLockDriverImpl.drvFree(&dom->man);
+        dom->man.privateData = NULL;
+    }
+    VIR_FREE(dom->state);
+
+    return 0;
+}
+
+static int
+virDLMReplayCompareNs(const void *a,
+                      const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Per kind of call: how many were replayed, how many failed, how
+ * many had another outcome than in the trace, and the recorded
+ * then replayed latencies.
+ */
+static int
+virDLMReplayReport(unsigned long long wall)
+{
+    unsigned long long *ns = NULL;
+    unsigned long long recorded, replayed;
+    size_t count, failed, differ, skipped;
+    unsigned long long lag = 0;
+    fake_dlm_stats stats;
+    virDLMReplayCallPtr call;
+    size_t i, j;
+
+    if (VIR_ALLOC_N(ns, replay.ncalls) < 0)
+        return -1;
+
+    fake_dlm_get_stats(&stats);
+
+    for (i = 0; i < replay.threads; i++)
+        lag = MAX(lag, replay.workers[i].lag);
+
+    printf("# calls=%zu threads=%u speed=%g rtt=%uus jitter=%uus nodes=%u "
+           "wall=%.3fs lag=%.1fms\n",
+           replay.ncalls, replay.threads, replay.speed, replay.rtt,
+           replay.jitter, replay.nodes, wall / 1e9, lag / 1e6);
+    printf("%-16s %8s %8s %8s %8s %12s %12s %12s\n",
+           "call", "count", "failed", "differ", "skipped",
+           "trace(us)", "mean(us)", "p99(us)");
+
+    for (i = 0; i < VIR_DLM_TRACE_CALL_LAST; i++) {
+        count = failed = differ = skipped = 0;
+        recorded = replayed = 0;
+
+        for (j = 0; j < replay.ncalls; j++) {
+            call = replay.calls + j;
+            if (call->record.call != i)
+                continue;
+
+            if (call->skipped) {
+                skipped++;
+                continue;
+            }
+
+            ns[count++] = call->ns;
+            recorded += call->record.duration;
+            replayed += call->ns;
+            if (call->result < 0)
+                failed++;
+            if ((call->result < 0) != (call->record.result < 0))
+                differ++;
+        }
+
+        if (!count && !skipped)
+            continue;
+
+        qsort(ns, count, sizeof(*ns), virDLMReplayCompareNs);
+
+        printf("%-16s %8zu %8zu %8zu %8zu %12.1f %12.1f %12.1f\n",
+               virDLMTraceCallTypeToString(i), count, failed, differ,
+               skipped,
+               count ? (double)recorded / count : 0,
+               count ? replayed / 1000.0 / count : 0,
+               count ? ns[(count * 99 + 99) / 100 - 1] / 1000.0 : 0);
+    }
+
+    printf("# dlm: lock=%llu convert=%llu unlock=%llu adopt=%llu "
+           "queued=%llu denied=%llu basts=%llu\n",
+           stats.requests[FAKE_DLM_OP_LOCK],
+           stats.requests[FAKE_DLM_OP_CONVERT],
+           stats.requests[FAKE_DLM_OP_UNLOCK],
+           stats.requests[FAKE_DLM_OP_ADOPT],
+           stats.queued, stats.denied, stats.basts);
+
+    if (replay.firstError)
+        printf("# first error: %s\n", replay.firstError);
+
+    VIR_FREE(ns);
+    return 0;
+}
+
+/* Without a configuration file of the user, see dlm_bench.c */
+static int
+virDLMReplayConfig(char **dir,
+                   char **configFile,
+                   const char *extra)
+{
+    char *content = NULL;
+    int rv = -1;
+
+    if (VIR_STRDUP(*dir, "/tmp/dlm-replay-XXXXXX") < 0)
+        return -1;
+
+    if (!mkdtemp(*dir)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create a temporary directory"));
+        VIR_FREE(*dir);
+        return -1;
+    }
+
+    if (!(*configFile = virFileBuildPath(*dir, "dlm", ".conf")))
+        goto cleanup;
+
+    if (virAsprintf(&content,
+                    "lockspace_name = \"dlm_replay\"\n"
+                    "lock_record_file = \"%s/DLMlocks.txt\"\n"
+                    "%s",
+                    *dir, extra ? extra : "") < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(*configFile, content, 0600) < 0) {
+        virReportSystemError(errno, _("unable to write '%s'"), *configFile);
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(content);
+    return rv;
+}
+
+static void
+virDLMReplayUsage(const char *argv0)
+{
+    fprintf(stderr,
+            _("\n"
+              "Usage:\n"
+              "  %s [options] <trace>\n"
+              "\n"
+              "Options:\n"
+              "  -h | --help               Display program help\n"
+              "  -f | --config <file>      Driver configuration file (default: a scratch one)\n"
+              "  -x | --speed <factor>     Replay that many times faster than recorded,\n"
+              "                            0 for as fast as possible (default %g)\n"
+              "  -t | --threads <n>        Threads calling the driver (default %u)\n"
+              "  -r | --rtt <usec>         DLM round trip (default %u)\n"
+              "  -j | --jitter <usec>      Random extra delay of the DLM (default %u)\n"
+              "  -n | --nodes <n>          Nodes of the simulated cluster (default %u)\n"
+              "  -c | --caching            Enable lock_caching\n"
+              "  -g | --grace <msec>       Set release_grace_period\n"
+              "\n"),
+            argv0, replay.speed, replay.threads, replay.rtt,
+            replay.jitter, replay.nodes);
+}
+
+static int
+virDLMReplayParseUInt(const char *arg,
+                      unsigned int *value,
+                      bool positive)
+{
+    if (virStrToLong_ui(arg, NULL, 10, value) < 0 ||
+        (positive && *value == 0)) {
+        fprintf(stderr, _("invalid number '%s'\n"), arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *configFile = NULL;
+    char *scratchConfig = NULL;
+    char *scratchDir = NULL;
+    char *extra = NULL;
+    bool caching = false;
+    unsigned int grace = 0;
+    unsigned long long start;
+    virThread eventThread;
+    size_t i;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    struct option opts[] = {
+        { "config", required_argument, NULL, 'f' },
+        { "speed", required_argument, NULL, 'x' },
+        { "threads", required_argument, NULL, 't' },
+        { "rtt", required_argument, NULL, 'r' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "nodes", required_argument, NULL, 'n' },
+        { "caching", no_argument, NULL, 'c' },
+        { "grace", required_argument, NULL, 'g' },
+        { "help", no_argument, NULL, 'h' },
+        { 0, 0, 0, 0 },
+    };
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    while ((c = getopt_long(argc, argv, "hf:x:t:r:j:n:cg:",
+                            opts, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            configFile = optarg;
+            break;
+        case 'x':
+            if (virStrToDouble(optarg, NULL, &replay.speed) < 0 ||
+                replay.speed < 0) {
+                fprintf(stderr, _("invalid speed '%s'\n"), optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            if (virDLMReplayParseUInt(optarg, &replay.threads, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'r':
+            if (virDLMReplayParseUInt(optarg, &replay.rtt, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'j':
+            if (virDLMReplayParseUInt(optarg, &replay.jitter, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'n':
+            if (virDLMReplayParseUInt(optarg, &replay.nodes, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'c':
+            caching = true;
+            break;
+        case 'g':
+            if (virDLMReplayParseUInt(optarg, &grace, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'h':
+            virDLMReplayUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            virDLMReplayUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        virDLMReplayUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    if (virDLMReplayLoad(argv[optind]) < 0)
+        goto cleanup;
+
+    if (!replay.ncalls) {
+        fprintf(stderr, _("%s: '%s' holds no call\n"), argv[0], argv[optind]);
+        ret = EXIT_SUCCESS;
+        goto cleanup;
+    }
+
+    if (virDLMReplayAssign() < 0)
+        goto cleanup;
+
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(replay.nodes, 1) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to simulate the cluster"));
+        goto cleanup;
+    }
+    for (i = 0; i < FAKE_DLM_OP_LAST; i++)
+        fake_dlm_set_latency(i, replay.rtt, replay.jitter);
+
+    if (!configFile) {
+        if (virAsprintf(&extra, "lock_caching = %d\n"
+                        "release_grace_period = %u\n",
+                        caching, grace) < 0 ||
+            virDLMReplayConfig(&scratchDir, &scratchConfig, extra) < 0)
+            goto cleanup;
+        configFile = scratchConfig;
+    }
+
+    /* The asynchronous calls need an event loop */
+    if (virThreadCreate(&eventThread, false, virDLMReplayEventLoop, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create the event loop thread"));
+        goto cleanup;
+    }
+
+    if (virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, configFile,
+                                  VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+        goto cleanup;
+
+    start = virDLMReplayNow();
+    if (virDLMReplayRun() < 0)
+        goto cleanup;
+
+    if (virDLMReplayReport(virDLMReplayNow() - start) < 0)
+        goto cleanup;
+
+    ret = EXIT_SUCCESS;
+
+ cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    if (replay.domains)
+        virHashForEach(replay.domains, virDLMReplayStop, NULL);
+
+    virLockDriverImpl.drvDeinit();
+    quit = true;
+
+    virHashFree(replay.domains);
+    if (replay.workers) {
+        for (i = 0; i < replay.threads; i++)
+            VIR_FREE(replay.workers[i].calls);
+        VIR_FREE(replay.workers);
+    }
+    VIR_FREE(replay.calls);
+    VIR_FREE(replay.firstError);
+    VIR_FREE(extra);
+    VIR_FREE(scratchConfig);
+    if (scratchDir) {
+        ignore_value(virFileDeleteTree(scratchDir));
+        VIR_FREE(scratchDir);
+    }
+
+    return ret;
+}
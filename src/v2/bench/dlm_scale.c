@@ -0,0 +1,759 @@
+/*
+ * dlm_scale.c: node scale scenarios of the DLM lock driver
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Replays what a whole node goes through, as opposed to dlm_bench
+ * which measures single calls:
+ *
+ *  - boot: a boot storm, every domain of the node started at once
+ *  - evacuate: every domain stopped and its disks taken over by
+ *    another node, as when the node is drained
+ *  - restart: libvirtd restarted while holding many locks, which
+ *    turn into orphans to be adopted again
+ *
+ * Every phase reports its wall time, the time the driver spent
+ * hashing resource names, writing its record file and adopting
+ * locks, the time the requests spent in the DLM, the peak RSS of
+ * the process so far and the size of the record file. The DLM time
+ * is summed over the requests, which run concurrently, so it may
+ * exceed the wall time.
+ *
+ * Built like dlm_bench, and as root as well.
+ */
+
+#include <config.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <libdlm.h>
+
+#include "dlm_stats.h"
+#include "fake_dlm.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "vircrypto.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virgettext.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+#define VIR_DLM_SCALE_LOCKSPACE "dlm_scale"
+#define VIR_DLM_SCALE_PEER 2
+
+VIR_LOG_INIT("locking.dlm_scale")
+
+typedef enum {
+    VIR_DLM_SCALE_PHASE_BOOT,
+    VIR_DLM_SCALE_PHASE_EVACUATE,
+    VIR_DLM_SCALE_PHASE_RESTART,
+
+    VIR_DLM_SCALE_PHASE_LAST
+} virDLMScalePhase;
+
+VIR_ENUM_DECL(virDLMScalePhase)
+VIR_ENUM_IMPL(virDLMScalePhase, VIR_DLM_SCALE_PHASE_LAST,
+              "boot", "evacuate", "restart")
+
+typedef struct _virDLMScaleVM virDLMScaleVM;
+typedef virDLMScaleVM *virDLMScaleVMPtr;
+struct _virDLMScaleVM {
+    virLockManager man;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    char name[32];
+    bool running;
+
+    /* Locks of the peer node after the evacuation */
+    uint32_t *peerLocks;
+    size_t npeerLocks;
+};
+
+typedef int (*virDLMScaleFunc)(size_t index);
+
+typedef struct _virDLMScaleWorker virDLMScaleWorker;
+typedef virDLMScaleWorker *virDLMScaleWorkerPtr;
+struct _virDLMScaleWorker {
+    virThread thread;
+    size_t index;
+    size_t nvms;
+    virDLMScaleFunc func;
+    size_t failed;
+};
+
+static struct {
+    unsigned int vms;
+    unsigned int disks;
+    unsigned int threads;
+    unsigned int held;          /* locks held across the restart */
+    unsigned int rtt;
+    unsigned int jitter;
+    unsigned int nodes;
+    bool phases[VIR_DLM_SCALE_PHASE_LAST];
+
+    const char *recordFile;
+    virDLMScaleVMPtr vm;
+    size_t nvm;
+    char *firstError;
+} scale = {
+    .vms = 1000,
+    .disks = 4,
+    .threads = 16,
+    .held = 5000,
+    .rtt = 300,
+    .jitter = 100,
+    .nodes = 3,
+};
+
+static bool quit;
+
+static unsigned long long
+virDLMScaleNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+virDLMScaleEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+}
+
+static void
+virDLMScaleError(void)
+{
+    if (!scale.firstError)
+        ignore_value(VIR_STRDUP(scale.firstError, virGetLastErrorMessage()));
+    virResetLastError();
+}
+
+static int
+virDLMScaleDiskPath(size_t index,
+                    size_t disk,
+                    char **path)
+{
+    return virAsprintf(path, "/dev/scale/vm-%zu-disk-%zu", index, disk);
+}
+
+static int
+virDLMScaleStart(size_t index)
+{
+    virDLMScaleVMPtr vm = scale.vm + index;
+    char *path = NULL;
+    size_t i;
+    int rv = -1;
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = vm->name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "id",
+          .value = { .ui = index + 1 },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_INT,
+          .key = "pid",
+          .value = { .iv = getpid() },
+        },
+    };
+
+    memcpy(params[0].value.uuid, vm->uuid, VIR_UUID_BUFLEN);
+    vm->man.driver = &virLockDriverImpl;
+
+    if (virLockDriverImpl.drvNew(&vm->man,
+                                 VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN,
+                                 ARRAY_CARDINALITY(params), params, 0) < 0)
+        goto cleanup;
+
+    for (i = 0; i < scale.disks; i++) {
+        if (virDLMScaleDiskPath(index, i, &path) < 0 ||
+            virLockDriverImpl.drvAddResource(&vm->man,
+                                             VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                             path, 0, NULL, 0) < 0)
+            goto cleanup;
+        VIR_FREE(path);
+    }
+
+    if (virLockDriverImpl.drvAcquire(&vm->man, NULL, 0,
+                                     VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                     NULL) < 0)
+        goto cleanup;
+
+    vm->running = true;
+    rv = 0;
+
+ cleanup:
+    if (rv < 0)
+        virLockDriverImpl.drvFree(&vm->man);
+    VIR_FREE(path);
+    return rv;
+}
+
+static int
+virDLMScaleStop(size_t index)
+{
+    virDLMScaleVMPtr vm = scale.vm + index;
+    int rv;
+
+    if (!vm->running)
+        return 0;
+
+    rv = virLockDriverImpl.drvRelease(&vm->man, NULL, 0);
+    virLockDriverImpl.drvFree(&vm->man);
+    vm->running = false;
+
+    return rv;
+}
+
+/* The peer node takes the disks of the stopped domain, waiting if need be */
+static int
+virDLMScaleTakeOver(size_t index)
+{
+    virDLMScaleVMPtr vm = scale.vm + index;
+    unsigned long long deadline;
+    char *path = NULL;
+    char *name = NULL;
+    uint32_t lkid;
+    size_t i;
+    int rv = -1;
+
+    if (virDLMScaleStop(index) < 0)
+        return -1;
+
+    if (VIR_ALLOC_N(vm->peerLocks, scale.disks) < 0)
+        return -1;
+
+    for (i = 0; i < scale.disks; i++) {
+        if (virDLMScaleDiskPath(index, i, &path) < 0 ||
+            virCryptoHashString(VIR_CRYPTO_HASH_SHA256, path, &name) < 0)
+            goto cleanup;
+
+        if (fake_dlm_remote_lock(VIR_DLM_SCALE_PEER, VIR_DLM_SCALE_LOCKSPACE,
+                                 name, LKM_EXMODE, LKF_PERSISTENT,
+                                 &lkid) < 0) {
+            virReportSystemError(errno, _("peer unable to lock '%s'"), path);
+            goto cleanup;
+        }
+        vm->peerLocks[vm->npeerLocks++] = lkid;
+
+        /* Cached locks are let go as the DLM asks for them */
+        deadline = virDLMScaleNow() + 30 * 1000000000ull;
+        while (fake_dlm_lock_mode(lkid) != LKM_EXMODE) {
+            if (virDLMScaleNow() > deadline) {
+                virReportError(VIR_ERR_OPERATION_TIMEOUT,
+                               _("peer still waiting for '%s'"), path);
+                goto cleanup;
+            }
+            usleep(100);
+        }
+
+        VIR_FREE(path);
+        VIR_FREE(name);
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(path);
+    VIR_FREE(name);
+    return rv;
+}
+
+static int
+virDLMScalePeerRelease(size_t index)
+{
+    virDLMScaleVMPtr vm = scale.vm + index;
+    size_t i;
+
+    for (i = 0; i < vm->npeerLocks; i++)
+        ignore_value(fake_dlm_remote_unlock(vm->peerLocks[i]));
+    VIR_FREE(vm->peerLocks);
+    vm->npeerLocks = 0;
+
+    return 0;
+}
+
+static void
+virDLMScaleWorkerRun(void *opaque)
+{
+    virDLMScaleWorkerPtr worker = opaque;
+    size_t i;
+
+    for (i = worker->index; i < worker->nvms; i += scale.threads) {
+        if (worker->func(i) < 0) {
+            virDLMScaleError();
+            worker->failed++;
+        }
+    }
+}
+
+/* Apply @func to the first @nvms domains, returns the failures */
+static ssize_t
+virDLMScaleRun(virDLMScaleFunc func,
+               size_t nvms)
+{
+    virDLMScaleWorkerPtr workers = NULL;
+    ssize_t failed = 0;
+    size_t i;
+
+    if (VIR_ALLOC_N(workers, scale.threads) < 0)
+        return -1;
+
+    for (i = 0; i < scale.threads; i++) {
+        workers[i].index = i;
+        workers[i].nvms = nvms;
+        workers[i].func = func;
+        if (virThreadCreate(&workers[i].thread, true,
+                            virDLMScaleWorkerRun, workers + i) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to create benchmark thread"));
+            while (i--)
+                virThreadJoin(&workers[i].thread);
+            VIR_FREE(workers);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < scale.threads; i++) {
+        virThreadJoin(&workers[i].thread);
+        failed += workers[i].failed;
+    }
+
+    VIR_FREE(workers);
+    return failed;
+}
+
+static void
+virDLMScaleHeader(void)
+{
+    printf("# vms=%u disks=%u threads=%u held=%u rtt=%uus jitter=%uus nodes=%u\n",
+           scale.vms, scale.disks, scale.threads, scale.held,
+           scale.rtt, scale.jitter, scale.nodes);
+    printf("%-9s %8s %6s %10s %10s %10s %10s %10s %10s %12s\n",
+           "phase", "ops", "failed", "wall(ms)", "hash(ms)", "dlm(ms)",
+           "record(ms)", "adopt(ms)", "rss(KiB)", "record(B)");
+}
+
+static void
+virDLMScaleReport(virDLMScalePhase phase,
+                  size_t ops,
+                  ssize_t failed,
+                  unsigned long long wall,
+                  fake_dlm_stats *before)
+{
+    virDLMStats stats;
+    fake_dlm_stats after;
+    struct rusage usage;
+    struct stat sb;
+
+    virDLMStatsGet(&stats, true);
+    fake_dlm_get_stats(&after);
+    getrusage(RUSAGE_SELF, &usage);
+    if (stat(scale.recordFile, &sb) < 0)
+        sb.st_size = 0;
+
+    printf("%-9s %8zu %6zd %10.1f %10.1f %10.1f %10.1f %10.1f %10ld %12lld\n",
+           virDLMScalePhaseTypeToString(phase), ops, failed,
+           wall / 1e6,
+           stats.steps[VIR_DLM_STATS_STEP_HASH].sum / 1e6,
+           (after.wait - before->wait) / 1e3,
+           (stats.steps[VIR_DLM_STATS_STEP_WRITE].sum +
+            stats.steps[VIR_DLM_STATS_STEP_SYNC].sum) / 1e6,
+           stats.steps[VIR_DLM_STATS_STEP_ADOPT].sum / 1e6,
+           usage.ru_maxrss, (long long)sb.st_size);
+}
+
+static int
+virDLMScalePhaseRun(virDLMScalePhase phase,
+                    const char *configFile)
+{
+    virDLMStats stats;
+    fake_dlm_stats before;
+    unsigned long long start;
+    size_t nvms = scale.vms;
+    ssize_t failed = 0;
+
+    /* Only what the phase itself does is accounted */
+    switch (phase) {
+    case VIR_DLM_SCALE_PHASE_EVACUATE:
+        if (!scale.phases[VIR_DLM_SCALE_PHASE_BOOT] &&
+            virDLMScaleRun(virDLMScaleStart, nvms) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_SCALE_PHASE_RESTART:
+        nvms = (scale.held + scale.disks - 1) / MAX(scale.disks, 1);
+        if (nvms > scale.nvm)
+            nvms = scale.nvm;
+        if (virDLMScaleRun(virDLMScaleStart, nvms) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_SCALE_PHASE_BOOT:
+    case VIR_DLM_SCALE_PHASE_LAST:
+        break;
+    }
+
+    virDLMStatsGet(&stats, true);
+    fake_dlm_get_stats(&before);
+    start = virDLMScaleNow();
+
+    switch (phase) {
+    case VIR_DLM_SCALE_PHASE_BOOT:
+        failed = virDLMScaleRun(virDLMScaleStart, nvms);
+        break;
+
+    case VIR_DLM_SCALE_PHASE_EVACUATE:
+        failed = virDLMScaleRun(virDLMScaleTakeOver, nvms);
+        break;
+
+    case VIR_DLM_SCALE_PHASE_RESTART:
+        /* The managers of the running domains outlive the driver,
+         * as the domain objects of libvirtd would */
+        if (virLockDriverImpl.drvDeinit() < 0 ||
+            virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, configFile,
+                                      VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_SCALE_PHASE_LAST:
+        break;
+    }
+
+    if (failed < 0)
+        return -1;
+
+    virDLMScaleReport(phase, phase == VIR_DLM_SCALE_PHASE_RESTART ?
+                      nvms * scale.disks : nvms,
+                      failed, virDLMScaleNow() - start, &before);
+
+    /* Leave the node empty for the next phase */
+    switch (phase) {
+    case VIR_DLM_SCALE_PHASE_BOOT:
+        if (!scale.phases[VIR_DLM_SCALE_PHASE_EVACUATE] &&
+            virDLMScaleRun(virDLMScaleStop, nvms) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_SCALE_PHASE_EVACUATE:
+        if (virDLMScaleRun(virDLMScalePeerRelease, nvms) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_SCALE_PHASE_RESTART:
+        if (virDLMScaleRun(virDLMScaleStop, nvms) < 0)
+            return -1;
+        break;
+
+    case VIR_DLM_SCALE_PHASE_LAST:
+        break;
+    }
+
+    return 0;
+}
+
+static int
+virDLMScaleParsePhases(const char *arg)
+{
+    char **names = NULL;
+    size_t i;
+    int phase;
+    int rv = -1;
+
+    memset(scale.phases, 0, sizeof(scale.phases));
+
+    if (STREQ(arg, "all")) {
+        for (i = 0; i < VIR_DLM_SCALE_PHASE_LAST; i++)
+            scale.phases[i] = true;
+        return 0;
+    }
+
+    if (!(names = virStringSplit(arg, ",", 0)))
+        return -1;
+
+    for (i = 0; names[i]; i++) {
+        if ((phase = virDLMScalePhaseTypeFromString(names[i])) < 0) {
+            fprintf(stderr, _("unknown phase '%s'\n"), names[i]);
+            goto cleanup;
+        }
+        scale.phases[phase] = true;
+    }
+
+    rv = 0;
+ cleanup:
+    virStringListFree(names);
+    return rv;
+}
+
+static int
+virDLMScaleParseUInt(const char *arg,
+                     unsigned int *value,
+                     bool positive)
+{
+    if (virStrToLong_ui(arg, NULL, 10, value) < 0 ||
+        (positive && *value == 0)) {
+        fprintf(stderr, _("invalid number '%s'\n"), arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+virDLMScaleUsage(const char *argv0)
+{
+    fprintf(stderr,
+            _("\n"
+              "Usage:\n"
+              "  %s [options]\n"
+              "\n"
+              "Options:\n"
+              "  -h | --help               Display program help\n"
+              "  -p | --phase <list>       Comma separated list of boot, evacuate, restart\n"
+              "                            or all (default all)\n"
+              "  -m | --vms <n>            Domains booted and evacuated (default %u)\n"
+              "  -d | --disks <n>          Disks per domain (default %u)\n"
+              "  -t | --threads <n>        Threads calling the driver (default %u)\n"
+              "  -H | --held <n>           Locks held across the restart (default %u)\n"
+              "  -r | --rtt <usec>         DLM round trip (default %u)\n"
+              "  -j | --jitter <usec>      Random extra delay of the DLM (default %u)\n"
+              "  -n | --nodes <n>          Nodes of the simulated cluster (default %u)\n"
+              "  -c | --caching            Enable lock_caching\n"
+              "  -g | --grace <msec>       Set release_grace_period\n"
+              "\n"),
+            argv0, scale.vms, scale.disks, scale.threads, scale.held,
+            scale.rtt, scale.jitter, scale.nodes);
+}
+
+int
+main(int argc, char **argv)
+{
+    char *configFile = NULL;
+    char *dir = NULL;
+    char *recordFile = NULL;
+    char *content = NULL;
+    bool caching = false;
+    unsigned int grace = 0;
+    virThread eventThread;
+    size_t i, j;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    struct option opts[] = {
+        { "phase", required_argument, NULL, 'p' },
+        { "vms", required_argument, NULL, 'm' },
+        { "disks", required_argument, NULL, 'd' },
+        { "threads", required_argument, NULL, 't' },
+        { "held", required_argument, NULL, 'H' },
+        { "rtt", required_argument, NULL, 'r' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "nodes", required_argument, NULL, 'n' },
+        { "caching", no_argument, NULL, 'c' },
+        { "grace", required_argument, NULL, 'g' },
+        { "help", no_argument, NULL, 'h' },
+        { 0, 0, 0, 0 },
+    };
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < VIR_DLM_SCALE_PHASE_LAST; i++)
+        scale.phases[i] = true;
+
+    while ((c = getopt_long(argc, argv, "hp:m:d:t:H:r:j:n:cg:",
+                            opts, NULL)) != -1) {
+        switch (c) {
+        case 'p':
+            if (virDLMScaleParsePhases(optarg) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'm':
+            if (virDLMScaleParseUInt(optarg, &scale.vms, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'd':
+            if (virDLMScaleParseUInt(optarg, &scale.disks, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 't':
+            if (virDLMScaleParseUInt(optarg, &scale.threads, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'H':
+            if (virDLMScaleParseUInt(optarg, &scale.held, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'r':
+            if (virDLMScaleParseUInt(optarg, &scale.rtt, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'j':
+            if (virDLMScaleParseUInt(optarg, &scale.jitter, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'n':
+            if (virDLMScaleParseUInt(optarg, &scale.nodes, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'c':
+            caching = true;
+            break;
+        case 'g':
+            if (virDLMScaleParseUInt(optarg, &grace, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'h':
+            virDLMScaleUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            virDLMScaleUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (scale.nodes < VIR_DLM_SCALE_PEER) {
+        fprintf(stderr, _("%s: the evacuation needs at least %d nodes\n"),
+                argv[0], VIR_DLM_SCALE_PEER);
+        exit(EXIT_FAILURE);
+    }
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(scale.nodes, 1) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to simulate the cluster"));
+        goto cleanup;
+    }
+    for (i = 0; i < FAKE_DLM_OP_LAST; i++)
+        fake_dlm_set_latency(i, scale.rtt, scale.jitter);
+
+    /* A scratch configuration keeps the record file of the host alone */
+    if (VIR_STRDUP(dir, "/tmp/dlm-scale-XXXXXX") < 0)
+        goto cleanup;
+    if (!mkdtemp(dir)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create a temporary directory"));
+        VIR_FREE(dir);
+        goto cleanup;
+    }
+
+    if (!(configFile = virFileBuildPath(dir, "dlm", ".conf")) ||
+        !(recordFile = virFileBuildPath(dir, "DLMlocks", ".txt")))
+        goto cleanup;
+    scale.recordFile = recordFile;
+
+    if (virAsprintf(&content,
+                    "lockspace_name = \"%s\"\n"
+                    "lock_record_file = \"%s\"\n"
+                    "lock_caching = %d\n"
+                    "release_grace_period = %u\n",
+                    VIR_DLM_SCALE_LOCKSPACE, recordFile,
+                    caching, grace) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(configFile, content, 0600) < 0) {
+        virReportSystemError(errno, _("unable to write '%s'"), configFile);
+        goto cleanup;
+    }
+
+    if (virThreadCreate(&eventThread, false, virDLMScaleEventLoop, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create the event loop thread"));
+        goto cleanup;
+    }
+
+    if (virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, configFile,
+                                  VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+        goto cleanup;
+
+    scale.nvm = MAX(scale.vms, (scale.held + scale.disks - 1) / scale.disks);
+    if (VIR_ALLOC_N(scale.vm, scale.nvm) < 0)
+        goto cleanup;
+
+    for (i = 0; i < scale.nvm; i++) {
+        scale.vm[i].uuid[0] = 0x5c;
+        scale.vm[i].uuid[1] = 0xa1;
+        for (j = 0; j < sizeof(i); j++)
+            scale.vm[i].uuid[VIR_UUID_BUFLEN - 1 - j] = (i >> (8 * j)) & 0xff;
+        snprintf(scale.vm[i].name, sizeof(scale.vm[i].name),
+                 "scale-%zu", i);
+    }
+
+    virDLMScaleHeader();
+
+    for (i = 0; i < VIR_DLM_SCALE_PHASE_LAST; i++) {
+        if (scale.phases[i] &&
+            virDLMScalePhaseRun(i, configFile) < 0)
+            goto cleanup;
+    }
+
+    if (scale.firstError)
+        printf("# first error: %s\n", scale.firstError);
+
+    ret = EXIT_SUCCESS;
+
+ cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    if (scale.vm) {
+        for (i = 0; i < scale.nvm; i++) {
+            ignore_value(virDLMScaleStop(i));
+            VIR_FREE(scale.vm[i].peerLocks);
+        }
+    }
+
+    virLockDriverImpl.drvDeinit();
+    quit = true;
+
+    VIR_FREE(scale.vm);
+    VIR_FREE(scale.firstError);
+    VIR_FREE(content);
+    VIR_FREE(configFile);
+    VIR_FREE(recordFile);
+    if (dir) {
+        ignore_value(virFileDeleteTree(dir));
+        VIR_FREE(dir);
+    }
+
+    return ret;
+}
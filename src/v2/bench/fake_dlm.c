@@ -0,0 +1,2179 @@
+/*
+ * fake_dlm.c: in-process stand-in for libdlm and libcpg
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Built as a shared library linked instead of the real ones:
+ *
+ *   cc -shared -fPIC -o libfakedlm.so fake_dlm.c -lpthread
+ *
+ * The model follows the DLM closely enough for the driver: locks
+ * are granted in the order they were queued, conversions ahead of
+ * new locks, with the usual compatibility matrix. Blocking ASTs are
+ * sent once per lock and mode, value blocks are written by the PW
+ * and EX holders and invalidated when such a holder dies, and the
+ * persistent locks of a closed lockspace become orphans which can
+ * be adopted or purged.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <corosync/cpg.h>
+#include <libdlm.h>
+
+#include "fake_dlm.h"
+
+#define FAKE_DLM_BUCKETS 4096
+#define FAKE_DLM_MAX_NODES 64
+#define FAKE_DLM_DEFAULT_LOCKSPACE "default"
+
+typedef struct _fakeLockspace fakeLockspace;
+typedef struct _fakeResource fakeResource;
+typedef struct _fakeLock fakeLock;
+typedef struct _fakeEvent fakeEvent;
+typedef struct _fakePending fakePending;
+typedef struct _fakeWaiter fakeWaiter;
+typedef struct _fakeCpg fakeCpg;
+typedef struct _fakeCpgEvent fakeCpgEvent;
+
+typedef enum {
+    FAKE_LOCK_GRANTED,      /* nothing pending */
+    FAKE_LOCK_INFLIGHT,     /* on its way to the master */
+    FAKE_LOCK_CONVERTING,   /* on the convert queue */
+    FAKE_LOCK_WAITING,      /* on the wait queue */
+} fakeLockState;
+
+typedef enum {
+    FAKE_ACTION_REQUEST,
+    FAKE_ACTION_UNLOCK,
+    FAKE_ACTION_CANCEL,
+} fakeAction;
+
+/* Completion of a _wait call, delivered without the file descriptor */
+struct _fakeWaiter {
+    pthread_cond_t cond;
+    bool done;
+};
+
+struct _fakeLock {
+    uint32_t lkid;
+    fakeResource *res;
+
+    int grmode;                 /* -1 until first granted */
+    int rqmode;
+    uint32_t rqflags;
+    fakeLockState state;
+    bool busy;                  /* a request or unlock is unresolved */
+    bool cancel;                /* canceled before reaching the master */
+    int fault;                  /* status injected in the next completion */
+    int highbast;               /* highest mode a bast was sent for */
+    unsigned long long issued;  /* of the pending request */
+
+    unsigned int nodeid;
+    pid_t pid;
+    bool persistent;
+    bool orphan;
+
+    struct dlm_lksb *lksb;
+    struct dlm_lksb ownLksb;    /* of remote locks */
+    void (*ast)(void *arg);
+    void *astarg;
+    void (*bast)(void *arg);
+    void *bastarg;
+    fakeWaiter *waiter;
+
+    fakeLock *prev, *next;      /* all the locks of @res */
+    fakeLock *qnext;            /* convert or wait queue */
+    fakeLock *idnext;           /* lkid hash chain */
+};
+
+struct _fakeResource {
+    char *name;
+    unsigned int namelen;
+    fakeLockspace *ls;
+
+    char lvb[DLM_LVB_LEN];
+    bool lvbValid;
+
+    fakeLock *locks;
+    fakeLock *convertq;
+    fakeLock *waitq;
+
+    fakeResource *next;
+};
+
+struct _fakeEvent {
+    void (*fn)(void *arg);
+    void *arg;
+    fakeEvent *next;
+};
+
+struct _fakeLockspace {
+    char *name;
+    bool open;
+    int fd;
+
+    fakeResource *buckets[FAKE_DLM_BUCKETS];
+
+    fakeEvent *head, *tail;
+
+    bool threaded;
+    pthread_t thread;
+
+    fakeLockspace *next;
+};
+
+struct _fakePending {
+    unsigned long long due;
+    fakeLock *lock;
+    fakeAction action;
+    fakePending *next;
+};
+
+struct _fakeCpgEvent {
+    bool totem;
+    size_t nmembers, nleft, njoined;
+    struct cpg_address members[FAKE_DLM_MAX_NODES];
+    struct cpg_address left[1];
+    struct cpg_address joined[1];
+    uint32_t nodes[FAKE_DLM_MAX_NODES];
+    struct cpg_ring_id ring;
+    fakeCpgEvent *next;
+};
+
+struct _fakeCpg {
+    cpg_handle_t handle;
+    int fd;
+    cpg_model_v1_data_t model;
+    void *context;
+    struct cpg_name group;
+    bool joined;
+    fakeCpgEvent *head, *tail;
+    fakeCpg *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* of the latency worker */
+    bool worker;
+
+    fakeLockspace *lockspaces;
+    fakeLock *ids[FAKE_DLM_BUCKETS];
+    uint32_t lastLkid;
+
+    unsigned int nnodes;
+    unsigned int local;
+    bool down[FAKE_DLM_MAX_NODES + 1];
+    bool yield[FAKE_DLM_MAX_NODES + 1];
+
+    unsigned int latency[FAKE_DLM_OP_LAST];
+    unsigned int jitter[FAKE_DLM_OP_LAST];
+    unsigned int faultRate[FAKE_DLM_OP_LAST];
+    int faultError[FAKE_DLM_OP_LAST];
+    bool faultAsync[FAKE_DLM_OP_LAST];
+
+    fakePending *pending;
+
+    fakeCpg *cpgs;
+    cpg_handle_t lastHandle;
+    uint64_t ringSeq;
+
+    unsigned int seed;
+    fake_dlm_stats stats;
+} fake = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .nnodes = 1,
+    .local = 1,
+    .seed = 1,
+};
+
+static pthread_once_t fakeOnce = PTHREAD_ONCE_INIT;
+
+/* Rows are requested modes, columns granted ones, NL to EX */
+static const bool fakeCompat[6][6] = {
+    { 1, 1, 1, 1, 1, 1 },
+    { 1, 1, 1, 1, 1, 0 },
+    { 1, 1, 1, 0, 0, 0 },
+    { 1, 1, 0, 1, 0, 0 },
+    { 1, 1, 0, 0, 0, 0 },
+    { 1, 0, 0, 0, 0, 0 },
+};
+
+static void
+fakeInit(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fake.cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static unsigned long long
+fakeNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static unsigned int
+fakeHash(const char *name,
+         unsigned int namelen)
+{
+    uint32_t hash = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < namelen; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash % FAKE_DLM_BUCKETS;
+}
+
+static void
+fakeSignal(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "fake_dlm: unable to signal fd %d: %s\n",
+                fd, strerror(errno));
+}
+
+static void
+fakeDrain(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "fake_dlm: unable to read fd %d: %s\n",
+                fd, strerror(errno));
+}
+
+
+/* Lockspaces, resources and locks. Called with the lock held. */
+
+static fakeLockspace *
+fakeLockspaceFind(const char *name)
+{
+    fakeLockspace *ls;
+
+    for (ls = fake.lockspaces; ls; ls = ls->next) {
+        if (strcmp(ls->name, name) == 0)
+            return ls;
+    }
+
+    return NULL;
+}
+
+static fakeLockspace *
+fakeLockspaceGet(const char *name)
+{
+    fakeLockspace *ls;
+
+    if ((ls = fakeLockspaceFind(name)))
+        return ls;
+
+    if (!(ls = calloc(1, sizeof(*ls))) ||
+        !(ls->name = strdup(name))) {
+        free(ls);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if ((ls->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        free(ls->name);
+        free(ls);
+        return NULL;
+    }
+
+    ls->next = fake.lockspaces;
+    fake.lockspaces = ls;
+    return ls;
+}
+
+static fakeLockspace *
+fakeLockspaceByFd(int fd)
+{
+    fakeLockspace *ls;
+
+    for (ls = fake.lockspaces; ls; ls = ls->next) {
+        if (ls->fd == fd)
+            return ls;
+    }
+
+    return NULL;
+}
+
+static fakeResource *
+fakeResourceGet(fakeLockspace *ls,
+                const char *name,
+                unsigned int namelen,
+                bool create)
+{
+    unsigned int bucket = fakeHash(name, namelen);
+    fakeResource *res;
+
+    for (res = ls->buckets[bucket]; res; res = res->next) {
+        if (res->namelen == namelen &&
+            memcmp(res->name, name, namelen) == 0)
+            return res;
+    }
+
+    if (!create)
+        return NULL;
+
+    if (!(res = calloc(1, sizeof(*res))) ||
+        !(res->name = malloc(namelen + 1))) {
+        free(res);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(res->name, name, namelen);
+    res->name[namelen] = '\0';
+    res->namelen = namelen;
+    res->ls = ls;
+    res->next = ls->buckets[bucket];
+    ls->buckets[bucket] = res;
+    return res;
+}
+
+/* Resources without locks are forgotten, value block included */
+static void
+fakeResourceCheckFree(fakeResource *res)
+{
+    fakeResource **cur;
+
+    if (res->locks)
+        return;
+
+    for (cur = &res->ls->buckets[fakeHash(res->name, res->namelen)];
+         *cur; cur = &(*cur)->next) {
+        if (*cur == res) {
+            *cur = res->next;
+            break;
+        }
+    }
+
+    free(res->name);
+    free(res);
+}
+
+static fakeLock *
+fakeLockFind(uint32_t lkid)
+{
+    fakeLock *lock;
+
+    for (lock = fake.ids[lkid % FAKE_DLM_BUCKETS]; lock; lock = lock->idnext) {
+        if (lock->lkid == lkid)
+            return lock;
+    }
+
+    return NULL;
+}
+
+static fakeLock *
+fakeLockNew(fakeResource *res,
+            unsigned int nodeid)
+{
+    fakeLock *lock;
+
+    if (!(lock = calloc(1, sizeof(*lock)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    do {
+        lock->lkid = ++fake.lastLkid;
+    } while (lock->lkid == 0 || fakeLockFind(lock->lkid));
+
+    lock->res = res;
+    lock->grmode = -1;
+    lock->highbast = -1;
+    lock->nodeid = nodeid;
+    lock->lksb = &lock->ownLksb;
+
+    lock->next = res->locks;
+    if (res->locks)
+        res->locks->prev = lock;
+    res->locks = lock;
+
+    lock->idnext = fake.ids[lock->lkid % FAKE_DLM_BUCKETS];
+    fake.ids[lock->lkid % FAKE_DLM_BUCKETS] = lock;
+
+    fake.stats.locks++;
+    return lock;
+}
+
+static void
+fakeQueueRemove(fakeLock **queue,
+                fakeLock *lock)
+{
+    for (; *queue; queue = &(*queue)->qnext) {
+        if (*queue == lock) {
+            *queue = lock->qnext;
+            lock->qnext = NULL;
+            return;
+        }
+    }
+}
+
+static void
+fakeQueueAppend(fakeLock **queue,
+                fakeLock *lock)
+{
+    while (*queue)
+        queue = &(*queue)->qnext;
+    *queue = lock;
+    lock->qnext = NULL;
+}
+
+static void
+fakeLockFree(fakeLock *lock)
+{
+    fakeResource *res = lock->res;
+    fakeLock **cur;
+
+    fakeQueueRemove(&res->convertq, lock);
+    fakeQueueRemove(&res->waitq, lock);
+
+    if (lock->prev)
+        lock->prev->next = lock->next;
+    else
+        res->locks = lock->next;
+    if (lock->next)
+        lock->next->prev = lock->prev;
+
+    for (cur = &fake.ids[lock->lkid % FAKE_DLM_BUCKETS];
+         *cur; cur = &(*cur)->idnext) {
+        if (*cur == lock) {
+            *cur = lock->idnext;
+            break;
+        }
+    }
+
+    if (lock->orphan)
+        fake.stats.orphans--;
+    fake.stats.locks--;
+    free(lock);
+}
+
+
+/* Delivery of the ASTs. Called with the lock held. */
+
+static void
+fakeQueueEvent(fakeLockspace *ls,
+               void (*fn)(void *arg),
+               void *arg)
+{
+    fakeEvent *event;
+
+    if (!fn)
+        return;
+
+    if (!(event = calloc(1, sizeof(*event)))) {
+        fprintf(stderr, "fake_dlm: lost an AST, out of memory\n");
+        return;
+    }
+
+    event->fn = fn;
+    event->arg = arg;
+    if (ls->tail)
+        ls->tail->next = event;
+    else
+        ls->head = event;
+    ls->tail = event;
+
+    fakeSignal(ls->fd);
+}
+
+/* Complete the pending request of @lock with @status */
+static void
+fakeComplete(fakeLock *lock,
+             int status)
+{
+    if (lock->nodeid == fake.local)
+        fake.stats.wait += fakeNow() - lock->issued;
+
+    lock->busy = false;
+    lock->lksb->sb_status = status;
+    lock->lksb->sb_lkid = lock->lkid;
+    fake.stats.asts++;
+
+    if (lock->waiter) {
+        lock->waiter->done = true;
+        pthread_cond_broadcast(&lock->waiter->cond);
+        lock->waiter = NULL;
+    } else if (lock->nodeid == fake.local && !lock->orphan) {
+        fakeQueueEvent(lock->res->ls, lock->ast, lock->astarg);
+    }
+}
+
+static bool
+fakeCompatible(fakeResource *res,
+               fakeLock *self,
+               int mode)
+{
+    fakeLock *lock;
+
+    for (lock = res->locks; lock; lock = lock->next) {
+        if (lock == self || lock->grmode < 0)
+            continue;
+        if (!fakeCompat[mode][lock->grmode])
+            return false;
+    }
+
+    return true;
+}
+
+/* Apply the value block rules to the grant of @lock */
+static void
+fakeGrant(fakeLock *lock)
+{
+    fakeResource *res = lock->res;
+    struct dlm_lksb *lksb = lock->lksb;
+
+    lksb->sb_flags = 0;
+
+    if ((lock->rqflags & LKF_VALBLK) && lksb->sb_lvbptr) {
+        if (lock->grmode >= LKM_PWMODE) {
+            memcpy(res->lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
+            res->lvbValid = true;
+        } else {
+            memcpy(lksb->sb_lvbptr, res->lvb, DLM_LVB_LEN);
+            if (!res->lvbValid)
+                lksb->sb_flags |= DLM_SBF_VALNOTVALID;
+        }
+    }
+
+    lock->grmode = lock->rqmode;
+    lock->highbast = -1;
+    lock->state = FAKE_LOCK_GRANTED;
+    fakeComplete(lock, 0);
+}
+
+static void fakeRemoteYield(fakeLock *lock);
+
+/* Tell the holders in the way of @lock, once per mode */
+static void
+fakeSendBasts(fakeLock *lock)
+{
+    fakeResource *res = lock->res;
+    fakeLock *yielding[64];
+    size_t nyielding = 0, i;
+    fakeLock *other;
+
+    for (other = res->locks; other; other = other->next) {
+        if (other == lock || other->grmode < 0 || other->orphan ||
+            fakeCompat[lock->rqmode][other->grmode] ||
+            other->highbast >= lock->rqmode)
+            continue;
+
+        other->highbast = lock->rqmode;
+        fake.stats.basts++;
+
+        if (other->nodeid == fake.local) {
+            fakeQueueEvent(res->ls, other->bast, other->bastarg);
+        } else if (fake.yield[other->nodeid] && !other->busy &&
+                   nyielding < sizeof(yielding) / sizeof(yielding[0])) {
+            yielding[nyielding++] = other;
+        }
+    }
+
+    for (i = 0; i < nyielding; i++)
+        fakeRemoteYield(yielding[i]);
+}
+
+/* Grant what became compatible, conversions first, in order */
+static void
+fakeGrantPending(fakeResource *res)
+{
+    fakeLock *lock;
+
+    while ((lock = res->convertq) &&
+           fakeCompatible(res, lock, lock->rqmode)) {
+        fakeQueueRemove(&res->convertq, lock);
+        fakeGrant(lock);
+    }
+
+    if (res->convertq)
+        return;
+
+    while ((lock = res->waitq) &&
+           fakeCompatible(res, lock, lock->rqmode)) {
+        fakeQueueRemove(&res->waitq, lock);
+        fakeGrant(lock);
+    }
+}
+
+/* A new lock or a conversion reaches the master */
+static void
+fakeApplyRequest(fakeLock *lock)
+{
+    fakeResource *res = lock->res;
+    bool convert = lock->grmode >= 0;
+    bool grantable;
+    int status;
+
+    if (lock->cancel || lock->fault) {
+        status = lock->cancel ? ECANCEL : lock->fault;
+        lock->cancel = false;
+        lock->fault = 0;
+        lock->state = FAKE_LOCK_GRANTED;
+        fakeComplete(lock, status);
+        if (!convert)
+            fakeLockFree(lock);
+        fakeResourceCheckFree(res);
+        return;
+    }
+
+    grantable = fakeCompatible(res, lock, lock->rqmode);
+    if (lock->rqmode != LKM_NLMODE &&
+        !(lock->rqflags & LKF_EXPEDITE)) {
+        if (convert)
+            grantable = grantable && !res->convertq;
+        else
+            grantable = grantable && !res->convertq && !res->waitq;
+    }
+
+    if (grantable) {
+        fakeGrant(lock);
+        /* A down conversion may let others in */
+        if (convert)
+            fakeGrantPending(res);
+        return;
+    }
+
+    if (lock->rqflags & LKF_NOQUEUE) {
+        fake.stats.denied++;
+        if (lock->rqflags & LKF_NOQUEUEBAST)
+            fakeSendBasts(lock);
+        lock->state = FAKE_LOCK_GRANTED;
+        fakeComplete(lock, EAGAIN);
+        if (!convert)
+            fakeLockFree(lock);
+        fakeResourceCheckFree(res);
+        return;
+    }
+
+    fake.stats.queued++;
+    if (convert) {
+        lock->state = FAKE_LOCK_CONVERTING;
+        fakeQueueAppend(&res->convertq, lock);
+    } else {
+        lock->state = FAKE_LOCK_WAITING;
+        fakeQueueAppend(&res->waitq, lock);
+    }
+    fakeSendBasts(lock);
+}
+
+static void
+fakeApplyUnlock(fakeLock *lock)
+{
+    fakeResource *res = lock->res;
+    struct dlm_lksb *lksb = lock->lksb;
+    int fault = lock->fault;
+
+    if (fault) {
+        lock->fault = 0;
+        fakeComplete(lock, fault);
+        return;
+    }
+
+    if ((lock->rqflags & LKF_VALBLK) && lksb->sb_lvbptr &&
+        lock->grmode >= LKM_PWMODE) {
+        memcpy(res->lvb, lksb->sb_lvbptr, DLM_LVB_LEN);
+        res->lvbValid = true;
+    }
+
+    /* The lock is gone, the AST must not touch it */
+    if (lock->nodeid == fake.local)
+        fake.stats.wait += fakeNow() - lock->issued;
+    lock->busy = false;
+    lksb->sb_status = EUNLOCK;
+    lksb->sb_lkid = lock->lkid;
+    fake.stats.asts++;
+    if (lock->waiter) {
+        lock->waiter->done = true;
+        pthread_cond_broadcast(&lock->waiter->cond);
+    } else if (lock->nodeid == fake.local) {
+        fakeQueueEvent(res->ls, lock->ast, lock->astarg);
+    }
+
+    fakeLockFree(lock);
+    fakeGrantPending(res);
+    fakeResourceCheckFree(res);
+}
+
+static void
+fakeApplyCancel(fakeLock *lock)
+{
+    fakeResource *res = lock->res;
+
+    switch (lock->state) {
+    case FAKE_LOCK_INFLIGHT:
+        lock->cancel = true;
+        return;
+
+    case FAKE_LOCK_CONVERTING:
+        fakeQueueRemove(&res->convertq, lock);
+        lock->state = FAKE_LOCK_GRANTED;
+        fakeComplete(lock, ECANCEL);
+        fakeGrantPending(res);
+        return;
+
+    case FAKE_LOCK_WAITING:
+        fakeQueueRemove(&res->waitq, lock);
+        fakeComplete(lock, ECANCEL);
+        fakeLockFree(lock);
+        fakeGrantPending(res);
+        fakeResourceCheckFree(res);
+        return;
+
+    case FAKE_LOCK_GRANTED:
+        /* Too late, the completion AST already told */
+        return;
+    }
+}
+
+static void
+fakeApply(fakeLock *lock,
+          fakeAction action)
+{
+    switch (action) {
+    case FAKE_ACTION_REQUEST:
+        fakeApplyRequest(lock);
+        break;
+    case FAKE_ACTION_UNLOCK:
+        fakeApplyUnlock(lock);
+        break;
+    case FAKE_ACTION_CANCEL:
+        fakeApplyCancel(lock);
+        break;
+    }
+}
+
+
+/* Latency. The worker applies the requests once they are due. */
+
+static void *
+fakeWorker(void *opaque)
+{
+    fakePending *pending;
+    struct timespec ts;
+    unsigned long long now;
+
+    (void)opaque;
+
+    pthread_mutex_lock(&fake.lock);
+    for (;;) {
+        if (!fake.pending) {
+            pthread_cond_wait(&fake.cond, &fake.lock);
+            continue;
+        }
+
+        now = fakeNow();
+        if (fake.pending->due > now) {
+            ts.tv_sec = fake.pending->due / 1000000;
+            ts.tv_nsec = (fake.pending->due % 1000000) * 1000;
+            pthread_cond_timedwait(&fake.cond, &fake.lock, &ts);
+            continue;
+        }
+
+        pending = fake.pending;
+        fake.pending = pending->next;
+        fakeApply(pending->lock, pending->action);
+        free(pending);
+    }
+
+    return NULL;
+}
+
+static unsigned int
+fakeRandom(unsigned int max)
+{
+    if (max == 0)
+        return 0;
+    return rand_r(&fake.seed) % max;
+}
+
+/* Whether the next request of type @op fails, and how */
+static int
+fakeFault(fake_dlm_op op,
+          bool *async)
+{
+    if (!fake.faultRate[op] ||
+        fakeRandom(1000) >= fake.faultRate[op])
+        return 0;
+
+    fake.stats.failures[op]++;
+    *async = fake.faultAsync[op];
+    return fake.faultError[op];
+}
+
+/* Apply @action to @lock once the latency of @op is elapsed */
+static int
+fakeSchedule(fakeLock *lock,
+             fake_dlm_op op,
+             fakeAction action)
+{
+    unsigned long long delay;
+    fakePending *pending, **cur;
+    pthread_t worker;
+
+    fake.stats.requests[op]++;
+
+    delay = fake.latency[op] + fakeRandom(fake.jitter[op]);
+    if (delay == 0) {
+        fakeApply(lock, action);
+        return 0;
+    }
+
+    if (!fake.worker) {
+        if (pthread_create(&worker, NULL, fakeWorker, NULL) != 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_detach(worker);
+        fake.worker = true;
+    }
+
+    if (!(pending = calloc(1, sizeof(*pending)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pending->due = fakeNow() + delay;
+    pending->lock = lock;
+    pending->action = action;
+
+    /* Ties keep the order of the requests */
+    for (cur = &fake.pending; *cur; cur = &(*cur)->next) {
+        if ((*cur)->due > pending->due)
+            break;
+    }
+    pending->next = *cur;
+    *cur = pending;
+
+    pthread_cond_signal(&fake.cond);
+    return 0;
+}
+
+/* Sleep for the latency of @op, for the calls which are synchronous */
+static void
+fakeDelay(fake_dlm_op op)
+{
+    unsigned long long delay = fake.latency[op] + fakeRandom(fake.jitter[op]);
+
+    if (delay) {
+        pthread_mutex_unlock(&fake.lock);
+        usleep(delay);
+        pthread_mutex_lock(&fake.lock);
+    }
+}
+
+
+/* Requests, shared by the local and remote nodes */
+
+static int
+fakeLockRequest(fakeLockspace *ls,
+                unsigned int nodeid,
+                uint32_t mode,
+                struct dlm_lksb *lksb,
+                uint32_t flags,
+                const void *name,
+                unsigned int namelen,
+                void (*astaddr)(void *arg),
+                void *astarg,
+                void (*bastaddr)(void *arg),
+                void *bastarg,
+                fakeWaiter *waiter,
+                fakeLock **ret)
+{
+    fakeResource *res;
+    fakeLock *lock;
+    fake_dlm_op op = (flags & LKF_CONVERT) ? FAKE_DLM_OP_CONVERT : FAKE_DLM_OP_LOCK;
+    bool async = false;
+    int error;
+
+    if (mode > LKM_EXMODE || (nodeid == fake.local && !lksb)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fake.down[nodeid]) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (flags & LKF_CONVERT) {
+        if (!(lock = fakeLockFind(lksb->sb_lkid)) ||
+            lock->res->ls != ls || lock->nodeid != nodeid ||
+            lock->orphan) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (lock->busy) {
+            errno = EBUSY;
+            return -1;
+        }
+    } else {
+        if (!(res = fakeResourceGet(ls, name, namelen, true)) ||
+            !(lock = fakeLockNew(res, nodeid)))
+            return -1;
+        lock->persistent = !!(flags & LKF_PERSISTENT);
+        if (nodeid == fake.local)
+            lock->pid = getpid();
+    }
+
+    if ((error = fakeFault(op, &async)) && !async) {
+        if (!(flags & LKF_CONVERT)) {
+            res = lock->res;
+            fakeLockFree(lock);
+            fakeResourceCheckFree(res);
+        }
+        errno = error;
+        return -1;
+    }
+
+    if (lksb)
+        lock->lksb = lksb;
+    lock->lksb->sb_lkid = lock->lkid;
+    lock->rqmode = mode;
+    lock->rqflags = flags;
+    lock->ast = astaddr;
+    lock->astarg = astarg;
+    lock->bast = bastaddr;
+    lock->bastarg = bastarg;
+    lock->waiter = waiter;
+    lock->fault = error;
+    lock->busy = true;
+    lock->issued = fakeNow();
+    lock->state = FAKE_LOCK_INFLIGHT;
+
+    if (ret)
+        *ret = lock;
+
+    return fakeSchedule(lock, op, FAKE_ACTION_REQUEST);
+}
+
+static int
+fakeUnlockRequest(fakeLockspace *ls,
+                  unsigned int nodeid,
+                  uint32_t lkid,
+                  uint32_t flags,
+                  struct dlm_lksb *lksb,
+                  void *astarg,
+                  fakeWaiter *waiter)
+{
+    fakeLock *lock;
+    bool async = false;
+    int error;
+
+    if (!(lock = fakeLockFind(lkid)) ||
+        (ls && lock->res->ls != ls) || lock->nodeid != nodeid) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (flags & LKF_CANCEL) {
+        if (!lock->busy) {
+            errno = EBUSY;
+            return -1;
+        }
+        if (lksb)
+            lock->lksb = lksb;
+        if (astarg)
+            lock->astarg = astarg;
+        return fakeSchedule(lock, FAKE_DLM_OP_UNLOCK, FAKE_ACTION_CANCEL);
+    }
+
+    if (lock->busy) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if ((error = fakeFault(FAKE_DLM_OP_UNLOCK, &async)) && !async) {
+        errno = error;
+        return -1;
+    }
+
+    if (lksb)
+        lock->lksb = lksb;
+    if (astarg)
+        lock->astarg = astarg;
+    lock->rqflags = flags;
+    lock->waiter = waiter;
+    lock->fault = error;
+    lock->busy = true;
+    lock->issued = fakeNow();
+
+    return fakeSchedule(lock, FAKE_DLM_OP_UNLOCK, FAKE_ACTION_UNLOCK);
+}
+
+/* Called with the lock held from the basts */
+static void
+fakeRemoteYield(fakeLock *lock)
+{
+    lock->rqmode = LKM_NLMODE;
+    lock->rqflags = LKF_CONVERT;
+    lock->busy = true;
+    lock->state = FAKE_LOCK_INFLIGHT;
+    fakeApplyRequest(lock);
+}
+
+static int
+fakeWait(fakeWaiter *waiter)
+{
+    while (!waiter->done)
+        pthread_cond_wait(&waiter->cond, &fake.lock);
+    pthread_cond_destroy(&waiter->cond);
+    return 0;
+}
+
+
+/* libdlm */
+
+dlm_lshandle_t
+dlm_create_lockspace(const char *name,
+                     mode_t mode)
+{
+    fakeLockspace *ls;
+
+    (void)mode;
+
+    pthread_once(&fakeOnce, fakeInit);
+    pthread_mutex_lock(&fake.lock);
+    if ((ls = fakeLockspaceGet(name)))
+        ls->open = true;
+    pthread_mutex_unlock(&fake.lock);
+
+    return ls;
+}
+
+dlm_lshandle_t
+dlm_open_lockspace(const char *name)
+{
+    fakeLockspace *ls;
+
+    pthread_once(&fakeOnce, fakeInit);
+    pthread_mutex_lock(&fake.lock);
+    if ((ls = fakeLockspaceFind(name)))
+        ls->open = true;
+    else
+        errno = ENOENT;
+    pthread_mutex_unlock(&fake.lock);
+
+    return ls;
+}
+
+/*
+ * The persistent locks of this process become orphans, the others
+ * are dropped. The lockspace itself stays, as in the kernel.
+ */
+int
+dlm_close_lockspace(dlm_lshandle_t lockspace)
+{
+    fakeLockspace *ls = lockspace;
+    fakeResource *res, *nextRes;
+    fakeLock *lock, *next;
+    bool threaded;
+    size_t i;
+
+    pthread_mutex_lock(&fake.lock);
+
+    for (i = 0; i < FAKE_DLM_BUCKETS; i++) {
+        for (res = ls->buckets[i]; res; res = nextRes) {
+            nextRes = res->next;
+
+            for (lock = res->locks; lock; lock = next) {
+                next = lock->next;
+                if (lock->nodeid != fake.local || lock->orphan)
+                    continue;
+
+                if (lock->persistent && lock->grmode >= 0) {
+                    fakeQueueRemove(&res->convertq, lock);
+                    lock->state = FAKE_LOCK_GRANTED;
+                    lock->busy = false;
+                    lock->orphan = true;
+                    lock->lksb = &lock->ownLksb;
+                    lock->ast = NULL;
+                    lock->bast = NULL;
+                    fake.stats.orphans++;
+                } else if (!lock->busy) {
+                    fakeLockFree(lock);
+                }
+            }
+
+            fakeGrantPending(res);
+            fakeResourceCheckFree(res);
+        }
+    }
+
+    while (ls->head) {
+        fakeEvent *event = ls->head;
+        ls->head = event->next;
+        free(event);
+    }
+    ls->tail = NULL;
+    ls->open = false;
+    threaded = ls->threaded;
+    ls->threaded = false;
+
+    pthread_mutex_unlock(&fake.lock);
+
+    if (threaded) {
+        pthread_cancel(ls->thread);
+        pthread_join(ls->thread, NULL);
+    }
+
+    return 0;
+}
+
+int
+dlm_release_lockspace(const char *name,
+                      dlm_lshandle_t lockspace,
+                      int force)
+{
+    (void)name;
+    (void)force;
+
+    return dlm_close_lockspace(lockspace);
+}
+
+int
+dlm_ls_get_fd(dlm_lshandle_t lockspace)
+{
+    fakeLockspace *ls = lockspace;
+
+    return ls->fd;
+}
+
+/* Deliver every queued AST, without the lock held */
+int
+dlm_dispatch(int fd)
+{
+    fakeLockspace *ls;
+    fakeEvent *events, *event;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!(ls = fakeLockspaceByFd(fd))) {
+        pthread_mutex_unlock(&fake.lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    fakeDrain(fd);
+    events = ls->head;
+    ls->head = ls->tail = NULL;
+    pthread_mutex_unlock(&fake.lock);
+
+    while ((event = events)) {
+        events = event->next;
+        event->fn(event->arg);
+        free(event);
+    }
+
+    return 0;
+}
+
+static void *
+fakeDispatchThread(void *opaque)
+{
+    fakeLockspace *ls = opaque;
+    struct pollfd pfd = { .fd = ls->fd, .events = POLLIN };
+
+    for (;;) {
+        if (poll(&pfd, 1, -1) > 0)
+            dlm_dispatch(ls->fd);
+    }
+
+    return NULL;
+}
+
+int
+dlm_ls_pthread_init(dlm_lshandle_t lockspace)
+{
+    fakeLockspace *ls = lockspace;
+    int rv = 0;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!ls->threaded) {
+        if (pthread_create(&ls->thread, NULL, fakeDispatchThread, ls) != 0) {
+            errno = EAGAIN;
+            rv = -1;
+        } else {
+            ls->threaded = true;
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return rv;
+}
+
+int
+dlm_ls_lock(dlm_lshandle_t lockspace,
+            uint32_t mode,
+            struct dlm_lksb *lksb,
+            uint32_t flags,
+            const void *name,
+            unsigned int namelen,
+            uint32_t parent,
+            void (*astaddr)(void *astarg),
+            void *astarg,
+            void (*bastaddr)(void *astarg),
+            void *range)
+{
+    int rv;
+
+    (void)parent;
+    (void)range;
+
+    pthread_mutex_lock(&fake.lock);
+    rv = fakeLockRequest(lockspace, fake.local, mode, lksb, flags,
+                         name, namelen, astaddr, astarg,
+                         bastaddr, astarg, NULL, NULL);
+    pthread_mutex_unlock(&fake.lock);
+
+    return rv;
+}
+
+int
+dlm_ls_lock_wait(dlm_lshandle_t lockspace,
+                 uint32_t mode,
+                 struct dlm_lksb *lksb,
+                 uint32_t flags,
+                 const void *name,
+                 unsigned int namelen,
+                 uint32_t parent,
+                 void *bastarg,
+                 void (*bastaddr)(void *bastarg),
+                 void *range)
+{
+    fakeWaiter waiter = { .done = false };
+    int rv;
+
+    (void)parent;
+    (void)range;
+
+    pthread_cond_init(&waiter.cond, NULL);
+
+    pthread_mutex_lock(&fake.lock);
+    if ((rv = fakeLockRequest(lockspace, fake.local, mode, lksb, flags,
+                              name, namelen, NULL, NULL,
+                              bastaddr, bastarg, &waiter, NULL)) == 0)
+        fakeWait(&waiter);
+    else
+        pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_unlock(&fake.lock);
+
+    return rv;
+}
+
+/*
+ * Only orphan adoption is modelled beyond dlm_ls_lock: it succeeds
+ * at once if this node has an orphan in @mode, fails with EAGAIN if
+ * it has one in another mode and with ENOENT otherwise.
+ */
+int
+dlm_ls_lockx(dlm_lshandle_t lockspace,
+             uint32_t mode,
+             struct dlm_lksb *lksb,
+             uint32_t flags,
+             const void *name,
+             unsigned int namelen,
+             uint32_t parent,
+             void (*astaddr)(void *astarg),
+             void *astarg,
+             void (*bastaddr)(void *astarg),
+             uint64_t *xid,
+             uint64_t *timeout)
+{
+    fakeLockspace *ls = lockspace;
+    fakeResource *res;
+    fakeLock *lock, *other = NULL;
+    unsigned long long start;
+    bool async = false;
+    int error;
+    int rv = -1;
+
+    (void)xid;
+    (void)timeout;
+
+    if (!(flags & LKF_ORPHAN))
+        return dlm_ls_lock(lockspace, mode, lksb, flags, name, namelen,
+                           parent, astaddr, astarg, bastaddr, NULL);
+
+    pthread_mutex_lock(&fake.lock);
+
+    fake.stats.requests[FAKE_DLM_OP_ADOPT]++;
+    start = fakeNow();
+    fakeDelay(FAKE_DLM_OP_ADOPT);
+
+    if ((error = fakeFault(FAKE_DLM_OP_ADOPT, &async))) {
+        errno = error;
+        goto cleanup;
+    }
+
+    errno = ENOENT;
+    if (!(res = fakeResourceGet(ls, name, namelen, false)))
+        goto cleanup;
+
+    for (lock = res->locks; lock; lock = lock->next) {
+        if (!lock->orphan || lock->nodeid != fake.local)
+            continue;
+        if ((int)mode == lock->grmode)
+            break;
+        other = lock;
+    }
+
+    if (!lock) {
+        if (other)
+            errno = EAGAIN;
+        goto cleanup;
+    }
+
+    lock->orphan = false;
+    lock->pid = getpid();
+    lock->lksb = lksb;
+    lock->ast = astaddr;
+    lock->astarg = astarg;
+    lock->bast = bastaddr;
+    lock->bastarg = astarg;
+    lock->rqmode = mode;
+    lock->rqflags = flags;
+    fake.stats.orphans--;
+
+    lksb->sb_flags = 0;
+    lock->issued = start;
+    fakeComplete(lock, 0);
+
+    rv = 0;
+ cleanup:
+    pthread_mutex_unlock(&fake.lock);
+    return rv;
+}
+
+int
+dlm_ls_unlock(dlm_lshandle_t lockspace,
+              uint32_t lkid,
+              uint32_t flags,
+              struct dlm_lksb *lksb,
+              void *astarg)
+{
+    int rv;
+
+    pthread_mutex_lock(&fake.lock);
+    rv = fakeUnlockRequest(lockspace, fake.local, lkid, flags, lksb,
+                           astarg, NULL);
+    pthread_mutex_unlock(&fake.lock);
+
+    return rv;
+}
+
+int
+dlm_ls_unlock_wait(dlm_lshandle_t lockspace,
+                   uint32_t lkid,
+                   uint32_t flags,
+                   struct dlm_lksb *lksb)
+{
+    fakeWaiter waiter = { .done = false };
+    int rv;
+
+    pthread_cond_init(&waiter.cond, NULL);
+
+    pthread_mutex_lock(&fake.lock);
+    if ((rv = fakeUnlockRequest(lockspace, fake.local, lkid, flags, lksb,
+                                NULL, &waiter)) == 0)
+        fakeWait(&waiter);
+    else
+        pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_unlock(&fake.lock);
+
+    return rv;
+}
+
+/* Drop the orphans of @nodeid, of its process @pid unless 0 */
+int
+dlm_ls_purge(dlm_lshandle_t lockspace,
+             int nodeid,
+             int pid)
+{
+    fakeLockspace *ls = lockspace;
+    fakeResource *res, *nextRes;
+    fakeLock *lock, *next;
+    size_t i;
+
+    pthread_mutex_lock(&fake.lock);
+
+    for (i = 0; i < FAKE_DLM_BUCKETS; i++) {
+        for (res = ls->buckets[i]; res; res = nextRes) {
+            nextRes = res->next;
+
+            for (lock = res->locks; lock; lock = next) {
+                next = lock->next;
+                if (lock->orphan && lock->nodeid == (unsigned int)nodeid &&
+                    (pid == 0 || lock->pid == pid))
+                    fakeLockFree(lock);
+            }
+
+            fakeGrantPending(res);
+            fakeResourceCheckFree(res);
+        }
+    }
+
+    pthread_mutex_unlock(&fake.lock);
+    return 0;
+}
+
+/* The default lockspace helpers of libdlm, synchronous */
+int
+lock_resource(const char *resource,
+              int mode,
+              int flags,
+              int *lockid)
+{
+    struct dlm_lksb lksb;
+    dlm_lshandle_t ls;
+
+    if (!(ls = dlm_create_lockspace(FAKE_DLM_DEFAULT_LOCKSPACE, 0600)))
+        return -1;
+
+    memset(&lksb, 0, sizeof(lksb));
+    if (flags & LKF_CONVERT)
+        lksb.sb_lkid = *lockid;
+
+    if (dlm_ls_lock_wait(ls, mode, &lksb, flags, resource,
+                         strlen(resource), 0, NULL, NULL, NULL) < 0)
+        return -1;
+
+    if (lksb.sb_status != 0) {
+        errno = lksb.sb_status;
+        return -1;
+    }
+
+    *lockid = lksb.sb_lkid;
+    return 0;
+}
+
+int
+unlock_resource(int lockid)
+{
+    struct dlm_lksb lksb;
+    dlm_lshandle_t ls;
+
+    if (!(ls = dlm_create_lockspace(FAKE_DLM_DEFAULT_LOCKSPACE, 0600)))
+        return -1;
+
+    memset(&lksb, 0, sizeof(lksb));
+    if (dlm_ls_unlock_wait(ls, lockid, 0, &lksb) < 0)
+        return -1;
+
+    if (lksb.sb_status != EUNLOCK) {
+        errno = lksb.sb_status;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* libcpg. Every node up is a member of every group. */
+
+static fakeCpg *
+fakeCpgFind(cpg_handle_t handle)
+{
+    fakeCpg *cpg;
+
+    for (cpg = fake.cpgs; cpg; cpg = cpg->next) {
+        if (cpg->handle == handle)
+            return cpg;
+    }
+
+    return NULL;
+}
+
+static size_t
+fakeCpgMembers(struct cpg_address *members,
+               uint32_t *nodes)
+{
+    size_t n = 0;
+    unsigned int i;
+
+    for (i = 1; i <= fake.nnodes; i++) {
+        if (fake.down[i])
+            continue;
+        members[n].nodeid = i;
+        members[n].pid = i == fake.local ? (uint32_t)getpid() : 1000 + i;
+        members[n].reason = 0;
+        nodes[n] = i;
+        n++;
+    }
+
+    return n;
+}
+
+/* Queue a change of the membership, @nodeid joined or left */
+static void
+fakeCpgQueue(fakeCpg *cpg,
+             unsigned int nodeid,
+             uint32_t reason,
+             bool totem)
+{
+    fakeCpgEvent *event;
+    struct cpg_address *changed;
+
+    if (!(event = calloc(1, sizeof(*event)))) {
+        fprintf(stderr, "fake_dlm: lost a CPG event, out of memory\n");
+        return;
+    }
+
+    event->totem = totem;
+    event->nmembers = fakeCpgMembers(event->members, event->nodes);
+    event->ring.nodeid = fake.local;
+    event->ring.seq = ++fake.ringSeq;
+
+    if (nodeid) {
+        if (reason == CPG_REASON_JOIN || reason == CPG_REASON_NODEUP) {
+            changed = event->joined;
+            event->njoined = 1;
+        } else {
+            changed = event->left;
+            event->nleft = 1;
+        }
+        changed->nodeid = nodeid;
+        changed->pid = nodeid == fake.local ? (uint32_t)getpid() : 1000 + nodeid;
+        changed->reason = reason;
+    }
+
+    if (cpg->tail)
+        cpg->tail->next = event;
+    else
+        cpg->head = event;
+    cpg->tail = event;
+
+    fakeSignal(cpg->fd);
+}
+
+static void
+fakeCpgNotify(unsigned int nodeid,
+              uint32_t reason)
+{
+    fakeCpg *cpg;
+
+    for (cpg = fake.cpgs; cpg; cpg = cpg->next) {
+        if (!cpg->joined)
+            continue;
+        fakeCpgQueue(cpg, nodeid, reason, false);
+        fakeCpgQueue(cpg, 0, 0, true);
+    }
+}
+
+cs_error_t
+cpg_model_initialize(cpg_handle_t *handle,
+                     cpg_model_t model,
+                     cpg_model_data_t *model_data,
+                     void *context)
+{
+    fakeCpg *cpg;
+
+    if (model != CPG_MODEL_V1)
+        return CS_ERR_INVALID_PARAM;
+
+    pthread_once(&fakeOnce, fakeInit);
+
+    if (!(cpg = calloc(1, sizeof(*cpg))))
+        return CS_ERR_NO_MEMORY;
+
+    if ((cpg->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        free(cpg);
+        return CS_ERR_LIBRARY;
+    }
+
+    if (model_data)
+        memcpy(&cpg->model, model_data, sizeof(cpg->model));
+    cpg->context = context;
+
+    pthread_mutex_lock(&fake.lock);
+    cpg->handle = *handle = ++fake.lastHandle;
+    cpg->next = fake.cpgs;
+    fake.cpgs = cpg;
+    pthread_mutex_unlock(&fake.lock);
+
+    return CS_OK;
+}
+
+cs_error_t
+cpg_initialize(cpg_handle_t *handle,
+               cpg_callbacks_t *callbacks)
+{
+    cpg_model_v1_data_t model;
+
+    memset(&model, 0, sizeof(model));
+    model.model = CPG_MODEL_V1;
+    model.cpg_deliver_fn = callbacks->cpg_deliver_fn;
+    model.cpg_confchg_fn = callbacks->cpg_confchg_fn;
+
+    return cpg_model_initialize(handle, CPG_MODEL_V1,
+                                (cpg_model_data_t *)&model, NULL);
+}
+
+cs_error_t
+cpg_finalize(cpg_handle_t handle)
+{
+    fakeCpg **cur, *cpg = NULL;
+    fakeCpgEvent *event;
+
+    pthread_mutex_lock(&fake.lock);
+    for (cur = &fake.cpgs; *cur; cur = &(*cur)->next) {
+        if ((*cur)->handle == handle) {
+            cpg = *cur;
+            *cur = cpg->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    if (!cpg)
+        return CS_ERR_BAD_HANDLE;
+
+    while ((event = cpg->head)) {
+        cpg->head = event->next;
+        free(event);
+    }
+    close(cpg->fd);
+    free(cpg);
+
+    return CS_OK;
+}
+
+cs_error_t
+cpg_fd_get(cpg_handle_t handle,
+           int *fd)
+{
+    fakeCpg *cpg;
+    cs_error_t err = CS_ERR_BAD_HANDLE;
+
+    pthread_mutex_lock(&fake.lock);
+    if ((cpg = fakeCpgFind(handle))) {
+        *fd = cpg->fd;
+        err = CS_OK;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return err;
+}
+
+cs_error_t
+cpg_context_get(cpg_handle_t handle,
+                void **context)
+{
+    fakeCpg *cpg;
+    cs_error_t err = CS_ERR_BAD_HANDLE;
+
+    pthread_mutex_lock(&fake.lock);
+    if ((cpg = fakeCpgFind(handle))) {
+        *context = cpg->context;
+        err = CS_OK;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return err;
+}
+
+cs_error_t
+cpg_context_set(cpg_handle_t handle,
+                void *context)
+{
+    fakeCpg *cpg;
+    cs_error_t err = CS_ERR_BAD_HANDLE;
+
+    pthread_mutex_lock(&fake.lock);
+    if ((cpg = fakeCpgFind(handle))) {
+        cpg->context = context;
+        err = CS_OK;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return err;
+}
+
+cs_error_t
+cpg_join(cpg_handle_t handle,
+         const struct cpg_name *group)
+{
+    fakeCpg *cpg;
+    cs_error_t err = CS_ERR_BAD_HANDLE;
+
+    pthread_mutex_lock(&fake.lock);
+    if ((cpg = fakeCpgFind(handle))) {
+        cpg->group = *group;
+        cpg->joined = true;
+        fakeCpgQueue(cpg, fake.local, CPG_REASON_JOIN, false);
+        if (cpg->model.flags & CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF)
+            fakeCpgQueue(cpg, 0, 0, true);
+        err = CS_OK;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return err;
+}
+
+cs_error_t
+cpg_leave(cpg_handle_t handle,
+          const struct cpg_name *group)
+{
+    fakeCpg *cpg;
+    cs_error_t err = CS_ERR_BAD_HANDLE;
+
+    (void)group;
+
+    pthread_mutex_lock(&fake.lock);
+    if ((cpg = fakeCpgFind(handle))) {
+        cpg->joined = false;
+        err = CS_OK;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    return err;
+}
+
+cs_error_t
+cpg_local_get(cpg_handle_t handle,
+              unsigned int *local_nodeid)
+{
+    (void)handle;
+
+    pthread_mutex_lock(&fake.lock);
+    *local_nodeid = fake.local;
+    pthread_mutex_unlock(&fake.lock);
+
+    return CS_OK;
+}
+
+cs_error_t
+cpg_membership_get(cpg_handle_t handle,
+                   struct cpg_name *groupName,
+                   struct cpg_address *member_list,
+                   int *member_list_entries)
+{
+    struct cpg_address members[FAKE_DLM_MAX_NODES];
+    uint32_t nodes[FAKE_DLM_MAX_NODES];
+    size_t n;
+
+    (void)handle;
+    (void)groupName;
+
+    pthread_mutex_lock(&fake.lock);
+    n = fakeCpgMembers(members, nodes);
+    pthread_mutex_unlock(&fake.lock);
+
+    if ((int)n > *member_list_entries)
+        n = *member_list_entries;
+    memcpy(member_list, members, n * sizeof(*members));
+    *member_list_entries = n;
+
+    return CS_OK;
+}
+
+cs_error_t
+cpg_dispatch(cpg_handle_t handle,
+             cs_dispatch_flags_t dispatch_types)
+{
+    fakeCpg *cpg;
+    fakeCpgEvent *events, *event;
+
+    pthread_mutex_lock(&fake.lock);
+    if (!(cpg = fakeCpgFind(handle))) {
+        pthread_mutex_unlock(&fake.lock);
+        return CS_ERR_BAD_HANDLE;
+    }
+
+    fakeDrain(cpg->fd);
+    events = cpg->head;
+    if (dispatch_types == CS_DISPATCH_ONE ||
+        dispatch_types == CS_DISPATCH_ONE_NONBLOCKING) {
+        if (events) {
+            cpg->head = events->next;
+            events->next = NULL;
+            if (!cpg->head)
+                cpg->tail = NULL;
+            else
+                fakeSignal(cpg->fd);
+        }
+    } else {
+        cpg->head = cpg->tail = NULL;
+    }
+    pthread_mutex_unlock(&fake.lock);
+
+    while ((event = events)) {
+        events = event->next;
+
+        if (event->totem) {
+            if (cpg->model.cpg_totem_confchg_fn)
+                cpg->model.cpg_totem_confchg_fn(handle, event->ring,
+                                                event->nmembers,
+                                                event->nodes);
+        } else if (cpg->model.cpg_confchg_fn) {
+            cpg->model.cpg_confchg_fn(handle, &cpg->group,
+                                      event->members, event->nmembers,
+                                      event->left, event->nleft,
+                                      event->joined, event->njoined);
+        }
+
+        free(event);
+    }
+
+    return CS_OK;
+}
+
+
+/* Control interface */
+
+void
+fake_dlm_reset(void)
+{
+    fakeLockspace *ls;
+    fakeResource *res;
+    fakePending *pending;
+    size_t i;
+
+    pthread_once(&fakeOnce, fakeInit);
+    pthread_mutex_lock(&fake.lock);
+
+    while ((pending = fake.pending)) {
+        fake.pending = pending->next;
+        free(pending);
+    }
+
+    while ((ls = fake.lockspaces)) {
+        fake.lockspaces = ls->next;
+        for (i = 0; i < FAKE_DLM_BUCKETS; i++) {
+            while ((res = ls->buckets[i])) {
+                while (res->locks)
+                    fakeLockFree(res->locks);
+                fakeResourceCheckFree(res);
+            }
+        }
+        while (ls->head) {
+            fakeEvent *event = ls->head;
+            ls->head = event->next;
+            free(event);
+        }
+        close(ls->fd);
+        free(ls->name);
+        free(ls);
+    }
+
+    fake.nnodes = 1;
+    fake.local = 1;
+    memset(fake.down, 0, sizeof(fake.down));
+    memset(fake.yield, 0, sizeof(fake.yield));
+    memset(fake.latency, 0, sizeof(fake.latency));
+    memset(fake.jitter, 0, sizeof(fake.jitter));
+    memset(fake.faultRate, 0, sizeof(fake.faultRate));
+    memset(&fake.stats, 0, sizeof(fake.stats));
+
+    pthread_mutex_unlock(&fake.lock);
+}
+
+int
+fake_dlm_set_nodes(unsigned int nnodes,
+                   unsigned int local)
+{
+    if (nnodes == 0 || nnodes > FAKE_DLM_MAX_NODES ||
+        local == 0 || local > nnodes) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    fake.nnodes = nnodes;
+    fake.local = local;
+    pthread_mutex_unlock(&fake.lock);
+
+    return 0;
+}
+
+void
+fake_dlm_set_latency(fake_dlm_op op,
+                     unsigned int usec,
+                     unsigned int jitter)
+{
+    pthread_mutex_lock(&fake.lock);
+    fake.latency[op] = usec;
+    fake.jitter[op] = jitter;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void
+fake_dlm_set_fault(fake_dlm_op op,
+                   unsigned int permille,
+                   int error,
+                   bool async)
+{
+    pthread_mutex_lock(&fake.lock);
+    fake.faultRate[op] = permille;
+    fake.faultError[op] = error;
+    fake.faultAsync[op] = async;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+int
+fake_dlm_remote_lock(unsigned int nodeid,
+                     const char *lockspace,
+                     const char *name,
+                     int mode,
+                     uint32_t flags,
+                     uint32_t *lkid)
+{
+    struct dlm_lksb lksb;
+    fakeLockspace *ls;
+    fakeLock *lock;
+    unsigned int latency = 0;
+    int rv = -1;
+
+    if (nodeid == 0 || nodeid > FAKE_DLM_MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_once(&fakeOnce, fakeInit);
+    pthread_mutex_lock(&fake.lock);
+
+    if (nodeid == fake.local || nodeid > fake.nnodes) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    if (!(ls = fakeLockspaceGet(lockspace)))
+        goto cleanup;
+
+    /* The other nodes are not slowed down */
+    latency = fake.latency[FAKE_DLM_OP_LOCK];
+    fake.latency[FAKE_DLM_OP_LOCK] = 0;
+    memset(&lksb, 0, sizeof(lksb));
+    if (fakeLockRequest(ls, nodeid, mode, &lksb, flags & ~LKF_CONVERT,
+                        name, strlen(name), NULL, NULL, NULL, NULL,
+                        NULL, &lock) < 0)
+        goto cleanup;
+
+    /* A denied lock is already gone */
+    if (lksb.sb_status != 0) {
+        errno = lksb.sb_status;
+        goto cleanup;
+    }
+    lock->lksb = &lock->ownLksb;
+
+    *lkid = lock->lkid;
+    rv = lock->state == FAKE_LOCK_GRANTED ? 0 : 1;
+
+ cleanup:
+    if (latency)
+        fake.latency[FAKE_DLM_OP_LOCK] = latency;
+    pthread_mutex_unlock(&fake.lock);
+    return rv;
+}
+
+int
+fake_dlm_remote_convert(uint32_t lkid,
+                        int mode,
+                        uint32_t flags)
+{
+    fakeLock *lock;
+    unsigned int latency;
+    int rv = -1;
+
+    pthread_mutex_lock(&fake.lock);
+
+    if (!(lock = fakeLockFind(lkid)) || lock->nodeid == fake.local) {
+        errno = ENOENT;
+        goto cleanup;
+    }
+
+    latency = fake.latency[FAKE_DLM_OP_CONVERT];
+    fake.latency[FAKE_DLM_OP_CONVERT] = 0;
+    lock->ownLksb.sb_lkid = lkid;
+    rv = fakeLockRequest(lock->res->ls, lock->nodeid, mode, &lock->ownLksb,
+                         flags | LKF_CONVERT, NULL, 0,
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+    fake.latency[FAKE_DLM_OP_CONVERT] = latency;
+
+    if (rv == 0) {
+        if (lock->ownLksb.sb_status == EAGAIN) {
+            errno = EAGAIN;
+            rv = -1;
+        } else if (lock->state != FAKE_LOCK_GRANTED) {
+            rv = 1;
+        }
+    }
+
+ cleanup:
+    pthread_mutex_unlock(&fake.lock);
+    return rv;
+}
+
+int
+fake_dlm_remote_unlock(uint32_t lkid)
+{
+    fakeLock *lock;
+    unsigned int latency;
+    int rv = -1;
+
+    pthread_mutex_lock(&fake.lock);
+
+    if (!(lock = fakeLockFind(lkid)) || lock->nodeid == fake.local) {
+        errno = ENOENT;
+        goto cleanup;
+    }
+
+    latency = fake.latency[FAKE_DLM_OP_UNLOCK];
+    fake.latency[FAKE_DLM_OP_UNLOCK] = 0;
+    if (lock->state == FAKE_LOCK_GRANTED)
+        rv = fakeUnlockRequest(NULL, lock->nodeid, lkid, 0, NULL, NULL, NULL);
+    else
+        rv = fakeUnlockRequest(NULL, lock->nodeid, lkid, LKF_CANCEL,
+                               NULL, NULL, NULL);
+    fake.latency[FAKE_DLM_OP_UNLOCK] = latency;
+
+ cleanup:
+    pthread_mutex_unlock(&fake.lock);
+    return rv;
+}
+
+int
+fake_dlm_lock_mode(uint32_t lkid)
+{
+    fakeLock *lock;
+    int mode = -1;
+
+    pthread_mutex_lock(&fake.lock);
+    if ((lock = fakeLockFind(lkid)))
+        mode = lock->grmode;
+    pthread_mutex_unlock(&fake.lock);
+
+    return mode;
+}
+
+int
+fake_dlm_set_yield(unsigned int nodeid,
+                   bool yield)
+{
+    if (nodeid == 0 || nodeid > FAKE_DLM_MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    fake.yield[nodeid] = yield;
+    pthread_mutex_unlock(&fake.lock);
+
+    return 0;
+}
+
+int
+fake_dlm_node_down(unsigned int nodeid)
+{
+    fakeLockspace *ls;
+    fakeResource *res, *nextRes;
+    fakeLock *lock, *next;
+    size_t i;
+    int rv = -1;
+
+    pthread_mutex_lock(&fake.lock);
+
+    if (nodeid == 0 || nodeid > fake.nnodes || nodeid == fake.local ||
+        fake.down[nodeid]) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    fake.down[nodeid] = true;
+
+    for (ls = fake.lockspaces; ls; ls = ls->next) {
+        for (i = 0; i < FAKE_DLM_BUCKETS; i++) {
+            for (res = ls->buckets[i]; res; res = nextRes) {
+                nextRes = res->next;
+
+                for (lock = res->locks; lock; lock = next) {
+                    next = lock->next;
+                    if (lock->nodeid != nodeid)
+                        continue;
+                    /* Whatever it wrote is lost */
+                    if (lock->grmode >= LKM_PWMODE)
+                        res->lvbValid = false;
+                    fakeLockFree(lock);
+                }
+
+                fakeGrantPending(res);
+                fakeResourceCheckFree(res);
+            }
+        }
+    }
+
+    fakeCpgNotify(nodeid, CPG_REASON_NODEDOWN);
+
+    rv = 0;
+ cleanup:
+    pthread_mutex_unlock(&fake.lock);
+    return rv;
+}
+
+int
+fake_dlm_node_up(unsigned int nodeid)
+{
+    int rv = -1;
+
+    pthread_mutex_lock(&fake.lock);
+
+    if (nodeid == 0 || nodeid > fake.nnodes || !fake.down[nodeid]) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    fake.down[nodeid] = false;
+    fakeCpgNotify(nodeid, CPG_REASON_JOIN);
+
+    rv = 0;
+ cleanup:
+    pthread_mutex_unlock(&fake.lock);
+    return rv;
+}
+
+void
+fake_dlm_get_stats(fake_dlm_stats *stats)
+{
+    pthread_mutex_lock(&fake.lock);
+    *stats = fake.stats;
+    pthread_mutex_unlock(&fake.lock);
+}
@@ -0,0 +1,126 @@
+/*
+ * fake_dlm.h: control interface of the in-process DLM stand-in
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __FAKE_DLM_H__
+# define __FAKE_DLM_H__
+
+# include <stdbool.h>
+# include <stdint.h>
+
+/*
+ * fake_dlm.c implements the libdlm and libcpg symbols used by the
+ * driver on top of an in-memory lock manager, so that the driver
+ * runs, and can be measured, without a kernel DLM, dlm_controld and
+ * corosync. It is linked in place of -ldlm -lcpg.
+ *
+ * The process is one node of a simulated cluster, the others only
+ * exist through the fake_dlm_remote_* calls. Requests reach the
+ * simulated resource master after a configurable latency, and their
+ * ASTs are then delivered through the lockspace file descriptor as
+ * with the real library.
+ */
+
+typedef enum {
+    FAKE_DLM_OP_LOCK,       /* new lock */
+    FAKE_DLM_OP_CONVERT,
+    FAKE_DLM_OP_UNLOCK,     /* unlock or cancel */
+    FAKE_DLM_OP_ADOPT,      /* orphan adoption */
+
+    FAKE_DLM_OP_LAST
+} fake_dlm_op;
+
+typedef struct {
+    unsigned long long requests[FAKE_DLM_OP_LAST];
+    unsigned long long failures[FAKE_DLM_OP_LAST];
+    unsigned long long asts;
+    unsigned long long basts;
+    unsigned long long queued;      /* requests which had to wait */
+    unsigned long long denied;      /* LKF_NOQUEUE requests refused */
+    unsigned long long locks;       /* currently existing, orphans included */
+    unsigned long long orphans;
+    unsigned long long wait;        /* microseconds between the requests of
+                                     * this node and their completion, summed */
+} fake_dlm_stats;
+
+/* Drop every lockspace, lock and setting */
+void fake_dlm_reset(void);
+
+/*
+ * Simulate a cluster of @nnodes nodes, numbered from 1, this
+ * process being node @local. Defaults to a single node.
+ */
+int fake_dlm_set_nodes(unsigned int nnodes, unsigned int local);
+
+/*
+ * Delay between a request of type @op and its effect on the
+ * resource, in microseconds, plus up to @jitter at random.
+ */
+void fake_dlm_set_latency(fake_dlm_op op,
+                          unsigned int usec,
+                          unsigned int jitter);
+
+/*
+ * Fail @permille out of a thousand requests of type @op with
+ * @error, either returned by the call itself or, with @async, as
+ * the status of the completion AST.
+ */
+void fake_dlm_set_fault(fake_dlm_op op,
+                        unsigned int permille,
+                        int error,
+                        bool async);
+
+/*
+ * Locks of the other nodes. They apply at once, whatever the
+ * latency. fake_dlm_remote_lock returns 0 if the lock is granted,
+ * 1 if it is queued, -1 with errno set otherwise.
+ */
+int fake_dlm_remote_lock(unsigned int nodeid,
+                         const char *lockspace,
+                         const char *name,
+                         int mode,
+                         uint32_t flags,
+                         uint32_t *lkid);
+int fake_dlm_remote_convert(uint32_t lkid,
+                            int mode,
+                            uint32_t flags);
+int fake_dlm_remote_unlock(uint32_t lkid);
+
+/* Mode a lock is granted in, or -1 if it is not */
+int fake_dlm_lock_mode(uint32_t lkid);
+
+/*
+ * With @yield the locks of @nodeid are converted to NL as soon as
+ * a blocking AST would be delivered to them, as a node caching its
+ * locks would do.
+ */
+int fake_dlm_set_yield(unsigned int nodeid, bool yield);
+
+/*
+ * Fail or bring back a node. The locks of a failed node, orphans
+ * included, are dropped as by the DLM recovery, and the CPG members
+ * are told.
+ */
+int fake_dlm_node_down(unsigned int nodeid);
+int fake_dlm_node_up(unsigned int nodeid);
+
+void fake_dlm_get_stats(fake_dlm_stats *stats);
+
+#endif /* __FAKE_DLM_H__ */
@@ -0,0 +1,1020 @@
+/*
+ * lock_compare.c: same workload on several lock drivers
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * Drives each of the given lock drivers through its virLockDriver
+ * table with the same domains and disks, one driver after the other,
+ * and reports per driver the start and stop latencies, the time to
+ * restart the driver while domains hold their locks, and the memory
+ * it takes per running domain. A driver is one of
+ *
+ *  - dlm: lock_driver_dlm.c, compiled in, on top of fake_dlm.c
+ *  - posix: a stand-in for lockd built in here, which takes an OFD
+ *    lock on a file per disk as virtlockd does, without the daemon
+ *  - the path of a plugin, loaded like libvirt does, optionally
+ *    followed by ':' and its configuration file, to measure the
+ *    lockd and sanlock plugins of an installed libvirt
+ *
+ * It is built like dlm_bench, plus -ldl:
+ *
+ *   lock_compare.c fake_dlm.c lock_driver_dlm.c dlm_protocol.c
+ *   dlm_trace.c dlm_stats.c dlm_recorder.c
+ *   -DDLM_CLUSTER_NAME_PATH='"/"' -ldl
+ *
+ * The latency of the DLM stand-in is set with --rtt and --jitter,
+ * the posix locks cost what the local file system costs, so compare
+ * them with --rtt 0 to see the overhead of the drivers themselves.
+ */
+
+#include <config.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "fake_dlm.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "vircrypto.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virgettext.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+VIR_LOG_INIT("locking.lock_compare")
+
+typedef enum {
+    VIR_LOCK_COMPARE_OP_START,
+    VIR_LOCK_COMPARE_OP_STOP,
+
+    VIR_LOCK_COMPARE_OP_LAST
+} virLockCompareOp;
+
+typedef struct _virLockCompareVM virLockCompareVM;
+typedef virLockCompareVM *virLockCompareVMPtr;
+struct _virLockCompareVM {
+    virLockManager man;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    char name[32];
+    bool running;
+};
+
+typedef struct _virLockCompareWorker virLockCompareWorker;
+typedef virLockCompareWorker *virLockCompareWorkerPtr;
+struct _virLockCompareWorker {
+    virThread thread;
+    size_t index;
+    virLockCompareOp op;
+    unsigned long long *ns;     /* of the VMs of this worker */
+    size_t nns;
+    size_t failed;
+};
+
+typedef struct _virLockCompareResult virLockCompareResult;
+typedef virLockCompareResult *virLockCompareResultPtr;
+struct _virLockCompareResult {
+    unsigned long long *ns[VIR_LOCK_COMPARE_OP_LAST];
+    size_t nns[VIR_LOCK_COMPARE_OP_LAST];
+    size_t failed[VIR_LOCK_COMPARE_OP_LAST];
+    unsigned long long restart;     /* nanoseconds, deinit and init */
+    size_t lost;                    /* domains which failed to stop after it */
+    long long rss;                  /* KiB taken by the running domains */
+};
+
+static struct {
+    unsigned int vms;
+    unsigned int disks;
+    unsigned int threads;
+    unsigned int sharedPercent;
+    unsigned int images;
+    unsigned int rtt;
+    unsigned int jitter;
+    unsigned int nodes;
+
+    virLockDriverPtr driver;
+    const char *configFile;
+    unsigned int initFlags;
+    virLockCompareVMPtr vm;
+    char *firstError;
+} compare = {
+    .vms = 100,
+    .disks = 2,
+    .threads = 4,
+    .sharedPercent = 0,
+    .images = 4,
+    .rtt = 200,
+    .jitter = 0,
+    .nodes = 3,
+};
+
+static bool quit;
+
+
+/*
+ * The posix driver: a disk is locked by an OFD lock on the file
+ * named after the SHA-256 of its path in posix.dir, exclusive for a
+ * writable disk and shared for a shareable one. OFD locks belong to
+ * the open file, so the domains of this process exclude each other
+ * as the domains of different virtlockd clients do.
+ */
+typedef struct _virLockComparePosixPrivate virLockComparePosixPrivate;
+typedef virLockComparePosixPrivate *virLockComparePosixPrivatePtr;
+struct _virLockComparePosixPrivate {
+    size_t nresources;
+    char **paths;
+    bool *shared;
+    int *fds;
+};
+
+static struct {
+    char *dir;
+} posix;
+
+static int
+virLockComparePosixInit(unsigned int version ATTRIBUTE_UNUSED,
+                        const char *configFile ATTRIBUTE_UNUSED,
+                        unsigned int flags)
+{
+    virCheckFlags(0, -1);
+
+    if (!posix.dir) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("no directory for the posix locks"));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+virLockComparePosixDeinit(void)
+{
+    return 0;
+}
+
+static int
+virLockComparePosixNew(virLockManagerPtr lock,
+                       unsigned int type,
+                       size_t nparams ATTRIBUTE_UNUSED,
+                       virLockManagerParamPtr params ATTRIBUTE_UNUSED,
+                       unsigned int flags)
+{
+    virLockComparePosixPrivatePtr priv;
+
+    virCheckFlags(VIR_LOCK_MANAGER_NEW_STARTED, -1);
+
+    if (type != VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unsupported object type %d"), type);
+        return -1;
+    }
+
+    if (VIR_ALLOC(priv) < 0)
+        return -1;
+
+    lock->privateData = priv;
+    return 0;
+}
+
+static void
+virLockComparePosixClose(virLockComparePosixPrivatePtr priv)
+{
+    size_t i;
+
+    for (i = 0; i < priv->nresources; i++)
+        VIR_FORCE_CLOSE(priv->fds[i]);
+}
+
+static void
+virLockComparePosixFree(virLockManagerPtr lock)
+{
+    virLockComparePosixPrivatePtr priv = lock->privateData;
+    size_t i;
+
+    if (!priv)
+        return;
+
+    virLockComparePosixClose(priv);
+    for (i = 0; i < priv->nresources; i++)
+        VIR_FREE(priv->paths[i]);
+    VIR_FREE(priv->paths);
+    VIR_FREE(priv->shared);
+    VIR_FREE(priv->fds);
+    VIR_FREE(priv);
+    lock->privateData = NULL;
+}
+
+static int
+virLockComparePosixAddResource(virLockManagerPtr lock,
+                               unsigned int type ATTRIBUTE_UNUSED,
+                               const char *name,
+                               size_t nparams ATTRIBUTE_UNUSED,
+                               virLockManagerParamPtr params ATTRIBUTE_UNUSED,
+                               unsigned int flags)
+{
+    virLockComparePosixPrivatePtr priv = lock->privateData;
+    char *digest = NULL;
+    char *path = NULL;
+    size_t n = priv->nresources;
+    int rv = -1;
+
+    virCheckFlags(VIR_LOCK_MANAGER_RESOURCE_READONLY |
+                  VIR_LOCK_MANAGER_RESOURCE_SHARED, -1);
+
+    if (flags & VIR_LOCK_MANAGER_RESOURCE_READONLY)
+        return 0;
+
+    if (virCryptoHashString(VIR_CRYPTO_HASH_SHA256, name, &digest) < 0 ||
+        !(path = virFileBuildPath(posix.dir, digest, NULL)))
+        goto cleanup;
+
+    if (VIR_REALLOC_N(priv->paths, n + 1) < 0 ||
+        VIR_REALLOC_N(priv->shared, n + 1) < 0 ||
+        VIR_REALLOC_N(priv->fds, n + 1) < 0)
+        goto cleanup;
+
+    VIR_STEAL_PTR(priv->paths[n], path);
+    priv->shared[n] = !!(flags & VIR_LOCK_MANAGER_RESOURCE_SHARED);
+    priv->fds[n] = -1;
+    priv->nresources++;
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(digest);
+    VIR_FREE(path);
+    return rv;
+}
+
+static int
+virLockComparePosixAcquire(virLockManagerPtr lock,
+                           const char *state ATTRIBUTE_UNUSED,
+                           unsigned int flags,
+                           virDomainLockFailureAction action ATTRIBUTE_UNUSED,
+                           int *fd)
+{
+    virLockComparePosixPrivatePtr priv = lock->privateData;
+    struct flock fl;
+    size_t i;
+
+    virCheckFlags(VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY |
+                  VIR_LOCK_MANAGER_ACQUIRE_RESTRICT, -1);
+
+    if (fd)
+        *fd = -1;
+
+    if (flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY)
+        return 0;
+
+    for (i = 0; i < priv->nresources; i++) {
+        if ((priv->fds[i] = open(priv->paths[i],
+                                 O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+            virReportSystemError(errno, _("unable to open '%s'"),
+                                 priv->paths[i]);
+            goto error;
+        }
+
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = priv->shared[i] ? F_RDLCK : F_WRLCK;
+        fl.l_whence = SEEK_SET;
+
+        if (fcntl(priv->fds[i], F_OFD_SETLK, &fl) < 0) {
+            virReportSystemError(errno, _("unable to lock '%s'"),
+                                 priv->paths[i]);
+            goto error;
+        }
+    }
+
+    return 0;
+
+ error:
+    virLockComparePosixClose(priv);
+    return -1;
+}
+
+static int
+virLockComparePosixRelease(virLockManagerPtr lock,
+                           char **state,
+                           unsigned int flags)
+{
+    virCheckFlags(0, -1);
+
+    if (state)
+        *state = NULL;
+
+    virLockComparePosixClose(lock->privateData);
+    return 0;
+}
+
+static int
+virLockComparePosixInquire(virLockManagerPtr lock ATTRIBUTE_UNUSED,
+                           char **state,
+                           unsigned int flags)
+{
+    virCheckFlags(0, -1);
+
+    if (state)
+        *state = NULL;
+
+    return 0;
+}
+
+static virLockDriver virLockComparePosix = {
+    .version = VIR_LOCK_MANAGER_VERSION,
+    .flags = 0,
+
+    .drvInit = virLockComparePosixInit,
+    .drvDeinit = virLockComparePosixDeinit,
+
+    .drvNew = virLockComparePosixNew,
+    .drvFree = virLockComparePosixFree,
+
+    .drvAddResource = virLockComparePosixAddResource,
+
+    .drvAcquire = virLockComparePosixAcquire,
+    .drvRelease = virLockComparePosixRelease,
+    .drvInquire = virLockComparePosixInquire,
+};
+
+
+static unsigned long long
+virLockCompareNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+virLockCompareEventLoop(void *opaque ATTRIBUTE_UNUSED)
+{
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+}
+
+static void
+virLockCompareError(void)
+{
+    /* Only the first one, the others are most likely the same */
+    if (!compare.firstError)
+        ignore_value(VIR_STRDUP(compare.firstError, virGetLastErrorMessage()));
+    virResetLastError();
+}
+
+/* Resident set of the process in KiB, -1 if unknown */
+static long long
+virLockCompareRSS(void)
+{
+    char *buf = NULL;
+    unsigned long long size, resident;
+    long long rss = -1;
+
+    if (virFileReadAll("/proc/self/statm", 1024, &buf) >= 0 &&
+        sscanf(buf, "%llu %llu", &size, &resident) == 2)
+        rss = resident * (sysconf(_SC_PAGESIZE) / 1024);
+
+    VIR_FREE(buf);
+    return rss;
+}
+
+/* The same disks whatever the driver, see virDLMBenchAddDisks */
+static int
+virLockCompareAddDisks(virLockCompareVMPtr vm,
+                       size_t index)
+{
+    unsigned int seed = index + 1;
+    char *path = NULL;
+    unsigned int flags;
+    size_t i;
+    int rv = -1;
+
+    for (i = 0; i < compare.disks; i++) {
+        if (rand_r(&seed) % 100 < compare.sharedPercent) {
+            flags = VIR_LOCK_MANAGER_RESOURCE_SHARED;
+            if (virAsprintf(&path, "/dev/compare/image-%u",
+                            rand_r(&seed) % compare.images) < 0)
+                goto cleanup;
+        } else {
+            flags = 0;
+            if (virAsprintf(&path, "/dev/compare/vm-%zu-disk-%zu",
+                            index, i) < 0)
+                goto cleanup;
+        }
+
+        if (compare.driver->drvAddResource(&vm->man,
+                                           VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                           path, 0, NULL, flags) < 0)
+            goto cleanup;
+
+        VIR_FREE(path);
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(path);
+    return rv;
+}
+
+static int
+virLockCompareStart(virLockCompareVMPtr vm,
+                    size_t index)
+{
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = vm->name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "id",
+          .value = { .ui = index + 1 },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_INT,
+          .key = "pid",
+          .value = { .iv = getpid() },
+        },
+    };
+
+    memcpy(params[0].value.uuid, vm->uuid, VIR_UUID_BUFLEN);
+
+    vm->man.driver = compare.driver;
+    vm->man.privateData = NULL;
+
+    if (compare.driver->drvNew(&vm->man,
+                               VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN,
+                               ARRAY_CARDINALITY(params), params, 0) < 0 ||
+        virLockCompareAddDisks(vm, index) < 0 ||
+        compare.driver->drvAcquire(&vm->man, NULL, 0,
+                                   VIR_DOMAIN_LOCK_FAILURE_DEFAULT,
+                                   NULL) < 0) {
+        if (vm->man.privateData)
+            compare.driver->drvFree(&vm->man);
+        vm->man.privateData = NULL;
+        return -1;
+    }
+
+    vm->running = true;
+    return 0;
+}
+
+static int
+virLockCompareStop(virLockCompareVMPtr vm)
+{
+    int rv;
+
+    rv = compare.driver->drvRelease(&vm->man, NULL, 0);
+    compare.driver->drvFree(&vm->man);
+    vm->man.privateData = NULL;
+    vm->running = false;
+
+    return rv;
+}
+
+static void
+virLockCompareWorkerRun(void *opaque)
+{
+    virLockCompareWorkerPtr worker = opaque;
+    virLockCompareVMPtr vm;
+    unsigned long long start;
+    size_t i;
+    int rc;
+
+    for (i = worker->index; i < compare.vms; i += compare.threads) {
+        vm = compare.vm + i;
+
+        if (vm->running == (worker->op == VIR_LOCK_COMPARE_OP_START))
+            continue;
+
+        start = virLockCompareNow();
+        if (worker->op == VIR_LOCK_COMPARE_OP_START)
+            rc = virLockCompareStart(vm, i);
+        else
+            rc = virLockCompareStop(vm);
+
+        if (rc < 0) {
+            virLockCompareError();
+            worker->failed++;
+            continue;
+        }
+        worker->ns[worker->nns++] = virLockCompareNow() - start;
+    }
+}
+
+/*
+ * Apply @op to every VM from compare.threads threads, adding the
+ * latencies and failures to @result unless it is NULL.
+ */
+static int
+virLockCompareRun(virLockCompareOp op,
+                  virLockCompareResultPtr result,
+                  size_t *failed)
+{
+    virLockCompareWorkerPtr workers = NULL;
+    size_t i;
+    int rv = -1;
+
+    if (VIR_ALLOC_N(workers, compare.threads) < 0)
+        return -1;
+
+    for (i = 0; i < compare.threads; i++) {
+        workers[i].index = i;
+        workers[i].op = op;
+        if (VIR_ALLOC_N(workers[i].ns,
+                        compare.vms / compare.threads + 1) < 0)
+            goto cleanup;
+    }
+
+    for (i = 0; i < compare.threads; i++) {
+        if (virThreadCreate(&workers[i].thread, true,
+                            virLockCompareWorkerRun, workers + i) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to create benchmark thread"));
+            while (i--)
+                virThreadJoin(&workers[i].thread);
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < compare.threads; i++)
+        virThreadJoin(&workers[i].thread);
+
+    for (i = 0; i < compare.threads; i++) {
+        if (failed)
+            *failed += workers[i].failed;
+        if (!result)
+            continue;
+
+        result->failed[op] += workers[i].failed;
+        if (VIR_REALLOC_N(result->ns[op],
+                          result->nns[op] + workers[i].nns) < 0)
+            goto cleanup;
+        memcpy(result->ns[op] + result->nns[op], workers[i].ns,
+               workers[i].nns * sizeof(*workers[i].ns));
+        result->nns[op] += workers[i].nns;
+    }
+
+    rv = 0;
+ cleanup:
+    for (i = 0; i < compare.threads; i++)
+        VIR_FREE(workers[i].ns);
+    VIR_FREE(workers);
+    return rv;
+}
+
+/*
+ * Start and stop every domain, measuring both, start them again
+ * and restart the driver under them, then stop them: a domain
+ * failing to stop lost its locks in the restart.
+ */
+static int
+virLockCompareDriver(virLockCompareResultPtr result)
+{
+    unsigned long long start;
+    long long rss;
+    size_t lost = 0;
+    size_t i;
+    int rv = -1;
+
+    rss = virLockCompareRSS();
+
+    if (compare.driver->drvInit(VIR_LOCK_MANAGER_VERSION, compare.configFile,
+                                compare.initFlags) < 0)
+        return -1;
+
+    if (virLockCompareRun(VIR_LOCK_COMPARE_OP_START, result, NULL) < 0)
+        goto cleanup;
+
+    if (rss >= 0)
+        result->rss = virLockCompareRSS() - rss;
+
+    if (virLockCompareRun(VIR_LOCK_COMPARE_OP_STOP, result, NULL) < 0 ||
+        virLockCompareRun(VIR_LOCK_COMPARE_OP_START, NULL, NULL) < 0)
+        goto cleanup;
+
+    start = virLockCompareNow();
+    if (compare.driver->drvDeinit() < 0 ||
+        compare.driver->drvInit(VIR_LOCK_MANAGER_VERSION, compare.configFile,
+                                compare.initFlags) < 0) {
+        virLockCompareError();
+        result->restart = 0;
+        result->lost = compare.vms;
+        goto forget;
+    }
+    result->restart = virLockCompareNow() - start;
+
+    if (virLockCompareRun(VIR_LOCK_COMPARE_OP_STOP, NULL, &lost) < 0)
+        goto cleanup;
+    result->lost = lost;
+
+    rv = 0;
+ cleanup:
+    for (i = 0; i < compare.vms; i++) {
+        if (compare.vm[i].running)
+            ignore_value(virLockCompareStop(compare.vm + i));
+    }
+    compare.driver->drvDeinit();
+    return rv;
+
+ forget:
+    /* Nothing to release them with */
+    for (i = 0; i < compare.vms; i++) {
+        compare.vm[i].running = false;
+        compare.vm[i].man.privateData = NULL;
+    }
+    return 0;
+}
+
+static int
+virLockCompareCompare(const void *a,
+                      const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The nearest rank, in microseconds, of @permille of the sorted @ns */
+static double
+virLockComparePercentile(unsigned long long *ns,
+                         size_t nns,
+                         unsigned int permille)
+{
+    size_t rank;
+
+    if (!nns)
+        return 0;
+
+    rank = (nns * permille + 999) / 1000;
+    if (rank > 0)
+        rank--;
+
+    return ns[rank] / 1000.0;
+}
+
+static void
+virLockCompareReport(const char *name,
+                     virLockCompareResultPtr result)
+{
+    size_t i;
+
+    for (i = 0; i < VIR_LOCK_COMPARE_OP_LAST; i++)
+        qsort(result->ns[i], result->nns[i], sizeof(*result->ns[i]),
+              virLockCompareCompare);
+
+    printf("%-12s %10.1f %10.1f %10.1f %10.1f %6zu %12.3f %6zu %10.1f\n",
+           name,
+           virLockComparePercentile(result->ns[VIR_LOCK_COMPARE_OP_START],
+                                    result->nns[VIR_LOCK_COMPARE_OP_START], 500),
+           virLockComparePercentile(result->ns[VIR_LOCK_COMPARE_OP_START],
+                                    result->nns[VIR_LOCK_COMPARE_OP_START], 990),
+           virLockComparePercentile(result->ns[VIR_LOCK_COMPARE_OP_STOP],
+                                    result->nns[VIR_LOCK_COMPARE_OP_STOP], 500),
+           virLockComparePercentile(result->ns[VIR_LOCK_COMPARE_OP_STOP],
+                                    result->nns[VIR_LOCK_COMPARE_OP_STOP], 990),
+           result->failed[VIR_LOCK_COMPARE_OP_START] +
+           result->failed[VIR_LOCK_COMPARE_OP_STOP],
+           result->restart / 1e6, result->lost,
+           result->rss >= 0 ? (double)result->rss / compare.vms : -1);
+}
+
+/* Scratch configuration of the DLM driver, see dlm_bench.c */
+static int
+virLockCompareConfig(const char *dir,
+                     char **configFile)
+{
+    char *content = NULL;
+    int rv = -1;
+
+    if (!(*configFile = virFileBuildPath(dir, "dlm", ".conf")))
+        return -1;
+
+    if (virAsprintf(&content,
+                    "lockspace_name = \"lock_compare\"\n"
+                    "lock_record_file = \"%s/DLMlocks.txt\"\n",
+                    dir) < 0)
+        goto cleanup;
+
+    if (virFileWriteStr(*configFile, content, 0600) < 0) {
+        virReportSystemError(errno, _("unable to write '%s'"), *configFile);
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(content);
+    return rv;
+}
+
+/* Point compare.driver at the driver called @name */
+static int
+virLockCompareSelect(const char *name,
+                     const char *dlmConfig,
+                     void **handle)
+{
+    char *path = NULL;
+    char *sep;
+    int rv = -1;
+
+    compare.initFlags = 0;
+    compare.configFile = NULL;
+    *handle = NULL;
+
+    if (STREQ(name, "dlm")) {
+        compare.driver = &virLockDriverImpl;
+        compare.configFile = dlmConfig;
+        compare.initFlags = VIR_LOCK_MANAGER_DLM_INIT_SERVER;
+        return 0;
+    }
+
+    if (STREQ(name, "posix")) {
+        compare.driver = &virLockComparePosix;
+        return 0;
+    }
+
+    if (VIR_STRDUP(path, name) < 0)
+        return -1;
+    if ((sep = strchr(path, ':'))) {
+        *sep = '\0';
+        compare.configFile = name + (sep - path) + 1;
+    }
+
+    if (!(*handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unable to load lock driver plugin %s: %s"),
+                       path, dlerror());
+        goto cleanup;
+    }
+
+    if (!(compare.driver = dlsym(*handle, "virLockDriverImpl"))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("missing plugin initialization symbol 'virLockDriverImpl' in %s"),
+                       path);
+        dlclose(*handle);
+        *handle = NULL;
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(path);
+    return rv;
+}
+
+static void
+virLockCompareUsage(const char *argv0)
+{
+    fprintf(stderr,
+            _("\n"
+              "Usage:\n"
+              "  %s [options] <driver>...\n"
+              "\n"
+              "A driver is dlm, posix or <plugin.so>[:<config file>].\n"
+              "\n"
+              "Options:\n"
+              "  -h | --help               Display program help\n"
+              "  -m | --vms <n>            Domains (default %u)\n"
+              "  -d | --disks <n>          Disks per domain (default %u)\n"
+              "  -t | --threads <n>        Threads calling the driver (default %u)\n"
+              "  -S | --shared <percent>   Disks which are shared images (default %u)\n"
+              "  -I | --images <n>         Shared images (default %u)\n"
+              "  -r | --rtt <usec>         DLM round trip (default %u)\n"
+              "  -j | --jitter <usec>      Random extra delay of the DLM (default %u)\n"
+              "  -n | --nodes <n>          Nodes of the simulated cluster (default %u)\n"
+              "\n"),
+            argv0, compare.vms, compare.disks, compare.threads,
+            compare.sharedPercent, compare.images, compare.rtt,
+            compare.jitter, compare.nodes);
+}
+
+static int
+virLockCompareParseUInt(const char *arg,
+                        unsigned int *value,
+                        bool positive)
+{
+    if (virStrToLong_ui(arg, NULL, 10, value) < 0 ||
+        (positive && *value == 0)) {
+        fprintf(stderr, _("invalid number '%s'\n"), arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    virLockCompareResult result;
+    char *scratchDir = NULL;
+    char *dlmConfig = NULL;
+    virThread eventThread;
+    void *handle = NULL;
+    bool failed = false;
+    size_t i, j;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    struct option opts[] = {
+        { "vms", required_argument, NULL, 'm' },
+        { "disks", required_argument, NULL, 'd' },
+        { "threads", required_argument, NULL, 't' },
+        { "shared", required_argument, NULL, 'S' },
+        { "images", required_argument, NULL, 'I' },
+        { "rtt", required_argument, NULL, 'r' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "nodes", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { 0, 0, 0, 0 },
+    };
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    while ((c = getopt_long(argc, argv, "hm:d:t:S:I:r:j:n:",
+                            opts, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            if (virLockCompareParseUInt(optarg, &compare.vms, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'd':
+            if (virLockCompareParseUInt(optarg, &compare.disks, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 't':
+            if (virLockCompareParseUInt(optarg, &compare.threads, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'S':
+            if (virLockCompareParseUInt(optarg, &compare.sharedPercent, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'I':
+            if (virLockCompareParseUInt(optarg, &compare.images, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'r':
+            if (virLockCompareParseUInt(optarg, &compare.rtt, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'j':
+            if (virLockCompareParseUInt(optarg, &compare.jitter, false) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'n':
+            if (virLockCompareParseUInt(optarg, &compare.nodes, true) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'h':
+            virLockCompareUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            virLockCompareUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc) {
+        virLockCompareUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (compare.threads > compare.vms)
+        compare.threads = compare.vms;
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    fake_dlm_reset();
+    if (fake_dlm_set_nodes(compare.nodes, 1) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to simulate the cluster"));
+        goto cleanup;
+    }
+    for (i = 0; i < FAKE_DLM_OP_LAST; i++)
+        fake_dlm_set_latency(i, compare.rtt, compare.jitter);
+
+    if (VIR_STRDUP(scratchDir, "/tmp/lock-compare-XXXXXX") < 0)
+        goto cleanup;
+    if (!mkdtemp(scratchDir)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create a temporary directory"));
+        VIR_FREE(scratchDir);
+        goto cleanup;
+    }
+    if (virLockCompareConfig(scratchDir, &dlmConfig) < 0 ||
+        !(posix.dir = virFileBuildPath(scratchDir, "files", NULL)))
+        goto cleanup;
+    if (virFileMakePath(posix.dir) < 0) {
+        virReportSystemError(errno, _("unable to create '%s'"), posix.dir);
+        goto cleanup;
+    }
+
+    if (virThreadCreate(&eventThread, false, virLockCompareEventLoop, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create the event loop thread"));
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(compare.vm, compare.vms) < 0)
+        goto cleanup;
+
+    for (i = 0; i < compare.vms; i++) {
+        compare.vm[i].uuid[0] = 0xc0;
+        compare.vm[i].uuid[1] = 0x3e;
+        for (j = 0; j < sizeof(i); j++)
+            compare.vm[i].uuid[VIR_UUID_BUFLEN - 1 - j] = (i >> (8 * j)) & 0xff;
+        snprintf(compare.vm[i].name, sizeof(compare.vm[i].name),
+                 "compare-%zu", i);
+    }
+
+    printf("# vms=%u disks=%u threads=%u shared=%u%% images=%u "
+           "rtt=%uus jitter=%uus nodes=%u\n",
+           compare.vms, compare.disks, compare.threads,
+           compare.sharedPercent, compare.images, compare.rtt,
+           compare.jitter, compare.nodes);
+    printf("%-12s %10s %10s %10s %10s %6s %12s %6s %10s\n",
+           "driver", "start50", "start99", "stop50", "stop99", "failed",
+           "restart(ms)", "lost", "KiB/vm");
+    printf("%-12s %10s %10s %10s %10s\n",
+           "", "(us)", "(us)", "(us)", "(us)");
+
+    for (i = optind; i < argc; i++) {
+        memset(&result, 0, sizeof(result));
+        result.rss = -1;
+
+        if (virLockCompareSelect(argv[i], dlmConfig, &handle) < 0 ||
+            virLockCompareDriver(&result) < 0) {
+            fprintf(stderr, _("%s: %s: %s\n"), argv[0], argv[i],
+                    virGetLastErrorMessage());
+            virResetLastError();
+            failed = true;
+        } else {
+            virLockCompareReport(argv[i], &result);
+        }
+
+        for (j = 0; j < VIR_LOCK_COMPARE_OP_LAST; j++)
+            VIR_FREE(result.ns[j]);
+
+        /* A plugin may have left threads or event handles behind,
+         * so it stays loaded */
+        handle = NULL;
+    }
+
+    if (compare.firstError)
+        printf("# first error: %s\n", compare.firstError);
+
+    if (!failed)
+        ret = EXIT_SUCCESS;
+
+ cleanup:
+    /* The failures of the drivers are already reported */
+    if (ret != EXIT_SUCCESS && !failed)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    quit = true;
+
+    VIR_FREE(compare.vm);
+    VIR_FREE(compare.firstError);
+    VIR_FREE(dlmConfig);
+    VIR_FREE(posix.dir);
+    if (scratchDir) {
+        ignore_value(virFileDeleteTree(scratchDir));
+        VIR_FREE(scratchDir);
+    }
+
+    return ret;
+}
@@ -0,0 +1,432 @@
+/*
+ * dlm_daemon.c: virtdlmd, a daemon holding DLM locks for libvirtd
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include "dlm_protocol.h"
+#include "lock_driver.h"
+#include "lock_driver_dlm.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virevent.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virpidfile.h"
+#include "virstring.h"
+#include "virthread.h"
+
+#include "configmake.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+#define VIR_DLM_DAEMON_CONFIG SYSCONFDIR "/libvirt/virtdlmd.conf"
+#define VIR_DLM_DAEMON_PIDFILE RUNSTATEDIR "/virtdlmd.pid"
+
+VIR_LOG_INIT("locking.dlm_daemon")
+
+/*
+ * Each connection is served by its own thread and the calls are
+ * dispatched concurrently: the lock driver does its own locking,
+ * and an Acquire queued behind a holder must not keep the Release
+ * of that holder, coming from another connection, from running.
+ */
+
+static int quitPipe[2] = { -1, -1 };
+static bool quit;
+
+static void
+virDLMDaemonSignal(int sig ATTRIBUTE_UNUSED)
+{
+    char c = 0;
+
+    ignore_value(safewrite(quitPipe[1], &c, 1));
+}
+
+static void
+virDLMDaemonQuit(int watch ATTRIBUTE_UNUSED,
+                 int fd ATTRIBUTE_UNUSED,
+                 int events ATTRIBUTE_UNUSED,
+                 void *opaque ATTRIBUTE_UNUSED)
+{
+    quit = true;
+}
+
+static int
+virDLMDaemonDispatchCall(uint32_t proc,
+                         virDLMProtocolBufferPtr call,
+                         char **state)
+{
+    virLockManager man = { &virLockDriverImpl, NULL };
+    virLockManagerParamPtr params = NULL;
+    size_t nparams = 0;
+    char *name = NULL;
+    char *inState = NULL;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t action;
+    uint32_t nresources;
+    size_t i;
+    int rv = -1;
+
+    if (virDLMProtocolGetUInt32(call, &type) < 0 ||
+        virDLMProtocolGetUInt32(call, &flags) < 0 ||
+        virDLMProtocolGetParams(call, &nparams, &params) < 0)
+        goto cleanup;
+
+    if (virLockDriverImpl.drvNew(&man, type, nparams, params, flags) < 0)
+        goto cleanup;
+
+    virDLMProtocolParamsFree(nparams, params);
+    params = NULL;
+
+    if (virDLMProtocolGetUInt32(call, &nresources) < 0)
+        goto cleanup;
+
+    for (i = 0; i < nresources; i++) {
+        if (virDLMProtocolGetUInt32(call, &type) < 0 ||
+            virDLMProtocolGetString(call, &name) < 0 ||
+            virDLMProtocolGetParams(call, &nparams, &params) < 0 ||
+            virDLMProtocolGetUInt32(call, &flags) < 0)
+            goto cleanup;
+
+        if (!name) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("missing resource name"));
+            goto cleanup;
+        }
+
+        if (virLockDriverImpl.drvAddResource(&man, type, name,
+                                             nparams, params, flags) < 0)
+            goto cleanup;
+
+        VIR_FREE(name);
+        virDLMProtocolParamsFree(nparams, params);
+        params = NULL;
+    }
+
+    if (virDLMProtocolGetUInt32(call, &flags) < 0 ||
+        virDLMProtocolGetUInt32(call, &action) < 0 ||
+        virDLMProtocolGetString(call, &inState) < 0)
+        goto cleanup;
+
+    switch ((virDLMProtocolProcedure) proc) {
+    case VIR_DLM_PROTOCOL_PROC_ACQUIRE:
+        flags &= ~VIR_LOCK_MANAGER_ACQUIRE_RESTRICT;
+        rv = virLockDriverImpl.drvAcquire(&man, inState, flags, action, NULL);
+        break;
+    case VIR_DLM_PROTOCOL_PROC_RELEASE:
+        rv = virLockDriverImpl.drvRelease(&man, state, flags);
+        break;
+    case VIR_DLM_PROTOCOL_PROC_INQUIRE:
+        rv = virLockDriverImpl.drvInquire(&man, state, flags);
+        break;
+    case VIR_DLM_PROTOCOL_PROC_UPDATE_RESOURCE:
+        if (virDLMProtocolGetUInt32(call, &type) < 0 ||
+            virDLMProtocolGetString(call, &name) < 0 ||
+            virDLMProtocolGetParams(call, &nparams, &params) < 0 ||
+            virDLMProtocolGetUInt32(call, &flags) < 0)
+            break;
+
+        if (!name) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("missing resource name"));
+            break;
+        }
+
+        rv = virLockDriverImpl.drvUpdateResource(&man, type, name,
+                                                 nparams, params, flags);
+        break;
+    default:
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unknown DLM daemon procedure %u"), proc);
+        break;
+    }
+
+ cleanup:
+    if (man.privateData)
+        virLockDriverImpl.drvFree(&man);
+    virDLMProtocolParamsFree(nparams, params);
+    VIR_FREE(name);
+    VIR_FREE(inState);
+
+    return rv;
+}
+
+static void
+virDLMDaemonClient(void *opaque)
+{
+    int fd = (intptr_t)opaque;
+    virDLMProtocolHeader hdr;
+    virDLMProtocolBuffer msg;
+    char *state = NULL;
+    int status;
+
+    memset(&msg, 0, sizeof(msg));
+
+    while (virDLMProtocolRecv(fd, &hdr, &msg) > 0) {
+        virResetLastError();
+        status = virDLMDaemonDispatchCall(hdr.proc, &msg, &state);
+        virDLMProtocolBufferFree(&msg);
+        if (virDLMProtocolAddString(&msg, status < 0 ?
+                                    virGetLastErrorMessage() : state) < 0)
+            status = -1;
+
+        VIR_FREE(state);
+
+        if (virDLMProtocolSend(fd, hdr.proc, status, &msg) < 0)
+            break;
+        virDLMProtocolBufferFree(&msg);
+    }
+
+    virDLMProtocolBufferFree(&msg);
+    VIR_FORCE_CLOSE(fd);
+}
+
+static void
+virDLMDaemonAccept(int watch ATTRIBUTE_UNUSED,
+                   int fd,
+                   int events ATTRIBUTE_UNUSED,
+                   void *opaque ATTRIBUTE_UNUSED)
+{
+    virThread thread;
+    int clientFd;
+
+    if ((clientFd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            virReportSystemError(errno, "%s", _("unable to accept client"));
+        return;
+    }
+
+    if (virThreadCreate(&thread, false, virDLMDaemonClient,
+                        (void *)(intptr_t)clientFd) < 0) {
+        VIR_WARN("unable to create client thread");
+        VIR_FORCE_CLOSE(clientFd);
+    }
+}
+
+static int
+virDLMDaemonListen(const char *path)
+{
+    struct sockaddr_un addr;
+    char *dir = NULL;
+    char *tmp;
+    int fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (virStrcpyStatic(addr.sun_path, path) == NULL) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("socket path '%s' too long"), path);
+        goto error;
+    }
+
+    if (VIR_STRDUP(dir, path) < 0)
+        goto error;
+    if ((tmp = strrchr(dir, '/')) && tmp != dir) {
+        *tmp = '\0';
+        if (virFileMakePath(dir) < 0) {
+            virReportSystemError(errno, _("unable to create '%s'"), dir);
+            goto error;
+        }
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                     0)) < 0) {
+        virReportSystemError(errno, "%s", _("unable to create socket"));
+        goto error;
+    }
+
+    if (unlink(path) < 0 && errno != ENOENT) {
+        virReportSystemError(errno, _("unable to remove '%s'"), path);
+        goto error;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        virReportSystemError(errno, _("unable to bind to '%s'"), path);
+        goto error;
+    }
+
+    /* Only root is allowed to take locks on behalf of libvirtd */
+    if (chmod(path, 0600) < 0) {
+        virReportSystemError(errno, _("unable to set mode of '%s'"), path);
+        goto error;
+    }
+
+    if (listen(fd, 30) < 0) {
+        virReportSystemError(errno, _("unable to listen on '%s'"), path);
+        goto error;
+    }
+
+    VIR_FREE(dir);
+    return fd;
+
+ error:
+    VIR_FREE(dir);
+    VIR_FORCE_CLOSE(fd);
+    return -1;
+}
+
+static void
+virDLMDaemonUsage(const char *argv0)
+{
+    fprintf(stderr,
+            _("\n"
+              "Usage:\n"
+              "  %s [options]\n"
+              "\n"
+              "Options:\n"
+              "  -h | --help            Display program help\n"
+              "  -f | --config <file>   Configuration file (default %s)\n"
+              "  -p | --pid-file <file> Change name of PID file (default %s)\n"
+              "  -s | --socket <path>   Listen socket (default %s)\n"
+              "\n"),
+            argv0, VIR_DLM_DAEMON_CONFIG, VIR_DLM_DAEMON_PIDFILE,
+            VIR_DLM_PROTOCOL_SOCKET);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *configFile = VIR_DLM_DAEMON_CONFIG;
+    const char *pidFile = VIR_DLM_DAEMON_PIDFILE;
+    const char *socketPath = VIR_DLM_PROTOCOL_SOCKET;
+    struct sigaction sig_action;
+    int pidFd = -1;
+    int listenFd = -1;
+    int listenWatch = -1;
+    int quitWatch = -1;
+    int ret = EXIT_FAILURE;
+    int c;
+
+    struct option opts[] = {
+        { "config", required_argument, NULL, 'f' },
+        { "pid-file", required_argument, NULL, 'p' },
+        { "socket", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { 0, 0, 0, 0 },
+    };
+
+    if (virGettextInitialize() < 0 ||
+        virThreadInitialize() < 0 ||
+        virErrorInitialize() < 0) {
+        fprintf(stderr, _("%s: initialization failed\n"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    while ((c = getopt_long(argc, argv, "hf:p:s:", opts, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            configFile = optarg;
+            break;
+        case 'p':
+            pidFile = optarg;
+            break;
+        case 's':
+            socketPath = optarg;
+            break;
+        case 'h':
+            virDLMDaemonUsage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            virDLMDaemonUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (virLogSetFromEnv() < 0 ||
+        virEventRegisterDefaultImpl() < 0)
+        goto cleanup;
+
+    if ((pidFd = virPidFileAcquirePath(pidFile, false, getpid())) < 0)
+        goto cleanup;
+
+    if (pipe2(quitPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        virReportSystemError(errno, "%s", _("unable to create pipe"));
+        goto cleanup;
+    }
+
+    memset(&sig_action, 0, sizeof(sig_action));
+    sig_action.sa_handler = virDLMDaemonSignal;
+    sigaction(SIGINT, &sig_action, NULL);
+    sigaction(SIGTERM, &sig_action, NULL);
+    sig_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sig_action, NULL);
+
+    /* Adopts the orphan locks left by a previous instance */
+    if (virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, configFile,
+                                  VIR_LOCK_MANAGER_DLM_INIT_SERVER) < 0)
+        goto cleanup;
+
+    if ((listenFd = virDLMDaemonListen(socketPath)) < 0)
+        goto cleanup;
+
+    if ((quitWatch = virEventAddHandle(quitPipe[0], VIR_EVENT_HANDLE_READABLE,
+                                       virDLMDaemonQuit, NULL, NULL)) < 0 ||
+        (listenWatch = virEventAddHandle(listenFd, VIR_EVENT_HANDLE_READABLE,
+                                         virDLMDaemonAccept, NULL, NULL)) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to watch daemon sockets"));
+        goto cleanup;
+    }
+
+    VIR_INFO("virtdlmd listening on %s", socketPath);
+
+    while (!quit) {
+        if (virEventRunDefaultImpl() < 0)
+            break;
+    }
+
+    ret = EXIT_SUCCESS;
+
+ cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, _("%s: %s\n"), argv[0], virGetLastErrorMessage());
+
+    if (listenWatch >= 0)
+        virEventRemoveHandle(listenWatch);
+    if (quitWatch >= 0)
+        virEventRemoveHandle(quitWatch);
+    if (listenFd >= 0) {
+        VIR_FORCE_CLOSE(listenFd);
+        unlink(socketPath);
+    }
+
+    /* The driver is not deinitialized on purpose: the locks are
+     * persistent and must stay granted as orphans until the next
+     * instance adopts them, which is the whole point of this daemon */
+
+    VIR_FORCE_CLOSE(quitPipe[0]);
+    VIR_FORCE_CLOSE(quitPipe[1]);
+    if (pidFd >= 0)
+        virPidFileReleasePath(pidFile, pidFd);
+
+    return ret;
+}
@@ -0,0 +1,44 @@
+/*
+ * dlm_probe.h: static probes of the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_DLM_PROBE_H__
+# define __VIR_DLM_PROBE_H__
+
+/*
+ * A probe site is a nop until a tracer attaches to it, and its
+ * arguments are only evaluated while one is, through the semaphore
+ * tested by the _ENABLED macro. Without WITH_DTRACE_PROBES the
+ * probes go away, so they may only be given plain expressions.
+ */
+# ifdef WITH_DTRACE_PROBES
+#  include "dlm_probes.h"
+
+#  define DLM_PROBE(NAME, ...) \
+    do { \
+        if (LIBVIRT_DLM_ ## NAME ## _ENABLED()) \
+            LIBVIRT_DLM_ ## NAME(__VA_ARGS__); \
+    } while (0)
+# else
+#  define DLM_PROBE(NAME, ...) \
+    do { } while (0)
+# endif
+
+#endif /* __VIR_DLM_PROBE_H__ */
@@ -0,0 +1,416 @@
+/*
+ * dlm_protocol.c: wire protocol between the DLM lock plugin and virtdlmd
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <stdint.h>
+
+#include "dlm_protocol.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "viruuid.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+#define VIR_DLM_PROTOCOL_NULL_STRING UINT32_MAX
+
+VIR_LOG_INIT("locking.dlm_protocol")
+
+void
+virDLMProtocolBufferFree(virDLMProtocolBufferPtr buf)
+{
+    if (!buf)
+        return;
+
+    VIR_FREE(buf->data);
+    buf->len = 0;
+    buf->alloc = 0;
+    buf->offset = 0;
+}
+
+static int
+virDLMProtocolAddBytes(virDLMProtocolBufferPtr buf,
+                       const void *data,
+                       size_t len)
+{
+    if (buf->len + len > VIR_DLM_PROTOCOL_MAX_MESSAGE) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("DLM daemon message exceeds %d bytes"),
+                       VIR_DLM_PROTOCOL_MAX_MESSAGE);
+        return -1;
+    }
+
+    if (VIR_RESIZE_N(buf->data, buf->alloc, buf->len, len) < 0)
+        return -1;
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return 0;
+}
+
+int
+virDLMProtocolAddUInt32(virDLMProtocolBufferPtr buf, uint32_t val)
+{
+    return virDLMProtocolAddBytes(buf, &val, sizeof(val));
+}
+
+int
+virDLMProtocolAddUInt64(virDLMProtocolBufferPtr buf, uint64_t val)
+{
+    return virDLMProtocolAddBytes(buf, &val, sizeof(val));
+}
+
+int
+virDLMProtocolAddString(virDLMProtocolBufferPtr buf, const char *str)
+{
+    size_t len;
+
+    if (!str)
+        return virDLMProtocolAddUInt32(buf, VIR_DLM_PROTOCOL_NULL_STRING);
+
+    len = strlen(str);
+    if (virDLMProtocolAddUInt32(buf, len) < 0)
+        return -1;
+
+    return virDLMProtocolAddBytes(buf, str, len);
+}
+
+int
+virDLMProtocolAddBuffer(virDLMProtocolBufferPtr buf,
+                        virDLMProtocolBufferPtr data)
+{
+    return virDLMProtocolAddBytes(buf, data->data, data->len);
+}
+
+int
+virDLMProtocolAddParams(virDLMProtocolBufferPtr buf,
+                        size_t nparams,
+                        virLockManagerParamPtr params)
+{
+    size_t i;
+    uint64_t val;
+
+    if (virDLMProtocolAddUInt32(buf, nparams) < 0)
+        return -1;
+
+    for (i = 0; i < nparams; i++) {
+        if (virDLMProtocolAddUInt32(buf, params[i].type) < 0 ||
+            virDLMProtocolAddString(buf, params[i].key) < 0)
+            return -1;
+
+        switch (params[i].type) {
+        case VIR_LOCK_MANAGER_PARAM_TYPE_STRING:
+            if (virDLMProtocolAddString(buf, params[i].value.str) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_CSTRING:
+            if (virDLMProtocolAddString(buf, params[i].value.cstr) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_INT:
+            if (virDLMProtocolAddUInt32(buf, params[i].value.iv) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_UINT:
+            if (virDLMProtocolAddUInt32(buf, params[i].value.ui) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_LONG:
+            if (virDLMProtocolAddUInt64(buf, params[i].value.l) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_ULONG:
+            if (virDLMProtocolAddUInt64(buf, params[i].value.ul) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_DOUBLE:
+            memcpy(&val, &params[i].value.d, sizeof(val));
+            if (virDLMProtocolAddUInt64(buf, val) < 0)
+                return -1;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_UUID:
+            if (virDLMProtocolAddBytes(buf, params[i].value.uuid,
+                                       VIR_UUID_BUFLEN) < 0)
+                return -1;
+            break;
+        default:
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unknown lock manager param type %d"),
+                           params[i].type);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+virDLMProtocolGetBytes(virDLMProtocolBufferPtr buf,
+                       void *data,
+                       size_t len)
+{
+    if (len > buf->len - buf->offset) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("truncated DLM daemon message"));
+        return -1;
+    }
+
+    memcpy(data, buf->data + buf->offset, len);
+    buf->offset += len;
+
+    return 0;
+}
+
+int
+virDLMProtocolGetUInt32(virDLMProtocolBufferPtr buf, uint32_t *val)
+{
+    return virDLMProtocolGetBytes(buf, val, sizeof(*val));
+}
+
+int
+virDLMProtocolGetUInt64(virDLMProtocolBufferPtr buf, uint64_t *val)
+{
+    return virDLMProtocolGetBytes(buf, val, sizeof(*val));
+}
+
+int
+virDLMProtocolGetString(virDLMProtocolBufferPtr buf, char **str)
+{
+    uint32_t len;
+
+    *str = NULL;
+
+    if (virDLMProtocolGetUInt32(buf, &len) < 0)
+        return -1;
+
+    if (len == VIR_DLM_PROTOCOL_NULL_STRING)
+        return 0;
+
+    if (len > buf->len - buf->offset) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("truncated DLM daemon message"));
+        return -1;
+    }
+
+    if (VIR_STRNDUP(*str, buf->data + buf->offset, len) < 0)
+        return -1;
+    buf->offset += len;
+
+    return 0;
+}
+
+void
+virDLMProtocolParamsFree(size_t nparams,
+                         virLockManagerParamPtr params)
+{
+    size_t i;
+
+    if (!params)
+        return;
+
+    for (i = 0; i < nparams; i++) {
+        VIR_FREE(params[i].key);
+        if (params[i].type == VIR_LOCK_MANAGER_PARAM_TYPE_STRING ||
+            params[i].type == VIR_LOCK_MANAGER_PARAM_TYPE_CSTRING)
+            VIR_FREE(params[i].value.str);
+    }
+
+    VIR_FREE(params);
+}
+
+int
+virDLMProtocolGetParams(virDLMProtocolBufferPtr buf,
+                        size_t *nparams,
+                        virLockManagerParamPtr *params)
+{
+    virLockManagerParamPtr tmp = NULL;
+    char *key = NULL;
+    uint32_t count;
+    uint32_t type;
+    uint32_t val32;
+    uint64_t val64;
+    size_t i;
+
+    *nparams = 0;
+    *params = NULL;
+
+    if (virDLMProtocolGetUInt32(buf, &count) < 0)
+        return -1;
+
+    /* every param takes at least its type and key length */
+    if (count > (buf->len - buf->offset) / (2 * sizeof(uint32_t))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("too many params %u in DLM daemon message"),
+                       count);
+        return -1;
+    }
+
+    if (count == 0)
+        return 0;
+
+    if (VIR_ALLOC_N(tmp, count) < 0)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (virDLMProtocolGetUInt32(buf, &type) < 0 ||
+            virDLMProtocolGetString(buf, &key) < 0)
+            goto error;
+
+        if (!key) {
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("missing param key in DLM daemon message"));
+            goto error;
+        }
+
+        tmp[i].type = type;
+        VIR_STEAL_PTR(tmp[i].key, key);
+
+        switch (type) {
+        case VIR_LOCK_MANAGER_PARAM_TYPE_STRING:
+        case VIR_LOCK_MANAGER_PARAM_TYPE_CSTRING:
+            if (virDLMProtocolGetString(buf, &tmp[i].value.str) < 0)
+                goto error;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_INT:
+            if (virDLMProtocolGetUInt32(buf, &val32) < 0)
+                goto error;
+            tmp[i].value.iv = (int)val32;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_UINT:
+            if (virDLMProtocolGetUInt32(buf, &tmp[i].value.ui) < 0)
+                goto error;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_LONG:
+            if (virDLMProtocolGetUInt64(buf, &val64) < 0)
+                goto error;
+            tmp[i].value.l = (long long)val64;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_ULONG:
+            if (virDLMProtocolGetUInt64(buf, &val64) < 0)
+                goto error;
+            tmp[i].value.ul = val64;
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_DOUBLE:
+            if (virDLMProtocolGetUInt64(buf, &val64) < 0)
+                goto error;
+            memcpy(&tmp[i].value.d, &val64, sizeof(val64));
+            break;
+        case VIR_LOCK_MANAGER_PARAM_TYPE_UUID:
+            if (virDLMProtocolGetBytes(buf, tmp[i].value.uuid,
+                                       VIR_UUID_BUFLEN) < 0)
+                goto error;
+            break;
+        default:
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unknown lock manager param type %u"),
+                           type);
+            goto error;
+        }
+    }
+
+    *nparams = count;
+    *params = tmp;
+
+    return 0;
+
+ error:
+    virDLMProtocolParamsFree(count, tmp);
+    return -1;
+}
+
+int
+virDLMProtocolSend(int fd,
+                   uint32_t proc,
+                   int32_t status,
+                   virDLMProtocolBufferPtr body)
+{
+    virDLMProtocolHeader hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = VIR_DLM_PROTOCOL_MAGIC;
+    hdr.length = body ? body->len : 0;
+    hdr.proc = proc;
+    hdr.status = status;
+
+    if (safewrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        (hdr.length &&
+         safewrite(fd, body->data, hdr.length) != hdr.length)) {
+        virReportSystemError(errno, "%s",
+                             _("unable to send DLM daemon message"));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 on success, 0 if the peer closed the connection
+ * before sending anything, -1 on error
+ */
+int
+virDLMProtocolRecv(int fd,
+                   virDLMProtocolHeaderPtr hdr,
+                   virDLMProtocolBufferPtr body)
+{
+    ssize_t got;
+
+    virDLMProtocolBufferFree(body);
+
+    got = saferead(fd, hdr, sizeof(*hdr));
+    if (got == 0)
+        return 0;
+
+    if (got != sizeof(*hdr)) {
+        virReportSystemError(got < 0 ? errno : EPIPE, "%s",
+                             _("unable to receive DLM daemon message"));
+        return -1;
+    }
+
+    if (hdr->magic != VIR_DLM_PROTOCOL_MAGIC ||
+        hdr->length > VIR_DLM_PROTOCOL_MAX_MESSAGE) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("malformed DLM daemon message magic=0x%x length=%u"),
+                       hdr->magic, hdr->length);
+        return -1;
+    }
+
+    if (hdr->length == 0)
+        return 1;
+
+    if (VIR_ALLOC_N(body->data, hdr->length) < 0)
+        return -1;
+    body->alloc = hdr->length;
+
+    got = saferead(fd, body->data, hdr->length);
+    if (got != hdr->length) {
+        virReportSystemError(got < 0 ? errno : EPIPE, "%s",
+                             _("unable to receive DLM daemon message"));
+        virDLMProtocolBufferFree(body);
+        return -1;
+    }
+    body->len = hdr->length;
+
+    return 1;
+}
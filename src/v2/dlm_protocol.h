@@ -0,0 +1,113 @@
+/*
+ * dlm_protocol.h: wire protocol between the DLM lock plugin and virtdlmd
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_DLM_PROTOCOL_H__
+# define __VIR_DLM_PROTOCOL_H__
+
+# include "internal.h"
+# include "lock_driver.h"
+
+# include "configmake.h"
+
+/*
+ * Each message is a fixed header followed by @length bytes of
+ * payload. Both ends always live on the same host, so every
+ * integer is sent in host byte order.
+ *
+ * A call carries the whole lock manager context, so the daemon
+ * does not keep any per-connection state:
+ *
+ *   u32 object type, u32 new flags, params
+ *   u32 nresources, { u32 type, string name, params, u32 flags } ...
+ *   u32 call flags, u32 failure action, string state
+ *
+ * followed, for an update, by the resource to update in the same
+ * form as the others.
+ *
+ * A reply carries the returned state on success or the error
+ * message on failure. Strings are a u32 length followed by the
+ * bytes, UINT32_MAX standing for NULL. Params are a u32 count
+ * followed by { u32 type, string key, value }.
+ */
+
+# define VIR_DLM_PROTOCOL_MAGIC 0x444c4d31 /* "DLM1" */
+
+# define VIR_DLM_PROTOCOL_MAX_MESSAGE (4 * 1024 * 1024)
+
+# define VIR_DLM_PROTOCOL_SOCKET RUNSTATEDIR "/libvirt/virtdlmd-sock"
+
+typedef enum {
+    VIR_DLM_PROTOCOL_PROC_ACQUIRE = 1,
+    VIR_DLM_PROTOCOL_PROC_RELEASE = 2,
+    VIR_DLM_PROTOCOL_PROC_INQUIRE = 3,
+    VIR_DLM_PROTOCOL_PROC_UPDATE_RESOURCE = 4,
+} virDLMProtocolProcedure;
+
+typedef struct _virDLMProtocolHeader virDLMProtocolHeader;
+typedef virDLMProtocolHeader *virDLMProtocolHeaderPtr;
+
+typedef struct _virDLMProtocolBuffer virDLMProtocolBuffer;
+typedef virDLMProtocolBuffer *virDLMProtocolBufferPtr;
+
+struct _virDLMProtocolHeader {
+    uint32_t magic;
+    uint32_t length;
+    uint32_t proc;
+    int32_t status;
+};
+
+struct _virDLMProtocolBuffer {
+    char *data;
+    size_t len;
+    size_t alloc;
+    size_t offset;
+};
+
+void virDLMProtocolBufferFree(virDLMProtocolBufferPtr buf);
+
+int virDLMProtocolAddUInt32(virDLMProtocolBufferPtr buf, uint32_t val);
+int virDLMProtocolAddUInt64(virDLMProtocolBufferPtr buf, uint64_t val);
+int virDLMProtocolAddString(virDLMProtocolBufferPtr buf, const char *str);
+int virDLMProtocolAddBuffer(virDLMProtocolBufferPtr buf,
+                            virDLMProtocolBufferPtr data);
+int virDLMProtocolAddParams(virDLMProtocolBufferPtr buf,
+                            size_t nparams,
+                            virLockManagerParamPtr params);
+
+int virDLMProtocolGetUInt32(virDLMProtocolBufferPtr buf, uint32_t *val);
+int virDLMProtocolGetUInt64(virDLMProtocolBufferPtr buf, uint64_t *val);
+int virDLMProtocolGetString(virDLMProtocolBufferPtr buf, char **str);
+int virDLMProtocolGetParams(virDLMProtocolBufferPtr buf,
+                            size_t *nparams,
+                            virLockManagerParamPtr *params);
+
+void virDLMProtocolParamsFree(size_t nparams,
+                              virLockManagerParamPtr params);
+
+int virDLMProtocolSend(int fd,
+                       uint32_t proc,
+                       int32_t status,
+                       virDLMProtocolBufferPtr body);
+int virDLMProtocolRecv(int fd,
+                       virDLMProtocolHeaderPtr hdr,
+                       virDLMProtocolBufferPtr body);
+
+#endif /* __VIR_DLM_PROTOCOL_H__ */
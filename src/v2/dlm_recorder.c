@@ -0,0 +1,197 @@
+/*
+ * dlm_recorder.c: flight recorder of the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "dlm_recorder.h"
+#include "viralloc.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+VIR_LOG_INIT("locking.dlm_recorder")
+
+VIR_ENUM_IMPL(virDLMRecorderOp, VIR_DLM_RECORDER_LAST,
+              "lock", "convert", "unlock", "cancel", "complete",
+              "adopt", "record")
+
+verify((VIR_DLM_RECORDER_EVENTS & (VIR_DLM_RECORDER_EVENTS - 1)) == 0);
+
+static virDLMRecorderEvent events[VIR_DLM_RECORDER_EVENTS];
+static uint64_t head;
+
+static unsigned long long
+virDLMRecorderNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+virDLMRecorderAdd(virDLMRecorderOp op,
+                  const char *name,
+                  unsigned int lkid,
+                  pid_t pid,
+                  unsigned int mode,
+                  int status,
+                  unsigned long long duration)
+{
+    uint64_t seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    virDLMRecorderEventPtr event = events + (seq & (VIR_DLM_RECORDER_EVENTS - 1));
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    event->time = virDLMRecorderNow();
+    event->duration = duration;
+    event->lkid = lkid;
+    event->status = status;
+    event->pid = pid;
+    event->op = op;
+    event->mode = mode;
+    if (name)
+        strncpy(event->name, name, sizeof(event->name));
+    else
+        event->name[0] = '\0';
+
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy the event @seq into @event, false if it was overwritten */
+static bool
+virDLMRecorderGet(uint64_t seq,
+                  virDLMRecorderEventPtr event)
+{
+    virDLMRecorderEventPtr slot = events + (seq & (VIR_DLM_RECORDER_EVENTS - 1));
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+        return false;
+
+    memcpy(event, slot, sizeof(*event));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + 1;
+}
+
+/*
+ * Write the recorded events to @fd, the oldest first, each with
+ * its age at the time of the dump. Events are added meanwhile, so
+ * the oldest ones may be skipped as they get overwritten.
+ */
+int
+virDLMRecorderDump(int fd,
+                   const char *reason)
+{
+    virDLMRecorderEvent event;
+    char line[256];
+    char *when = NULL;
+    unsigned long long now = virDLMRecorderNow();
+    unsigned long long age;
+    unsigned long long ms;
+    uint64_t last = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint64_t seq;
+    size_t skipped = 0;
+    int len;
+    int rv = -1;
+
+    if (virTimeMillisNow(&ms) < 0 ||
+        !(when = virTimeStringThen(ms)))
+        return -1;
+
+    len = snprintf(line, sizeof(line),
+                   "DLM flight recorder dump at %s: %s\n", when, reason);
+    if (safewrite(fd, line, MIN(len, sizeof(line) - 1)) < 0)
+        goto cleanup;
+
+    seq = last > VIR_DLM_RECORDER_EVENTS ? last - VIR_DLM_RECORDER_EVENTS : 0;
+    for (; seq < last; seq++) {
+        if (!virDLMRecorderGet(seq, &event)) {
+            skipped++;
+            continue;
+        }
+
+        /* Stamped by a writer after @now was read */
+        age = now > event.time ? now - event.time : 0;
+
+        len = snprintf(line, sizeof(line),
+                       "-%llu.%06llus %-8s %-.*s lkid=%x pid=%d mode=%u "
+                       "status=%d duration=%lluus\n",
+                       age / 1000000000ULL,
+                       age / 1000 % 1000000,
+                       virDLMRecorderOpTypeToString(event.op),
+                       (int)sizeof(event.name), event.name,
+                       event.lkid, event.pid, event.mode, event.status,
+                       (unsigned long long)event.duration / 1000);
+        if (safewrite(fd, line, MIN(len, sizeof(line) - 1)) < 0)
+            goto cleanup;
+    }
+
+    len = snprintf(line, sizeof(line),
+                   "%llu events, %zu overwritten while dumping\n\n",
+                   (unsigned long long)MIN(last, VIR_DLM_RECORDER_EVENTS),
+                   skipped);
+    if (safewrite(fd, line, MIN(len, sizeof(line) - 1)) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    VIR_FREE(when);
+    return rv;
+}
+
+/* Append a dump to @path */
+int
+virDLMRecorderDumpFile(const char *path,
+                       const char *reason)
+{
+    int fd;
+    int rv;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0600)) < 0) {
+        virReportSystemError(errno, _("unable to open '%s'"), path);
+        return -1;
+    }
+
+    if ((rv = virDLMRecorderDump(fd, reason)) < 0)
+        virReportSystemError(errno, _("unable to write '%s'"), path);
+
+    if (VIR_CLOSE(fd) < 0 && rv == 0) {
+        virReportSystemError(errno, _("unable to write '%s'"), path);
+        rv = -1;
+    }
+
+    if (rv == 0)
+        VIR_WARN("DLM flight recorder dumped to '%s': %s", path, reason);
+
+    return rv;
+}
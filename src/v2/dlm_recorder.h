@@ -0,0 +1,83 @@
+/*
+ * dlm_recorder.h: flight recorder of the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_DLM_RECORDER_H__
+# define __VIR_DLM_RECORDER_H__
+
+# include "internal.h"
+
+/*
+ * The last VIR_DLM_RECORDER_EVENTS requests made to the DLM and
+ * their completions, always kept in memory so that they can be
+ * dumped after the fact: when asked to, when a request seems to
+ * hang, or when the adoption of the recorded locks fails.
+ *
+ * Adding an event takes no lock: a slot is claimed with an atomic
+ * increment, and its sequence number, written last, tells a dump
+ * whether the slot was overwritten while being read.
+ */
+# define VIR_DLM_RECORDER_EVENTS 4096
+
+typedef enum {
+    VIR_DLM_RECORDER_LOCK,          /* new NL lock requested */
+    VIR_DLM_RECORDER_CONVERT,       /* conversion requested */
+    VIR_DLM_RECORDER_UNLOCK,        /* unlock requested */
+    VIR_DLM_RECORDER_CANCEL,        /* cancel of a request */
+    VIR_DLM_RECORDER_COMPLETE,      /* completion AST of a request */
+    VIR_DLM_RECORDER_ADOPT,         /* recorded lock adopted */
+    VIR_DLM_RECORDER_RECORD,        /* lock written to the record file */
+
+    VIR_DLM_RECORDER_LAST
+} virDLMRecorderOp;
+
+VIR_ENUM_DECL(virDLMRecorderOp)
+
+# define VIR_DLM_RECORDER_NAME_LEN 24
+
+typedef struct _virDLMRecorderEvent virDLMRecorderEvent;
+typedef virDLMRecorderEvent *virDLMRecorderEventPtr;
+struct _virDLMRecorderEvent {
+    uint64_t seq;                   /* 0 while the slot is written */
+    uint64_t time;                  /* CLOCK_MONOTONIC nanoseconds */
+    uint64_t duration;              /* nanoseconds, of a completion */
+    uint32_t lkid;
+    int32_t status;
+    int32_t pid;                    /* of the domain */
+    uint8_t op;                     /* virDLMRecorderOp */
+    uint8_t mode;
+    uint8_t reserved[2];
+    char name[VIR_DLM_RECORDER_NAME_LEN]; /* start of the lock name */
+};
+
+void virDLMRecorderAdd(virDLMRecorderOp op,
+                       const char *name,
+                       unsigned int lkid,
+                       pid_t pid,
+                       unsigned int mode,
+                       int status,
+                       unsigned long long duration);
+
+int virDLMRecorderDump(int fd,
+                       const char *reason);
+int virDLMRecorderDumpFile(const char *path,
+                           const char *reason);
+
+#endif /* __VIR_DLM_RECORDER_H__ */
@@ -0,0 +1,547 @@
+/*
+ * dlm_stats.c: latency histograms and counters of the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <libdlm.h>
+
+#include "dlm_stats.h"
+#include "viralloc.h"
+#include "virbuffer.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virlog.h"
+#include "virstring.h"
+#include "virthread.h"
+#include "virtime.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+VIR_LOG_INIT("locking.dlm_stats")
+
+VIR_ENUM_IMPL(virDLMStatsStep, VIR_DLM_STATS_STEP_LAST,
+              "hash", "create", "convert", "unlock", "adopt",
+              "record_write", "record_sync")
+
+VIR_ENUM_IMPL(virDLMStatsResult, VIR_DLM_STATS_RESULT_LAST,
+              "granted", "conflict", "canceled", "error")
+
+/* Bounds of the exported buckets, in powers of two of nanoseconds:
+ * from about a microsecond to about a minute */
+#define VIR_DLM_STATS_EXPORT_MIN_BITS 10
+#define VIR_DLM_STATS_EXPORT_MAX_BITS 36
+
+static virDLMStats stats;
+
+static virMutex hotLock = VIR_MUTEX_INITIALIZER;
+static virDLMStatsHot hot[VIR_DLM_STATS_HOT_MAX];
+static size_t nhot;
+
+unsigned long long
+virDLMStatsNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t
+virDLMStatsBucket(unsigned long long ns)
+{
+    int msb;
+
+    if (ns < VIR_DLM_STATS_SUB_BUCKETS)
+        return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= VIR_DLM_STATS_MAX_BITS)
+        return VIR_DLM_STATS_BUCKETS - 1;
+
+    return (msb - VIR_DLM_STATS_SUB_BITS + 1) * VIR_DLM_STATS_SUB_BUCKETS +
+        ((ns >> (msb - VIR_DLM_STATS_SUB_BITS)) &
+         (VIR_DLM_STATS_SUB_BUCKETS - 1));
+}
+
+/* Smallest value of the bucket after @bucket */
+static unsigned long long
+virDLMStatsBucketEnd(size_t bucket)
+{
+    size_t msb;
+
+    if (bucket < VIR_DLM_STATS_SUB_BUCKETS)
+        return bucket + 1;
+
+    msb = bucket / VIR_DLM_STATS_SUB_BUCKETS + VIR_DLM_STATS_SUB_BITS - 1;
+
+    return (unsigned long long)(VIR_DLM_STATS_SUB_BUCKETS +
+                                bucket % VIR_DLM_STATS_SUB_BUCKETS + 1) <<
+        (msb - VIR_DLM_STATS_SUB_BITS);
+}
+
+void
+virDLMStatsAdd(virDLMStatsStep step,
+               unsigned long long ns)
+{
+    virDLMStatsHistogramPtr hist = &stats.steps[step];
+
+    __atomic_add_fetch(&hist->buckets[virDLMStatsBucket(ns)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+/* @start from virDLMStatsNow, 0 when the step was not started */
+void
+virDLMStatsEnd(virDLMStatsStep step,
+               unsigned long long start)
+{
+    unsigned long long now;
+
+    if (!start)
+        return;
+
+    now = virDLMStatsNow();
+    virDLMStatsAdd(step, now > start ? now - start : 0);
+}
+
+/* Account the status of a lock request completion */
+void
+virDLMStatsResultAdd(int status)
+{
+    virDLMStatsResult result;
+
+    switch (status) {
+    case 0:
+    case EUNLOCK:
+        result = VIR_DLM_STATS_GRANTED;
+        break;
+    case EAGAIN:
+        result = VIR_DLM_STATS_CONFLICT;
+        break;
+    case ECANCEL:
+        result = VIR_DLM_STATS_CANCELED;
+        break;
+    default:
+        result = VIR_DLM_STATS_ERROR;
+        break;
+    }
+
+    __atomic_add_fetch(&stats.results[result], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Account a conflict on the lock @name of the resource @path, after
+ * @wait nanoseconds. Only called once a request failed, so taking
+ * a lock does not slow down the granted ones.
+ */
+void
+virDLMStatsConflict(const char *name,
+                    const char *path,
+                    unsigned long long wait)
+{
+    virDLMStatsHotPtr entry = NULL;
+    char *newName = NULL;
+    char *newPath = NULL;
+    unsigned long long now;
+    size_t i;
+
+    if (virTimeMillisNow(&now) < 0)
+        now = 0;
+
+    virMutexLock(&hotLock);
+
+    for (i = 0; i < nhot; i++) {
+        if (STREQ(hot[i].name, name)) {
+            entry = hot + i;
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (VIR_STRDUP_QUIET(newName, name) < 0 ||
+            VIR_STRDUP_QUIET(newPath, path) < 0)
+            goto cleanup;
+
+        if (nhot < VIR_DLM_STATS_HOT_MAX) {
+            entry = hot + nhot++;
+        } else {
+            entry = hot;
+            for (i = 1; i < nhot; i++) {
+                if (hot[i].conflicts < entry->conflicts)
+                    entry = hot + i;
+            }
+
+            /* The count is inherited, the rest starts afresh */
+            VIR_FREE(entry->name);
+            VIR_FREE(entry->path);
+            entry->error = entry->conflicts;
+            entry->wait = 0;
+        }
+
+        VIR_STEAL_PTR(entry->name, newName);
+        VIR_STEAL_PTR(entry->path, newPath);
+    }
+
+    entry->conflicts++;
+    entry->wait += wait;
+    entry->last = now;
+
+ cleanup:
+    virMutexUnlock(&hotLock);
+    VIR_FREE(newName);
+    VIR_FREE(newPath);
+}
+
+static unsigned long long
+virDLMStatsFetch(unsigned long long *value,
+                 bool reset)
+{
+    if (reset)
+        return __atomic_exchange_n(value, 0, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy the statistics into @out, and clear them if @reset is set.
+ * Samples keep being added meanwhile, so the buckets of a histogram
+ * may not add up exactly to its count.
+ */
+void
+virDLMStatsGet(virDLMStatsPtr out,
+               bool reset)
+{
+    virDLMStatsHistogramPtr hist;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < VIR_DLM_STATS_STEP_LAST; i++) {
+        hist = &stats.steps[i];
+
+        out->steps[i].count = virDLMStatsFetch(&hist->count, reset);
+        out->steps[i].sum = virDLMStatsFetch(&hist->sum, reset);
+        for (j = 0; j < VIR_DLM_STATS_BUCKETS; j++)
+            out->steps[i].buckets[j] = virDLMStatsFetch(&hist->buckets[j],
+                                                        reset);
+    }
+
+    for (i = 0; i < VIR_DLM_STATS_RESULT_LAST; i++)
+        out->results[i] = virDLMStatsFetch(&stats.results[i], reset);
+}
+
+/* Upper bound of the bucket holding @percentile of the samples */
+unsigned long long
+virDLMStatsPercentile(virDLMStatsHistogramPtr hist,
+                      double percentile)
+{
+    unsigned long long total = 0;
+    unsigned long long seen = 0;
+    unsigned long long rank;
+    size_t i;
+
+    for (i = 0; i < VIR_DLM_STATS_BUCKETS; i++)
+        total += hist->buckets[i];
+
+    if (!total)
+        return 0;
+
+    rank = total * percentile / 100;
+    if (rank >= total)
+        rank = total - 1;
+
+    for (i = 0; i < VIR_DLM_STATS_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank)
+            break;
+    }
+
+    return virDLMStatsBucketEnd(i);
+}
+
+static int
+virDLMStatsHotCompare(const void *a,
+                      const void *b)
+{
+    const virDLMStatsHot *ha = a;
+    const virDLMStatsHot *hb = b;
+
+    if (ha->conflicts != hb->conflicts)
+        return ha->conflicts < hb->conflicts ? 1 : -1;
+
+    return 0;
+}
+
+void
+virDLMStatsHotFree(virDLMStatsHotPtr entries,
+                   size_t nentries)
+{
+    size_t i;
+
+    for (i = 0; i < nentries; i++) {
+        VIR_FREE(entries[i].name);
+        VIR_FREE(entries[i].path);
+    }
+    VIR_FREE(entries);
+}
+
+/*
+ * Copy in @entries the @max most contended resources, the most
+ * contended first.
+ */
+int
+virDLMStatsHotGet(virDLMStatsHotPtr *entries,
+                  size_t *nentries,
+                  size_t max)
+{
+    virDLMStatsHotPtr copy = NULL;
+    size_t ncopy = 0;
+    size_t i;
+
+    *entries = NULL;
+    *nentries = 0;
+
+    virMutexLock(&hotLock);
+
+    if (nhot && VIR_ALLOC_N(copy, nhot) < 0)
+        goto error;
+
+    for (i = 0; i < nhot; i++) {
+        copy[i] = hot[i];
+        copy[i].name = NULL;
+        copy[i].path = NULL;
+        ncopy++;
+
+        if (VIR_STRDUP(copy[i].name, hot[i].name) < 0 ||
+            VIR_STRDUP(copy[i].path, hot[i].path) < 0)
+            goto error;
+    }
+
+    virMutexUnlock(&hotLock);
+
+    if (ncopy)
+        qsort(copy, ncopy, sizeof(*copy), virDLMStatsHotCompare);
+
+    if (ncopy > max) {
+        for (i = max; i < ncopy; i++) {
+            VIR_FREE(copy[i].name);
+            VIR_FREE(copy[i].path);
+        }
+        ncopy = max;
+    }
+
+    *entries = copy;
+    *nentries = ncopy;
+    return 0;
+
+ error:
+    virMutexUnlock(&hotLock);
+    virDLMStatsHotFree(copy, ncopy);
+    return -1;
+}
+
+/* Quote @str as the value of a label */
+static void
+virDLMStatsFormatLabel(virBufferPtr buf,
+                       const char *str)
+{
+    virBufferAddChar(buf, '"');
+    for (; str && *str; str++) {
+        switch (*str) {
+        case '\\':
+            virBufferAddLit(buf, "\\\\");
+            break;
+        case '"':
+            virBufferAddLit(buf, "\\\"");
+            break;
+        case '\n':
+            virBufferAddLit(buf, "\\n");
+            break;
+        default:
+            virBufferAddChar(buf, *str);
+            break;
+        }
+    }
+    virBufferAddChar(buf, '"');
+}
+
+static void
+virDLMStatsFormatHot(virBufferPtr buf,
+                     const char *metric,
+                     virDLMStatsHotPtr entry)
+{
+    virBufferAsprintf(buf, "%s{lock=", metric);
+    virDLMStatsFormatLabel(buf, entry->name);
+    virBufferAddLit(buf, ",path=");
+    virDLMStatsFormatLabel(buf, entry->path);
+    virBufferAddLit(buf, "} ");
+}
+
+static void
+virDLMStatsFormatHistogram(virBufferPtr buf,
+                           virDLMStatsStep step,
+                           virDLMStatsHistogramPtr hist)
+{
+    const char *name = virDLMStatsStepTypeToString(step);
+    unsigned long long seen = 0;
+    size_t bucket = 0;
+    size_t bits;
+
+    /* Bucket bounds fall on powers of two, the cumulative counts
+     * are exact */
+    for (bits = VIR_DLM_STATS_EXPORT_MIN_BITS;
+         bits <= VIR_DLM_STATS_EXPORT_MAX_BITS; bits++) {
+        while (bucket < VIR_DLM_STATS_BUCKETS &&
+               virDLMStatsBucketEnd(bucket) <= 1ULL << bits)
+            seen += hist->buckets[bucket++];
+
+        virBufferAsprintf(buf,
+                          "libvirt_dlm_step_seconds_bucket"
+                          "{step=\"%s\",le=\"%.9g\"} %llu\n",
+                          name, (1ULL << bits) / 1e9, seen);
+    }
+
+    while (bucket < VIR_DLM_STATS_BUCKETS)
+        seen += hist->buckets[bucket++];
+
+    virBufferAsprintf(buf,
+                      "libvirt_dlm_step_seconds_bucket"
+                      "{step=\"%s\",le=\"+Inf\"} %llu\n",
+                      name, seen);
+    virBufferAsprintf(buf, "libvirt_dlm_step_seconds_sum{step=\"%s\"} %.9f\n",
+                      name, hist->sum / 1e9);
+    virBufferAsprintf(buf, "libvirt_dlm_step_seconds_count{step=\"%s\"} %llu\n",
+                      name, seen);
+}
+
+static int
+virDLMStatsRewrite(int fd,
+                   const void *opaque)
+{
+    const char *content = opaque;
+    size_t len = strlen(content);
+
+    if (safewrite(fd, content, len) != len)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Write the statistics to @path in the text format of Prometheus,
+ * for the textfile collector of its node exporter. The file is
+ * replaced at once, a collector never reads it half written.
+ */
+int
+virDLMStatsWriteFile(const char *path,
+                     size_t maxhot)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virDLMStats snapshot;
+    virDLMStatsHotPtr entries = NULL;
+    size_t nentries = 0;
+    char *content = NULL;
+    size_t i;
+    int rv = -1;
+
+    virDLMStatsGet(&snapshot, false);
+    if (virDLMStatsHotGet(&entries, &nentries, maxhot) < 0)
+        goto cleanup;
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirt_dlm_step_seconds Time spent in each "
+                    "step of the DLM lock plugin.\n"
+                    "# TYPE libvirt_dlm_step_seconds histogram\n");
+    for (i = 0; i < VIR_DLM_STATS_STEP_LAST; i++)
+        virDLMStatsFormatHistogram(&buf, i, &snapshot.steps[i]);
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirt_dlm_requests_total Lock requests "
+                    "completed by the DLM, by outcome.\n"
+                    "# TYPE libvirt_dlm_requests_total counter\n");
+    for (i = 0; i < VIR_DLM_STATS_RESULT_LAST; i++)
+        virBufferAsprintf(&buf,
+                          "libvirt_dlm_requests_total{result=\"%s\"} %llu\n",
+                          virDLMStatsResultTypeToString(i),
+                          snapshot.results[i]);
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirt_dlm_hot_conflicts_total Conflicts on "
+                    "the most contended resources.\n"
+                    "# TYPE libvirt_dlm_hot_conflicts_total counter\n");
+    for (i = 0; i < nentries; i++) {
+        virDLMStatsFormatHot(&buf, "libvirt_dlm_hot_conflicts_total",
+                             entries + i);
+        virBufferAsprintf(&buf, "%llu\n", entries[i].conflicts);
+    }
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirt_dlm_hot_conflicts_overcount Conflicts "
+                    "counted before the resource was tracked, at most.\n"
+                    "# TYPE libvirt_dlm_hot_conflicts_overcount gauge\n");
+    for (i = 0; i < nentries; i++) {
+        virDLMStatsFormatHot(&buf, "libvirt_dlm_hot_conflicts_overcount",
+                             entries + i);
+        virBufferAsprintf(&buf, "%llu\n", entries[i].error);
+    }
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirt_dlm_hot_wait_seconds_total Time spent "
+                    "on the conflicts of the most contended resources.\n"
+                    "# TYPE libvirt_dlm_hot_wait_seconds_total counter\n");
+    for (i = 0; i < nentries; i++) {
+        virDLMStatsFormatHot(&buf, "libvirt_dlm_hot_wait_seconds_total",
+                             entries + i);
+        virBufferAsprintf(&buf, "%.9f\n", entries[i].wait / 1e9);
+    }
+
+    virBufferAddLit(&buf,
+                    "# HELP libvirt_dlm_hot_last_conflict_timestamp_seconds "
+                    "Time of the last conflict on the most contended "
+                    "resources.\n"
+                    "# TYPE libvirt_dlm_hot_last_conflict_timestamp_seconds "
+                    "gauge\n");
+    for (i = 0; i < nentries; i++) {
+        virDLMStatsFormatHot(&buf,
+                             "libvirt_dlm_hot_last_conflict_timestamp_seconds",
+                             entries + i);
+        virBufferAsprintf(&buf, "%.3f\n", entries[i].last / 1e3);
+    }
+
+    if (virBufferCheckError(&buf) < 0)
+        goto cleanup;
+
+    content = virBufferContentAndReset(&buf);
+
+    if (virFileRewrite(path, 0644, virDLMStatsRewrite, content) < 0)
+        goto cleanup;
+
+    rv = 0;
+ cleanup:
+    virBufferFreeAndReset(&buf);
+    virDLMStatsHotFree(entries, nentries);
+    VIR_FREE(content);
+    return rv;
+}
@@ -0,0 +1,133 @@
+/*
+ * dlm_stats.h: latency histograms and counters of the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_DLM_STATS_H__
+# define __VIR_DLM_STATS_H__
+
+# include "internal.h"
+
+/*
+ * Always accounted: a sample is a few relaxed atomic additions, so
+ * the steps can be timed on every request. The DLM steps are timed
+ * from the request to its completion AST, the local ones around the
+ * work itself, which tells whether a slow start waited for the
+ * cluster or for the local disk.
+ *
+ * Histograms are log-linear like HDR ones: every power of two of
+ * nanoseconds is split into VIR_DLM_STATS_SUB_BUCKETS buckets, so a
+ * value is known within 1/VIR_DLM_STATS_SUB_BUCKETS of itself.
+ * Anything above 2^VIR_DLM_STATS_MAX_BITS ns lands in the last one.
+ */
+# define VIR_DLM_STATS_SUB_BITS 3
+# define VIR_DLM_STATS_SUB_BUCKETS (1 << VIR_DLM_STATS_SUB_BITS)
+# define VIR_DLM_STATS_MAX_BITS 40
+# define VIR_DLM_STATS_BUCKETS \
+    ((VIR_DLM_STATS_MAX_BITS - VIR_DLM_STATS_SUB_BITS + 1) * \
+     VIR_DLM_STATS_SUB_BUCKETS)
+
+typedef enum {
+    VIR_DLM_STATS_STEP_HASH,        /* digest of a resource name */
+    VIR_DLM_STATS_STEP_CREATE,      /* new NL lock */
+    VIR_DLM_STATS_STEP_CONVERT,     /* conversion of a lock */
+    VIR_DLM_STATS_STEP_UNLOCK,      /* unlock of a lock */
+    VIR_DLM_STATS_STEP_ADOPT,       /* adoption of the recorded locks */
+    VIR_DLM_STATS_STEP_WRITE,       /* write of the record file */
+    VIR_DLM_STATS_STEP_SYNC,        /* fdatasync of the record file */
+
+    VIR_DLM_STATS_STEP_LAST
+} virDLMStatsStep;
+
+VIR_ENUM_DECL(virDLMStatsStep)
+
+/* Outcome of the lock requests, as told by their completion AST */
+typedef enum {
+    VIR_DLM_STATS_GRANTED,
+    VIR_DLM_STATS_CONFLICT,         /* EAGAIN, held by someone else */
+    VIR_DLM_STATS_CANCELED,         /* timed out */
+    VIR_DLM_STATS_ERROR,
+
+    VIR_DLM_STATS_RESULT_LAST
+} virDLMStatsResult;
+
+VIR_ENUM_DECL(virDLMStatsResult)
+
+typedef struct _virDLMStatsHistogram virDLMStatsHistogram;
+typedef virDLMStatsHistogram *virDLMStatsHistogramPtr;
+struct _virDLMStatsHistogram {
+    unsigned long long count;
+    unsigned long long sum;         /* nanoseconds */
+    unsigned long long buckets[VIR_DLM_STATS_BUCKETS];
+};
+
+typedef struct _virDLMStats virDLMStats;
+typedef virDLMStats *virDLMStatsPtr;
+struct _virDLMStats {
+    virDLMStatsHistogram steps[VIR_DLM_STATS_STEP_LAST];
+    unsigned long long results[VIR_DLM_STATS_RESULT_LAST];
+};
+
+/*
+ * Resources most fought over, as counted by the space-saving
+ * algorithm: a conflict on a resource which is not tracked yet
+ * replaces the least contended one, inheriting its count. A count
+ * is thus over by at most @error, while any resource taking more
+ * than 1/VIR_DLM_STATS_HOT_MAX of the conflicts is sure to be kept.
+ */
+# define VIR_DLM_STATS_HOT_MAX 64
+
+typedef struct _virDLMStatsHot virDLMStatsHot;
+typedef virDLMStatsHot *virDLMStatsHotPtr;
+struct _virDLMStatsHot {
+    char *name;                     /* of the lock */
+    char *path;                     /* of the resource, as added */
+    unsigned long long conflicts;
+    unsigned long long error;       /* counted for replaced resources */
+    unsigned long long wait;        /* nanoseconds spent on conflicts */
+    unsigned long long last;        /* milliseconds since the epoch */
+};
+
+unsigned long long virDLMStatsNow(void);
+
+void virDLMStatsAdd(virDLMStatsStep step,
+                    unsigned long long ns);
+void virDLMStatsEnd(virDLMStatsStep step,
+                    unsigned long long start);
+void virDLMStatsResultAdd(int status);
+void virDLMStatsConflict(const char *name,
+                         const char *path,
+                         unsigned long long wait);
+
+void virDLMStatsGet(virDLMStatsPtr stats,
+                    bool reset);
+
+unsigned long long virDLMStatsPercentile(virDLMStatsHistogramPtr hist,
+                                         double percentile);
+
+int virDLMStatsHotGet(virDLMStatsHotPtr *hot,
+                      size_t *nhot,
+                      size_t max);
+void virDLMStatsHotFree(virDLMStatsHotPtr hot,
+                        size_t nhot);
+
+int virDLMStatsWriteFile(const char *path,
+                         size_t nhot);
+
+#endif /* __VIR_DLM_STATS_H__ */
@@ -0,0 +1,242 @@
+/*
+ * dlm_trace.c: binary trace of the calls made to the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "dlm_trace.h"
+#include "viralloc.h"
+#include "vircrypto.h"
+#include "virerror.h"
+#include "virfile.h"
+#include "virlog.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+VIR_LOG_INIT("locking.dlm_trace")
+
+VIR_ENUM_IMPL(virDLMTraceCall, VIR_DLM_TRACE_CALL_LAST,
+              "new", "free", "add_resource", "acquire", "release",
+              "inquire", "update_resource", "acquire_async",
+              "release_async")
+
+struct _virDLMTrace {
+    int fd;
+    char *path;
+};
+
+unsigned long long
+virDLMTraceNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+virDLMTraceDigest(const char *name,
+                  unsigned char *digest)
+{
+    return virCryptoHashBuf(VIR_CRYPTO_HASH_SHA256, name, digest);
+}
+
+static void
+virDLMTraceFree(virDLMTracePtr trace)
+{
+    if (!trace)
+        return;
+
+    VIR_FORCE_CLOSE(trace->fd);
+    VIR_FREE(trace->path);
+    VIR_FREE(trace);
+}
+
+static virDLMTracePtr
+virDLMTraceNew(const char *path)
+{
+    virDLMTracePtr trace = NULL;
+
+    if (VIR_ALLOC(trace) < 0)
+        return NULL;
+    trace->fd = -1;
+
+    if (VIR_STRDUP(trace->path, path) < 0) {
+        VIR_FREE(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+static int
+virDLMTraceReadHeader(virDLMTracePtr trace)
+{
+    virDLMTraceHeader hdr;
+    ssize_t got;
+
+    got = saferead(trace->fd, &hdr, sizeof(hdr));
+    if (got < 0) {
+        virReportSystemError(errno, _("unable to read DLM trace '%s'"),
+                             trace->path);
+        return -1;
+    }
+
+    if (got != sizeof(hdr) ||
+        hdr.magic != VIR_DLM_TRACE_MAGIC ||
+        hdr.version != VIR_DLM_TRACE_VERSION ||
+        hdr.recordSize != sizeof(virDLMTraceRecord)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("'%s' is not a DLM trace of this version"),
+                       trace->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Open @path for appending, creating it with a header if it
+ * does not exist yet.
+ */
+virDLMTracePtr
+virDLMTraceOpen(const char *path)
+{
+    virDLMTracePtr trace = NULL;
+    virDLMTraceHeader hdr;
+    struct stat st;
+
+    if (!(trace = virDLMTraceNew(path)))
+        return NULL;
+
+    trace->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (trace->fd < 0 || fstat(trace->fd, &st) < 0) {
+        virReportSystemError(errno, _("unable to open DLM trace '%s'"),
+                             path);
+        goto error;
+    }
+
+    if (st.st_size > 0) {
+        if (virDLMTraceReadHeader(trace) < 0)
+            goto error;
+    } else {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = VIR_DLM_TRACE_MAGIC;
+        hdr.version = VIR_DLM_TRACE_VERSION;
+        hdr.recordSize = sizeof(virDLMTraceRecord);
+
+        if (safewrite(trace->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            virReportSystemError(errno, _("unable to write DLM trace '%s'"),
+                                 path);
+            goto error;
+        }
+    }
+
+    VIR_DEBUG("tracing DLM lock calls to '%s'", path);
+
+    return trace;
+
+ error:
+    virDLMTraceFree(trace);
+    return NULL;
+}
+
+virDLMTracePtr
+virDLMTraceOpenRead(const char *path)
+{
+    virDLMTracePtr trace = NULL;
+
+    if (!(trace = virDLMTraceNew(path)))
+        return NULL;
+
+    if ((trace->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        virReportSystemError(errno, _("unable to open DLM trace '%s'"),
+                             path);
+        goto error;
+    }
+
+    if (virDLMTraceReadHeader(trace) < 0)
+        goto error;
+
+    return trace;
+
+ error:
+    virDLMTraceFree(trace);
+    return NULL;
+}
+
+void
+virDLMTraceClose(virDLMTracePtr trace)
+{
+    virDLMTraceFree(trace);
+}
+
+/*
+ * Called on the paths of the plugin, so a failure is only
+ * logged: losing a record must not fail a lock operation.
+ */
+int
+virDLMTraceWrite(virDLMTracePtr trace,
+                 virDLMTraceRecordPtr record)
+{
+    ssize_t done;
+
+    done = write(trace->fd, record, sizeof(*record));
+    if (done != sizeof(*record)) {
+        VIR_WARN("unable to write DLM trace '%s': errno=%d",
+                 trace->path, done < 0 ? errno : ENOSPC);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 if a record was read, 0 at the end of the trace,
+ * -1 on error. A record cut short by a crash ends the trace.
+ */
+int
+virDLMTraceRead(virDLMTracePtr trace,
+                virDLMTraceRecordPtr record)
+{
+    ssize_t got;
+
+    got = saferead(trace->fd, record, sizeof(*record));
+    if (got < 0) {
+        virReportSystemError(errno, _("unable to read DLM trace '%s'"),
+                             trace->path);
+        return -1;
+    }
+
+    if (got != sizeof(*record)) {
+        if (got)
+            VIR_WARN("ignoring a truncated record at the end of '%s'",
+                     trace->path);
+        return 0;
+    }
+
+    return 1;
+}
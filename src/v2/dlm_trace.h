@@ -0,0 +1,107 @@
+/*
+ * dlm_trace.h: binary trace of the calls made to the DLM lock plugin
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_DLM_TRACE_H__
+# define __VIR_DLM_TRACE_H__
+
+# include "internal.h"
+# include "viruuid.h"
+
+/*
+ * A trace is a header followed by fixed size records, one per call
+ * of the plugin entry points, in host byte order: it is meant to be
+ * replayed on a machine of the same kind. Resource names are only
+ * kept as their SHA-256 digest, which is enough to tell whether two
+ * calls refer to the same resource.
+ *
+ * Records are appended by a single write each, so the calls made
+ * from several threads, or by several processes sharing the file,
+ * never interleave within a record. A restarted driver keeps
+ * appending to the same trace.
+ */
+
+# define VIR_DLM_TRACE_MAGIC 0x444c4d54 /* "DLMT" */
+# define VIR_DLM_TRACE_VERSION 1
+# define VIR_DLM_TRACE_DIGEST_LEN 32
+
+typedef enum {
+    VIR_DLM_TRACE_CALL_NEW,
+    VIR_DLM_TRACE_CALL_FREE,
+    VIR_DLM_TRACE_CALL_ADD_RESOURCE,
+    VIR_DLM_TRACE_CALL_ACQUIRE,
+    VIR_DLM_TRACE_CALL_RELEASE,
+    VIR_DLM_TRACE_CALL_INQUIRE,
+    VIR_DLM_TRACE_CALL_UPDATE_RESOURCE,
+    VIR_DLM_TRACE_CALL_ACQUIRE_ASYNC,
+    VIR_DLM_TRACE_CALL_RELEASE_ASYNC,
+
+    VIR_DLM_TRACE_CALL_LAST
+} virDLMTraceCall;
+
+VIR_ENUM_DECL(virDLMTraceCall)
+
+typedef struct _virDLMTraceHeader virDLMTraceHeader;
+typedef virDLMTraceHeader *virDLMTraceHeaderPtr;
+struct _virDLMTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+};
+
+typedef struct _virDLMTraceRecord virDLMTraceRecord;
+typedef virDLMTraceRecord *virDLMTraceRecordPtr;
+struct _virDLMTraceRecord {
+    uint64_t time;          /* CLOCK_REALTIME nanoseconds of the call */
+    uint64_t offset;        /* region of a resource, length 0 for all */
+    uint64_t length;
+    uint32_t duration;      /* microseconds until completion */
+    uint32_t flags;         /* of the call */
+    int32_t result;
+    uint32_t id;            /* of the domain */
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    unsigned char digest[VIR_DLM_TRACE_DIGEST_LEN]; /* of the resource */
+    uint8_t call;           /* virDLMTraceCall */
+    uint8_t type;           /* of the resource */
+    uint8_t mode;           /* DLM mode the resource is locked in */
+    uint8_t action;         /* failure action of an acquire */
+    uint8_t state;          /* a lock state was given or asked for */
+    uint8_t reserved[3];
+};
+
+typedef struct _virDLMTrace virDLMTrace;
+typedef virDLMTrace *virDLMTracePtr;
+
+unsigned long long virDLMTraceNow(void);
+
+int virDLMTraceDigest(const char *name,
+                      unsigned char *digest);
+
+virDLMTracePtr virDLMTraceOpen(const char *path);
+void virDLMTraceClose(virDLMTracePtr trace);
+int virDLMTraceWrite(virDLMTracePtr trace,
+                     virDLMTraceRecordPtr record);
+
+virDLMTracePtr virDLMTraceOpenRead(const char *path);
+int virDLMTraceRead(virDLMTracePtr trace,
+                    virDLMTraceRecordPtr record);
+
+#endif /* __VIR_DLM_TRACE_H__ */
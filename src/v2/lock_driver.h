@@ -103,7 +103,7 @@ struct _virLockManagerParam {
  * Changes in micro version denote new compatible flags
  */
 # define VIR_LOCK_MANAGER_VERSION_MAJOR 1
-# define VIR_LOCK_MANAGER_VERSION_MINOR 0
+# define VIR_LOCK_MANAGER_VERSION_MINOR 2
 # define VIR_LOCK_MANAGER_VERSION_MICRO 0
 
 # define VIR_LOCK_MANAGER_VERSION \
@@ -284,6 +284,106 @@ typedef int (*virLockDriverInquire)(virLockManagerPtr man,
                                     char **state,
                                     unsigned int flags);
 
+/**
+ * virLockDriverCompletion:
+ * @manager: the lock manager context
+ * @result: 0 on success, or -1 on failure
+ * @state: lock state returned by the operation, or NULL
+ * @opaque: data given when the operation was started
+ *
+ * Called exactly once when an asynchronous operation is
+ * over. On failure the error is reported in the thread
+ * invoking the callback. The callback owns @state and
+ * must free it.
+ *
+ * The callback may run in any thread, including the
+ * event loop, or before the call starting the operation
+ * returned, so it must not block nor call back into
+ * the lock driver.
+ */
+typedef void (*virLockDriverCompletion)(virLockManagerPtr man,
+                                        int result,
+                                        char *state,
+                                        void *opaque);
+
+/**
+ * virLockDriverAcquireAsync:
+ * @manager: the lock manager context
+ * @state: the current lock state
+ * @flags: optional flags, currently unused
+ * @action: action to take when lock is lost
+ * @cb: callback invoked once the locks are acquired
+ * @opaque: data passed to @cb
+ *
+ * Like virLockDriverAcquire, but return as soon as the
+ * requests are submitted instead of waiting for the locks
+ * to be granted, so that the caller does not block while
+ * they are held elsewhere. No file descriptor is leaked,
+ * drivers needing one do not provide this entry point.
+ *
+ * The lock manager context must not be used nor freed
+ * until @cb was invoked.
+ *
+ * Returns 0 if the operation was started, in which case
+ * @cb will be called, or -1 on failure
+ */
+typedef int (*virLockDriverAcquireAsync)(virLockManagerPtr man,
+                                         const char *state,
+                                         unsigned int flags,
+                                         virDomainLockFailureAction action,
+                                         virLockDriverCompletion cb,
+                                         void *opaque);
+
+/**
+ * virLockDriverReleaseAsync:
+ * @manager: the lock manager context
+ * @flags: optional flags
+ * @cb: callback invoked once the locks are released
+ * @opaque: data passed to @cb
+ *
+ * Like virLockDriverRelease, but return as soon as the
+ * requests are submitted. The lock state is passed
+ * to @cb.
+ *
+ * The lock manager context must not be used nor freed
+ * until @cb was invoked.
+ *
+ * Returns 0 if the operation was started, in which case
+ * @cb will be called, or -1 on failure
+ */
+typedef int (*virLockDriverReleaseAsync)(virLockManagerPtr man,
+                                         unsigned int flags,
+                                         virLockDriverCompletion cb,
+                                         void *opaque);
+
+/**
+ * virLockDriverUpdateResource:
+ * @manager: the lock manager context
+ * @type: the resource type virLockManagerResourceType
+ * @name: the resource name
+ * @nparams: number of metadata parameters
+ * @params: extra metadata parameters
+ * @flags: the resource access flags
+ *
+ * Change the access mode of a resource of a running
+ * object to the one given by @flags, acquiring it if
+ * the object does not hold it yet, without touching
+ * its other resources. A resource held already is not
+ * released during the change, so it stays protected
+ * in its former mode if the change fails.
+ *
+ * On success the resource is part of the context, as
+ * if added with virLockDriverAddResource.
+ *
+ * Returns 0 on success, or -1 on failure
+ */
+typedef int (*virLockDriverUpdateResource)(virLockManagerPtr man,
+                                           unsigned int type,
+                                           const char *name,
+                                           size_t nparams,
+                                           virLockManagerParamPtr params,
+                                           unsigned int flags);
+
 
 struct _virLockManager {
     virLockDriverPtr driver;
@@ -313,6 +413,13 @@ struct _virLockDriver {
     virLockDriverAcquire drvAcquire;
     virLockDriverRelease drvRelease;
     virLockDriverInquire drvInquire;
+
+    /* Optional, since 1.1.0 */
+    virLockDriverAcquireAsync drvAcquireAsync;
+    virLockDriverReleaseAsync drvReleaseAsync;
+
+    /* Optional, since 1.2.0 */
+    virLockDriverUpdateResource drvUpdateResource;
 };
 
 
@@ -22,25 +22,43 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <stdint.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <time.h>
 
 #include <corosync/cpg.h>
 #include <libdlm.h>
 
+#include "dlm_probe.h"
+#include "dlm_protocol.h"
+#include "dlm_recorder.h"
+#include "dlm_stats.h"
+#include "dlm_trace.h"
 #include "lock_driver.h"
+#include "lock_driver_dlm.h"
 #include "viralloc.h"
 #include "virconf.h"
 #include "vircrypto.h"
 #include "virerror.h"
+#include "virevent.h"
 #include "virfile.h"
 #include "virhash.h"
 #include "virlog.h"
+#include "virobject.h"
 #include "virstring.h"
+#include "virthread.h"
+#include "virtime.h"
+#include "virutil.h"
 #include "viruuid.h"
 
 #include "configmake.h"
@@ -49,11 +67,87 @@
 
 #define VIR_RESOURCE_TABLE_SIZE 10
 
-/* This will be set after dlm_controld is started. */
-#define DLM_CLUSTER_NAME_PATH "/sys/kernel/config/dlm/cluster/cluster_name"
+/* This will be set after dlm_controld is started. Overridable for
+ * the builds running on a stand-in of libdlm, like the benchmarks */
+#ifndef DLM_CLUSTER_NAME_PATH
+# define DLM_CLUSTER_NAME_PATH "/sys/kernel/config/dlm/cluster/cluster_name"
+#endif
+
+/* The CPG group joined by every driver sharing a lockspace */
+#define DLM_CPG_GROUP_PREFIX "libvirt_dlm_"
+
+/* Most chunks a disk region may span, each of them being a lock */
+#define VIR_LOCK_MANAGER_DLM_REGION_MAX_CHUNKS 4096
+
+/* Flag of the resources virtdlmd is given back for an update of the
+ * context, which replaces their former mode, NL dropping them */
+#define VIR_LOCK_MANAGER_DLM_RESOURCE_UPDATE (1U << 31)
 
 VIR_LOG_INIT("locking.lock_driver_dlm")
 
+typedef enum {
+    /* Never purge the orphans of other nodes */
+    VIR_LOCK_MANAGER_DLM_PURGE_NONE = 0,
+    /* Purge when the driver on a live node is gone */
+    VIR_LOCK_MANAGER_DLM_PURGE_DEPARTED,
+
+    VIR_LOCK_MANAGER_DLM_PURGE_LAST
+} virLockManagerDLMPurgePolicy;
+
+typedef enum {
+    /* Fail at once if the lock is held by someone else */
+    VIR_LOCK_MANAGER_DLM_WAIT_NOWAIT = 0,
+    /* Queue the request, cancel it when acquire_timeout expires */
+    VIR_LOCK_MANAGER_DLM_WAIT_TIMEOUT,
+    /* Queue the request until it is granted */
+    VIR_LOCK_MANAGER_DLM_WAIT_FOREVER,
+
+    VIR_LOCK_MANAGER_DLM_WAIT_LAST
+} virLockManagerDLMWaitPolicy;
+
+VIR_ENUM_DECL(virLockManagerDLMWaitPolicy)
+VIR_ENUM_IMPL(virLockManagerDLMWaitPolicy,
+              VIR_LOCK_MANAGER_DLM_WAIT_LAST,
+              "nowait", "timeout", "forever")
+
+typedef enum {
+    /* Shareable writable disks are locked as any other reader */
+    VIR_LOCK_MANAGER_DLM_SHARED_PR = 0,
+    /* Allow concurrent writers, but no reader or exclusive user */
+    VIR_LOCK_MANAGER_DLM_SHARED_CW,
+
+    VIR_LOCK_MANAGER_DLM_SHARED_LAST
+} virLockManagerDLMSharedMode;
+
+VIR_ENUM_DECL(virLockManagerDLMSharedMode)
+VIR_ENUM_IMPL(virLockManagerDLMSharedMode,
+              VIR_LOCK_MANAGER_DLM_SHARED_LAST,
+              "pr", "cw")
+
+typedef enum {
+    /* Readonly disks are not locked */
+    VIR_LOCK_MANAGER_DLM_READONLY_NONE = 0,
+    /* Lock them in CR, which only keeps exclusive users away */
+    VIR_LOCK_MANAGER_DLM_READONLY_CR,
+
+    VIR_LOCK_MANAGER_DLM_READONLY_LAST
+} virLockManagerDLMReadonlyMode;
+
+VIR_ENUM_DECL(virLockManagerDLMReadonlyMode)
+VIR_ENUM_IMPL(virLockManagerDLMReadonlyMode,
+              VIR_LOCK_MANAGER_DLM_READONLY_LAST,
+              "none", "cr")
+
+VIR_ENUM_DECL(virLockManagerDLMMode)
+VIR_ENUM_IMPL(virLockManagerDLMMode,
+              LKM_EXMODE + 1,
+              "NL", "CR", "CW", "PR", "PW", "EX")
+
+VIR_ENUM_DECL(virLockManagerDLMPurgePolicy)
+VIR_ENUM_IMPL(virLockManagerDLMPurgePolicy,
+              VIR_LOCK_MANAGER_DLM_PURGE_LAST,
+              "none", "departed")
+
 typedef struct _virLockManagerDLMLock virLockManagerDLMLock;
 typedef virLockManagerDLMLock *virLockManagerDLMLockPtr;
 
@@ -63,30 +157,114 @@ typedef virLockManagerDLMLockResource *virLockManagerDLMLockResourcePtr;
 typedef struct _virLockManagerDLMResource virLockManagerDLMResource;
 typedef virLockManagerDLMResource *virLockManagerDLMResourcePtr;
 
+typedef struct _virLockManagerDLMOwner virLockManagerDLMOwner;
+typedef virLockManagerDLMOwner *virLockManagerDLMOwnerPtr;
+
 typedef struct _virLockManagerDLMPrivate virLockManagerDLMPrivate;
 typedef virLockManagerDLMPrivate *virLockManagerDLMPrivatePtr;
 
+typedef struct _virLockManagerDLMAstCall virLockManagerDLMAstCall;
+typedef virLockManagerDLMAstCall *virLockManagerDLMAstCallPtr;
+
+typedef struct _virLockManagerDLMLockCache virLockManagerDLMLockCache;
+typedef virLockManagerDLMLockCache *virLockManagerDLMLockCachePtr;
+
+typedef struct _virLockManagerDLMWaiter virLockManagerDLMWaiter;
+typedef virLockManagerDLMWaiter *virLockManagerDLMWaiterPtr;
+
+typedef struct _virLockManagerDLMSchedEntry virLockManagerDLMSchedEntry;
+typedef virLockManagerDLMSchedEntry *virLockManagerDLMSchedEntryPtr;
+
+typedef struct _virLockManagerDLMSchedQueue virLockManagerDLMSchedQueue;
+typedef virLockManagerDLMSchedQueue *virLockManagerDLMSchedQueuePtr;
+
+typedef struct _virLockManagerDLMScheduler virLockManagerDLMScheduler;
+typedef virLockManagerDLMScheduler *virLockManagerDLMSchedulerPtr;
+
+typedef struct _virLockManagerDLMOp virLockManagerDLMOp;
+typedef virLockManagerDLMOp *virLockManagerDLMOpPtr;
+
+typedef struct _virLockManagerDLMBatchReq virLockManagerDLMBatchReq;
+typedef virLockManagerDLMBatchReq *virLockManagerDLMBatchReqPtr;
+
+typedef struct _virLockManagerDLMHandoff virLockManagerDLMHandoff;
+typedef virLockManagerDLMHandoff *virLockManagerDLMHandoffPtr;
+
+typedef struct _virLockManagerDLMExpiry virLockManagerDLMExpiry;
+typedef virLockManagerDLMExpiry *virLockManagerDLMExpiryPtr;
+
+typedef struct _virLockManagerDLMDaemonJob virLockManagerDLMDaemonJob;
+typedef virLockManagerDLMDaemonJob *virLockManagerDLMDaemonJobPtr;
+
+typedef struct _virLockManagerDLMPurge virLockManagerDLMPurge;
+typedef virLockManagerDLMPurge *virLockManagerDLMPurgePtr;
+
+typedef struct _virLockManagerDLMMembership virLockManagerDLMMembership;
+typedef virLockManagerDLMMembership *virLockManagerDLMMembershipPtr;
+
 typedef struct _virLockManagerDLMDriver virLockManagerDLMDriver;
 typedef virLockManagerDLMDriver *virLockManagerDLMDriverPtr;
 
 struct _virLockManagerDLMLock {
     pid_t vm_pid;
     unsigned int lkid;
+    unsigned int mode; /* granted to @vm_pid, NL if unknown */
+    unsigned long long retainedUntil; /* kept at NL until then for a state
+                                         handed out by a release */
+    unsigned long long graceUntil; /* released but kept granted until then */
+    unsigned char graceUuid[VIR_UUID_BUFLEN]; /* domain it is kept for */
+    bool expiring; /* the release after the grace period is in progress */
+    bool cached; /* kept until another node asks for it */
+    bool bast; /* granted with a blocking AST */
+    bool contended; /* another node asked for it while held */
+    virLockManagerDLMLockCachePtr cache;
 };
 
 struct _virLockManagerDLMLockResource {
     char *name;
-    unsigned int mode;
     size_t nHolders;
     size_t nLocks;
     virLockManagerDLMLockPtr locks;
+    size_t nBusy; /* operations with a request in progress */
 };
 
 struct _virLockManagerDLMResource {
     char *name;
     unsigned int mode;
+    char *path;         /* as added, to report contention */
+};
+
+/*
+ * Owner of a lock, published in its value block by the exclusive
+ * holder and overwritten when it is released. Integers are big
+ * endian, the nodes of a cluster need not share the byte order.
+ */
+struct _virLockManagerDLMOwner {
+    uint8_t version;
+    uint8_t mode;                       /* LKM_NLMODE once released */
+    uint16_t padding;
+    uint32_t nodeId;
+    uint64_t timestamp;                 /* milliseconds since the epoch */
+    unsigned char uuid[VIR_UUID_BUFLEN];
 };
 
+verify(sizeof(virLockManagerDLMOwner) == DLM_LVB_LEN);
+
+#define VIR_LOCK_MANAGER_DLM_OWNER_VERSION 1
+
+/*
+ * Lock state handed out by Inquire and Release, and given back to
+ * Acquire on resume. It reads
+ *
+ *   dlm:<version>:<node ID>;<digest>,<mode>,<lkid>;...
+ *
+ * with one entry per lease held, <digest> being the start of the
+ * SHA-256 of the resource name, as lease names may contain anything.
+ */
+#define VIR_LOCK_MANAGER_DLM_STATE_PREFIX "dlm:"
+#define VIR_LOCK_MANAGER_DLM_STATE_VERSION 1
+#define VIR_LOCK_MANAGER_DLM_STATE_DIGEST_LEN 16
+
 struct _virLockManagerDLMPrivate {
     unsigned char vm_uuid[VIR_UUID_BUFLEN];
     char *vm_name;
@@ -97,6 +275,277 @@ struct _virLockManagerDLMPrivate {
     virLockManagerDLMResourcePtr resources;
 
     bool hasRWDisks;
+
+    int acquireWait;
+    unsigned long long acquireTimeout;
+
+    /* Encoded context forwarded to virtdlmd */
+    virDLMProtocolBuffer object;
+    virDLMProtocolBuffer requests;
+    size_t nrequests;
+};
+
+/*
+ * The DLM keeps the AST routine of a lock from one request to the
+ * next, an unlock only giving a new argument. So every request is
+ * made with virLockManagerDLMAst, the argument telling what to do.
+ */
+struct _virLockManagerDLMAstCall {
+    void (*func)(void *opaque);
+    void *opaque;
+};
+
+/*
+ * AST argument of the requests on a lock which may be cached. The
+ * DLM gives the same argument to the blocking AST, which may come
+ * long after the request, so it lives as long as the lock and only
+ * forwards completions to @pending.
+ */
+struct _virLockManagerDLMLockCache {
+    virLockManagerDLMAstCall ast;
+    virLockManagerDLMAstCallPtr pending;    /* request in progress */
+    virLockManagerDLMLockResourcePtr res;
+    unsigned int lkid;
+};
+
+/*
+ * A thread waiting for an AST or an operation to complete. It is
+ * woken up through @wakeFd, so that it can dispatch ASTs itself
+ * while waiting. The eventfd is also the only completion flag: the
+ * waiter often lives on the stack of the waiting thread, which may
+ * return as soon as it reads it.
+ */
+struct _virLockManagerDLMWaiter {
+    virLockManagerDLMAstCall ast;
+    int wakeFd;
+
+    struct dlm_lksb lksb;
+    unsigned long long issuedAt;            /* of an unlock */
+
+    int result;
+    char *state;
+    virErrorPtr error;
+};
+
+/* A request waiting to be sent to the DLM */
+struct _virLockManagerDLMSchedEntry {
+    void (*resume)(void *opaque);
+    void *opaque;
+    bool urgent;                    /* frees locks */
+    const unsigned char *owner;     /* domain UUID */
+};
+
+struct _virLockManagerDLMSchedQueue {
+    unsigned char owner[VIR_UUID_BUFLEN];
+    size_t nentries;
+    virLockManagerDLMSchedEntryPtr *entries;
+};
+
+/*
+ * Admission control in front of the DLM: at most @maxInflight
+ * requests are pending at once, 0 meaning no limit. Past that,
+ * requests freeing locks are queued in @urgent and served first,
+ * the others are queued per domain and the domains served in turn,
+ * so that one domain with many disks can't starve the others.
+ */
+struct _virLockManagerDLMScheduler {
+    virMutex lock;
+    pid_t pid;
+    unsigned int maxInflight;
+    unsigned int inflight;
+    /* Last completion, or admission while none was in flight */
+    unsigned long long progress;
+
+    size_t nurgent;
+    virLockManagerDLMSchedEntryPtr *urgent;
+
+    size_t nqueues;
+    virLockManagerDLMSchedQueuePtr queues;
+    size_t next;
+};
+
+typedef enum {
+    VIR_LOCK_MANAGER_DLM_OP_ACQUIRE,
+    VIR_LOCK_MANAGER_DLM_OP_RELEASE,
+} virLockManagerDLMOpType;
+
+/* Steps of the acquisition of one resource */
+typedef enum {
+    /* Creating a NL lock, no spare one was left */
+    VIR_LOCK_MANAGER_DLM_PHASE_CREATE,
+    /* Converting the lock to the wanted mode */
+    VIR_LOCK_MANAGER_DLM_PHASE_CONVERT,
+    /* Reading the owner from the value block after a failure */
+    VIR_LOCK_MANAGER_DLM_PHASE_QUERY,
+    /* Writing ourselves as owner into the value block */
+    VIR_LOCK_MANAGER_DLM_PHASE_PUBLISH,
+    /* Converting at once the locks given by the state */
+    VIR_LOCK_MANAGER_DLM_PHASE_BATCH,
+} virLockManagerDLMPhase;
+
+/*
+ * One of the requests issued together when a lock state is given
+ * to an acquire. They either convert the locks of the state without
+ * queuing, what they do not get being acquired the usual way
+ * afterwards, or, for a migration handoff, queue new locks.
+ */
+struct _virLockManagerDLMBatchReq {
+    virLockManagerDLMOpPtr op;
+    virLockManagerDLMAstCall ast;
+
+    size_t resource;                        /* resource of the lock manager */
+    unsigned int lkid;                      /* lock recorded in the state */
+    virLockManagerDLMLockResourcePtr res;   /* NULL if the lock is gone */
+    size_t index;
+    bool issued;                            /* waiting for the DLM */
+    bool publishing;
+    unsigned long long issuedAt;
+
+    struct dlm_lksb lksb;
+    char lvb[DLM_LVB_LEN];
+};
+
+/*
+ * An acquire or release in progress. The resources of the lock
+ * manager are handled one after the other, the completion AST of
+ * each request submitting the next one, so no thread is blocked
+ * while the DLM answers.
+ */
+struct _virLockManagerDLMOp {
+    virObjectLockable parent;
+
+    virLockManagerDLMOpType type;
+    virLockManagerPtr man;
+
+    unsigned int convertFlags;
+    unsigned long long deadline;
+    int timer;
+
+    size_t next;                            /* resource of @man to handle */
+    size_t end;                             /* resource after the last one */
+    size_t count;                           /* resources to handle, @end - @next */
+    bool update;                            /* @next may be held already */
+    bool held;                              /* @index is held by the domain */
+    virLockManagerDLMLockResourcePtr res;   /* resource being handled */
+    size_t index;                           /* lock of @res being converted */
+    virLockManagerDLMPhase phase;
+    int failure;                            /* status of the failed convert */
+    bool issued;                            /* waiting for the DLM */
+    unsigned long long issuedAt;
+    bool canceled;
+    bool done;
+
+    unsigned int mode;                      /* request to issue */
+    unsigned int flags;
+    virLockManagerDLMSchedEntry sched;
+
+    virLockManagerDLMAstCall ast;
+    struct dlm_lksb lksb;
+    char lvb[DLM_LVB_LEN];
+
+    virLockManagerDLMBatchReqPtr batch;     /* from the state given to acquire */
+    size_t nbatch;
+    bool handoff;                           /* the batch queues new locks */
+    size_t npending;                        /* batch requests in progress */
+    bool *granted;                          /* resources acquired by the batch */
+
+    bool rebound;                           /* @index was kept after a release */
+    virLockManagerDLMLockCachePtr cache;    /* of @index, for a blocking AST */
+    unsigned long long graceUntil;          /* of @index, restored on failure */
+
+    bool retain;                            /* keep released locks for @state */
+    char *state;
+
+    bool rollback;                          /* failed acquire, now a release */
+    virErrorPtr error;                      /* of the failed acquire */
+
+    virLockDriverCompletion cb;
+    void *opaque;
+};
+
+/*
+ * Locks queued on the destination of an incoming migration while
+ * the source still holds them, so that they are granted as soon as
+ * the source lets them go at switchover instead of being requested
+ * after the resume. Owned by the driver until the resume, or the
+ * release of a domain which never resumed, takes it over.
+ */
+struct _virLockManagerDLMHandoff {
+    virObject parent;
+
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    virLockManager man;                     /* copy of the destination's */
+    virLockManagerDLMOpPtr op;
+
+    /* Updated with the driver lock held */
+    bool finished;
+    int result;
+
+    /* Woken once finished, unless @cb is set */
+    virLockManagerDLMWaiter waiter;
+
+    /* Asynchronous call waiting for the handoff */
+    virLockManagerDLMOpType cbType;
+    virLockManagerPtr cbMan;
+    virLockDriverCompletion cb;
+    void *cbOpaque;
+};
+
+/*
+ * Release of a lock whose grace period is over. The domain which
+ * released it is gone, so it belongs to no lock manager.
+ */
+struct _virLockManagerDLMExpiry {
+    virLockManagerDLMLockResourcePtr res;   /* kept busy until the AST */
+    unsigned int lkid;
+    unsigned int mode;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+
+    virLockManagerDLMSchedEntry sched;
+    bool issued;
+
+    virLockManagerDLMAstCall ast;
+    struct dlm_lksb lksb;
+    char lvb[DLM_LVB_LEN];
+};
+
+/* An asynchronous call forwarded to virtdlmd from its own thread */
+struct _virLockManagerDLMDaemonJob {
+    virLockManagerPtr man;
+    virDLMProtocolProcedure proc;
+    char *state;
+    unsigned int flags;
+    virDomainLockFailureAction action;
+
+    virLockDriverCompletion cb;
+    void *opaque;
+};
+
+/* A peer whose orphan locks will be purged after @deadline */
+struct _virLockManagerDLMPurge {
+    unsigned int nodeId;
+    unsigned long long deadline;
+};
+
+/*
+ * Cluster membership as last reported by corosync. @nodes are the
+ * nodes of the totem ring, @peers the processes which joined the
+ * CPG group of the lockspace, i.e. the other instances of this
+ * driver. Updated from the event loop, hence the lock.
+ */
+struct _virLockManagerDLMMembership {
+    virMutex lock;
+    bool valid;
+    unsigned long long ringSeq;
+
+    size_t nnodes;
+    unsigned int *nodes;
+
+    size_t npeers;
+    struct cpg_address *peers;
+
+    size_t npurges;
+    virLockManagerDLMPurgePtr purges;
 };
 
 struct _virLockManagerDLMDriver {
@@ -106,16 +555,156 @@ struct _virLockManagerDLMDriver {
     bool purgeLockspace;
     char *lockspaceName;
 
+    int purgePolicy;
+    unsigned int purgeDelay;
+    int purgeTimer;
+    /* dlm_ls_purge blocks during a recovery, it is run by @purgeThread
+     * on the nodes handed over by the timer */
+    virThread purgeThread;
+    bool purgeStarted;                      /* @purgeThread to be joined */
+    bool purgeRunning;
+    size_t npurgeNodes;
+    unsigned int *purgeNodes;
+
+    int acquireWait;
+    unsigned long long acquireTimeout;
+
+    /* Lock modes of shareable and readonly disks, NL for none */
+    unsigned int sharedMode;
+    unsigned int readonlyMode;
+
+    bool ownerInfo;
+
+    /* Disk regions are locked by chunks of that many bytes */
+    unsigned long long regionChunk;
+
+    unsigned long long handoffTimeout;
+
+    /* Locks released with a lock state are kept that long in
+     * milliseconds for the acquire given the state */
+    unsigned long long stateRetention;
+
+    /* Released locks stay granted that long in milliseconds for a
+     * restart of their domain, 0 to convert them at once */
+    unsigned long long releaseGrace;
+    int graceTimer;
+
+    /* Released locks are kept granted until another node asks
+     * for them */
+    bool lockCaching;
+
     dlm_lshandle_t lockspace;
     virHashTablePtr resources;
+    char *recordFile;
     int lockFd;
+
+    /* Every call of the plugin is appended to it when set */
+    char *traceFile;
+    virDLMTracePtr trace;
+
+    /* The statistics are written there every @statsInterval seconds,
+     * with the @statsHot most contended resources */
+    char *statsFile;
+    unsigned int statsInterval;
+    unsigned int statsHot;
+    int statsTimer;
+
+    /* The flight recorder is dumped there on SIGUSR2 if
+     * @recorderSignal, and by the watchdog when no request completed
+     * for @hangTimeout seconds */
+    char *recorderFile;
+    bool recorderSignal;
+    unsigned int hangTimeout;
+    int watchdogPipe[2];
+    bool watchdogRunning;
+    virThread watchdog;
+    bool signalSet;
+    struct sigaction oldSignal;
+    unsigned long long adoptStart;          /* while adopting locks */
+
+    virLockManagerDLMScheduler sched;
+
+    /* The lockspace device, ASTs are read from it */
+    int dlmFd;
+    int dlmWatch;
+    virMutex dispatchLock;
+
+    /* Protects @resources and the record file, which are also
+     * updated from the AST thread, and @handoffs */
+    virMutex lock;
+
+    size_t nhandoffs;
+    virLockManagerDLMHandoffPtr *handoffs;
+
+    bool useDaemon;
+    char *daemonSocket;
+
+    cpg_handle_t cpgHandle;
+    int cpgWatch;
+    unsigned int localNodeId;
+    virLockManagerDLMMembership membership;
 };
 
 static virLockManagerDLMDriverPtr driver;
 
+static virClassPtr virLockManagerDLMOpClass;
+static virClassPtr virLockManagerDLMHandoffClass;
+
+static void virLockManagerDLMWaiterDestroy(virLockManagerDLMWaiterPtr waiter);
+static void virLockManagerDLMGraceTimeout(int timer, void *opaque);
+static void virLockManagerDLMStatsTimeout(int timer, void *opaque);
+static void virLockManagerDLMFree(virLockManagerPtr lock);
+
+static void
+virLockManagerDLMOpDispose(void *obj)
+{
+    virLockManagerDLMOpPtr op = obj;
+
+    VIR_FREE(op->batch);
+    VIR_FREE(op->granted);
+    VIR_FREE(op->state);
+    virFreeError(op->error);
+}
+
+static void
+virLockManagerDLMHandoffDispose(void *obj)
+{
+    virLockManagerDLMHandoffPtr handoff = obj;
+
+    virObjectUnref(handoff->op);
+    virLockManagerDLMFree(&handoff->man);
+    virLockManagerDLMWaiterDestroy(&handoff->waiter);
+}
+
+static int
+virLockManagerDLMOpOnceInit(void)
+{
+    if (!(virLockManagerDLMOpClass = virClassNew(virClassForObjectLockable(),
+                                                 "virLockManagerDLMOp",
+                                                 sizeof(virLockManagerDLMOp),
+                                                 virLockManagerDLMOpDispose)))
+        return -1;
+
+    if (!(virLockManagerDLMHandoffClass = virClassNew(virClassForObject(),
+                                                      "virLockManagerDLMHandoff",
+                                                      sizeof(virLockManagerDLMHandoff),
+                                                      virLockManagerDLMHandoffDispose)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(virLockManagerDLMOp)
+
+static void virLockManagerDLMAst(void *opaque);
+
 static int virLockManagerDLMLoadConfig(const char *configFile)
 {
     virConfPtr conf = NULL;
+    char *purgePolicy = NULL;
+    char *waitPolicy = NULL;
+    char *sharedMode = NULL;
+    char *readonlyMode = NULL;
     int rv = -1;
 
     if (access(configFile, R_OK) == -1) {
@@ -144,32 +733,245 @@ static int virLockManagerDLMLoadConfig(const char *configFile)
     if (virConfGetValueString(conf, "lockspace_name", &driver->lockspaceName) < 0)
         goto cleanup;
 
+    if (virConfGetValueString(conf, "purge_peer_orphans", &purgePolicy) < 0)
+        goto cleanup;
+
+    if (purgePolicy &&
+        (driver->purgePolicy = virLockManagerDLMPurgePolicyTypeFromString(purgePolicy)) < 0) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED,
+                       _("unknown purge_peer_orphans policy '%s'"),
+                       purgePolicy);
+        goto cleanup;
+    }
+
+    if (virConfGetValueUInt(conf, "purge_peer_delay", &driver->purgeDelay) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "acquire_wait", &waitPolicy) < 0)
+        goto cleanup;
+
+    if (waitPolicy &&
+        (driver->acquireWait = virLockManagerDLMWaitPolicyTypeFromString(waitPolicy)) < 0) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED,
+                       _("unknown acquire_wait policy '%s'"),
+                       waitPolicy);
+        goto cleanup;
+    }
+
+    if (virConfGetValueULLong(conf, "acquire_timeout", &driver->acquireTimeout) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "shared_disk_lock_mode", &sharedMode) < 0)
+        goto cleanup;
+
+    if (sharedMode) {
+        switch (virLockManagerDLMSharedModeTypeFromString(sharedMode)) {
+        case VIR_LOCK_MANAGER_DLM_SHARED_PR:
+            driver->sharedMode = LKM_PRMODE;
+            break;
+        case VIR_LOCK_MANAGER_DLM_SHARED_CW:
+            driver->sharedMode = LKM_CWMODE;
+            break;
+        default:
+            virReportError(VIR_ERR_CONFIG_UNSUPPORTED,
+                           _("unknown shared_disk_lock_mode '%s'"),
+                           sharedMode);
+            goto cleanup;
+        }
+    }
+
+    if (virConfGetValueString(conf, "readonly_disk_lock_mode", &readonlyMode) < 0)
+        goto cleanup;
+
+    if (readonlyMode) {
+        switch (virLockManagerDLMReadonlyModeTypeFromString(readonlyMode)) {
+        case VIR_LOCK_MANAGER_DLM_READONLY_NONE:
+            driver->readonlyMode = LKM_NLMODE;
+            break;
+        case VIR_LOCK_MANAGER_DLM_READONLY_CR:
+            driver->readonlyMode = LKM_CRMODE;
+            break;
+        default:
+            virReportError(VIR_ERR_CONFIG_UNSUPPORTED,
+                           _("unknown readonly_disk_lock_mode '%s'"),
+                           readonlyMode);
+            goto cleanup;
+        }
+    }
+
+    if (virConfGetValueBool(conf, "lock_owner_info", &driver->ownerInfo) < 0)
+        goto cleanup;
+
+    if (virConfGetValueULLong(conf, "region_chunk_size",
+                              &driver->regionChunk) < 0)
+        goto cleanup;
+
+    if (driver->regionChunk == 0) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                       _("region_chunk_size must be at least 1 byte"));
+        goto cleanup;
+    }
+
+    if (virConfGetValueULLong(conf, "migration_handoff_timeout",
+                              &driver->handoffTimeout) < 0)
+        goto cleanup;
+
+    if (virConfGetValueULLong(conf, "lock_state_retention",
+                              &driver->stateRetention) < 0)
+        goto cleanup;
+
+    if (virConfGetValueULLong(conf, "release_grace_period",
+                              &driver->releaseGrace) < 0)
+        goto cleanup;
+
+    if (virConfGetValueBool(conf, "lock_caching", &driver->lockCaching) < 0)
+        goto cleanup;
+
+    if (virConfGetValueUInt(conf, "max_inflight_requests",
+                            &driver->sched.maxInflight) < 0)
+        goto cleanup;
+
+    if (virConfGetValueBool(conf, "lock_daemon", &driver->useDaemon) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "lock_daemon_socket", &driver->daemonSocket) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "lock_record_file", &driver->recordFile) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "trace_file", &driver->traceFile) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "stats_file", &driver->statsFile) < 0)
+        goto cleanup;
+
+    if (virConfGetValueUInt(conf, "stats_interval", &driver->statsInterval) < 0)
+        goto cleanup;
+
+    if (driver->statsInterval == 0) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                       _("stats_interval must be at least 1 second"));
+        goto cleanup;
+    }
+
+    if (virConfGetValueUInt(conf, "stats_hot_resources", &driver->statsHot) < 0)
+        goto cleanup;
+
+    if (virConfGetValueString(conf, "flight_recorder_file",
+                              &driver->recorderFile) < 0)
+        goto cleanup;
+
+    if (virConfGetValueBool(conf, "flight_recorder_signal",
+                            &driver->recorderSignal) < 0)
+        goto cleanup;
+
+    if (virConfGetValueUInt(conf, "hang_timeout", &driver->hangTimeout) < 0)
+        goto cleanup;
+
     rv = 0;
 
  cleanup:
+    VIR_FREE(purgePolicy);
+    VIR_FREE(waitPolicy);
+    VIR_FREE(sharedMode);
+    VIR_FREE(readonlyMode);
     virConfFree(conf);
     return rv;
 }
 
+static int
+virLockManagerDLMHash(const char *input,
+                      char **output)
+{
+    unsigned long long start = virDLMStatsNow();
+    int rv;
+
+    rv = virCryptoHashString(VIR_CRYPTO_HASH_SHA256, input, output);
+    virDLMStatsEnd(VIR_DLM_STATS_STEP_HASH, start);
+
+    return rv;
+}
+
+/* Record the completion of a request, issued at @issuedAt if not 0 */
+static void
+virLockManagerDLMRecordComplete(const char *name,
+                                struct dlm_lksb *lksb,
+                                pid_t pid,
+                                unsigned int mode,
+                                unsigned long long issuedAt)
+{
+    unsigned long long now = issuedAt ? virDLMStatsNow() : 0;
+
+    virDLMRecorderAdd(VIR_DLM_RECORDER_COMPLETE, name, lksb->sb_lkid, pid,
+                      mode, lksb->sb_status,
+                      now > issuedAt ? now - issuedAt : 0);
+}
+
+static void virLockManagerDLMRecorderDump(const char *fmt, ...)
+    ATTRIBUTE_FMT_PRINTF(1, 2);
+
+/* Dump the flight recorder, keeping the last error of the caller */
+static void
+virLockManagerDLMRecorderDump(const char *fmt, ...)
+{
+    virErrorPtr err;
+    char *reason = NULL;
+    va_list args;
+
+    if (!driver->recorderFile)
+        return;
+
+    err = virSaveLastError();
+
+    va_start(args, fmt);
+    if (virVasprintf(&reason, fmt, args) >= 0 &&
+        virDLMRecorderDumpFile(driver->recorderFile, reason) < 0)
+        VIR_WARN("unable to dump the flight recorder: %s",
+                 virGetLastErrorMessage());
+    va_end(args);
+
+    if (err)
+        virSetError(err);
+    else
+        virResetLastError();
+    virFreeError(err);
+    VIR_FREE(reason);
+}
+
 static int
 virLockManagerDLMWrite(virLockManagerDLMLockPtr lock, char *name)
 {
+    unsigned long long begin = virDLMStatsNow();
+    unsigned long long start;
     char *string = NULL;
     int rv = -1;
 
-    if (virAsprintf(&string, "%u,%u,%s\n",
-                    lock->lkid, (unsigned int)lock->vm_pid, name) < 0)
+    DLM_PROBE(RECORD_BEGIN, name, lock->mode, lock->lkid, lock->vm_pid);
+
+    if (virAsprintf(&string, "%u,%u,%s,%u\n",
+                    lock->lkid, (unsigned int)lock->vm_pid, name,
+                    lock->mode) < 0)
         goto cleanup;
 
+    start = virDLMStatsNow();
     if (safewrite(driver->lockFd, string, strlen(string)) < 0)
         goto cleanup;
+    virDLMStatsEnd(VIR_DLM_STATS_STEP_WRITE, start);
 
+    start = virDLMStatsNow();
     if (fdatasync(driver->lockFd) < 0)
         goto cleanup;
+    virDLMStatsEnd(VIR_DLM_STATS_STEP_SYNC, start);
 
     rv = 0;
  cleanup:
     VIR_FREE(string);
+    DLM_PROBE(RECORD_END, name, lock->mode, lock->lkid, lock->vm_pid,
+              rv < 0 ? errno : 0);
+    virDLMRecorderAdd(VIR_DLM_RECORDER_RECORD, name, lock->lkid, lock->vm_pid,
+                      lock->mode, rv < 0 ? errno : 0,
+                      virDLMStatsNow() - begin);
 
     return rv;
 }
@@ -177,10 +979,12 @@ virLockManagerDLMWrite(virLockManagerDLMLockPtr lock, char *name)
 static int
 virLockManagerDLMAdoptLocksInternal(void *payload,
                                     const void *name ATTRIBUTE_UNUSED,
-                                    void *data ATTRIBUTE_UNUSED)
+                                    void *data)
 {
     virLockManagerDLMLockResourcePtr res = payload;
-    unsigned int mode = LKM_PRMODE;
+    size_t *failed = data;
+    unsigned int guess = LKM_PRMODE;
+    unsigned int mode;
     struct dlm_lksb lksb;
     ssize_t i;
     int rv;
@@ -188,32 +992,50 @@ virLockManagerDLMAdoptLocksInternal(void *payload,
     for (i = res->nLocks-1; i >= 0; i--) {
         memset(&lksb, 0, sizeof(lksb));
 
+        /* The mode of older records is unknown, an orphan is only
+         * adopted in its own mode so try the usual ones */
+        mode = res->locks[i].mode;
+        if (mode == LKM_NLMODE)
+            mode = guess;
+
+        DLM_PROBE(ADOPT_BEGIN, res->name, mode, res->locks[i].lkid,
+                  res->locks[i].vm_pid);
         rv = dlm_ls_lockx(driver->lockspace, mode,
                           &lksb, LKF_PERSISTENT|LKF_ORPHAN,
                           res->name, strlen(res->name),
-                          0, (void *)1, (void *)1,
-                          (void *)1, NULL, NULL);
-        if ((rv == -1) && (errno == EAGAIN)) {
-            mode = LKM_EXMODE;
+                          0, virLockManagerDLMAst, NULL,
+                          NULL, NULL, NULL);
+        if ((rv == -1) && (errno == EAGAIN) &&
+            res->locks[i].mode == LKM_NLMODE) {
+            mode = guess = LKM_EXMODE;
             rv = dlm_ls_lockx(driver->lockspace, mode,
                               &lksb, LKF_PERSISTENT|LKF_ORPHAN,
                               res->name, strlen(res->name),
-                              0, (void *)1, (void *)1,
-                              (void *)1, NULL, NULL);
+                              0, virLockManagerDLMAst, NULL,
+                              NULL, NULL, NULL);
         }
 
+        DLM_PROBE(ADOPT_END, res->name, mode,
+                  rv < 0 ? res->locks[i].lkid : lksb.sb_lkid,
+                  res->locks[i].vm_pid, rv < 0 ? errno : lksb.sb_status);
+        virDLMRecorderAdd(VIR_DLM_RECORDER_ADOPT, res->name,
+                          rv < 0 ? res->locks[i].lkid : lksb.sb_lkid,
+                          res->locks[i].vm_pid, mode,
+                          rv < 0 ? errno : lksb.sb_status, 0);
+
         if (rv < 0) {
             virReportError(VIR_ERR_INTERNAL_ERROR,
                            _("unable to adopt lock, rv=%d lockName=%s lockStatus=%d"),
                            rv, res->name, lksb.sb_status);
             VIR_DELETE_ELEMENT(res->locks, i, res->nLocks);
+            (*failed)++;
 
             continue;
         }
 
         res->locks[i].lkid = lksb.sb_lkid;
+        res->locks[i].mode = mode;
         res->nHolders += 1;
-        res->mode = mode;
     }
     
     res->nLocks = res->nHolders;
@@ -225,30 +1047,522 @@ virLockManagerDLMAdoptLocksInternal(void *payload,
 }
 
 static void
-virLockManagerDLMResourceDataFree(void *opaque,
-                                  const void *name ATTRIBUTE_UNUSED)
+virLockManagerDLMAst(void *opaque)
 {
-    virLockManagerDLMLockResourcePtr res = opaque;
-    virLockManagerDLMLockPtr lock;
-    struct dlm_lksb lksb;
-    int rv;
-
-    if (!res)
-        return;
-
-    while(res->nLocks != 0) {
-        lock = res->locks + res->nLocks - 1;
-        rv = dlm_ls_unlock_wait(driver->lockspace, lock->lkid, 0, &lksb);
-        if ((rv < 0) || (lksb.sb_status != EUNLOCK)) {
-            VIR_WARN("unable to release lock: rv=%d lockStatus=%d",
-                     rv, lksb.sb_status);
-        }
-
-        VIR_DELETE_ELEMENT(res->locks, res->nLocks-1, res->nLocks);
-    }
+    virLockManagerDLMAstCallPtr call = opaque;
 
-    VIR_FREE(res->name);
-    VIR_FREE(res);
+    /* Adopted locks do not expect any AST */
+    if (call)
+        call->func(call->opaque);
+}
+
+/*
+ * The scheduler belongs to the process, a child forked while
+ * requests were in flight would otherwise wait for their ASTs.
+ * Must be called with the scheduler lock held.
+ */
+static void
+virLockManagerDLMSchedCheckFork(virLockManagerDLMSchedulerPtr sched)
+{
+    size_t i;
+
+    if (sched->pid == getpid())
+        return;
+
+    sched->pid = getpid();
+    sched->inflight = 0;
+    VIR_FREE(sched->urgent);
+    sched->nurgent = 0;
+    for (i = 0; i < sched->nqueues; i++)
+        VIR_FREE(sched->queues[i].entries);
+    VIR_FREE(sched->queues);
+    sched->nqueues = 0;
+    sched->next = 0;
+}
+
+/*
+ * Take a slot for @entry. Returns true if it was granted, the
+ * caller then issues its request at once. Otherwise @entry is
+ * queued and its resume callback will be invoked once a slot is
+ * free, from whatever thread completed a request.
+ */
+static bool
+virLockManagerDLMSchedAdmit(virLockManagerDLMSchedEntryPtr entry)
+{
+    virLockManagerDLMSchedulerPtr sched = &driver->sched;
+    virLockManagerDLMSchedQueuePtr queue = NULL;
+    virLockManagerDLMSchedQueue newQueue;
+    bool admitted = false;
+    size_t i;
+
+    virMutexLock(&sched->lock);
+    virLockManagerDLMSchedCheckFork(sched);
+
+    /* Never overtake what is queued */
+    if ((sched->maxInflight == 0 ||
+         sched->inflight < sched->maxInflight) &&
+        sched->nurgent == 0 &&
+        (entry->urgent || sched->nqueues == 0)) {
+        if (sched->inflight++ == 0)
+            sched->progress = virDLMStatsNow();
+        admitted = true;
+        goto cleanup;
+    }
+
+    if (entry->urgent) {
+        if (VIR_APPEND_ELEMENT_COPY(sched->urgent, sched->nurgent, entry) < 0)
+            goto overflow;
+        goto cleanup;
+    }
+
+    for (i = 0; i < sched->nqueues; i++) {
+        if (memcmp(sched->queues[i].owner, entry->owner, VIR_UUID_BUFLEN) == 0) {
+            queue = sched->queues + i;
+            break;
+        }
+    }
+
+    if (!queue) {
+        memset(&newQueue, 0, sizeof(newQueue));
+        memcpy(newQueue.owner, entry->owner, VIR_UUID_BUFLEN);
+        if (VIR_APPEND_ELEMENT(sched->queues, sched->nqueues, newQueue) < 0)
+            goto overflow;
+        queue = sched->queues + sched->nqueues - 1;
+    }
+
+    if (VIR_APPEND_ELEMENT_COPY(queue->entries, queue->nentries, entry) < 0)
+        goto overflow;
+
+ cleanup:
+    virMutexUnlock(&sched->lock);
+    return admitted;
+
+ overflow:
+    /* Better exceed the limit than lose the request */
+    virResetLastError();
+    if (sched->inflight++ == 0)
+        sched->progress = virDLMStatsNow();
+    admitted = true;
+    goto cleanup;
+}
+
+/*
+ * Must be called with the scheduler lock held. Releases come first,
+ * then the domains take turns.
+ */
+static virLockManagerDLMSchedEntryPtr
+virLockManagerDLMSchedPop(virLockManagerDLMSchedulerPtr sched)
+{
+    virLockManagerDLMSchedEntryPtr entry;
+    virLockManagerDLMSchedQueuePtr queue;
+
+    if (sched->nurgent) {
+        entry = sched->urgent[0];
+        VIR_DELETE_ELEMENT(sched->urgent, 0, sched->nurgent);
+        return entry;
+    }
+
+    if (!sched->nqueues)
+        return NULL;
+
+    if (sched->next >= sched->nqueues)
+        sched->next = 0;
+
+    queue = sched->queues + sched->next;
+    entry = queue->entries[0];
+    VIR_DELETE_ELEMENT(queue->entries, 0, queue->nentries);
+
+    if (queue->nentries == 0)
+        VIR_DELETE_ELEMENT(sched->queues, sched->next, sched->nqueues);
+    else
+        sched->next++;
+
+    return entry;
+}
+
+/*
+ * Give back the slot of a completed request and admit the waiting
+ * ones. Must not be called with any other lock held, the resume
+ * callbacks take theirs.
+ */
+static void
+virLockManagerDLMSchedDone(void)
+{
+    virLockManagerDLMSchedulerPtr sched = &driver->sched;
+    virLockManagerDLMSchedEntryPtr entry;
+
+    virMutexLock(&sched->lock);
+    virLockManagerDLMSchedCheckFork(sched);
+
+    if (sched->inflight > 0)
+        sched->inflight--;
+    sched->progress = virDLMStatsNow();
+
+    while ((sched->maxInflight == 0 ||
+            sched->inflight < sched->maxInflight) &&
+           (entry = virLockManagerDLMSchedPop(sched))) {
+        sched->inflight++;
+        virMutexUnlock(&sched->lock);
+
+        entry->resume(entry->opaque);
+
+        virMutexLock(&sched->lock);
+    }
+
+    virMutexUnlock(&sched->lock);
+}
+
+/*
+ * Take @entry out of the queue. Returns true if it was still
+ * queued, false if it was already admitted.
+ */
+static bool
+virLockManagerDLMSchedRemove(virLockManagerDLMSchedEntryPtr entry)
+{
+    virLockManagerDLMSchedulerPtr sched = &driver->sched;
+    virLockManagerDLMSchedQueuePtr queue;
+    bool found = false;
+    size_t i, j;
+
+    virMutexLock(&sched->lock);
+
+    for (i = 0; i < sched->nurgent; i++) {
+        if (sched->urgent[i] == entry) {
+            VIR_DELETE_ELEMENT(sched->urgent, i, sched->nurgent);
+            found = true;
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < sched->nqueues; i++) {
+        queue = sched->queues + i;
+        for (j = 0; j < queue->nentries; j++) {
+            if (queue->entries[j] != entry)
+                continue;
+
+            VIR_DELETE_ELEMENT(queue->entries, j, queue->nentries);
+            if (queue->nentries == 0) {
+                VIR_DELETE_ELEMENT(sched->queues, i, sched->nqueues);
+                if (sched->next > i)
+                    sched->next--;
+            }
+            found = true;
+            goto cleanup;
+        }
+    }
+
+ cleanup:
+    virMutexUnlock(&sched->lock);
+    return found;
+}
+
+/*
+ * Deliver the ASTs of the completed requests. This is done from the
+ * event loop, and by the threads waiting for a request: they can't
+ * count on the event loop, there is none in the child forked for a
+ * domain. The device is non blocking, so whoever comes second just
+ * finds nothing to read.
+ */
+static void
+virLockManagerDLMDispatchAsts(void)
+{
+    virMutexLock(&driver->dispatchLock);
+    while (dlm_dispatch(driver->dlmFd) == 0)
+        ;
+    virMutexUnlock(&driver->dispatchLock);
+}
+
+static void
+virLockManagerDLMLockspaceDispatch(int watch,
+                                   int fd ATTRIBUTE_UNUSED,
+                                   int events,
+                                   void *opaque ATTRIBUTE_UNUSED)
+{
+    if (events & (VIR_EVENT_HANDLE_ERROR | VIR_EVENT_HANDLE_HANGUP)) {
+        VIR_WARN("lost the DLM lockspace device, ASTs are now only "
+                 "delivered to waiting threads");
+        virEventRemoveHandle(watch);
+        driver->dlmWatch = -1;
+        return;
+    }
+
+    virLockManagerDLMDispatchAsts();
+}
+
+static int
+virLockManagerDLMWaiterInit(virLockManagerDLMWaiterPtr waiter)
+{
+    memset(waiter, 0, sizeof(*waiter));
+
+    if ((waiter->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create eventfd"));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+virLockManagerDLMWaiterDestroy(virLockManagerDLMWaiterPtr waiter)
+{
+    VIR_FORCE_CLOSE(waiter->wakeFd);
+    VIR_FREE(waiter->state);
+    virFreeError(waiter->error);
+}
+
+static void
+virLockManagerDLMWaiterWake(void *opaque)
+{
+    virLockManagerDLMWaiterPtr waiter = opaque;
+    uint64_t one = 1;
+
+    /* @waiter may be gone once this is written */
+    ignore_value(safewrite(waiter->wakeFd, &one, sizeof(one)));
+}
+
+/*
+ * Wait until @waiter is woken up, or @deadline in milliseconds since
+ * the epoch passes, 0 meaning no deadline. ASTs arriving meanwhile
+ * are dispatched from here.
+ *
+ * Returns 0 once woken up, 1 if the deadline passed first.
+ */
+static int
+virLockManagerDLMWaiterWait(virLockManagerDLMWaiterPtr waiter,
+                            unsigned long long deadline)
+{
+    struct pollfd fds[2];
+    unsigned long long now;
+    uint64_t value;
+    int timeout;
+
+    for (;;) {
+        timeout = -1;
+        if (deadline) {
+            if (virTimeMillisNow(&now) < 0)
+                now = deadline;
+            if (now >= deadline)
+                return 1;
+            timeout = MIN(deadline - now, INT_MAX);
+        }
+
+        fds[0].fd = waiter->wakeFd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = driver->dlmFd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        if (poll(fds, ARRAY_CARDINALITY(fds), timeout) < 0) {
+            if (errno != EINTR)
+                VIR_WARN("unable to poll the DLM lockspace: errno=%d", errno);
+            continue;
+        }
+
+        if ((fds[0].revents & POLLIN) &&
+            saferead(waiter->wakeFd, &value, sizeof(value)) == sizeof(value))
+            return 0;
+
+        if (fds[1].revents & POLLIN)
+            virLockManagerDLMDispatchAsts();
+    }
+}
+
+static void
+virLockManagerDLMUnlockAst(void *opaque)
+{
+    virLockManagerDLMWaiterPtr waiter = opaque;
+
+    virDLMStatsEnd(VIR_DLM_STATS_STEP_UNLOCK, waiter->issuedAt);
+    virDLMStatsResultAdd(waiter->lksb.sb_status);
+    virLockManagerDLMRecordComplete(NULL, &waiter->lksb, 0, LKM_NLMODE,
+                                    waiter->issuedAt);
+    virLockManagerDLMSchedDone();
+    virLockManagerDLMWaiterWake(opaque);
+}
+
+static void
+virLockManagerDLMUnlockResume(void *opaque)
+{
+    virLockManagerDLMWaiterPtr waiter = opaque;
+
+    waiter->issuedAt = virDLMStatsNow();
+    virDLMRecorderAdd(VIR_DLM_RECORDER_UNLOCK, NULL, waiter->lksb.sb_lkid,
+                      0, LKM_NLMODE, 0, 0);
+    if (dlm_ls_unlock(driver->lockspace, waiter->lksb.sb_lkid, 0,
+                      &waiter->lksb, &waiter->ast) < 0) {
+        waiter->lksb.sb_status = errno;
+        virLockManagerDLMRecordComplete(NULL, &waiter->lksb, 0, LKM_NLMODE,
+                                        0);
+        virLockManagerDLMSchedDone();
+        virLockManagerDLMWaiterWake(waiter);
+    }
+}
+
+/*
+ * Unlock @lkid and wait for it. dlm_ls_unlock_wait can't be used,
+ * it needs the lock to have been requested by dlm_ls_lock_wait.
+ */
+static int
+virLockManagerDLMUnlockWait(unsigned int lkid)
+{
+    virLockManagerDLMWaiter waiter;
+    virLockManagerDLMSchedEntry entry;
+    int rv = -1;
+
+    if (virLockManagerDLMWaiterInit(&waiter) < 0)
+        return -1;
+
+    waiter.ast.func = virLockManagerDLMUnlockAst;
+    waiter.ast.opaque = &waiter;
+    waiter.lksb.sb_lkid = lkid;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.resume = virLockManagerDLMUnlockResume;
+    entry.opaque = &waiter;
+    entry.urgent = true;
+
+    if (virLockManagerDLMSchedAdmit(&entry))
+        virLockManagerDLMUnlockResume(&waiter);
+
+    ignore_value(virLockManagerDLMWaiterWait(&waiter, 0));
+
+    if (waiter.lksb.sb_status != EUNLOCK) {
+        errno = waiter.lksb.sb_status;
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    virLockManagerDLMWaiterDestroy(&waiter);
+    return rv;
+}
+
+static int
+virLockManagerDLMResourceNameCompare(const void *a, const void *b)
+{
+    const virLockManagerDLMResource *ra = a;
+    const virLockManagerDLMResource *rb = b;
+
+    return strcmp(ra->name, rb->name);
+}
+
+static void
+virLockManagerDLMResourceDataFree(void *opaque,
+                                  const void *name ATTRIBUTE_UNUSED)
+{
+    virLockManagerDLMLockResourcePtr res = opaque;
+    virLockManagerDLMLockPtr lock;
+
+    if (!res)
+        return;
+
+    /* Once the lockspace is closed, the locks are left as orphans
+     * to be adopted again */
+    while(res->nLocks != 0) {
+        lock = res->locks + res->nLocks - 1;
+        if (driver->lockspace &&
+            virLockManagerDLMUnlockWait(lock->lkid) < 0)
+            VIR_WARN("unable to release lock %s lkid=%u: errno=%d",
+                     res->name, lock->lkid, errno);
+
+        VIR_FREE(lock->cache);
+        VIR_DELETE_ELEMENT(res->locks, res->nLocks-1, res->nLocks);
+    }
+
+    VIR_FREE(res->name);
+    VIR_FREE(res);
+}
+
+typedef struct {
+    virLockManagerDLMLockResourcePtr res;
+    unsigned int lkid;
+} virLockManagerDLMGraceLock;
+
+typedef struct {
+    size_t nlocks;
+    virLockManagerDLMGraceLock *locks;
+} virLockManagerDLMGraceList;
+
+/* Must be called with the driver lock held */
+static int
+virLockManagerDLMGraceListLocks(void *payload,
+                                const void *name ATTRIBUTE_UNUSED,
+                                void *opaque)
+{
+    virLockManagerDLMLockResourcePtr res = payload;
+    virLockManagerDLMGraceList *list = opaque;
+    virLockManagerDLMGraceLock entry;
+    size_t i;
+
+    for (i = 0; i < res->nLocks; i++) {
+        if (!res->locks[i].graceUntil || res->locks[i].expiring)
+            continue;
+
+        entry.res = res;
+        entry.lkid = res->locks[i].lkid;
+        if (VIR_APPEND_ELEMENT(list->locks, list->nlocks, entry) < 0) {
+            virResetLastError();
+            continue;
+        }
+
+        res->locks[i].expiring = true;
+        res->nBusy += 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Unlock at once the locks kept for a grace period, or cached. Once
+ * the lockspace is closed nobody would end the period, nor hear the
+ * blocking AST of another node asking for a cached lock, and they
+ * would be left as orphans granted to no domain.
+ */
+static void
+virLockManagerDLMGraceRelease(void)
+{
+    virLockManagerDLMGraceList list;
+    virLockManagerDLMLockResourcePtr res;
+    size_t i, j;
+    int rv;
+
+    memset(&list, 0, sizeof(list));
+
+    virMutexLock(&driver->lock);
+    virHashForEach(driver->resources, virLockManagerDLMGraceListLocks, &list);
+    virMutexUnlock(&driver->lock);
+
+    for (i = 0; i < list.nlocks; i++) {
+        res = list.locks[i].res;
+
+        if ((rv = virLockManagerDLMUnlockWait(list.locks[i].lkid)) < 0)
+            VIR_WARN("unable to release lock %s lkid=%u: errno=%d",
+                     res->name, list.locks[i].lkid, errno);
+
+        virMutexLock(&driver->lock);
+        res->nBusy -= 1;
+        for (j = 0; j < res->nLocks; j++) {
+            if (res->locks[j].lkid == list.locks[i].lkid)
+                break;
+        }
+
+        if (j < res->nLocks) {
+            res->locks[j].expiring = false;
+            if (rv == 0) {
+                res->locks[j].mode = LKM_NLMODE;
+                res->nHolders -= 1;
+                if (virLockManagerDLMWrite(res->locks + j, res->name) < 0)
+                    VIR_WARN("unable to write lock information to file");
+                VIR_FREE(res->locks[j].cache);
+                VIR_DELETE_ELEMENT(res->locks, j, res->nLocks);
+            }
+        }
+        virMutexUnlock(&driver->lock);
+    }
+
+    VIR_FREE(list.locks);
 }
 
 static int
@@ -260,7 +1574,9 @@ virLockManagerDLMAdoptLocks(const char *path)
     virLockManagerDLMLockResourcePtr res = 0;
     unsigned int vm_pid = 0;
     unsigned int lkid = 0;
+    unsigned int mode = LKM_NLMODE;
     size_t n = 0, tokcount = 0, i;
+    size_t failed = 0;
     ssize_t count = 0;
     int rv = -1;
 
@@ -282,8 +1598,15 @@ virLockManagerDLMAdoptLocks(const char *path)
 
         line[count-1] = '\0';
 
+        /* Records written before the mode was added have 3 fields */
         if (!(tmpArray = virStringSplitCount(line, ",", 0, &tokcount)) ||
-            (tokcount != 3))
+            (tokcount != 3 && tokcount != 4))
+            goto cleanup;
+
+        mode = LKM_NLMODE;
+        if (tokcount == 4 &&
+            (virStrToLong_ui(tmpArray[3], NULL, 10, &mode) < 0 ||
+             mode > LKM_EXMODE))
             goto cleanup;
 
         if (virStrToLong_ui(tmpArray[0], NULL, 10, &lkid) < 0)
@@ -305,590 +1628,4584 @@ virLockManagerDLMAdoptLocks(const char *path)
             }
         }
 
-        if (vm_pid == 0) {
-            for (i = 0; i < res->nLocks; i++) {
-                if (lkid == res->locks[i].lkid) {
-                    VIR_DELETE_ELEMENT(res->locks, i, res->nLocks);
-                    break;
-                }
-            }
+        /* The last record of a lock wins */
+        for (i = 0; i < res->nLocks; i++) {
+            if (lkid == res->locks[i].lkid)
+                break;
+        }
+
+        /* A released lock is forgotten, one recorded without a
+         * domain but in a mode was kept granted for a grace period,
+         * or cached, which is over for the restarted driver: its
+         * blocking AST is gone with the former one */
+        if (vm_pid == 0 && mode == LKM_NLMODE) {
+            if (i < res->nLocks)
+                VIR_DELETE_ELEMENT(res->locks, i, res->nLocks);
+            virStringListFree(tmpArray);
             continue;
         }
 
-        if (VIR_EXPAND_N(res->locks, res->nLocks, 1) < 0)
-            goto cleanup;
+        if (i == res->nLocks &&
+            VIR_EXPAND_N(res->locks, res->nLocks, 1) < 0)
+            goto cleanup;
+
+        res->locks[i].vm_pid = vm_pid;
+        res->locks[i].lkid = lkid;
+        res->locks[i].mode = mode;
+        res->locks[i].graceUntil = vm_pid == 0 ? 1 : 0;
+
+        virStringListFree(tmpArray);
+    }
+
+    if (virHashForEach(driver->resources,
+                       virLockManagerDLMAdoptLocksInternal,
+                       &failed) < 0)
+        goto cleanup;
+
+    if (failed)
+        virLockManagerDLMRecorderDump("unable to adopt %zu recorded locks",
+                                      failed);
+
+    rv = 0;
+
+ cleanup:
+    VIR_FORCE_FCLOSE(fp);
+    return rv;
+}
+
+/* Must be called with the membership lock held */
+static bool
+virLockManagerDLMHasPeer(unsigned int nodeId)
+{
+    virLockManagerDLMMembershipPtr view = &driver->membership;
+    size_t i;
+
+    for (i = 0; i < view->npeers; i++) {
+        if (view->peers[i].nodeid == nodeId)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Must be called with the membership lock held.
+ *
+ * The orphans of a node which left the cluster are left alone: the
+ * DLM recovery drops them once the node is fenced, and until then
+ * its VMs may still be writing. The orphans of a driver which went
+ * away on a live node are only purged when the policy allows it, as
+ * its VMs may still be alive, and not before purge_peer_delay
+ * seconds, so a restarted driver gets a chance to adopt them again.
+ */
+static void
+virLockManagerDLMSchedulePurge(const struct cpg_address *peer)
+{
+    virLockManagerDLMMembershipPtr view = &driver->membership;
+    virLockManagerDLMPurge purge;
+    size_t i;
+
+    if (peer->nodeid == driver->localNodeId ||
+        driver->purgeTimer < 0)
+        return;
+
+    switch (peer->reason) {
+    case CPG_REASON_LEAVE:
+    case CPG_REASON_PROCDOWN:
+        if (driver->purgePolicy < VIR_LOCK_MANAGER_DLM_PURGE_DEPARTED)
+            return;
+        break;
+    default:
+        return;
+    }
+
+    for (i = 0; i < view->npurges; i++) {
+        if (view->purges[i].nodeId == peer->nodeid)
+            return;
+    }
+
+    if (virTimeMillisNow(&purge.deadline) < 0)
+        return;
+    purge.deadline += driver->purgeDelay * 1000ull;
+    purge.nodeId = peer->nodeid;
+
+    if (VIR_APPEND_ELEMENT(view->purges, view->npurges, purge) < 0)
+        return;
+
+    VIR_INFO("orphan locks of node=%u will be purged in %u seconds",
+             purge.nodeId, driver->purgeDelay);
+
+    virEventUpdateTimeout(driver->purgeTimer, 1000);
+}
+
+static void
+virLockManagerDLMPurgeWorker(void *opaque ATTRIBUTE_UNUSED)
+{
+    size_t i;
+
+    for (i = 0; i < driver->npurgeNodes; i++) {
+        if (dlm_ls_purge(driver->lockspace, driver->purgeNodes[i], 0) != 0)
+            VIR_WARN("node=%u purge DLM locks failed in lockspace=%s",
+                     driver->purgeNodes[i], driver->lockspaceName);
+        else
+            VIR_INFO("node=%u purge DLM locks success in lockspace=%s",
+                     driver->purgeNodes[i], driver->lockspaceName);
+    }
+
+    __atomic_store_n(&driver->purgeRunning, false, __ATOMIC_RELEASE);
+}
+
+static void
+virLockManagerDLMPurgeJoin(void)
+{
+    if (!driver->purgeStarted)
+        return;
+
+    virThreadJoin(&driver->purgeThread);
+    driver->purgeStarted = false;
+    VIR_FREE(driver->purgeNodes);
+    driver->npurgeNodes = 0;
+}
+
+static void
+virLockManagerDLMPurgeTimeout(int timer,
+                              void *opaque ATTRIBUTE_UNUSED)
+{
+    virLockManagerDLMMembershipPtr view = &driver->membership;
+    unsigned int *nodes = NULL;
+    size_t nnodes = 0;
+    unsigned long long now;
+    size_t i;
+
+    /* Still purging, the due nodes wait for the next tick */
+    if (__atomic_load_n(&driver->purgeRunning, __ATOMIC_ACQUIRE))
+        return;
+    virLockManagerDLMPurgeJoin();
+
+    if (virTimeMillisNow(&now) < 0)
+        return;
+
+    virMutexLock(&view->lock);
+    for (i = 0; i < view->npurges; ) {
+        virLockManagerDLMPurgePtr purge = view->purges + i;
+
+        if (virLockManagerDLMHasPeer(purge->nodeId)) {
+            VIR_INFO("node=%u is back, its orphan locks are kept",
+                     purge->nodeId);
+        } else if (purge->deadline <= now) {
+            if (VIR_APPEND_ELEMENT(nodes, nnodes, purge->nodeId) < 0)
+                break;
+        } else {
+            i++;
+            continue;
+        }
+
+        VIR_DELETE_ELEMENT(view->purges, i, view->npurges);
+    }
+
+    if (view->npurges == 0)
+        virEventUpdateTimeout(timer, -1);
+    virMutexUnlock(&view->lock);
+
+    if (nnodes == 0)
+        return;
+
+    driver->purgeNodes = nodes;
+    driver->npurgeNodes = nnodes;
+    driver->purgeRunning = true;
+    if (virThreadCreate(&driver->purgeThread, true,
+                        virLockManagerDLMPurgeWorker, NULL) < 0) {
+        VIR_WARN("unable to create the purge thread, orphan locks "
+                 "of %zu nodes are kept", nnodes);
+        driver->purgeRunning = false;
+        VIR_FREE(driver->purgeNodes);
+        driver->npurgeNodes = 0;
+        return;
+    }
+    driver->purgeStarted = true;
+}
+
+static void
+virLockManagerDLMCpgConfchg(cpg_handle_t handle ATTRIBUTE_UNUSED,
+                            const struct cpg_name *groupName ATTRIBUTE_UNUSED,
+                            const struct cpg_address *memberList,
+                            size_t memberListEntries,
+                            const struct cpg_address *leftList,
+                            size_t leftListEntries,
+                            const struct cpg_address *joinedList,
+                            size_t joinedListEntries)
+{
+    virLockManagerDLMMembershipPtr view = &driver->membership;
+    struct cpg_address *peers = NULL;
+    size_t i;
+
+    for (i = 0; i < joinedListEntries; i++)
+        VIR_DEBUG("peer nodeId=%u pid=%u joined",
+                  joinedList[i].nodeid, joinedList[i].pid);
+
+    if (VIR_ALLOC_N(peers, memberListEntries) < 0)
+        return;
+    memcpy(peers, memberList, memberListEntries * sizeof(*peers));
+
+    virMutexLock(&view->lock);
+    VIR_FREE(view->peers);
+    view->peers = peers;
+    view->npeers = memberListEntries;
+
+    for (i = 0; i < leftListEntries; i++) {
+        VIR_DEBUG("peer nodeId=%u pid=%u left, reason=%u",
+                  leftList[i].nodeid, leftList[i].pid, leftList[i].reason);
+        virLockManagerDLMSchedulePurge(leftList + i);
+    }
+    virMutexUnlock(&view->lock);
+}
+
+static void
+virLockManagerDLMCpgTotemConfchg(cpg_handle_t handle ATTRIBUTE_UNUSED,
+                                 struct cpg_ring_id ringId,
+                                 uint32_t memberListEntries,
+                                 const uint32_t *memberList)
+{
+    virLockManagerDLMMembershipPtr view = &driver->membership;
+    unsigned int *nodes = NULL;
+    size_t i;
+
+    VIR_DEBUG("ring seq=%llu, %u nodes",
+              (unsigned long long)ringId.seq, memberListEntries);
+
+    if (VIR_ALLOC_N(nodes, memberListEntries) < 0)
+        return;
+    for (i = 0; i < memberListEntries; i++)
+        nodes[i] = memberList[i];
+
+    virMutexLock(&view->lock);
+    VIR_FREE(view->nodes);
+    view->nodes = nodes;
+    view->nnodes = memberListEntries;
+    view->ringSeq = ringId.seq;
+    view->valid = true;
+    virMutexUnlock(&view->lock);
+}
+
+static void
+virLockManagerDLMCpgDispatch(int watch,
+                             int fd ATTRIBUTE_UNUSED,
+                             int events,
+                             void *opaque ATTRIBUTE_UNUSED)
+{
+    if (!(events & (VIR_EVENT_HANDLE_ERROR | VIR_EVENT_HANDLE_HANGUP)) &&
+        cpg_dispatch(driver->cpgHandle, CS_DISPATCH_ALL) == CS_OK)
+        return;
+
+    VIR_WARN("lost the connection to the CPG service, "
+             "the membership is no longer updated");
+
+    virEventRemoveHandle(watch);
+    driver->cpgWatch = -1;
+
+    virMutexLock(&driver->membership.lock);
+    driver->membership.valid = false;
+    virMutexUnlock(&driver->membership.lock);
+}
+
+/*
+ * Keep one CPG connection for the whole life of the driver: the
+ * local node ID is cached, and the configuration changes delivered
+ * through its fd keep the membership view up to date.
+ */
+static int
+virLockManagerDLMCpgOpen(void)
+{
+    cpg_model_v1_data_t model;
+    struct cpg_name group;
+    cs_error_t err;
+    size_t retries = 0;
+    int fd = -1;
+
+    memset(&model, 0, sizeof(model));
+    model.model = CPG_MODEL_V1;
+    model.cpg_confchg_fn = virLockManagerDLMCpgConfchg;
+    model.cpg_totem_confchg_fn = virLockManagerDLMCpgTotemConfchg;
+    model.flags = CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF;
+
+    if ((err = cpg_model_initialize(&driver->cpgHandle, CPG_MODEL_V1,
+                                    (cpg_model_data_t *)&model,
+                                    NULL)) != CS_OK) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unable to create a new connection to the CPG service, error=%d"),
+                       err);
+        driver->cpgHandle = 0;
+        return -1;
+    }
+
+    if ((err = cpg_local_get(driver->cpgHandle,
+                             &driver->localNodeId)) != CS_OK) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unable to get the local node id by the CPG service, error=%d"),
+                       err);
+        return -1;
+    }
+
+    VIR_DEBUG("the local nodeId=%u", driver->localNodeId);
+
+    memset(&group, 0, sizeof(group));
+    group.length = snprintf(group.value, sizeof(group.value), "%s%s",
+                            DLM_CPG_GROUP_PREFIX, driver->lockspaceName);
+
+    while ((err = cpg_join(driver->cpgHandle, &group)) == CS_ERR_TRY_AGAIN &&
+           retries++ < 10)
+        usleep(100 * 1000);
+
+    if (err != CS_OK) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unable to join the CPG group %s, error=%d"),
+                       group.value, err);
+        return -1;
+    }
+
+    if (cpg_fd_get(driver->cpgHandle, &fd) != CS_OK) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to get the CPG file descriptor"));
+        return -1;
+    }
+
+    if ((driver->cpgWatch = virEventAddHandle(fd, VIR_EVENT_HANDLE_READABLE,
+                                              virLockManagerDLMCpgDispatch,
+                                              NULL, NULL)) < 0) {
+        VIR_WARN("no event loop to dispatch CPG events, "
+                 "the membership will not be tracked");
+        return 0;
+    }
+
+    if (driver->purgePolicy != VIR_LOCK_MANAGER_DLM_PURGE_NONE &&
+        (driver->purgeTimer = virEventAddTimeout(-1,
+                                                 virLockManagerDLMPurgeTimeout,
+                                                 NULL, NULL)) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to register the purge timer"));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+virLockManagerDLMCpgClose(void)
+{
+    if (driver->purgeTimer >= 0) {
+        virEventRemoveTimeout(driver->purgeTimer);
+        driver->purgeTimer = -1;
+    }
+    virLockManagerDLMPurgeJoin();
+
+    if (driver->cpgWatch >= 0) {
+        virEventRemoveHandle(driver->cpgWatch);
+        driver->cpgWatch = -1;
+    }
+
+    if (driver->cpgHandle) {
+        ignore_value(cpg_finalize(driver->cpgHandle));
+        driver->cpgHandle = 0;
+    }
+
+    VIR_FREE(driver->membership.nodes);
+    VIR_FREE(driver->membership.peers);
+    VIR_FREE(driver->membership.purges);
+    driver->membership.nnodes = 0;
+    driver->membership.npeers = 0;
+    driver->membership.npurges = 0;
+    driver->membership.valid = false;
+}
+
+static int
+virLockManagerDLMWriteLocksInternal(void *payload,
+                                    const void *name ATTRIBUTE_UNUSED,
+                                    void *data ATTRIBUTE_UNUSED)
+{
+    virLockManagerDLMLockResourcePtr res = payload;
+    size_t i;
+
+    for (i = 0; i < res->nLocks; i++) {
+        if (virLockManagerDLMWrite(res->locks+i, res->name) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+virLockManagerDLMSetupLockRecordFile(const bool newLockspace,
+                                     const bool purgeLockspace)
+{
+    unsigned int nodeId = driver->localNodeId;
+    const char *path = driver->recordFile;
+    unsigned long long start = virDLMStatsNow();
+    int rv = -1;
+
+    __atomic_store_n(&driver->adoptStart, start, __ATOMIC_RELAXED);
+    if (!newLockspace &&
+        virLockManagerDLMAdoptLocks(path) < 0) {
+        __atomic_store_n(&driver->adoptStart, 0, __ATOMIC_RELAXED);
+        virLockManagerDLMRecorderDump("unable to adopt the recorded locks");
+        goto cleanup;
+    }
+    __atomic_store_n(&driver->adoptStart, 0, __ATOMIC_RELAXED);
+    virDLMStatsEnd(VIR_DLM_STATS_STEP_ADOPT, start);
+
+    if (purgeLockspace && nodeId != 0) {
+        if (dlm_ls_purge(driver->lockspace, nodeId, 0) != 0) {
+            VIR_WARN("node=%u purge DLM locks failed in lockspace=%s",
+                     nodeId, driver->lockspaceName);
+        }
+        else
+            VIR_DEBUG("node=%u purge DLM locks sucess in lockspace=%s",
+                      nodeId, driver->lockspaceName);
+    }
+
+    driver->lockFd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (driver->lockFd < 0) {
+        virReportSystemError(errno,
+                             _("unable to open '%s'"),
+                             path);
+        goto cleanup;
+    }
+
+    if (virHashForEach(driver->resources,
+                       virLockManagerDLMWriteLocksInternal,
+                       NULL) < 0)
+    goto cleanup;
+
+    /* Adopted grace periods end now that they are recorded */
+    virLockManagerDLMGraceRelease();
+
+    rv = 0;
+ cleanup:
+    return rv;
+}
+
+static void
+virLockManagerDLMRecorderSignal(int sig ATTRIBUTE_UNUSED)
+{
+    int saved = errno;
+    char c = 'd';
+
+    ignore_value(safewrite(driver->watchdogPipe[1], &c, 1));
+    errno = saved;
+}
+
+/*
+ * Dump the flight recorder when asked to by SIGUSR2, and when the
+ * DLM looks stuck: requests in flight without any completion, or
+ * an adoption, for @hangTimeout seconds. Each stall is reported
+ * once. A thread of its own keeps it going if the event loop is
+ * the one stuck.
+ */
+static void
+virLockManagerDLMWatchdog(void *opaque ATTRIBUTE_UNUSED)
+{
+    struct pollfd pfd = { .fd = driver->watchdogPipe[0], .events = POLLIN };
+    unsigned long long timeout = driver->hangTimeout * 1000000000ULL;
+    unsigned long long reported = 0;
+    unsigned long long now;
+    unsigned long long progress;
+    unsigned long long adoptStart;
+    unsigned int inflight;
+    bool dump;
+    char c;
+
+    for (;;) {
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) {
+            VIR_WARN("DLM watchdog stopped: errno=%d", errno);
+            return;
+        }
+
+        dump = false;
+        while (read(pfd.fd, &c, 1) == 1) {
+            if (c == 'q')
+                return;
+            dump = true;
+        }
+
+        if (dump)
+            virLockManagerDLMRecorderDump("requested by signal");
+
+        if (!timeout)
+            continue;
+
+        now = virDLMStatsNow();
+        adoptStart = __atomic_load_n(&driver->adoptStart, __ATOMIC_RELAXED);
+
+        virMutexLock(&driver->sched.lock);
+        inflight = driver->sched.inflight;
+        progress = driver->sched.progress;
+        virMutexUnlock(&driver->sched.lock);
+
+        if (adoptStart && now - adoptStart > timeout &&
+            reported != adoptStart) {
+            reported = adoptStart;
+            VIR_WARN("adoption of the recorded locks stuck for %llus",
+                     (now - adoptStart) / 1000000000ULL);
+            virLockManagerDLMRecorderDump("adoption stuck for %llus",
+                                          (now - adoptStart) / 1000000000ULL);
+        } else if (inflight && now > progress && now - progress > timeout &&
+                   reported != progress) {
+            reported = progress;
+            VIR_WARN("%u DLM requests in flight, none completed for %llus",
+                     inflight, (now - progress) / 1000000000ULL);
+            virLockManagerDLMRecorderDump("%u requests in flight, none "
+                                          "completed for %llus", inflight,
+                                          (now - progress) / 1000000000ULL);
+        }
+    }
+}
+
+static void
+virLockManagerDLMWatchdogStop(void)
+{
+    char c = 'q';
+
+    if (driver->signalSet) {
+        sigaction(SIGUSR2, &driver->oldSignal, NULL);
+        driver->signalSet = false;
+    }
+
+    if (driver->watchdogRunning) {
+        ignore_value(safewrite(driver->watchdogPipe[1], &c, 1));
+        virThreadJoin(&driver->watchdog);
+        driver->watchdogRunning = false;
+    }
+
+    VIR_FORCE_CLOSE(driver->watchdogPipe[0]);
+    VIR_FORCE_CLOSE(driver->watchdogPipe[1]);
+}
+
+/*
+ * SIGUSR2 belongs to the process loading the plugin, it is only
+ * taken over if nobody handles or ignores it yet.
+ */
+static int
+virLockManagerDLMWatchdogStart(void)
+{
+    struct sigaction action;
+
+    if (!driver->recorderFile ||
+        (!driver->recorderSignal && !driver->hangTimeout))
+        return 0;
+
+    if (pipe2(driver->watchdogPipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        virReportSystemError(errno, "%s", _("unable to create pipe"));
+        goto error;
+    }
+
+    if (virThreadCreate(&driver->watchdog, true,
+                        virLockManagerDLMWatchdog, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create DLM watchdog thread"));
+        goto error;
+    }
+    driver->watchdogRunning = true;
+
+    if (driver->recorderSignal) {
+        if (sigaction(SIGUSR2, NULL, &driver->oldSignal) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to handle SIGUSR2"));
+            goto error;
+        }
+
+        if ((driver->oldSignal.sa_flags & SA_SIGINFO) ||
+            driver->oldSignal.sa_handler != SIG_DFL) {
+            VIR_WARN("SIGUSR2 is already in use, the flight recorder "
+                     "will not be dumped on it");
+            return 0;
+        }
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = virLockManagerDLMRecorderSignal;
+        action.sa_flags = SA_RESTART;
+        if (sigaction(SIGUSR2, &action, NULL) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to handle SIGUSR2"));
+            goto error;
+        }
+        driver->signalSet = true;
+    }
+
+    return 0;
+
+ error:
+    virLockManagerDLMWatchdogStop();
+    return -1;
+}
+
+static int
+virLockManagerDLMSetup(void)
+{
+    bool newLockspace = false;
+
+    if (!(driver->resources = virHashCreate(VIR_RESOURCE_TABLE_SIZE,
+                                            virLockManagerDLMResourceDataFree))) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to create resource hash table"));
+        return -1;
+    }
+
+    if (virLockManagerDLMWatchdogStart() < 0)
+        return -1;
+
+    if (!virFileExists(DLM_CLUSTER_NAME_PATH)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("check dlm_controld, ensure it has setuped"));
+        return -1;
+    }
+
+    driver->lockspace = dlm_open_lockspace(driver->lockspaceName);
+    if (!driver->lockspace) {
+        driver->lockspace = dlm_create_lockspace(driver->lockspaceName, 0600);
+        if (!driver->lockspace) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to open and create DLM lockspace"));
+            return -1;
+        }
+        newLockspace = true;
+    }
+
+    if ((driver->dlmFd = dlm_ls_get_fd(driver->lockspace)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to get the lockspace device"));
+        return -1;
+    }
+
+    if (virSetNonBlock(driver->dlmFd) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to set the lockspace device non blocking"));
+        return -1;
+    }
+
+    /* No event loop is fine, waiting threads dispatch ASTs anyway */
+    driver->dlmWatch = virEventAddHandle(driver->dlmFd,
+                                         VIR_EVENT_HANDLE_READABLE,
+                                         virLockManagerDLMLockspaceDispatch,
+                                         NULL, NULL);
+    if (driver->dlmWatch < 0)
+        VIR_DEBUG("no event loop, asynchronous operations are disabled");
+
+    /* Nothing would end the grace period of released locks, nor
+     * release the cached ones, without an event loop. They are
+     * released at once then */
+    if ((driver->releaseGrace || driver->lockCaching) &&
+        driver->dlmWatch >= 0 &&
+        (driver->graceTimer = virEventAddTimeout(-1,
+                                                 virLockManagerDLMGraceTimeout,
+                                                 NULL, NULL)) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to register the grace period timer"));
+        return -1;
+    }
+
+    /* Without an event loop, the statistics are only written when
+     * the driver is shut down */
+    if (driver->statsFile &&
+        driver->dlmWatch >= 0 &&
+        (driver->statsTimer = virEventAddTimeout(driver->statsInterval * 1000,
+                                                 virLockManagerDLMStatsTimeout,
+                                                 NULL, NULL)) < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to register the statistics timer"));
+        return -1;
+    }
+
+    /* Not fatal, the driver only loses what needs the node ID */
+    if (virLockManagerDLMCpgOpen() < 0) {
+        VIR_WARN("unable to track the cluster membership: %s",
+                 virGetLastErrorMessage());
+        virLockManagerDLMCpgClose();
+        driver->localNodeId = 0;
+    }
+
+    if (virLockManagerDLMSetupLockRecordFile(newLockspace,
+                                             driver->purgeLockspace) < 0)  {
+        return -1;
+    }
+
+    return 0;
+} 
+
+static void
+virLockManagerDLMCloseLockspace(void)
+{
+    if (driver->statsTimer >= 0) {
+        virEventRemoveTimeout(driver->statsTimer);
+        driver->statsTimer = -1;
+    }
+
+    if (driver->graceTimer >= 0) {
+        virEventRemoveTimeout(driver->graceTimer);
+        driver->graceTimer = -1;
+    }
+
+    if (driver->dlmWatch >= 0) {
+        virEventRemoveHandle(driver->dlmWatch);
+        driver->dlmWatch = -1;
+    }
+    driver->dlmFd = -1;
+
+    if (driver->lockspace) {
+        ignore_value(dlm_close_lockspace(driver->lockspace));
+        driver->lockspace = NULL;
+    }
+}
+
+static int
+virLockManagerDLMDeinit(void)
+{
+    size_t i;
+
+    if (!driver)
+        return 0;
+
+    if (driver->statsFile && !driver->useDaemon &&
+        virDLMStatsWriteFile(driver->statsFile, driver->statsHot) < 0)
+        VIR_WARN("unable to write the statistics: %s",
+                 virGetLastErrorMessage());
+
+    /* Nothing is kept for a grace period before the locks are
+     * recorded */
+    if (driver->lockspace && driver->lockFd > 0)
+        virLockManagerDLMGraceRelease();
+
+    virLockManagerDLMWatchdogStop();
+    virLockManagerDLMCpgClose();
+    virLockManagerDLMCloseLockspace();
+    virMutexDestroy(&driver->membership.lock);
+    virMutexDestroy(&driver->lock);
+    virMutexDestroy(&driver->dispatchLock);
+
+    if (driver->resources)
+        virHashFree(driver->resources);
+
+    for (i = 0; i < driver->nhandoffs; i++)
+        virObjectUnref(driver->handoffs[i]);
+    VIR_FREE(driver->handoffs);
+
+    for (i = 0; i < driver->sched.nqueues; i++)
+        VIR_FREE(driver->sched.queues[i].entries);
+    VIR_FREE(driver->sched.queues);
+    VIR_FREE(driver->sched.urgent);
+    virMutexDestroy(&driver->sched.lock);
+
+    if (driver->lockFd)
+        VIR_FORCE_CLOSE(driver->lockFd);
+
+    VIR_FREE(driver->lockspaceName);
+    VIR_FREE(driver->daemonSocket);
+    VIR_FREE(driver->recordFile);
+    virDLMTraceClose(driver->trace);
+    VIR_FREE(driver->traceFile);
+    VIR_FREE(driver->statsFile);
+    VIR_FREE(driver->recorderFile);
+    VIR_FREE(driver);
+
+    return 0;
+}
+
+static int
+virLockManagerDLMInit(unsigned int version,
+                      const char *configFile,
+                      unsigned int flags)
+{
+    VIR_DEBUG("version=%u configFile=%s flags=0x%x", version, NULLSTR(configFile), flags);
+
+    virCheckFlags(VIR_LOCK_MANAGER_DLM_INIT_SERVER, -1);
+
+    if (driver)
+        return 0;
+
+    if (geteuid() != 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("DLM lock requires root privileges"));
+        return -1;
+    }
+
+    if (VIR_ALLOC(driver) < 0)
+        return -1;
+
+    driver->cpgWatch = -1;
+    driver->dlmFd = -1;
+    driver->dlmWatch = -1;
+    driver->purgeTimer = -1;
+    driver->graceTimer = -1;
+    driver->statsTimer = -1;
+    driver->statsInterval = 15;
+    driver->statsHot = 10;
+    driver->watchdogPipe[0] = -1;
+    driver->watchdogPipe[1] = -1;
+    driver->hangTimeout = 60;
+    driver->purgeDelay = 60;
+    driver->acquireWait = VIR_LOCK_MANAGER_DLM_WAIT_NOWAIT;
+    driver->acquireTimeout = 30 * 1000;
+    driver->sharedMode = LKM_PRMODE;
+    driver->readonlyMode = LKM_NLMODE;
+    driver->ownerInfo = true;
+    driver->regionChunk = 1024 * 1024 * 1024;
+    driver->handoffTimeout = 10 * 60 * 1000;
+    driver->stateRetention = 60 * 60 * 1000;
+    if (virMutexInit(&driver->membership.lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize mutex"));
+        VIR_FREE(driver);
+        return -1;
+    }
+    if (virMutexInit(&driver->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize mutex"));
+        virMutexDestroy(&driver->membership.lock);
+        VIR_FREE(driver);
+        return -1;
+    }
+    if (virMutexInit(&driver->dispatchLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize mutex"));
+        virMutexDestroy(&driver->lock);
+        virMutexDestroy(&driver->membership.lock);
+        VIR_FREE(driver);
+        return -1;
+    }
+    if (virMutexInit(&driver->sched.lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize mutex"));
+        virMutexDestroy(&driver->dispatchLock);
+        virMutexDestroy(&driver->lock);
+        virMutexDestroy(&driver->membership.lock);
+        VIR_FREE(driver);
+        return -1;
+    }
+    driver->sched.pid = getpid();
+    driver->sched.maxInflight = 64;
+
+    if (virLockManagerDLMOpInitialize() < 0)
+        goto error;
+
+    driver->autoDiskLease = true;
+    driver->requireLeaseForDisks = !driver->autoDiskLease;
+    driver->purgeLockspace = true;
+
+    if (VIR_STRDUP(driver->lockspaceName, "libvirt") < 0)
+        goto error;
+
+    if (VIR_STRDUP(driver->daemonSocket, VIR_DLM_PROTOCOL_SOCKET) < 0)
+        goto error;
+
+    if (!(driver->recordFile = virFileBuildPath(RUNSTATEDIR,
+                                                "/libvirt/DLMlocks", ".txt")))
+        goto error;
+
+    if (!(driver->recorderFile = virFileBuildPath(LOCALSTATEDIR,
+                                                  "/log/libvirt/dlm-flight",
+                                                  ".log")))
+        goto error;
+
+    if (virLockManagerDLMLoadConfig(configFile) < 0)
+        goto error;
+
+    if (driver->traceFile &&
+        !(driver->trace = virDLMTraceOpen(driver->traceFile)))
+        goto error;
+
+    /* virtdlmd owns the lockspace, libvirtd only forwards requests */
+    if (flags & VIR_LOCK_MANAGER_DLM_INIT_SERVER)
+        driver->useDaemon = false;
+
+    if (driver->useDaemon) {
+        VIR_DEBUG("forwarding lock requests to %s", driver->daemonSocket);
+        return 0;
+    }
+
+    if (virLockManagerDLMSetup() < 0)
+        goto error;
+
+    return 0;
+
+ error:
+    virLockManagerDLMDeinit();
+    return -1;
+}
+
+static int
+virLockManagerDLMDaemonConnect(void)
+{
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (virStrcpyStatic(addr.sun_path, driver->daemonSocket) == NULL) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("DLM lock daemon socket path '%s' too long"),
+                       driver->daemonSocket);
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create socket"));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        virReportSystemError(errno,
+                             _("unable to connect to DLM lock daemon at '%s'"),
+                             driver->daemonSocket);
+        VIR_FORCE_CLOSE(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * One connection per call: Acquire runs in the child forked
+ * for the VM process, so nothing could be shared with it anyway.
+ */
+static int
+virLockManagerDLMDaemonCall(virLockManagerDLMPrivatePtr priv,
+                            virDLMProtocolProcedure proc,
+                            const char *state,
+                            unsigned int flags,
+                            virDomainLockFailureAction action,
+                            virDLMProtocolBufferPtr args,
+                            char **stateOut)
+{
+    virDLMProtocolBuffer msg;
+    virDLMProtocolHeader hdr;
+    char *result = NULL;
+    int fd = -1;
+    int rv = -1;
+
+    memset(&msg, 0, sizeof(msg));
+
+    if (virDLMProtocolAddBuffer(&msg, &priv->object) < 0 ||
+        virDLMProtocolAddUInt32(&msg, priv->nrequests) < 0 ||
+        virDLMProtocolAddBuffer(&msg, &priv->requests) < 0 ||
+        virDLMProtocolAddUInt32(&msg, flags) < 0 ||
+        virDLMProtocolAddUInt32(&msg, action) < 0 ||
+        virDLMProtocolAddString(&msg, state) < 0 ||
+        (args && virDLMProtocolAddBuffer(&msg, args) < 0))
+        goto cleanup;
+
+    if ((fd = virLockManagerDLMDaemonConnect()) < 0)
+        goto cleanup;
+
+    if (virDLMProtocolSend(fd, proc, 0, &msg) < 0)
+        goto cleanup;
+
+    rv = virDLMProtocolRecv(fd, &hdr, &msg);
+    if (rv <= 0) {
+        if (rv == 0)
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("DLM lock daemon closed the connection"));
+        rv = -1;
+        goto cleanup;
+    }
+    rv = -1;
+
+    if (hdr.proc != proc) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unexpected reply %u from DLM lock daemon"),
+                       hdr.proc);
+        goto cleanup;
+    }
+
+    if (virDLMProtocolGetString(&msg, &result) < 0)
+        goto cleanup;
+
+    if (hdr.status < 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       result ? result : _("DLM lock daemon request failed"));
+        goto cleanup;
+    }
+
+    if (stateOut)
+        VIR_STEAL_PTR(*stateOut, result);
+
+    rv = 0;
+ cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(result);
+    virDLMProtocolBufferFree(&msg);
+
+    return rv;
+}
+
+static void
+virLockManagerDLMDaemonJobRun(void *opaque)
+{
+    virLockManagerDLMDaemonJobPtr job = opaque;
+    char *state = NULL;
+    int rv;
+
+    rv = virLockManagerDLMDaemonCall(job->man->privateData, job->proc,
+                                     job->state, job->flags, job->action,
+                                     NULL, job->proc == VIR_DLM_PROTOCOL_PROC_RELEASE ?
+                                     &state : NULL);
+
+    job->cb(job->man, rv, state, job->opaque);
+
+    VIR_FREE(job->state);
+    VIR_FREE(job);
+}
+
+/*
+ * virtdlmd only answers once the call is over, so the asynchronous
+ * variants wait for it from a thread of their own.
+ */
+static int
+virLockManagerDLMDaemonCallAsync(virLockManagerPtr man,
+                                 virDLMProtocolProcedure proc,
+                                 const char *state,
+                                 unsigned int flags,
+                                 virDomainLockFailureAction action,
+                                 virLockDriverCompletion cb,
+                                 void *opaque)
+{
+    virLockManagerDLMDaemonJobPtr job = NULL;
+    virThread thread;
+
+    if (VIR_ALLOC(job) < 0)
+        return -1;
+
+    if (VIR_STRDUP(job->state, state) < 0) {
+        VIR_FREE(job);
+        return -1;
+    }
+
+    job->man = man;
+    job->proc = proc;
+    job->flags = flags;
+    job->action = action;
+    job->cb = cb;
+    job->opaque = opaque;
+
+    if (virThreadCreate(&thread, false, virLockManagerDLMDaemonJobRun, job) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create DLM lock daemon thread"));
+        VIR_FREE(job->state);
+        VIR_FREE(job);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+virLockManagerDLMNew(virLockManagerPtr lock,
+                     unsigned int type,
+                     size_t nparams,
+                     virLockManagerParamPtr params,
+                     unsigned int flags)
+{
+    virLockManagerDLMPrivatePtr priv = NULL;
+    size_t i;
+
+    virCheckFlags(VIR_LOCK_MANAGER_NEW_STARTED, -1);
+
+    if (!driver) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("DLM plugin is not initialized"));
+        return -1;
+    }
+
+    if (type != VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unsupported object type %d"), type);
+        return -1;
+    }
+
+    if (VIR_ALLOC(priv) < 0)
+        return -1;
+
+    lock->privateData = priv;
+
+    priv->acquireWait = driver->acquireWait;
+    priv->acquireTimeout = driver->acquireTimeout;
+
+    for (i = 0; i < nparams; i++) {
+        if (STREQ(params[i].key, "uuid")) {
+            memcpy(priv->vm_uuid, params[i].value.uuid, VIR_UUID_BUFLEN);
+        } else if (STREQ(params[i].key, "name")) {
+            if (VIR_STRDUP(priv->vm_name, params[i].value.str) < 0)
+                return -1;
+        } else if (STREQ(params[i].key, "id")) {
+            priv->vm_id = params[i].value.ui;
+        } else if (STREQ(params[i].key, "pid")) {
+            priv->vm_pid = params[i].value.iv;
+        } else if (STREQ(params[i].key, "uri")) {
+            /* ignore */
+        } else if (STREQ(params[i].key,
+                         VIR_LOCK_MANAGER_DLM_PARAM_ACQUIRE_WAIT)) {
+            if (params[i].type != VIR_LOCK_MANAGER_PARAM_TYPE_STRING &&
+                params[i].type != VIR_LOCK_MANAGER_PARAM_TYPE_CSTRING) {
+                virReportError(VIR_ERR_INVALID_ARG,
+                               _("parameter %s must be a string"),
+                               params[i].key);
+                return -1;
+            }
+            if ((priv->acquireWait =
+                 virLockManagerDLMWaitPolicyTypeFromString(params[i].value.cstr)) < 0) {
+                virReportError(VIR_ERR_INVALID_ARG,
+                               _("unknown acquire wait policy '%s'"),
+                               params[i].value.cstr);
+                return -1;
+            }
+        } else if (STREQ(params[i].key,
+                         VIR_LOCK_MANAGER_DLM_PARAM_ACQUIRE_TIMEOUT)) {
+            if (params[i].type == VIR_LOCK_MANAGER_PARAM_TYPE_UINT) {
+                priv->acquireTimeout = params[i].value.ui;
+            } else if (params[i].type == VIR_LOCK_MANAGER_PARAM_TYPE_ULONG) {
+                priv->acquireTimeout = params[i].value.ul;
+            } else {
+                virReportError(VIR_ERR_INVALID_ARG,
+                               _("parameter %s must be an unsigned integer"),
+                               params[i].key);
+                return -1;
+            }
+        } else {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unexpected parameter %s for object"),
+                           params[i].key);
+        }
+    }
+
+    if (priv->vm_pid == 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("missing PID parameter for domain object"));
+        return -1;
+    }
+    if (priv->vm_name == NULL) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("missing name parameter for domain object"));
+        return -1;
+    }
+    if (priv->vm_id == 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("missing ID parameter for domain object"));
+        return -1;
+    }
+    if (!virUUIDIsValid(priv->vm_uuid)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("missing UUID parameter for domain object"));
+        return -1;
+    }
+
+    if (driver->useDaemon &&
+        (virDLMProtocolAddUInt32(&priv->object, type) < 0 ||
+         virDLMProtocolAddUInt32(&priv->object, flags) < 0 ||
+         virDLMProtocolAddParams(&priv->object, nparams, params) < 0))
+        return -1;
+
+    return 0;
+}
+
+static void
+virLockManagerDLMFree(virLockManagerPtr lock)
+{
+    virLockManagerDLMPrivatePtr priv  = lock->privateData;
+
+    size_t i;
+
+    if (!priv)
+        return;
+
+    for (i = 0; i < priv->nresources; i++) {
+        VIR_FREE(priv->resources[i].name);
+        VIR_FREE(priv->resources[i].path);
+    }
+    VIR_FREE(priv->resources);
+    VIR_FREE(priv->vm_name);
+    virDLMProtocolBufferFree(&priv->object);
+    virDLMProtocolBufferFree(&priv->requests);
+    VIR_FREE(priv);
+    lock->privateData = NULL;
+
+    return;
+}
+
+/* Give @lock the same domain and resources as @src */
+static int
+virLockManagerDLMCopy(virLockManagerPtr lock,
+                      virLockManagerPtr src)
+{
+    virLockManagerDLMPrivatePtr from = src->privateData;
+    virLockManagerDLMPrivatePtr priv;
+    size_t i;
+
+    if (VIR_ALLOC(priv) < 0)
+        return -1;
+
+    lock->driver = src->driver;
+    lock->privateData = priv;
+
+    memcpy(priv->vm_uuid, from->vm_uuid, VIR_UUID_BUFLEN);
+    priv->vm_pid = from->vm_pid;
+    priv->vm_id = from->vm_id;
+    priv->acquireWait = from->acquireWait;
+    priv->acquireTimeout = from->acquireTimeout;
+
+    if (VIR_STRDUP(priv->vm_name, from->vm_name) < 0 ||
+        VIR_ALLOC_N(priv->resources, from->nresources) < 0)
+        return -1;
+
+    priv->nresources = from->nresources;
+    for (i = 0; i < from->nresources; i++) {
+        priv->resources[i].mode = from->resources[i].mode;
+        if (VIR_STRDUP(priv->resources[i].name, from->resources[i].name) < 0 ||
+            VIR_STRDUP(priv->resources[i].path, from->resources[i].path) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Look for the region of a disk resource in @params, the disk being
+ * locked as a whole if there is none.
+ */
+static int
+virLockManagerDLMRegionParse(size_t nparams,
+                             virLockManagerParamPtr params,
+                             bool *isRegion,
+                             unsigned long long *offset,
+                             unsigned long long *length)
+{
+    bool hasOffset = false, hasLength = false;
+    unsigned long long value;
+    size_t i;
+
+    *isRegion = false;
+    *offset = *length = 0;
+
+    for (i = 0; i < nparams; i++) {
+        if (params[i].type == VIR_LOCK_MANAGER_PARAM_TYPE_UINT) {
+            value = params[i].value.ui;
+        } else if (params[i].type == VIR_LOCK_MANAGER_PARAM_TYPE_ULONG) {
+            value = params[i].value.ul;
+        } else {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unexpected parameter %s for disk resource"),
+                           params[i].key);
+            return -1;
+        }
+
+        if (STREQ(params[i].key, VIR_LOCK_MANAGER_DLM_PARAM_OFFSET)) {
+            *offset = value;
+            hasOffset = true;
+        } else if (STREQ(params[i].key, VIR_LOCK_MANAGER_DLM_PARAM_LENGTH)) {
+            *length = value;
+            hasLength = true;
+        } else {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unexpected parameter %s for disk resource"),
+                           params[i].key);
+            return -1;
+        }
+    }
+
+    if (!hasOffset && !hasLength)
+        return 0;
+
+    if (!hasLength || *length == 0 || *offset + *length < *offset) {
+        virReportError(VIR_ERR_INVALID_ARG, "%s",
+                       _("invalid region for disk resource"));
+        return -1;
+    }
+
+    *isRegion = true;
+    return 0;
+}
+
+/* DLM mode of a resource added with @flags */
+static unsigned int
+virLockManagerDLMResourceMode(unsigned int flags)
+{
+    if (flags & VIR_LOCK_MANAGER_RESOURCE_READONLY)
+        return driver->readonlyMode;
+    else if (flags & VIR_LOCK_MANAGER_RESOURCE_SHARED)
+        return driver->sharedMode;
+    else
+        return LKM_EXMODE;
+}
+
+/*
+ * Append to @names the locks of the region of @length bytes at
+ * @offset of the disk @path: one per chunk of regionChunk bytes the
+ * region covers, so that two overlapping regions always share one.
+ */
+static int
+virLockManagerDLMRegionNames(const char *path,
+                             unsigned long long offset,
+                             unsigned long long length,
+                             char ***names,
+                             size_t *nnames)
+{
+    unsigned long long first = offset / driver->regionChunk;
+    unsigned long long last = (offset + length - 1) / driver->regionChunk;
+    unsigned long long chunk;
+    char *region = NULL;
+    char *name = NULL;
+
+    if (last - first >= VIR_LOCK_MANAGER_DLM_REGION_MAX_CHUNKS) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("region of disk '%s' spans more than %d chunks"),
+                       path, VIR_LOCK_MANAGER_DLM_REGION_MAX_CHUNKS);
+        return -1;
+    }
+
+    for (chunk = first; chunk <= last; chunk++) {
+        if (virAsprintf(&region, "%s:%llu:%llu",
+                        path, driver->regionChunk, chunk) < 0 ||
+            virLockManagerDLMHash(region, &name) < 0 ||
+            VIR_APPEND_ELEMENT(*names, *nnames, name) < 0) {
+            VIR_FREE(region);
+            VIR_FREE(name);
+            return -1;
+        }
+        VIR_FREE(region);
+    }
+
+    return 0;
+}
+
+/*
+ * Compute the lock names and mode of a resource, @lockNames being
+ * left empty if the resource is not locked at all and @mode being
+ * NL if it needs no lock in its current use.
+ *
+ * A region of a disk is locked as the chunks it covers, so that
+ * disjoint regions of one device can be held at once while
+ * overlapping ones conflict. Its holder also takes the device lock
+ * itself in @intentMode, which keeps out whoever writes to the whole
+ * device but not the holders of the other regions: CR for a readonly
+ * region, else CW, or PR if shareable disks are written in CW, which
+ * CW would let in. @intentName is left NULL for anything but a
+ * region.
+ */
+static int
+virLockManagerDLMResourceParse(virLockManagerDLMPrivatePtr priv,
+                               unsigned int type,
+                               const char *name,
+                               size_t nparams,
+                               virLockManagerParamPtr params,
+                               unsigned int flags,
+                               char ***lockNames,
+                               size_t *nlockNames,
+                               unsigned int *mode,
+                               char **intentName,
+                               unsigned int *intentMode)
+{
+    unsigned long long offset, length;
+    bool isRegion = false;
+    char *lockName = NULL;
+
+    *lockNames = NULL;
+    *nlockNames = 0;
+    *mode = LKM_NLMODE;
+    *intentName = NULL;
+    *intentMode = LKM_NLMODE;
+
+    switch (type) {
+    case VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK:
+        if (virLockManagerDLMRegionParse(nparams, params, &isRegion,
+                                         &offset, &length) < 0)
+            return -1;
+
+        if (!driver->autoDiskLease) {
+            if (!(flags & (VIR_LOCK_MANAGER_RESOURCE_SHARED |
+                           VIR_LOCK_MANAGER_RESOURCE_READONLY))) {
+                priv->hasRWDisks = true;
+
+                return 0;
+            }
+        }
+
+        if (isRegion) {
+            if (virLockManagerDLMRegionNames(name, offset, length,
+                                             lockNames, nlockNames) < 0 ||
+                virLockManagerDLMHash(name, intentName) < 0)
+                goto error;
+        } else {
+            if (virLockManagerDLMHash(name, &lockName) < 0 ||
+                VIR_APPEND_ELEMENT(*lockNames, *nlockNames, lockName) < 0)
+                goto error;
+        }
+
+        break;
+
+    case VIR_LOCK_MANAGER_RESOURCE_TYPE_LEASE:
+        if (VIR_STRDUP(lockName, name) < 0 ||
+            VIR_APPEND_ELEMENT(*lockNames, *nlockNames, lockName) < 0)
+            goto error;
+
+        break;
+
+    default:
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("unknown lock manager object type %d"),
+                       type);
+        return -1;
+    }
+
+    *mode = virLockManagerDLMResourceMode(flags);
+
+    if (*intentName && *mode != LKM_NLMODE) {
+        if (flags & VIR_LOCK_MANAGER_RESOURCE_READONLY)
+            *intentMode = LKM_CRMODE;
+        else if (driver->sharedMode == LKM_CWMODE)
+            *intentMode = LKM_PRMODE;
+        else
+            *intentMode = LKM_CWMODE;
+    }
+
+    return 0;
+
+ error:
+    VIR_FREE(lockName);
+    virStringListFreeCount(*lockNames, *nlockNames);
+    *lockNames = NULL;
+    *nlockNames = 0;
+    VIR_FREE(*intentName);
+    return -1;
+}
+
+/* Index of the resource of @priv locked as @name, or -1 */
+static ssize_t
+virLockManagerDLMResourceFind(virLockManagerDLMPrivatePtr priv,
+                              const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < priv->nresources; i++) {
+        if (STREQ(priv->resources[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Append @name, stolen, in @mode to the resources of @priv, added
+ * as @path. The device lock of a region, @intent, only ever
+ * strengthens the mode the device is already held in. An @update
+ * to NL removes the resource, as the call it replays did.
+ */
+static int
+virLockManagerDLMResourceAppend(virLockManagerDLMPrivatePtr priv,
+                                char **name,
+                                const char *path,
+                                unsigned int mode,
+                                bool intent,
+                                bool update)
+{
+    ssize_t i;
+
+    if (!*name || mode == LKM_NLMODE) {
+        if (*name && update &&
+            (i = virLockManagerDLMResourceFind(priv, *name)) >= 0) {
+            VIR_FREE(priv->resources[i].name);
+            VIR_FREE(priv->resources[i].path);
+            VIR_DELETE_ELEMENT(priv->resources, i, priv->nresources);
+        }
+        VIR_FREE(*name);
+        return 0;
+    }
+
+    /* Added again after an update, the last mode wins */
+    if ((i = virLockManagerDLMResourceFind(priv, *name)) >= 0) {
+        if (!intent || priv->resources[i].mode == LKM_CRMODE)
+            priv->resources[i].mode = mode;
+        VIR_FREE(*name);
+        return 0;
+    }
+
+    if (VIR_EXPAND_N(priv->resources, priv->nresources, 1) < 0) {
+        VIR_FREE(*name);
+        return -1;
+    }
+
+    VIR_STEAL_PTR(priv->resources[priv->nresources-1].name, *name);
+    priv->resources[priv->nresources-1].mode = mode;
+    if (VIR_STRDUP(priv->resources[priv->nresources-1].path, path) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+virLockManagerDLMAddResource(virLockManagerPtr lock,
+                             unsigned int type,
+                             const char *name,
+                             size_t nparams,
+                             virLockManagerParamPtr params,
+                             unsigned int flags)
+{
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    char **names = NULL;
+    size_t nnames = 0;
+    char *intentName = NULL;
+    unsigned int mode;
+    unsigned int intentMode;
+    bool update = !!(flags & VIR_LOCK_MANAGER_DLM_RESOURCE_UPDATE);
+    size_t i;
+    int rv = -1;
+
+    virCheckFlags(VIR_LOCK_MANAGER_RESOURCE_READONLY |
+                  VIR_LOCK_MANAGER_RESOURCE_SHARED |
+                  VIR_LOCK_MANAGER_DLM_RESOURCE_UPDATE, -1);
+
+    if (driver->useDaemon) {
+        if (virDLMProtocolAddUInt32(&priv->requests, type) < 0 ||
+            virDLMProtocolAddString(&priv->requests, name) < 0 ||
+            virDLMProtocolAddParams(&priv->requests, nparams, params) < 0 ||
+            virDLMProtocolAddUInt32(&priv->requests, flags) < 0)
+            return -1;
+
+        priv->nrequests++;
+        return 0;
+    }
+
+    if (virLockManagerDLMResourceParse(priv, type, name, nparams, params,
+                                       flags, &names, &nnames, &mode,
+                                       &intentName, &intentMode) < 0)
+        goto error;
+
+    if (virLockManagerDLMResourceAppend(priv, &intentName, name,
+                                        intentMode, true, false) < 0)
+        goto error;
+
+    for (i = 0; i < nnames; i++) {
+        if (virLockManagerDLMResourceAppend(priv, &names[i], name,
+                                            mode, false, update) < 0)
+            goto error;
+    }
+
+    rv = 0;
+ error:
+    virStringListFreeCount(names, nnames);
+    VIR_FREE(intentName);
+    return rv;
+}
+
+static int
+virLockManagerDLMResourceIsIdle(const void *payload,
+                                const void *name ATTRIBUTE_UNUSED,
+                                const void *data)
+{
+    const virLockManagerDLMLockResource *res = payload;
+    const unsigned long long *now = data;
+    size_t i;
+
+    if (res->nHolders != 0 || res->nBusy != 0)
+        return 0;
+
+    /* Keep the locks a lock state may still refer to, unless it was
+     * not used in time: the domain was destroyed or restored on
+     * another node meanwhile */
+    for (i = 0; i < res->nLocks; i++) {
+        if (res->locks[i].retainedUntil > *now)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Unlock the resources nobody holds anymore. This can't be done
+ * from the AST thread, nor with the driver lock held: the unlocks
+ * are completed by the AST thread, which may be waiting for it.
+ */
+static void
+virLockManagerDLMSweep(void)
+{
+    virLockManagerDLMLockResourcePtr *idle = NULL;
+    virLockManagerDLMLockResourcePtr res;
+    unsigned long long now;
+    size_t nidle = 0, i;
+
+    /* Keep every retained lock if the time is unknown */
+    if (virTimeMillisNow(&now) < 0) {
+        virResetLastError();
+        now = 0;
+    }
+
+    virMutexLock(&driver->lock);
+    while ((res = virHashSearch(driver->resources,
+                                virLockManagerDLMResourceIsIdle,
+                                &now, NULL))) {
+        if (VIR_APPEND_ELEMENT_COPY(idle, nidle, res) < 0)
+            break;
+        virHashSteal(driver->resources, res->name);
+    }
+    virMutexUnlock(&driver->lock);
+
+    for (i = 0; i < nidle; i++)
+        virLockManagerDLMResourceDataFree(idle[i], NULL);
+
+    VIR_FREE(idle);
+}
+
+static void
+virLockManagerDLMLockCacheAst(void *opaque)
+{
+    virLockManagerDLMLockCachePtr cache = opaque;
+    virLockManagerDLMAstCallPtr call = cache->pending;
+
+    cache->pending = NULL;
+    if (call)
+        call->func(call->opaque);
+}
+
+/*
+ * Blocking AST, another node asked for a lock in a mode conflicting
+ * with ours. A cached lock, or one in its grace period, is released
+ * right away, a lock in use is only not cached once released.
+ */
+static void
+virLockManagerDLMBast(void *opaque)
+{
+    virLockManagerDLMAstCallPtr call = opaque;
+    virLockManagerDLMLockCachePtr cache = call->opaque;
+    virLockManagerDLMLockResourcePtr res = cache->res;
+    bool expire = false;
+    size_t i;
+
+    virMutexLock(&driver->lock);
+
+    for (i = 0; i < res->nLocks; i++) {
+        if (res->locks[i].lkid != cache->lkid)
+            continue;
+
+        if (res->locks[i].graceUntil) {
+            if (!res->locks[i].expiring) {
+                VIR_DEBUG("lock %s is wanted by another node", res->name);
+                res->locks[i].graceUntil = 1;
+                res->locks[i].cached = false;
+                expire = true;
+            }
+        } else if (res->locks[i].vm_pid != 0) {
+            res->locks[i].contended = true;
+        }
+        break;
+    }
+
+    if (expire)
+        virEventUpdateTimeout(driver->graceTimer, 0);
+
+    virMutexUnlock(&driver->lock);
+}
+
+/*
+ * Must be called with the driver lock held. Returns the AST
+ * argument to request lock @index of @res with, or NULL if the
+ * lock won't be cached.
+ */
+static virLockManagerDLMLockCachePtr
+virLockManagerDLMLockCacheGet(virLockManagerDLMLockResourcePtr res,
+                              size_t index)
+{
+    virLockManagerDLMLockPtr lock = res->locks + index;
+
+    if (!driver->lockCaching || driver->graceTimer < 0)
+        return NULL;
+
+    if (!lock->cache) {
+        if (VIR_ALLOC(lock->cache) < 0) {
+            virResetLastError();
+            return NULL;
+        }
+
+        lock->cache->ast.func = virLockManagerDLMLockCacheAst;
+        lock->cache->ast.opaque = lock->cache;
+        lock->cache->res = res;
+        lock->cache->lkid = lock->lkid;
+    }
+
+    return lock->cache;
+}
+
+static void virLockManagerDLMOpAst(void *opaque);
+static void virLockManagerDLMOpResume(void *opaque);
+static bool virLockManagerDLMOpIssueBatch(virLockManagerDLMOpPtr op);
+
+static virLockManagerDLMOpPtr
+virLockManagerDLMOpNew(virLockManagerDLMOpType type,
+                       virLockManagerPtr man,
+                       virLockDriverCompletion cb,
+                       void *opaque)
+{
+    virLockManagerDLMPrivatePtr priv = man->privateData;
+    virLockManagerDLMOpPtr op;
+
+    if (!(op = virObjectLockableNew(virLockManagerDLMOpClass)))
+        return NULL;
+
+    op->type = type;
+    op->man = man;
+    op->end = priv->nresources;
+    op->timer = -1;
+    op->ast.func = virLockManagerDLMOpAst;
+    op->ast.opaque = op;
+    op->sched.resume = virLockManagerDLMOpResume;
+    op->sched.opaque = op;
+    op->sched.urgent = type == VIR_LOCK_MANAGER_DLM_OP_RELEASE;
+    op->sched.owner = priv->vm_uuid;
+    op->cb = cb;
+    op->opaque = opaque;
+
+    return op;
+}
+
+/*
+ * Must be called with @op locked. The request is only recorded,
+ * virLockManagerDLMOpSchedule hands it to the scheduler once @op
+ * is unlocked.
+ */
+static void
+virLockManagerDLMOpSubmit(virLockManagerDLMOpPtr op,
+                          unsigned int mode,
+                          unsigned int flags)
+{
+    op->mode = mode;
+    op->flags = flags;
+}
+
+/* Issue the recorded request, once admitted by the scheduler */
+static void
+virLockManagerDLMOpResume(void *opaque)
+{
+    virLockManagerDLMOpPtr op = opaque;
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    bool failed = false;
+
+    virObjectLock(op);
+    op->issuedAt = virDLMStatsNow();
+    if (op->phase == VIR_LOCK_MANAGER_DLM_PHASE_BATCH) {
+        if (virLockManagerDLMOpIssueBatch(op))
+            op->issued = true;
+        else
+            failed = true;
+    } else if (op->canceled) {
+        op->lksb.sb_status = ECANCEL;
+        failed = true;
+    } else if (op->cache) {
+        op->cache->pending = &op->ast;
+        if (dlm_ls_lock(driver->lockspace, op->mode, &op->lksb, op->flags,
+                        op->res->name, strlen(op->res->name), 0,
+                        virLockManagerDLMAst, &op->cache->ast,
+                        virLockManagerDLMBast, NULL) < 0) {
+            VIR_WARN("unable to request lock %s: errno=%d",
+                     op->res->name, errno);
+            op->cache->pending = NULL;
+            op->lksb.sb_status = errno;
+            failed = true;
+        } else {
+            op->issued = true;
+        }
+    } else if (dlm_ls_lock(driver->lockspace, op->mode, &op->lksb, op->flags,
+                           op->res->name, strlen(op->res->name), 0,
+                           virLockManagerDLMAst, &op->ast,
+                           NULL, NULL) < 0) {
+        VIR_WARN("unable to request lock %s: errno=%d",
+                 op->res->name, errno);
+        op->lksb.sb_status = errno;
+        failed = true;
+    } else {
+        op->issued = true;
+    }
+
+    if (op->issued && op->phase != VIR_LOCK_MANAGER_DLM_PHASE_BATCH) {
+        virDLMRecorderAdd(op->flags & LKF_CONVERT ?
+                          VIR_DLM_RECORDER_CONVERT : VIR_DLM_RECORDER_LOCK,
+                          op->res->name, op->lksb.sb_lkid, priv->vm_pid,
+                          op->mode, 0, 0);
+        if (op->phase == VIR_LOCK_MANAGER_DLM_PHASE_CREATE)
+            DLM_PROBE(CREATE_BEGIN, priv->vm_uuid, op->res->name,
+                      op->mode, op->lksb.sb_lkid);
+        else
+            DLM_PROBE(CONVERT_BEGIN, priv->vm_uuid, op->res->name,
+                      op->mode, op->lksb.sb_lkid);
+    }
+    virObjectUnlock(op);
+
+    /* Complete the request as the DLM would have */
+    if (failed) {
+        virLockManagerDLMSchedDone();
+        virLockManagerDLMOpAst(op);
+    }
+}
+
+static void
+virLockManagerDLMOpSchedule(virLockManagerDLMOpPtr op)
+{
+    if (virLockManagerDLMSchedAdmit(&op->sched))
+        virLockManagerDLMOpResume(op);
+}
+
+static void
+virLockManagerDLMOwnerEncode(const unsigned char *uuid,
+                             unsigned int mode,
+                             char *lvb)
+{
+    virLockManagerDLMOwner owner;
+    unsigned long long now = 0;
+
+    ignore_value(virTimeMillisNow(&now));
+
+    memset(&owner, 0, sizeof(owner));
+    owner.version = VIR_LOCK_MANAGER_DLM_OWNER_VERSION;
+    owner.mode = mode;
+    owner.nodeId = htobe32(driver->localNodeId);
+    owner.timestamp = htobe64(now);
+    memcpy(owner.uuid, uuid, VIR_UUID_BUFLEN);
+
+    memcpy(lvb, &owner, sizeof(owner));
+}
+
+/* Describe the owner found in @lvb, or return NULL if there is none */
+static char *
+virLockManagerDLMOwnerFormat(const char *lvb,
+                             unsigned int sbflags)
+{
+    virLockManagerDLMOwner owner;
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    char *when = NULL;
+    char *ret = NULL;
+
+    if (sbflags & DLM_SBF_VALNOTVALID)
+        return NULL;
+
+    memcpy(&owner, lvb, sizeof(owner));
+    if (owner.version != VIR_LOCK_MANAGER_DLM_OWNER_VERSION)
+        return NULL;
+
+    virUUIDFormat(owner.uuid, uuidstr);
+    if (!(when = virTimeStringThen(be64toh(owner.timestamp)))) {
+        virResetLastError();
+        return NULL;
+    }
+
+    /* Shared holders can't write the value block, so a released
+     * record does not mean nobody holds the lock */
+    if (owner.mode == LKM_NLMODE)
+        ignore_value(virAsprintf(&ret,
+                                 _("last released by domain %s on node %u at %s"),
+                                 uuidstr, be32toh(owner.nodeId), when));
+    else
+        ignore_value(virAsprintf(&ret,
+                                 _("held in %s mode by domain %s on node %u since %s"),
+                                 NULLSTR(virLockManagerDLMModeTypeToString(owner.mode)),
+                                 uuidstr, be32toh(owner.nodeId), when));
+
+    VIR_FREE(when);
+    return ret;
+}
+
+static void
+virLockManagerDLMExpiryAst(void *opaque)
+{
+    virLockManagerDLMExpiryPtr expiry = opaque;
+    virLockManagerDLMLockResourcePtr res = expiry->res;
+    int status = expiry->lksb.sb_status;
+    size_t i;
+
+    virMutexLock(&driver->lock);
+
+    for (i = 0; i < res->nLocks; i++) {
+        if (res->locks[i].lkid == expiry->lkid)
+            break;
+    }
+
+    if (i < res->nLocks) {
+        res->locks[i].expiring = false;
+
+        if (status == 0) {
+            res->locks[i].graceUntil = 0;
+            res->locks[i].cached = false;
+            res->locks[i].bast = false;
+            res->locks[i].mode = LKM_NLMODE;
+            res->nHolders -= 1;
+
+            if (virLockManagerDLMWrite(res->locks + i, res->name) < 0)
+                VIR_WARN("unable to write lock information to file");
+        } else {
+            /* Still expired, the next tick tries again */
+            VIR_WARN("failed to release lock %s: lockStatus=%d",
+                     res->name, status);
+            virEventUpdateTimeout(driver->graceTimer, 1000);
+        }
+    }
+
+    res->nBusy -= 1;
+
+    virMutexUnlock(&driver->lock);
+
+    if (expiry->issued)
+        virLockManagerDLMSchedDone();
+
+    VIR_FREE(expiry);
+}
+
+static void
+virLockManagerDLMExpiryResume(void *opaque)
+{
+    virLockManagerDLMExpiryPtr expiry = opaque;
+    unsigned int flags = LKF_CONVERT;
+
+    memset(&expiry->lksb, 0, sizeof(expiry->lksb));
+    expiry->lksb.sb_lkid = expiry->lkid;
+
+    /* Only now is the lock released for the other nodes */
+    if (expiry->mode == LKM_EXMODE && driver->ownerInfo) {
+        virLockManagerDLMOwnerEncode(expiry->uuid, LKM_NLMODE, expiry->lvb);
+        expiry->lksb.sb_lvbptr = expiry->lvb;
+        flags |= LKF_VALBLK;
+    }
+
+    expiry->issued = true;
+    if (dlm_ls_lock(driver->lockspace, LKM_NLMODE, &expiry->lksb, flags,
+                    expiry->res->name, strlen(expiry->res->name), 0,
+                    virLockManagerDLMAst, &expiry->ast,
+                    NULL, NULL) < 0) {
+        VIR_WARN("unable to request lock %s: errno=%d",
+                 expiry->res->name, errno);
+        expiry->lksb.sb_status = errno;
+        virLockManagerDLMExpiryAst(expiry);
+    }
+}
+
+typedef struct {
+    unsigned long long now;
+    size_t nkept;
+    size_t nexpiries;
+    virLockManagerDLMExpiryPtr *expiries;
+} virLockManagerDLMGraceData;
+
+/* Must be called with the driver lock held */
+static int
+virLockManagerDLMGraceCollect(void *payload,
+                              const void *name ATTRIBUTE_UNUSED,
+                              void *opaque)
+{
+    virLockManagerDLMLockResourcePtr res = payload;
+    virLockManagerDLMGraceData *data = opaque;
+    virLockManagerDLMLockPtr lock;
+    virLockManagerDLMExpiryPtr expiry;
+    size_t i;
+
+    for (i = 0; i < res->nLocks; i++) {
+        lock = res->locks + i;
+
+        if (!lock->graceUntil || lock->expiring)
+            continue;
+
+        if (lock->graceUntil > data->now) {
+            if (!lock->cached)
+                data->nkept++;
+            continue;
+        }
+
+        if (VIR_ALLOC(expiry) < 0) {
+            virResetLastError();
+            data->nkept++;
+            continue;
+        }
+
+        expiry->res = res;
+        expiry->lkid = lock->lkid;
+        expiry->mode = lock->mode;
+        memcpy(expiry->uuid, lock->graceUuid, VIR_UUID_BUFLEN);
+        expiry->sched.resume = virLockManagerDLMExpiryResume;
+        expiry->sched.opaque = expiry;
+        expiry->sched.urgent = true;
+        expiry->sched.owner = expiry->uuid;
+        expiry->ast.func = virLockManagerDLMExpiryAst;
+        expiry->ast.opaque = expiry;
+
+        if (VIR_APPEND_ELEMENT(data->expiries, data->nexpiries, expiry) < 0) {
+            virResetLastError();
+            VIR_FREE(expiry);
+            data->nkept++;
+            continue;
+        }
+
+        lock->expiring = true;
+        res->nBusy += 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the locks whose grace period is over, or which another
+ * node asked for. The timer ticks every second as long as some are
+ * kept for a grace period.
+ */
+static void
+virLockManagerDLMGraceTimeout(int timer,
+                              void *opaque ATTRIBUTE_UNUSED)
+{
+    virLockManagerDLMGraceData data;
+    size_t i;
+
+    memset(&data, 0, sizeof(data));
+    if (virTimeMillisNow(&data.now) < 0)
+        return;
+
+    virMutexLock(&driver->lock);
+    virHashForEach(driver->resources, virLockManagerDLMGraceCollect, &data);
+    virEventUpdateTimeout(timer, data.nkept ? 1000 : -1);
+    virMutexUnlock(&driver->lock);
+
+    for (i = 0; i < data.nexpiries; i++) {
+        VIR_DEBUG("grace period of lock %s is over",
+                  data.expiries[i]->res->name);
+        if (virLockManagerDLMSchedAdmit(&data.expiries[i]->sched))
+            virLockManagerDLMExpiryResume(data.expiries[i]);
+    }
+
+    VIR_FREE(data.expiries);
+}
+
+/* Refresh the statistics file, read by the node exporter */
+static void
+virLockManagerDLMStatsTimeout(int timer ATTRIBUTE_UNUSED,
+                              void *opaque ATTRIBUTE_UNUSED)
+{
+    if (virDLMStatsWriteFile(driver->statsFile, driver->statsHot) < 0)
+        VIR_WARN("unable to write the statistics: %s",
+                 virGetLastErrorMessage());
+}
+
+/* Account a conflict on the resource @index of @man */
+static void
+virLockManagerDLMConflict(virLockManagerPtr man,
+                          size_t index,
+                          unsigned long long start)
+{
+    virLockManagerDLMPrivatePtr priv = man->privateData;
+    unsigned long long now = virDLMStatsNow();
+
+    virDLMStatsConflict(priv->resources[index].name,
+                        priv->resources[index].path,
+                        now > start ? now - start : 0);
+}
+
+static void
+virLockManagerDLMOpReportTimeout(virLockManagerDLMOpPtr op,
+                                 const char *owner)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+
+    if (owner)
+        virReportError(VIR_ERR_OPERATION_TIMEOUT,
+                       _("failed to acquire lock: timed out after %llu ms, %s"),
+                       priv->acquireTimeout, owner);
+    else
+        virReportError(VIR_ERR_OPERATION_TIMEOUT,
+                       _("failed to acquire lock: timed out after %llu ms"),
+                       priv->acquireTimeout);
+}
+
+static void
+virLockManagerDLMOpReportFailure(virLockManagerDLMOpPtr op,
+                                 int status,
+                                 const char *owner)
+{
+    if (status == EAGAIN) {
+        if (owner)
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("failed to acquire lock: the lock could not be granted, %s"),
+                           owner);
+        else
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("failed to acquire lock: the lock could not be granted"));
+    } else if (status == ECANCEL) {
+        virLockManagerDLMOpReportTimeout(op, owner);
+    } else {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("failed to acquire lock: lockStatus=%d"),
+                       status);
+    }
+}
+
+/* Must be called with the driver lock held */
+static virLockManagerDLMLockResourcePtr
+virLockManagerDLMResourceGet(const char *name)
+{
+    virLockManagerDLMLockResourcePtr res;
+
+    if ((res = virHashLookup(driver->resources, name)))
+        return res;
+
+    if (VIR_ALLOC(res) < 0)
+        return NULL;
+    if (VIR_STRDUP(res->name, name) < 0) {
+        VIR_FREE(res);
+        return NULL;
+    }
+
+    if (virHashAddEntry(driver->resources, res->name, res) < 0) {
+        VIR_FREE(res->name);
+        VIR_FREE(res);
+        return NULL;
+    }
+
+    return res;
+}
+
+/* Start of the SHA-256 of @name, identifying a resource in a lock state */
+static int
+virLockManagerDLMStateDigest(const char *name,
+                             char **digest)
+{
+    if (virLockManagerDLMHash(name, digest) < 0)
+        return -1;
+
+    (*digest)[VIR_LOCK_MANAGER_DLM_STATE_DIGEST_LEN] = '\0';
+    return 0;
+}
+
+/*
+ * Describe the locks held by the domain of @priv, @state is left
+ * NULL if there are none.
+ */
+static int
+virLockManagerDLMStateFormat(virLockManagerDLMPrivatePtr priv,
+                             char **state)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virLockManagerDLMLockResourcePtr res;
+    char *digest = NULL;
+    size_t nentries = 0;
+    size_t i, j;
+    int rv = -1;
+
+    *state = NULL;
+
+    /* Unused locks have no pid either */
+    if (priv->vm_pid == 0)
+        return 0;
+
+    virBufferAsprintf(&buf, "%s%d:%u", VIR_LOCK_MANAGER_DLM_STATE_PREFIX,
+                      VIR_LOCK_MANAGER_DLM_STATE_VERSION, driver->localNodeId);
+
+    virMutexLock(&driver->lock);
+
+    for (i = 0; i < priv->nresources; i++) {
+        if (!(res = virHashLookup(driver->resources, priv->resources[i].name)) ||
+            res->nHolders == 0)
+            continue;
+
+        for (j = 0; j < res->nLocks; j++) {
+            if (res->locks[j].vm_pid == priv->vm_pid)
+                break;
+        }
+
+        if (j == res->nLocks)
+            continue;
+
+        if (virLockManagerDLMStateDigest(res->name, &digest) < 0)
+            goto cleanup;
+
+        virBufferAsprintf(&buf, ";%s,%s,%x", digest,
+                          virLockManagerDLMModeTypeToString(res->locks[j].mode),
+                          res->locks[j].lkid);
+        VIR_FREE(digest);
+        nentries++;
+    }
+
+    if (nentries == 0) {
+        rv = 0;
+        goto cleanup;
+    }
+
+    if (virBufferCheckError(&buf) < 0)
+        goto cleanup;
+
+    *state = virBufferContentAndReset(&buf);
+    rv = 0;
+
+ cleanup:
+    virMutexUnlock(&driver->lock);
+    virBufferFreeAndReset(&buf);
+    return rv;
+}
+
+static void virLockManagerDLMBatchAst(void *opaque);
+
+/*
+ * Prepare a batch of conversions for the locks named by @state.
+ * A state coming from another driver or node is ignored, as well
+ * as the entries matching none of the resources of @op.
+ */
+static int
+virLockManagerDLMOpLoadState(virLockManagerDLMOpPtr op,
+                             const char *state)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMBatchReqPtr req;
+    char **digests = NULL;
+    char **entries = NULL;
+    char **fields = NULL;
+    unsigned int version, nodeId, lkid;
+    char *end;
+    int mode;
+    size_t i, j, k;
+    int rv = -1;
+
+    if (!state || !STRPREFIX(state, VIR_LOCK_MANAGER_DLM_STATE_PREFIX))
+        return 0;
+
+    if (!(entries = virStringSplit(state + strlen(VIR_LOCK_MANAGER_DLM_STATE_PREFIX),
+                                   ";", 0)))
+        goto cleanup;
+
+    if (!entries[0] ||
+        virStrToLong_ui(entries[0], &end, 10, &version) < 0 ||
+        *end != ':' ||
+        version != VIR_LOCK_MANAGER_DLM_STATE_VERSION ||
+        virStrToLong_ui(end + 1, NULL, 10, &nodeId) < 0) {
+        VIR_DEBUG("ignoring unknown lock state '%s'", state);
+        rv = 0;
+        goto cleanup;
+    }
+
+    /* Lock IDs are only meaningful on the node which made them */
+    if (nodeId != driver->localNodeId) {
+        VIR_DEBUG("ignoring lock state of node %u", nodeId);
+        rv = 0;
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC_N(digests, priv->nresources + 1) < 0 ||
+        VIR_ALLOC_N(op->batch, priv->nresources) < 0 ||
+        VIR_ALLOC_N(op->granted, priv->nresources) < 0)
+        goto cleanup;
+
+    for (i = 0; i < priv->nresources; i++) {
+        if (virLockManagerDLMStateDigest(priv->resources[i].name,
+                                         digests + i) < 0)
+            goto cleanup;
+    }
+
+    for (i = 1; entries[i]; i++) {
+        virStringListFree(fields);
+        if (!(fields = virStringSplit(entries[i], ",", 0)))
+            goto cleanup;
+
+        if (virStringListLength((const char **)fields) != 3 ||
+            (mode = virLockManagerDLMModeTypeFromString(fields[1])) < 0 ||
+            virStrToLong_ui(fields[2], NULL, 16, &lkid) < 0) {
+            VIR_DEBUG("ignoring malformed lock state entry '%s'", entries[i]);
+            continue;
+        }
+
+        for (j = 0; j < priv->nresources; j++) {
+            if (STREQ(digests[j], fields[0]) &&
+                priv->resources[j].mode == mode)
+                break;
+        }
+
+        if (j == priv->nresources)
+            continue;
+
+        for (k = 0; k < op->nbatch; k++) {
+            if (op->batch[k].resource == j)
+                break;
+        }
+
+        if (k < op->nbatch)
+            continue;
+
+        req = op->batch + op->nbatch++;
+        req->op = op;
+        req->ast.func = virLockManagerDLMBatchAst;
+        req->ast.opaque = req;
+        req->resource = j;
+        req->lkid = lkid;
+    }
+
+    VIR_DEBUG("%zu of %zu resources found in the lock state",
+              op->nbatch, priv->nresources);
+
+    rv = 0;
+ cleanup:
+    virStringListFree(fields);
+    virStringListFree(entries);
+    virStringListFree(digests);
+    return rv;
+}
+
+/*
+ * Must be called with @op locked. Reserve the locks of the batch
+ * which are still there and unused, returns 1 if there are some
+ * to convert, 0 otherwise. A handoff has no lock yet, it only
+ * needs the resources.
+ */
+static int
+virLockManagerDLMOpNextBatch(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMBatchReqPtr req;
+    virLockManagerDLMLockResourcePtr res;
+    size_t nreserved = 0;
+    size_t i, index;
+
+    virMutexLock(&driver->lock);
+
+    for (i = 0; i < op->nbatch; i++) {
+        req = op->batch + i;
+
+        if (op->handoff) {
+            if (!(res = virLockManagerDLMResourceGet(priv->resources[req->resource].name))) {
+                virResetLastError();
+                continue;
+            }
+
+            req->res = res;
+            res->nBusy += 1;
+            nreserved++;
+            continue;
+        }
+
+        if (!(res = virHashLookup(driver->resources,
+                                  priv->resources[req->resource].name)))
+            continue;
+
+        for (index = 0; index < res->nLocks; index++) {
+            if (res->locks[index].lkid == req->lkid &&
+                res->locks[index].vm_pid == 0 &&
+                !res->locks[index].graceUntil)
+                break;
+        }
+
+        if (index == res->nLocks)
+            continue;
+
+        req->res = res;
+        req->index = index;
+        res->locks[index].vm_pid = priv->vm_pid;
+        res->locks[index].retainedUntil = 0;
+        res->nBusy += 1;
+        nreserved++;
+    }
+
+    virMutexUnlock(&driver->lock);
+
+    if (nreserved == 0) {
+        VIR_DEBUG("none of the %zu locks of the state is left", op->nbatch);
+        VIR_FREE(op->batch);
+        op->nbatch = 0;
+        return 0;
+    }
+
+    op->phase = VIR_LOCK_MANAGER_DLM_PHASE_BATCH;
+    return 1;
+}
+
+/*
+ * Must be called with @op locked. Issue every conversion of the
+ * batch, returns false if none could be.
+ */
+static bool
+virLockManagerDLMOpIssueBatch(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMBatchReqPtr req;
+    unsigned int flags = LKF_CONVERT|LKF_PERSISTENT|LKF_NOQUEUE;
+    size_t i;
+
+    /* New locks, queued behind the source of the migration */
+    if (op->handoff)
+        flags = LKF_PERSISTENT;
+
+    for (i = 0; i < op->nbatch; i++) {
+        req = op->batch + i;
+        if (!req->res)
+            continue;
+
+        memset(&req->lksb, 0, sizeof(req->lksb));
+        req->lksb.sb_lkid = req->lkid;
+
+        if (op->canceled) {
+            req->lksb.sb_status = ECANCEL;
+            continue;
+        }
+
+        req->issuedAt = virDLMStatsNow();
+        if (dlm_ls_lock(driver->lockspace, priv->resources[req->resource].mode,
+                        &req->lksb, flags,
+                        req->res->name, strlen(req->res->name), 0,
+                        virLockManagerDLMAst, &req->ast,
+                        NULL, NULL) < 0) {
+            VIR_WARN("unable to request lock %s: errno=%d",
+                     req->res->name, errno);
+            req->lksb.sb_status = errno;
+            continue;
+        }
+
+        virDLMRecorderAdd(op->handoff ? VIR_DLM_RECORDER_LOCK :
+                          VIR_DLM_RECORDER_CONVERT,
+                          req->res->name, req->lksb.sb_lkid, priv->vm_pid,
+                          priv->resources[req->resource].mode, 0, 0);
+        if (op->handoff)
+            DLM_PROBE(CREATE_BEGIN, priv->vm_uuid, req->res->name,
+                      priv->resources[req->resource].mode,
+                      req->lksb.sb_lkid);
+        else
+            DLM_PROBE(CONVERT_BEGIN, priv->vm_uuid, req->res->name,
+                      priv->resources[req->resource].mode,
+                      req->lksb.sb_lkid);
+        req->issued = true;
+        op->npending++;
+    }
+
+    return op->npending > 0;
+}
+
+static void
+virLockManagerDLMBatchAst(void *opaque)
+{
+    virLockManagerDLMBatchReqPtr req = opaque;
+    virLockManagerDLMOpPtr op = req->op;
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    bool last;
+
+    virObjectLock(op);
+    req->issued = false;
+
+    /* A handoff request waits for the source by design, only its
+     * outcome is accounted */
+    if (req->publishing || !op->handoff)
+        virDLMStatsEnd(VIR_DLM_STATS_STEP_CONVERT, req->issuedAt);
+    virDLMStatsResultAdd(req->lksb.sb_status);
+    virLockManagerDLMRecordComplete(req->res->name, &req->lksb, priv->vm_pid,
+                                    priv->resources[req->resource].mode,
+                                    req->issuedAt);
+    if (op->handoff && !req->publishing)
+        DLM_PROBE(CREATE_END, priv->vm_uuid, req->res->name,
+                  priv->resources[req->resource].mode,
+                  req->lksb.sb_lkid, req->lksb.sb_status);
+    else
+        DLM_PROBE(CONVERT_END, priv->vm_uuid, req->res->name,
+                  req->publishing ? LKM_EXMODE :
+                  priv->resources[req->resource].mode,
+                  req->lksb.sb_lkid, req->lksb.sb_status);
+    if (!req->publishing &&
+        (req->lksb.sb_status == EAGAIN || req->lksb.sb_status == ECANCEL))
+        virLockManagerDLMConflict(op->man, req->resource, req->issuedAt);
+
+    if (req->publishing) {
+        /* The lock is held anyway */
+        if (req->lksb.sb_status != 0)
+            VIR_WARN("unable to publish the owner of lock %s, lockStatus=%d",
+                     req->res->name, req->lksb.sb_status);
+        req->lksb.sb_status = 0;
+    } else if (req->lksb.sb_status == 0 &&
+               priv->resources[req->resource].mode == LKM_EXMODE &&
+               driver->ownerInfo) {
+        req->publishing = true;
+        virLockManagerDLMOwnerEncode(priv->vm_uuid, LKM_EXMODE, req->lvb);
+        req->lksb.sb_lvbptr = req->lvb;
+
+        req->issuedAt = virDLMStatsNow();
+        if (dlm_ls_lock(driver->lockspace, LKM_EXMODE, &req->lksb,
+                        LKF_CONVERT|LKF_PERSISTENT|LKF_VALBLK,
+                        req->res->name, strlen(req->res->name), 0,
+                        virLockManagerDLMAst, &req->ast,
+                        NULL, NULL) == 0) {
+            virDLMRecorderAdd(VIR_DLM_RECORDER_CONVERT, req->res->name,
+                              req->lksb.sb_lkid, priv->vm_pid, LKM_EXMODE,
+                              0, 0);
+            DLM_PROBE(CONVERT_BEGIN, priv->vm_uuid, req->res->name,
+                      LKM_EXMODE, req->lksb.sb_lkid);
+            virObjectUnlock(op);
+            return;
+        }
+
+        VIR_WARN("unable to publish the owner of lock %s: errno=%d",
+                 req->res->name, errno);
+        req->lksb.sb_status = 0;
+    }
+
+    last = --op->npending == 0;
+    virObjectUnlock(op);
+
+    if (last)
+        virLockManagerDLMOpAst(op);
+}
+
+/*
+ * Must be called with @op locked, once every request of the batch
+ * is completed. The resources it did not get are then acquired the
+ * usual way.
+ */
+static int
+virLockManagerDLMOpGrantedBatch(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMBatchReqPtr req;
+    virLockManagerDLMLockResourcePtr res;
+    size_t i;
+    int rv = 0;
+
+    virMutexLock(&driver->lock);
+
+    for (i = 0; i < op->nbatch; i++) {
+        req = op->batch + i;
+        if (!(res = req->res))
+            continue;
+
+        res->nBusy -= 1;
+
+        if (req->lksb.sb_status != 0) {
+            VIR_DEBUG("unable to get lock %s lkid=%u of the state, lockStatus=%d",
+                      res->name, req->lksb.sb_lkid, req->lksb.sb_status);
+            if (!op->handoff)
+                res->locks[req->index].vm_pid = 0;
+            continue;
+        }
+
+        if (op->handoff) {
+            if (VIR_EXPAND_N(res->locks, res->nLocks, 1) < 0) {
+                /* Left behind, but still recorded by the DLM */
+                VIR_WARN("unable to record lock %s lkid=%u",
+                         res->name, req->lksb.sb_lkid);
+                virResetLastError();
+                continue;
+            }
+
+            req->index = res->nLocks - 1;
+            res->locks[req->index].vm_pid = priv->vm_pid;
+            res->locks[req->index].lkid = req->lksb.sb_lkid;
+        }
+
+        res->nHolders += 1;
+        res->locks[req->index].mode = priv->resources[req->resource].mode;
+        res->locks[req->index].bast = false;
+        op->granted[req->resource] = true;
+
+        if (rv == 0 &&
+            virLockManagerDLMWrite(res->locks + req->index, res->name) < 0) {
+            virReportSystemError(errno, "%s",
+                                 "unable to write lock information to file");
+            rv = -1;
+        }
+    }
+
+    virMutexUnlock(&driver->lock);
+
+    VIR_FREE(op->batch);
+    op->nbatch = 0;
+    return rv;
+}
+
+/*
+ * Must be called with @op locked. Returns 1 if a request was
+ * recorded, 0 if every resource is acquired, -1 on error.
+ */
+static int
+virLockManagerDLMOpNextAcquire(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMResourcePtr args;
+    virLockManagerDLMLockResourcePtr res;
+    size_t index;
+    int rv = -1;
+
+    if (op->nbatch &&
+        (rv = virLockManagerDLMOpNextBatch(op)) != 0)
+        return rv;
+
+    virMutexLock(&driver->lock);
+
+ retry:
+    /* Skip what the batch already acquired */
+    while (op->granted && op->next < op->end &&
+           op->granted[op->next])
+        op->next++;
+
+    if (op->next == op->end) {
+        rv = 0;
+        goto cleanup;
+    }
+
+    rv = -1;
+
+    args = priv->resources + op->next;
+
+    if (!(res = virLockManagerDLMResourceGet(args->name)))
+        goto cleanup;
+
+    op->res = res;
+    op->held = false;
+    op->rebound = false;
+    op->cache = NULL;
+    memset(&op->lksb, 0, sizeof(op->lksb));
+
+    /* A lock the domain released within the grace period is still
+     * granted, it only has to be given to the new process. So is a
+     * cached lock, whatever domain of this node released it */
+    if (!op->update) {
+        for (index = 0; index < res->nLocks; index++) {
+            if (res->locks[index].graceUntil &&
+                !res->locks[index].expiring &&
+                (res->locks[index].cached ||
+                 memcmp(res->locks[index].graceUuid, priv->vm_uuid,
+                        VIR_UUID_BUFLEN) == 0))
+                break;
+        }
+
+        if (index < res->nLocks) {
+            op->graceUntil = res->locks[index].graceUntil;
+            res->locks[index].graceUntil = 0;
+            res->locks[index].vm_pid = priv->vm_pid;
+
+            if (res->locks[index].mode == args->mode) {
+                VIR_DEBUG("rebinding lock %s to pid=%lld",
+                          res->name, (long long)priv->vm_pid);
+                res->locks[index].cached = false;
+                if (virLockManagerDLMWrite(res->locks + index,
+                                           res->name) < 0) {
+                    virReportSystemError(errno, "%s",
+                                         "unable to write lock information to file");
+                    res->locks[index].vm_pid = 0;
+                    res->locks[index].graceUntil = op->graceUntil;
+                    res->locks[index].cached = op->graceUntil == ULLONG_MAX;
+                    goto cleanup;
+                }
+
+                op->res = NULL;
+                op->next++;
+                goto retry;
+            }
+
+            /* Converted like a held lock, but kept again if that
+             * fails */
+            op->held = true;
+            op->rebound = true;
+        }
+    }
+
+    /* An update converts the lock the domain holds in place */
+    if (op->update) {
+        for (index = 0; index < res->nLocks; index++) {
+            if (res->locks[index].vm_pid == priv->vm_pid)
+                break;
+        }
+        op->held = index < res->nLocks;
+    }
+
+    /* Reuse a lock left at NL by a previous holder if any, it is
+     * reserved by setting its pid until the conversion is over */
+    if (!op->held) {
+        for (index = 0; index < res->nLocks; index++) {
+            if (res->locks[index].vm_pid == 0 &&
+                !res->locks[index].graceUntil)
+                break;
+        }
+    }
+
+    if (index < res->nLocks) {
+        op->phase = VIR_LOCK_MANAGER_DLM_PHASE_CONVERT;
+        op->index = index;
+        op->lksb.sb_lkid = res->locks[index].lkid;
+        op->cache = virLockManagerDLMLockCacheGet(res, index);
+        res->locks[index].vm_pid = priv->vm_pid;
+        res->locks[index].retainedUntil = 0;
+
+        virLockManagerDLMOpSubmit(op, args->mode, op->convertFlags);
+    } else {
+        op->phase = VIR_LOCK_MANAGER_DLM_PHASE_CREATE;
+
+        virLockManagerDLMOpSubmit(op, LKM_NLMODE, LKF_EXPEDITE);
+    }
+
+    res->nBusy += 1;
+    rv = 1;
+
+ cleanup:
+    if (rv < 0)
+        op->res = NULL;
+    virMutexUnlock(&driver->lock);
+    return rv;
+}
+
+/*
+ * Must be called with @op locked, once the request on the current
+ * resource is completed. Returns 1 if a further request was
+ * recorded for it, 0 if it is acquired, -1 on error.
+ */
+static int
+virLockManagerDLMOpGrantedAcquire(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMResourcePtr args = priv->resources + op->next;
+    virLockManagerDLMLockResourcePtr res = op->res;
+    int status = op->lksb.sb_status;
+    char *owner = NULL;
+    int rv = -1;
+
+    if (op->phase == VIR_LOCK_MANAGER_DLM_PHASE_BATCH)
+        return virLockManagerDLMOpGrantedBatch(op);
+
+    virMutexLock(&driver->lock);
+
+    switch (op->phase) {
+    case VIR_LOCK_MANAGER_DLM_PHASE_CREATE:
+        if (status == ECANCEL) {
+            virLockManagerDLMOpReportTimeout(op, NULL);
+            goto error;
+        } else if (status != 0) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("unable to add NL lock, lockStatus=%d"),
+                           status);
+            goto error;
+        }
+
+        if (VIR_EXPAND_N(res->locks, res->nLocks, 1) < 0)
+            goto error;
+
+        op->index = res->nLocks - 1;
+        res->locks[op->index].vm_pid = priv->vm_pid;
+        res->locks[op->index].lkid = op->lksb.sb_lkid;
+        op->cache = virLockManagerDLMLockCacheGet(res, op->index);
+
+        if (op->canceled) {
+            res->locks[op->index].vm_pid = 0;
+            virLockManagerDLMOpReportTimeout(op, NULL);
+            goto error;
+        }
+
+        op->phase = VIR_LOCK_MANAGER_DLM_PHASE_CONVERT;
+        virLockManagerDLMOpSubmit(op, args->mode, op->convertFlags);
+
+        rv = 1;
+        goto cleanup;
+
+    case VIR_LOCK_MANAGER_DLM_PHASE_CONVERT:
+        if (status == 0)
+            break;
+
+        /* Find out who is in the way before giving up, the lock is
+         * kept reserved meanwhile. A held lock can't be queried, it
+         * would have to be converted to NL */
+        if ((status == EAGAIN || status == ECANCEL) && driver->ownerInfo &&
+            !op->held) {
+            op->phase = VIR_LOCK_MANAGER_DLM_PHASE_QUERY;
+            op->failure = status;
+            op->cache = NULL;
+            res->locks[op->index].bast = false;
+            memset(op->lvb, 0, sizeof(op->lvb));
+            op->lksb.sb_lvbptr = op->lvb;
+            virLockManagerDLMOpSubmit(op, LKM_NLMODE, LKF_CONVERT|LKF_VALBLK);
+
+            rv = 1;
+            goto cleanup;
+        }
+
+        /* A held lock stays in its former mode, and a lock kept
+         * after a release keeps waiting for its domain */
+        if (!op->held) {
+            res->locks[op->index].vm_pid = 0;
+        } else if (op->rebound) {
+            res->locks[op->index].vm_pid = 0;
+            res->locks[op->index].graceUntil = op->graceUntil;
+
+            /* It may have lost its blocking AST */
+            if (op->graceUntil == ULLONG_MAX) {
+                res->locks[op->index].graceUntil = 1;
+                res->locks[op->index].cached = false;
+                virEventUpdateTimeout(driver->graceTimer, 0);
+            }
+        }
+        virLockManagerDLMOpReportFailure(op, status, NULL);
+        goto error;
+
+    case VIR_LOCK_MANAGER_DLM_PHASE_QUERY:
+        res->locks[op->index].vm_pid = 0;
+
+        if (status == 0)
+            owner = virLockManagerDLMOwnerFormat(op->lvb, op->lksb.sb_flags);
+        else
+            VIR_DEBUG("unable to read the owner of lock %s, lockStatus=%d",
+                      res->name, status);
+
+        virLockManagerDLMOpReportFailure(op, op->failure, owner);
+        goto error;
+
+    case VIR_LOCK_MANAGER_DLM_PHASE_PUBLISH:
+        /* The lock is held anyway */
+        if (status != 0)
+            VIR_WARN("unable to publish the owner of lock %s, lockStatus=%d",
+                     res->name, status);
+        goto done;
+
+    case VIR_LOCK_MANAGER_DLM_PHASE_BATCH:
+        break;
+    }
+
+    if (!op->held)
+        res->nHolders += 1;
+    res->locks[op->index].mode = args->mode;
+    res->locks[op->index].cached = false;
+    res->locks[op->index].bast = !!op->cache;
+    res->locks[op->index].contended = false;
+
+    if (virLockManagerDLMWrite(res->locks + op->index, res->name) < 0) {
+        virReportSystemError(errno, "%s",
+                             "unable to write lock information to file");
+        goto error;
+    }
+
+    /* Only exclusive holders may write the value block */
+    if (args->mode == LKM_EXMODE && driver->ownerInfo) {
+        op->phase = VIR_LOCK_MANAGER_DLM_PHASE_PUBLISH;
+        virLockManagerDLMOwnerEncode(priv->vm_uuid, LKM_EXMODE, op->lvb);
+        op->lksb.sb_lvbptr = op->lvb;
+        virLockManagerDLMOpSubmit(op, LKM_EXMODE,
+                                  LKF_CONVERT|LKF_PERSISTENT|LKF_VALBLK);
+
+        rv = 1;
+        goto cleanup;
+    }
+
+ done:
+    res->nBusy -= 1;
+    op->res = NULL;
+    op->next++;
+
+    rv = 0;
+    goto cleanup;
+
+ error:
+    res->nBusy -= 1;
+    op->res = NULL;
+ cleanup:
+    virMutexUnlock(&driver->lock);
+    VIR_FREE(owner);
+    return rv;
+}
+
+/* Same as virLockManagerDLMOpNextAcquire, for a release */
+static int
+virLockManagerDLMOpNextRelease(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    virLockManagerDLMResourcePtr args;
+    virLockManagerDLMLockResourcePtr res;
+    unsigned long long now;
+    unsigned int flags;
+    bool cached;
+    size_t index;
+
+    for (; op->next < op->end; op->next++) {
+        args = priv->resources + op->next;
+
+        virMutexLock(&driver->lock);
+
+        if (!(res = virHashLookup(driver->resources, args->name)) ||
+            res->nHolders == 0) {
+            virMutexUnlock(&driver->lock);
+            continue;
+        }
+
+        for (index = 0; index < res->nLocks; index++) {
+            if (priv->vm_pid == res->locks[index].vm_pid)
+                break;
+        }
+
+        if (index == res->nLocks) {
+            virMutexUnlock(&driver->lock);
+            continue;
+        }
+
+        /* Keep the lock granted until another node asks for it if
+         * it can tell, else for a restart of the domain, unless a
+         * lock state was handed out for another process to use */
+        cached = driver->lockCaching && res->locks[index].bast &&
+            !res->locks[index].contended;
+        if (driver->graceTimer >= 0 && !op->retain && !op->update &&
+            !op->rollback &&
+            (cached ||
+             (driver->releaseGrace &&
+              (res->locks[index].mode == LKM_EXMODE ||
+               res->locks[index].mode == LKM_PRMODE))) &&
+            virTimeMillisNow(&now) == 0) {
+            /* Recorded as released but still granted, which a
+             * restarted driver releases instead of adopting it as
+             * held by the domain */
+            res->locks[index].vm_pid = 0;
+            if (virLockManagerDLMWrite(res->locks + index, res->name) == 0) {
+                res->locks[index].cached = cached;
+                memcpy(res->locks[index].graceUuid, priv->vm_uuid,
+                       VIR_UUID_BUFLEN);
+                if (cached) {
+                    VIR_DEBUG("caching lock %s", res->name);
+                    res->locks[index].graceUntil = ULLONG_MAX;
+                } else {
+                    VIR_DEBUG("keeping lock %s for %llu ms",
+                              res->name, driver->releaseGrace);
+                    res->locks[index].graceUntil = now + driver->releaseGrace;
+                    virEventUpdateTimeout(driver->graceTimer, 1000);
+                }
+                virMutexUnlock(&driver->lock);
+                continue;
+            }
+
+            VIR_WARN("unable to record lock %s as released, releasing it "
+                     "now: errno=%d", res->name, errno);
+            res->locks[index].vm_pid = priv->vm_pid;
+        }
+
+        op->res = res;
+        op->index = index;
+        memset(&op->lksb, 0, sizeof(op->lksb));
+        op->lksb.sb_lkid = res->locks[index].lkid;
+        flags = LKF_CONVERT;
+
+        /* Leave a released record behind for the next one who
+         * fails to get it */
+        if (res->locks[index].mode == LKM_EXMODE && driver->ownerInfo) {
+            virLockManagerDLMOwnerEncode(priv->vm_uuid, LKM_NLMODE, op->lvb);
+            op->lksb.sb_lvbptr = op->lvb;
+            flags |= LKF_VALBLK;
+        }
+
+        virLockManagerDLMOpSubmit(op, LKM_NLMODE, flags);
+        res->nBusy += 1;
+
+        virMutexUnlock(&driver->lock);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Same as virLockManagerDLMOpGrantedAcquire, for a release */
+static int
+virLockManagerDLMOpGrantedRelease(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMLockResourcePtr res = op->res;
+    int status = op->lksb.sb_status;
+    unsigned long long now;
+    int rv = -1;
+
+    virMutexLock(&driver->lock);
+
+    res->nBusy -= 1;
+    op->res = NULL;
+    op->next++;
+
+    if (status != 0) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("failed to release lock: lockStatus=%d"),
+                       status);
+        goto cleanup;
+    }
+
+    res->nHolders -= 1;
+    res->locks[op->index].vm_pid = 0;
+    res->locks[op->index].mode = LKM_NLMODE;
+    res->locks[op->index].bast = false;
+    res->locks[op->index].contended = false;
+    res->locks[op->index].retainedUntil = 0;
+    if (op->retain && virTimeMillisNow(&now) == 0)
+        res->locks[op->index].retainedUntil = now + driver->stateRetention;
+
+    if (virLockManagerDLMWrite(res->locks + op->index, res->name) < 0) {
+        virReportSystemError(errno, "%s",
+                             "unable to write lock information to file");
+        goto cleanup;
+    }
+
+    rv = 0;
+ cleanup:
+    virMutexUnlock(&driver->lock);
+    return rv;
+}
+
+/*
+ * Must be called with @op locked, once the acquire @op failed. It
+ * then releases what it got so far, so that a domain which fails
+ * to start does not keep a part of its locks, and is completed with
+ * the error of the acquire. Returns 1 if a release was recorded, 0
+ * once the rollback is over, -1 if there is nothing to roll back.
+ */
+static int
+virLockManagerDLMOpRollback(virLockManagerDLMOpPtr op)
+{
+    int rv;
+
+    /* Give up on that one, the others are released anyway */
+    if (op->rollback) {
+        VIR_WARN("unable to roll back a lock: %s", virGetLastErrorMessage());
+        return virLockManagerDLMOpNextRelease(op);
+    }
+
+    /* An update has its own way back */
+    if (op->type != VIR_LOCK_MANAGER_DLM_OP_ACQUIRE || op->update)
+        return -1;
+
+    op->error = virSaveLastError();
+    op->type = VIR_LOCK_MANAGER_DLM_OP_RELEASE;
+    op->rollback = true;
+    op->next = op->end - op->count;
+    op->phase = VIR_LOCK_MANAGER_DLM_PHASE_CONVERT;
+    op->cache = NULL;
+
+    if ((rv = virLockManagerDLMOpNextRelease(op)) == 0) {
+        virSetError(op->error);
+        virFreeError(op->error);
+        op->error = NULL;
+        op->type = VIR_LOCK_MANAGER_DLM_OP_ACQUIRE;
+        op->rollback = false;
+        return -1;
+    }
+
+    VIR_DEBUG("acquire failed, releasing the locks it got");
+    return rv;
+}
+
+/* Must be called with @op locked */
+static int
+virLockManagerDLMOpNext(virLockManagerDLMOpPtr op)
+{
+    if (op->canceled && !op->rollback) {
+        virLockManagerDLMOpReportTimeout(op, NULL);
+        return -1;
+    }
+
+    if (op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE)
+        return virLockManagerDLMOpNextAcquire(op);
+    else
+        return virLockManagerDLMOpNextRelease(op);
+}
+
+/* Report the outcome and drop the reference held by the operation */
+static void
+virLockManagerDLMOpFinish(virLockManagerDLMOpPtr op,
+                          int result)
+{
+    char *state = NULL;
+
+    virObjectLock(op);
+    op->done = true;
+    if (op->timer >= 0) {
+        virEventRemoveTimeout(op->timer);
+        op->timer = -1;
+    }
+    if (op->rollback) {
+        virSetError(op->error);
+        result = -1;
+    }
+    if (result == 0)
+        VIR_STEAL_PTR(state, op->state);
+    virObjectUnlock(op);
+
+    if (op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE || op->rollback)
+        DLM_PROBE(ACQUIRE_END, op->sched.owner, op->count, result);
+    else
+        DLM_PROBE(RELEASE_END, op->sched.owner, op->count, result);
+
+    op->cb(op->man, result, state, op->opaque);
+    virObjectUnref(op);
+}
+
+static void
+virLockManagerDLMOpAst(void *opaque)
+{
+    virLockManagerDLMOpPtr op = opaque;
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+    int rv;
+
+    bool issued;
+
+    virObjectLock(op);
+    issued = op->issued;
+    op->issued = false;
+
+    /* The requests of a batch are accounted one by one */
+    if (op->phase != VIR_LOCK_MANAGER_DLM_PHASE_BATCH) {
+        virLockManagerDLMRecordComplete(op->res ? op->res->name : NULL,
+                                        &op->lksb, priv->vm_pid, op->mode,
+                                        issued ? op->issuedAt : 0);
+        if (issued)
+            virDLMStatsEnd(op->phase == VIR_LOCK_MANAGER_DLM_PHASE_CREATE ?
+                           VIR_DLM_STATS_STEP_CREATE :
+                           VIR_DLM_STATS_STEP_CONVERT, op->issuedAt);
+        if (issued && op->phase == VIR_LOCK_MANAGER_DLM_PHASE_CREATE)
+            DLM_PROBE(CREATE_END, priv->vm_uuid, op->res->name, op->mode,
+                      op->lksb.sb_lkid, op->lksb.sb_status);
+        else if (issued)
+            DLM_PROBE(CONVERT_END, priv->vm_uuid, op->res->name, op->mode,
+                      op->lksb.sb_lkid, op->lksb.sb_status);
+        virDLMStatsResultAdd(op->lksb.sb_status);
+
+        if (issued && op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE &&
+            op->phase == VIR_LOCK_MANAGER_DLM_PHASE_CONVERT &&
+            (op->lksb.sb_status == EAGAIN || op->lksb.sb_status == ECANCEL))
+            virLockManagerDLMConflict(op->man, op->next, op->issuedAt);
+    }
+
+    if (op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE)
+        rv = virLockManagerDLMOpGrantedAcquire(op);
+    else
+        rv = virLockManagerDLMOpGrantedRelease(op);
+
+    if (rv == 0)
+        rv = virLockManagerDLMOpNext(op);
+    if (rv < 0)
+        rv = virLockManagerDLMOpRollback(op);
+    virObjectUnlock(op);
+
+    if (issued)
+        virLockManagerDLMSchedDone();
+
+    if (rv > 0)
+        virLockManagerDLMOpSchedule(op);
+    else
+        virLockManagerDLMOpFinish(op, rv);
+}
+
+/*
+ * Give up waiting. The completion AST of the pending request
+ * tells whether it was canceled or granted in the meantime, the
+ * operation then stops with a timeout error.
+ */
+static void
+virLockManagerDLMOpCancel(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMBatchReqPtr req;
+    bool dequeued = false;
+    size_t i;
+
+    virObjectLock(op);
+
+    /* A rollback has to go through */
+    if (op->done || op->canceled || op->rollback)
+        goto cleanup;
+
+    op->canceled = true;
+
+    if (op->issued && op->phase == VIR_LOCK_MANAGER_DLM_PHASE_BATCH) {
+        for (i = 0; i < op->nbatch; i++) {
+            req = op->batch + i;
+            if (!req->issued || req->publishing)
+                continue;
+
+            virDLMRecorderAdd(VIR_DLM_RECORDER_CANCEL, req->res->name,
+                              req->lksb.sb_lkid, 0, LKM_NLMODE, 0, 0);
+            if (dlm_ls_unlock(driver->lockspace, req->lksb.sb_lkid,
+                              LKF_CANCEL, &req->lksb, &req->ast) < 0)
+                VIR_DEBUG("unable to cancel request, errno=%d", errno);
+        }
+    } else if (op->issued) {
+        VIR_DEBUG("canceling request on lock %s lkid=%u",
+                  op->res->name, op->lksb.sb_lkid);
+        virDLMRecorderAdd(VIR_DLM_RECORDER_CANCEL, op->res->name,
+                          op->lksb.sb_lkid, 0, op->mode, 0, 0);
+        if (dlm_ls_unlock(driver->lockspace, op->lksb.sb_lkid,
+                          LKF_CANCEL, &op->lksb, &op->ast) < 0)
+            VIR_DEBUG("unable to cancel request, errno=%d", errno);
+    } else if (virLockManagerDLMSchedRemove(&op->sched)) {
+        op->lksb.sb_status = ECANCEL;
+        dequeued = true;
+    }
+
+ cleanup:
+    virObjectUnlock(op);
+
+    if (dequeued)
+        virLockManagerDLMOpAst(op);
+}
+
+static void
+virLockManagerDLMOpTimeout(int timer,
+                           void *opaque)
+{
+    virLockManagerDLMOpPtr op = opaque;
+
+    virEventUpdateTimeout(timer, -1);
+    virLockManagerDLMOpCancel(op);
+}
+
+/*
+ * Submit the first request of @op. With @useTimer the deadline is
+ * enforced from the event loop, else the caller has to do it.
+ *
+ * Returns 0 if the completion callback will be, or already was,
+ * invoked, -1 on error. On error the caller keeps its reference.
+ */
+static int
+virLockManagerDLMOpStart(virLockManagerDLMOpPtr op,
+                         bool useTimer)
+{
+    unsigned long long now;
+    int rv;
+
+    if (useTimer && op->deadline) {
+        if (virTimeMillisNow(&now) < 0)
+            return -1;
+
+        op->timer = virEventAddTimeout(op->deadline > now ? op->deadline - now : 0,
+                                       virLockManagerDLMOpTimeout,
+                                       virObjectRef(op),
+                                       virObjectFreeCallback);
+        if (op->timer < 0) {
+            virObjectUnref(op);
+            virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("unable to register acquire timeout"));
+            return -1;
+        }
+    }
+
+    op->count = op->end - op->next;
+    if (op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE)
+        DLM_PROBE(ACQUIRE_BEGIN, op->sched.owner, op->count);
+    else
+        DLM_PROBE(RELEASE_BEGIN, op->sched.owner, op->count);
+
+    virObjectLock(op);
+    if ((rv = virLockManagerDLMOpNext(op)) < 0)
+        rv = virLockManagerDLMOpRollback(op);
+    if (rv < 0 && op->timer >= 0) {
+        virEventRemoveTimeout(op->timer);
+        op->timer = -1;
+    }
+    virObjectUnlock(op);
+
+    if (rv < 0 && op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE)
+        DLM_PROBE(ACQUIRE_END, op->sched.owner, op->count, -1);
+    else if (rv < 0)
+        DLM_PROBE(RELEASE_END, op->sched.owner, op->count, -1);
+
+    if (rv == 0)
+        virLockManagerDLMOpFinish(op, 0);
+    else if (rv > 0)
+        virLockManagerDLMOpSchedule(op);
+
+    return rv < 0 ? -1 : 0;
+}
+
+static void
+virLockManagerDLMWaiterComplete(virLockManagerPtr man ATTRIBUTE_UNUSED,
+                                int result,
+                                char *state,
+                                void *opaque)
+{
+    virLockManagerDLMWaiterPtr waiter = opaque;
+
+    waiter->result = result;
+    waiter->state = state;
+    if (result < 0)
+        waiter->error = virSaveLastError();
+
+    virLockManagerDLMWaiterWake(waiter);
+}
+
+/*
+ * Run @op, created with virLockManagerDLMWaiterComplete and @waiter,
+ * until it is over. The deadline is enforced here rather than by a
+ * timer, there may be no event loop in this process.
+ */
+static int
+virLockManagerDLMOpRun(virLockManagerDLMOpPtr op,
+                       virLockManagerDLMWaiterPtr waiter)
+{
+    bool canceled = false;
+
+    virObjectRef(op);
+
+    if (virLockManagerDLMOpStart(op, false) < 0) {
+        virObjectUnref(op);
+        virObjectUnref(op);
+        return -1;
+    }
+
+    while (virLockManagerDLMWaiterWait(waiter,
+                                       canceled ? 0 : op->deadline) > 0) {
+        virLockManagerDLMOpCancel(op);
+        canceled = true;
+    }
+
+    virObjectUnref(op);
+
+    if (waiter->result < 0) {
+        virSetError(waiter->error);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+virLockManagerDLMAcquireCheck(virLockManagerDLMPrivatePtr priv)
+{
+    if (priv->nresources == 0 &&
+        priv->hasRWDisks &&
+        driver->requireLeaseForDisks) {
+        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
+                       _("read/write, exclusive access, disk were present, but no leases specified"));
+        return -1;
+    }
+
+    if (!driver->lockspace) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("lockspace is not opened"));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Nothing would deliver the ASTs of an operation nobody waits for */
+static int
+virLockManagerDLMAsyncCheck(void)
+{
+    if (driver->dlmWatch < 0) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("asynchronous lock operations need an event loop"));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Apply the wait policy of the lock manager to the acquire @op */
+static int
+virLockManagerDLMAcquireOpPolicy(virLockManagerDLMOpPtr op)
+{
+    virLockManagerDLMPrivatePtr priv = op->man->privateData;
+
+    /* Even a request which does not queue needs an answer from
+     * the resource master, so the deadline bounds both */
+    if (priv->acquireWait != VIR_LOCK_MANAGER_DLM_WAIT_FOREVER &&
+        priv->acquireTimeout) {
+        if (virTimeMillisNow(&op->deadline) < 0)
+            return -1;
+        op->deadline += priv->acquireTimeout;
+    }
+
+    op->convertFlags = LKF_CONVERT|LKF_PERSISTENT;
+    if (priv->acquireWait == VIR_LOCK_MANAGER_DLM_WAIT_NOWAIT)
+        op->convertFlags |= LKF_NOQUEUE;
+
+    return 0;
+}
+
+static virLockManagerDLMOpPtr
+virLockManagerDLMAcquireOpNew(virLockManagerPtr lock,
+                              const char *state,
+                              virLockDriverCompletion cb,
+                              void *opaque)
+{
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMOpPtr op;
+
+    VIR_DEBUG("Acquiring object %zu, wait=%s timeout=%llu",
+              priv->nresources,
+              virLockManagerDLMWaitPolicyTypeToString(priv->acquireWait),
+              priv->acquireTimeout);
+
+    if (!(op = virLockManagerDLMOpNew(VIR_LOCK_MANAGER_DLM_OP_ACQUIRE,
+                                      lock, cb, opaque)))
+        return NULL;
+
+    if (virLockManagerDLMAcquireOpPolicy(op) < 0) {
+        virObjectUnref(op);
+        return NULL;
+    }
+
+    if (priv->acquireWait != VIR_LOCK_MANAGER_DLM_WAIT_NOWAIT) {
+        /* Queue in a global order, so that two domains waiting
+         * for the same resources can't deadlock each other */
+        qsort(priv->resources, priv->nresources, sizeof(*priv->resources),
+              virLockManagerDLMResourceNameCompare);
+    }
+
+    if (virLockManagerDLMOpLoadState(op, state) < 0) {
+        virObjectUnref(op);
+        return NULL;
+    }
+
+    return op;
+}
+
+/*
+ * Returns true if @state was handed out by a lock manager of this
+ * driver on another node, i.e. by the source of a migration.
+ */
+static bool
+virLockManagerDLMStateIsForeign(const char *state)
+{
+    unsigned int version, nodeId;
+    char *end;
+
+    if (!state || !STRPREFIX(state, VIR_LOCK_MANAGER_DLM_STATE_PREFIX))
+        return false;
+
+    state += strlen(VIR_LOCK_MANAGER_DLM_STATE_PREFIX);
+    if (virStrToLong_ui(state, &end, 10, &version) < 0 ||
+        *end != ':' ||
+        version != VIR_LOCK_MANAGER_DLM_STATE_VERSION ||
+        virStrToLong_ui(end + 1, &end, 10, &nodeId) < 0 ||
+        (*end != ';' && *end != '\0'))
+        return false;
+
+    return nodeId != driver->localNodeId;
+}
+
+/* Take @handoff away from the driver, returns false if already done */
+static bool
+virLockManagerDLMHandoffRemove(virLockManagerDLMHandoffPtr handoff)
+{
+    bool found = false;
+    size_t i;
+
+    virMutexLock(&driver->lock);
+    for (i = 0; i < driver->nhandoffs; i++) {
+        if (driver->handoffs[i] == handoff) {
+            VIR_DELETE_ELEMENT(driver->handoffs, i, driver->nhandoffs);
+            found = true;
+            break;
+        }
+    }
+    virMutexUnlock(&driver->lock);
+
+    return found;
+}
+
+/* Take the handoff of the domain @uuid, if any, away from the driver */
+static virLockManagerDLMHandoffPtr
+virLockManagerDLMHandoffSteal(const unsigned char *uuid)
+{
+    virLockManagerDLMHandoffPtr handoff = NULL;
+    size_t i;
+
+    virMutexLock(&driver->lock);
+    for (i = 0; i < driver->nhandoffs; i++) {
+        if (memcmp(driver->handoffs[i]->uuid, uuid, VIR_UUID_BUFLEN) == 0) {
+            handoff = driver->handoffs[i];
+            VIR_DELETE_ELEMENT(driver->handoffs, i, driver->nhandoffs);
+            break;
+        }
+    }
+    virMutexUnlock(&driver->lock);
+
+    return handoff;
+}
+
+/*
+ * Start the asynchronous call which waited for @handoff, now that
+ * it is over: an acquire is done if the handoff succeeded, and
+ * falls back to the usual way otherwise.
+ */
+static void
+virLockManagerDLMHandoffContinue(virLockManagerDLMHandoffPtr handoff,
+                                 virLockManagerDLMOpType type,
+                                 virLockManagerPtr man,
+                                 virLockDriverCompletion cb,
+                                 void *opaque)
+{
+    virLockManagerDLMOpPtr op = NULL;
+
+    if (type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE) {
+        if (handoff->result == 0) {
+            cb(man, 0, NULL, opaque);
+            return;
+        }
+
+        op = virLockManagerDLMAcquireOpNew(man, NULL, cb, opaque);
+    } else {
+        op = virLockManagerDLMOpNew(VIR_LOCK_MANAGER_DLM_OP_RELEASE, man,
+                                    cb, opaque);
+    }
+
+    if (op && virLockManagerDLMOpStart(op, true) == 0)
+        return;
+
+    virObjectUnref(op);
+    cb(man, -1, NULL, opaque);
+}
+
+static void
+virLockManagerDLMHandoffFinish(virLockManagerDLMHandoffPtr handoff,
+                               int result)
+{
+    virLockManagerDLMOpType cbType;
+    virLockManagerPtr cbMan;
+    virLockDriverCompletion cb;
+    void *cbOpaque;
+
+    virMutexLock(&driver->lock);
+    handoff->finished = true;
+    handoff->result = result;
+    cbType = handoff->cbType;
+    cbMan = handoff->cbMan;
+    cb = handoff->cb;
+    cbOpaque = handoff->cbOpaque;
+    handoff->cb = NULL;
+    virMutexUnlock(&driver->lock);
+
+    if (cb) {
+        virLockManagerDLMHandoffContinue(handoff, cbType, cbMan, cb, cbOpaque);
+        /* The reference taken over from the driver */
+        virObjectUnref(handoff);
+    } else {
+        virLockManagerDLMWaiterWake(&handoff->waiter);
+    }
+
+    /* Nobody needs a failed handoff anymore */
+    if (result < 0 && virLockManagerDLMHandoffRemove(handoff))
+        virObjectUnref(handoff);
+
+    virObjectUnref(handoff);
+}
+
+static void
+virLockManagerDLMHandoffReleased(virLockManagerPtr man ATTRIBUTE_UNUSED,
+                                 int result,
+                                 char *state,
+                                 void *opaque)
+{
+    virLockManagerDLMHandoffPtr handoff = opaque;
+
+    VIR_FREE(state);
+    if (result < 0) {
+        VIR_WARN("unable to release the locks of a failed handoff: %s",
+                 virGetLastErrorMessage());
+        virResetLastError();
+    }
+
+    virLockManagerDLMHandoffFinish(handoff, -1);
+}
+
+/*
+ * Whatever a failed handoff got is released at once, nobody may
+ * resume the domain.
+ */
+static void
+virLockManagerDLMHandoffAcquired(virLockManagerPtr man,
+                                 int result,
+                                 char *state,
+                                 void *opaque)
+{
+    virLockManagerDLMHandoffPtr handoff = opaque;
+    virLockManagerDLMOpPtr op;
+
+    VIR_FREE(state);
+
+    if (result < 0) {
+        VIR_WARN("lock handoff failed: %s", virGetLastErrorMessage());
+        virResetLastError();
+
+        if ((op = virLockManagerDLMOpNew(VIR_LOCK_MANAGER_DLM_OP_RELEASE, man,
+                                         virLockManagerDLMHandoffReleased,
+                                         handoff))) {
+            if (virLockManagerDLMOpStart(op, false) == 0)
+                return;
+            virObjectUnref(op);
+        }
+
+        VIR_WARN("unable to release the locks of a failed handoff: %s",
+                 virGetLastErrorMessage());
+        virResetLastError();
+    }
+
+    virLockManagerDLMHandoffFinish(handoff, result);
+}
+
+/*
+ * Queue the locks of an incoming domain, which the source of the
+ * migration handed out @state for. They are granted when the source
+ * releases them at switchover, so nobody can take them in between.
+ *
+ * Failing to do so is not an error, the locks are then acquired the
+ * usual way on resume.
+ */
+static void
+virLockManagerDLMHandoffStart(virLockManagerPtr lock,
+                              const char *state)
+{
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMHandoffPtr handoff = NULL;
+    virLockManagerDLMOpPtr op = NULL;
+    virLockManagerDLMPrivatePtr copy;
+    size_t i;
+
+    /* The ASTs of the handoff come while nobody waits for them */
+    if (!driver->handoffTimeout ||
+        priv->nresources == 0 ||
+        driver->dlmWatch < 0 ||
+        !virLockManagerDLMStateIsForeign(state))
+        return;
 
-        res->locks[res->nLocks-1].vm_pid = vm_pid;
-        res->locks[res->nLocks-1].lkid = lkid;
+    if (!(handoff = virObjectNew(virLockManagerDLMHandoffClass)) ||
+        virLockManagerDLMWaiterInit(&handoff->waiter) < 0)
+        goto error;
 
-        virStringListFree(tmpArray);
-    }
+    memcpy(handoff->uuid, priv->vm_uuid, VIR_UUID_BUFLEN);
+    if (virLockManagerDLMCopy(&handoff->man, lock) < 0)
+        goto error;
 
-    if (virHashForEach(driver->resources,
-                       virLockManagerDLMAdoptLocksInternal,
-                       NULL) < 0)
-        goto cleanup;
+    copy = handoff->man.privateData;
+    copy->acquireWait = VIR_LOCK_MANAGER_DLM_WAIT_FOREVER;
 
-    rv = 0;
+    if (!(op = virLockManagerDLMOpNew(VIR_LOCK_MANAGER_DLM_OP_ACQUIRE,
+                                      &handoff->man,
+                                      virLockManagerDLMHandoffAcquired,
+                                      handoff)))
+        goto error;
 
- cleanup:
-    VIR_FORCE_FCLOSE(fp);
-    return rv;
-}
+    /* The source may take a while to reach the switchover, but a
+     * migration which failed must not leave requests queued */
+    if (virTimeMillisNow(&op->deadline) < 0)
+        goto error;
+    op->deadline += driver->handoffTimeout;
+    op->convertFlags = LKF_CONVERT|LKF_PERSISTENT;
+    op->handoff = true;
 
-static int
-virLockManagerDLMGetLocalNodeId(unsigned int *nodeId)
-{
-    cpg_handle_t handle = 0;
-    int rv = -1;
-    int result;
+    qsort(copy->resources, copy->nresources, sizeof(*copy->resources),
+          virLockManagerDLMResourceNameCompare);
 
-    result = cpg_model_initialize(&handle, CPG_MODEL_V1, NULL, NULL);
+    if (VIR_ALLOC_N(op->batch, copy->nresources) < 0 ||
+        VIR_ALLOC_N(op->granted, copy->nresources) < 0)
+        goto error;
 
-    virReportError(VIR_ERR_INTERNAL_ERROR, "result=%d, CS_OK=%d, cpg_handle=%ld, geteuid=%d", result, CS_OK, handle, geteuid());
-    //if (cpg_model_initialize(&handle, CPG_MODEL_V1, NULL, NULL) != CS_OK) {
-    if (result != CS_OK) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("unable to create a new connection to the CPG service"));
-        return -1;
+    for (i = 0; i < copy->nresources; i++) {
+        op->batch[i].op = op;
+        op->batch[i].ast.func = virLockManagerDLMBatchAst;
+        op->batch[i].ast.opaque = op->batch + i;
+        op->batch[i].resource = i;
     }
+    op->nbatch = copy->nresources;
 
-    if (cpg_local_get(handle, nodeId) != CS_OK) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("unable to get the local node id by the CPG service"));
+    handoff->op = virObjectRef(op);
+
+    virMutexLock(&driver->lock);
+    for (i = 0; i < driver->nhandoffs; i++) {
+        if (memcmp(driver->handoffs[i]->uuid, handoff->uuid,
+                   VIR_UUID_BUFLEN) == 0)
+            break;
+    }
+    if (i < driver->nhandoffs) {
+        virMutexUnlock(&driver->lock);
+        VIR_DEBUG("locks of domain %s already handed off", priv->vm_name);
         goto cleanup;
     }
+    if (VIR_APPEND_ELEMENT_COPY(driver->handoffs, driver->nhandoffs,
+                                handoff) < 0) {
+        virMutexUnlock(&driver->lock);
+        goto error;
+    }
+    virObjectRef(handoff);
+    virMutexUnlock(&driver->lock);
+
+    VIR_DEBUG("queuing %zu locks of incoming domain %s",
+              copy->nresources, priv->vm_name);
+
+    /* Reference of the completion callback */
+    virObjectRef(handoff);
+    if (virLockManagerDLMOpStart(op, true) < 0) {
+        virObjectUnref(handoff);
+        if (virLockManagerDLMHandoffRemove(handoff))
+            virObjectUnref(handoff);
+        goto error;
+    }
+    op = NULL;
 
-    VIR_DEBUG("the local nodeId=%u", *nodeId);
-
-    rv = 0;
  cleanup:
-    ignore_value(cpg_finalize(handle));
+    virObjectUnref(op);
+    virObjectUnref(handoff);
+    return;
 
-    return rv;
+ error:
+    VIR_WARN("unable to queue the locks of incoming domain %s: %s",
+             priv->vm_name, virGetLastErrorMessage());
+    virResetLastError();
+    goto cleanup;
 }
 
+/*
+ * Wait for the handoff of the domain of @priv, canceling it if the
+ * acquire deadline passes first. Returns 0 if the locks were handed
+ * off, 1 if they have to be acquired the usual way, -1 on timeout.
+ */
 static int
-virLockManagerDLMWriteLocksInternal(void *payload,
-                                    const void *name ATTRIBUTE_UNUSED,
-                                    void *data ATTRIBUTE_UNUSED)
+virLockManagerDLMHandoffWait(virLockManagerDLMHandoffPtr handoff,
+                             virLockManagerDLMPrivatePtr priv)
 {
-    virLockManagerDLMLockResourcePtr res = payload;
-    size_t i;
+    unsigned long long deadline = 0;
+    bool canceled = false;
+
+    if (priv->acquireWait != VIR_LOCK_MANAGER_DLM_WAIT_FOREVER &&
+        priv->acquireTimeout &&
+        virTimeMillisNow(&deadline) == 0)
+        deadline += priv->acquireTimeout;
+
+    while (virLockManagerDLMWaiterWait(&handoff->waiter,
+                                       canceled ? 0 : deadline) > 0) {
+        virLockManagerDLMOpCancel(handoff->op);
+        canceled = true;
+    }
 
-    for (i = 0; i < res->nLocks; i++) {
-        if (virLockManagerDLMWrite(res->locks+i, res->name) < 0)
-            return -1;
+    if (handoff->result == 0)
+        return 0;
+
+    if (canceled) {
+        virReportError(VIR_ERR_OPERATION_TIMEOUT,
+                       _("failed to acquire lock: timed out after %llu ms "
+                         "waiting for the migration source"),
+                       priv->acquireTimeout);
+        return -1;
     }
 
-    return 0;
+    VIR_DEBUG("handoff of domain %s failed, acquiring its locks",
+              priv->vm_name);
+    return 1;
 }
 
-static int
-virLockManagerDLMSetupLockRecordFile(const bool newLockspace,
-                                     const bool purgeLockspace)
+/*
+ * Settle the handoff of the domain of @priv, if any, before its
+ * release. A handoff nobody resumed is canceled, it then releases
+ * what it got by itself.
+ */
+static void
+virLockManagerDLMHandoffCancel(virLockManagerDLMPrivatePtr priv)
 {
-    unsigned int nodeId = 0;
-    char *path = NULL;
-    int rv = -1;
-    
-    path = virFileBuildPath(RUNSTATEDIR, "/libvirt/DLMlocks", ".txt");
+    virLockManagerDLMHandoffPtr handoff;
 
-    if (!newLockspace &&
-        virLockManagerDLMAdoptLocks(path) < 0) {
-        goto cleanup;
-    }
+    if (!(handoff = virLockManagerDLMHandoffSteal(priv->vm_uuid)))
+        return;
 
-    if (purgeLockspace &&
-        !virLockManagerDLMGetLocalNodeId(&nodeId)) {
-        if (dlm_ls_purge(driver->lockspace, nodeId, 0) != 0) {
-            VIR_WARN("node=%u purge DLM locks failed in lockspace=%s",
-                     nodeId, driver->lockspaceName);
-        }
-        else
-            VIR_DEBUG("node=%u purge DLM locks sucess in lockspace=%s",
-                      nodeId, driver->lockspaceName);
-    }
+    virLockManagerDLMOpCancel(handoff->op);
+    virLockManagerDLMWaiterWait(&handoff->waiter, 0);
+    virObjectUnref(handoff);
+}
 
-    driver->lockFd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-    if (driver->lockFd < 0) {
-        virReportSystemError(errno,
-                             _("unable to open '%s'"),
-                             path);
-        goto cleanup;
+/*
+ * Same as virLockManagerDLMHandoffWait and virLockManagerDLMHandoffCancel
+ * for an asynchronous call of @type: the call is started once the
+ * handoff is over. Returns false if there is no handoff.
+ */
+static bool
+virLockManagerDLMHandoffDefer(virLockManagerPtr man,
+                              virLockManagerDLMOpType type,
+                              virLockDriverCompletion cb,
+                              void *opaque)
+{
+    virLockManagerDLMPrivatePtr priv = man->privateData;
+    virLockManagerDLMHandoffPtr handoff;
+    bool finished;
+
+    if (!(handoff = virLockManagerDLMHandoffSteal(priv->vm_uuid)))
+        return false;
+
+    virMutexLock(&driver->lock);
+    if (!(finished = handoff->finished)) {
+        /* The reference is handed over to the completion */
+        handoff->cbType = type;
+        handoff->cbMan = man;
+        handoff->cb = cb;
+        handoff->cbOpaque = opaque;
+        virObjectRef(handoff);
     }
+    virMutexUnlock(&driver->lock);
 
-    if (virHashForEach(driver->resources,
-                       virLockManagerDLMWriteLocksInternal,
-                       NULL) < 0)
-    goto cleanup;
-
-    rv = 0;
- cleanup:
-    VIR_FREE(path);
+    if (finished)
+        virLockManagerDLMHandoffContinue(handoff, type, man, cb, opaque);
+    else if (type == VIR_LOCK_MANAGER_DLM_OP_RELEASE)
+        virLockManagerDLMOpCancel(handoff->op);
 
-    return rv;
+    virObjectUnref(handoff);
+    return true;
 }
 
 static int
-virLockManagerDLMSetup(void)
+virLockManagerDLMAcquire(virLockManagerPtr lock,
+                         const char *state,
+                         unsigned int flags,
+                         virDomainLockFailureAction action,
+                         int *fd)
 {
-    bool newLockspace = false;
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMHandoffPtr handoff;
+    virLockManagerDLMWaiter waiter;
+    virLockManagerDLMOpPtr op = NULL;
+    int rv;
 
-    if (!(driver->resources = virHashCreate(VIR_RESOURCE_TABLE_SIZE,
-                                            virLockManagerDLMResourceDataFree))) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("unable to create resource hash table"));
-        return -1;
+    virCheckFlags(VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY |
+                  VIR_LOCK_MANAGER_ACQUIRE_RESTRICT, -1);
+
+    if (driver->useDaemon) {
+        if (fd)
+            *fd = -1;
+
+        /* The restriction only concerns this process, the daemon
+         * has to keep its lockspace open for everyone else */
+        return virLockManagerDLMDaemonCall(priv, VIR_DLM_PROTOCOL_PROC_ACQUIRE,
+                                           state,
+                                           flags & ~VIR_LOCK_MANAGER_ACQUIRE_RESTRICT,
+                                           action, NULL, NULL);
     }
 
-    if (!virFileExists(DLM_CLUSTER_NAME_PATH)) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("check dlm_controld, ensure it has setuped"));
+    if (fd)
+        *fd = -1;
+
+    if (virLockManagerDLMAcquireCheck(priv) < 0)
         return -1;
-    }
 
-    driver->lockspace = dlm_open_lockspace(driver->lockspaceName);
-    if (!driver->lockspace) {
-        driver->lockspace = dlm_create_lockspace(driver->lockspaceName, 0600);
-        if (!driver->lockspace) {
-            virReportSystemError(errno, "%s",
-                                 _("unable to open and create DLM lockspace"));
+    /* A restricted process is about to exec the domain, it would
+     * take the lockspace away with it */
+    if ((flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY) &&
+        !(flags & VIR_LOCK_MANAGER_ACQUIRE_RESTRICT))
+        virLockManagerDLMHandoffStart(lock, state);
+
+    if (!(flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY) &&
+        (handoff = virLockManagerDLMHandoffSteal(priv->vm_uuid))) {
+        rv = virLockManagerDLMHandoffWait(handoff, priv);
+        virObjectUnref(handoff);
+        if (rv < 0)
             return -1;
-        }
-        newLockspace = true;
+        if (rv == 0)
+            flags |= VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY;
     }
 
-    if (dlm_ls_pthread_init(driver->lockspace)) {
-        if (errno != EEXIST) {
-            virReportSystemError(errno, "%s",
-                                 _("unable to initialize lockspace"));
+    if (!(flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY)) {
+        if (virLockManagerDLMWaiterInit(&waiter) < 0)
+            return -1;
+
+        if (!(op = virLockManagerDLMAcquireOpNew(lock, state,
+                                                 virLockManagerDLMWaiterComplete,
+                                                 &waiter))) {
+            virLockManagerDLMWaiterDestroy(&waiter);
             return -1;
         }
-    }
 
-    if (virLockManagerDLMSetupLockRecordFile(newLockspace,
-                                             driver->purgeLockspace) < 0)  {
-        return -1;
+        rv = virLockManagerDLMOpRun(op, &waiter);
+        virLockManagerDLMWaiterDestroy(&waiter);
+        if (rv < 0)
+            return -1;
     }
 
+    if (flags & VIR_LOCK_MANAGER_ACQUIRE_RESTRICT)
+        virLockManagerDLMCloseLockspace();
+
     return 0;
-} 
+}
 
 static int
-virLockManagerDLMDeinit(void)
+virLockManagerDLMAcquireAsync(virLockManagerPtr lock,
+                              const char *state,
+                              unsigned int flags,
+                              virDomainLockFailureAction action,
+                              virLockDriverCompletion cb,
+                              void *opaque)
 {
-    if (!driver)
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMOpPtr op = NULL;
+
+    virCheckFlags(VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY, -1);
+
+    if (driver->useDaemon)
+        return virLockManagerDLMDaemonCallAsync(lock, VIR_DLM_PROTOCOL_PROC_ACQUIRE,
+                                                state, flags, action,
+                                                cb, opaque);
+
+    if (virLockManagerDLMAcquireCheck(priv) < 0 ||
+        virLockManagerDLMAsyncCheck() < 0)
+        return -1;
+
+    if (flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY) {
+        virLockManagerDLMHandoffStart(lock, state);
+        cb(lock, 0, NULL, opaque);
         return 0;
+    }
 
-    if (driver->lockspace)
-        ignore_value(dlm_close_lockspace(driver->lockspace));
+    virLockManagerDLMSweep();
 
-    if (driver->resources)
-        virHashFree(driver->resources);
+    if (virLockManagerDLMHandoffDefer(lock, VIR_LOCK_MANAGER_DLM_OP_ACQUIRE,
+                                      cb, opaque))
+        return 0;
 
-    if (driver->lockFd)
-        VIR_FORCE_CLOSE(driver->lockFd);
+    if (!(op = virLockManagerDLMAcquireOpNew(lock, state, cb, opaque)))
+        return -1;
 
-    VIR_FREE(driver->lockspaceName);
-    VIR_FREE(driver);
+    if (virLockManagerDLMOpStart(op, true) < 0) {
+        virObjectUnref(op);
+        return -1;
+    }
 
     return 0;
 }
 
 static int
-virLockManagerDLMInit(unsigned int version,
-                      const char *configFile,
-                      unsigned int flags)
+virLockManagerDLMRelease(virLockManagerPtr lock,
+                         char **state,
+                         unsigned int flags)
 {
-    VIR_DEBUG("version=%u configFile=%s flags=0x%x", version, NULLSTR(configFile), flags);
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMWaiter waiter;
+    virLockManagerDLMOpPtr op = NULL;
+    int rv = -1;
 
     virCheckFlags(0, -1);
 
-    if (driver)
-        return 0;
+    if (state)
+        *state = NULL;
 
-    if (geteuid() != 0) {
+    if (driver->useDaemon)
+        return virLockManagerDLMDaemonCall(priv, VIR_DLM_PROTOCOL_PROC_RELEASE,
+                                           NULL, flags, 0, NULL, state);
+
+    if (!driver->lockspace) {
         virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("DLM lock requires root privileges"));
+                       _("lockspace is not opened"));
         return -1;
     }
 
-    if (VIR_ALLOC(driver) < 0)
+    virLockManagerDLMHandoffCancel(priv);
+
+    if (virLockManagerDLMWaiterInit(&waiter) < 0)
         return -1;
 
-    driver->autoDiskLease = true;
-    driver->requireLeaseForDisks = !driver->autoDiskLease;
-    driver->purgeLockspace = true;
+    if (!(op = virLockManagerDLMOpNew(VIR_LOCK_MANAGER_DLM_OP_RELEASE, lock,
+                                      virLockManagerDLMWaiterComplete,
+                                      &waiter)))
+        goto cleanup;
 
-    if (VIR_STRDUP(driver->lockspaceName, "libvirt") < 0)
-        goto error;
+    /* Keep the locks at NL so that the acquire given the state
+     * converts them back at once */
+    if (state) {
+        if (virLockManagerDLMStateFormat(priv, &op->state) < 0) {
+            virObjectUnref(op);
+            goto cleanup;
+        }
+        op->retain = !!op->state;
+    }
 
-    if (virLockManagerDLMLoadConfig(configFile) < 0)
-        goto error;
+    rv = virLockManagerDLMOpRun(op, &waiter);
 
-    if (virLockManagerDLMSetup() < 0)
-        goto error;
+    virLockManagerDLMSweep();
 
-    return 0;
+    if (rv == 0 && state)
+        VIR_STEAL_PTR(*state, waiter.state);
 
- error:
-    virLockManagerDLMDeinit();
-    return -1;
+ cleanup:
+    virLockManagerDLMWaiterDestroy(&waiter);
+    return rv;
 }
 
 static int
-virLockManagerDLMNew(virLockManagerPtr lock,
-                     unsigned int type,
-                     size_t nparams,
-                     virLockManagerParamPtr params,
-                     unsigned int flags)
+virLockManagerDLMReleaseAsync(virLockManagerPtr lock,
+                              unsigned int flags,
+                              virLockDriverCompletion cb,
+                              void *opaque)
 {
-    virLockManagerDLMPrivatePtr priv = NULL;
-    size_t i;
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMOpPtr op = NULL;
 
-    virCheckFlags(VIR_LOCK_MANAGER_NEW_STARTED, -1);
+    virCheckFlags(0, -1);
 
-    if (!driver) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("DLM plugin is not initialized"));
-        return -1;
-    }
+    if (driver->useDaemon)
+        return virLockManagerDLMDaemonCallAsync(lock, VIR_DLM_PROTOCOL_PROC_RELEASE,
+                                                NULL, flags, 0, cb, opaque);
 
-    if (type != VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("unsupported object type %d"), type);
+    if (!driver->lockspace) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("lockspace is not opened"));
         return -1;
     }
 
-    if (VIR_ALLOC(priv) < 0)
+    if (virLockManagerDLMAsyncCheck() < 0)
         return -1;
 
-    lock->privateData = priv;
+    /* What the previous asynchronous releases left behind */
+    virLockManagerDLMSweep();
 
-    for (i = 0; i < nparams; i++) {
-        if (STREQ(params[i].key, "uuid")) {
-            memcpy(priv->vm_uuid, params[i].value.uuid, VIR_UUID_BUFLEN);
-        } else if (STREQ(params[i].key, "name")) {
-            if (VIR_STRDUP(priv->vm_name, params[i].value.str) < 0)
-                return -1;
-        } else if (STREQ(params[i].key, "id")) {
-            priv->vm_id = params[i].value.ui;
-        } else if (STREQ(params[i].key, "pid")) {
-            priv->vm_pid = params[i].value.iv;
-        } else if (STREQ(params[i].key, "uri")) {
-            /* ignore */
-        } else {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("unexpected parameter %s for object"),
-                           params[i].key);
-        }
-    }
+    if (virLockManagerDLMHandoffDefer(lock, VIR_LOCK_MANAGER_DLM_OP_RELEASE,
+                                      cb, opaque))
+        return 0;
 
-    if (priv->vm_pid == 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("missing PID parameter for domain object"));
-        return -1;
-    }
-    if (priv->vm_name == NULL) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("missing name parameter for domain object"));
-        return -1;
-    }
-    if (priv->vm_id == 0) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("missing ID parameter for domain object"));
+    if (!(op = virLockManagerDLMOpNew(VIR_LOCK_MANAGER_DLM_OP_RELEASE, lock,
+                                      cb, opaque)))
         return -1;
-    }
-    if (!virUUIDIsValid(priv->vm_uuid)) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("missing UUID parameter for domain object"));
+
+    if (virLockManagerDLMStateFormat(priv, &op->state) < 0) {
+        virObjectUnref(op);
+        return -1;
+    }
+    op->retain = !!op->state;
+
+    if (virLockManagerDLMOpStart(op, true) < 0) {
+        virObjectUnref(op);
         return -1;
     }
 
     return 0;
 }
 
-static void
-virLockManagerDLMFree(virLockManagerPtr lock)
+/*
+ * Bring the lock @name, stolen, of the domain, added as @path, to
+ * @mode. Only called without virtdlmd.
+ */
+static int
+virLockManagerDLMUpdateOne(virLockManagerPtr lock,
+                           char **name,
+                           const char *path,
+                           unsigned int mode)
 {
-    virLockManagerDLMPrivatePtr priv  = lock->privateData;
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+    virLockManagerDLMWaiter waiter;
+    virLockManagerDLMOpPtr op = NULL;
+    virLockManagerDLMResource resource = { NULL, LKM_NLMODE, NULL };
+    unsigned int oldMode = LKM_NLMODE;
+    ssize_t i;
+    int rv = -1;
 
-    if (!priv)
-        return;
+    VIR_STEAL_PTR(resource.name, *name);
+    resource.mode = mode;
 
-    VIR_FREE(priv->resources);
-    VIR_FREE(priv->vm_name);
-    VIR_FREE(priv);
-    lock->privateData = NULL;
+    if ((i = virLockManagerDLMResourceFind(priv, resource.name)) < 0) {
+        if (resource.mode == LKM_NLMODE) {
+            rv = 0;
+            goto cleanup;
+        }
 
-    return;
+        if (VIR_STRDUP(resource.path, path) < 0 ||
+            VIR_APPEND_ELEMENT_COPY(priv->resources, priv->nresources,
+                                    resource) < 0)
+            goto cleanup;
+        resource.name = NULL;
+        resource.path = NULL;
+        i = priv->nresources - 1;
+    } else {
+        oldMode = priv->resources[i].mode;
+        priv->resources[i].mode = resource.mode;
+    }
+
+    VIR_DEBUG("Updating resource %s from %s to %s",
+              priv->resources[i].name,
+              virLockManagerDLMModeTypeToString(oldMode),
+              virLockManagerDLMModeTypeToString(resource.mode));
+
+    virLockManagerDLMSweep();
+
+    if (virLockManagerDLMWaiterInit(&waiter) < 0)
+        goto restore;
+
+    if (!(op = virLockManagerDLMOpNew(resource.mode == LKM_NLMODE ?
+                                      VIR_LOCK_MANAGER_DLM_OP_RELEASE :
+                                      VIR_LOCK_MANAGER_DLM_OP_ACQUIRE,
+                                      lock, virLockManagerDLMWaiterComplete,
+                                      &waiter)) ||
+        (op->type == VIR_LOCK_MANAGER_DLM_OP_ACQUIRE &&
+         virLockManagerDLMAcquireOpPolicy(op) < 0)) {
+        virObjectUnref(op);
+        virLockManagerDLMWaiterDestroy(&waiter);
+        goto restore;
+    }
+
+    op->next = i;
+    op->end = i + 1;
+    op->update = true;
+
+    rv = virLockManagerDLMOpRun(op, &waiter);
+    virLockManagerDLMWaiterDestroy(&waiter);
+    if (rv < 0)
+        goto restore;
+
+    if (resource.mode == LKM_NLMODE) {
+        VIR_FREE(priv->resources[i].name);
+        VIR_FREE(priv->resources[i].path);
+        VIR_DELETE_ELEMENT(priv->resources, i, priv->nresources);
+    }
+
+ cleanup:
+    VIR_FREE(resource.name);
+    VIR_FREE(resource.path);
+    return rv;
+
+ restore:
+    if (oldMode != LKM_NLMODE) {
+        priv->resources[i].mode = oldMode;
+    } else {
+        VIR_FREE(priv->resources[i].name);
+        VIR_FREE(priv->resources[i].path);
+        VIR_DELETE_ELEMENT(priv->resources, i, priv->nresources);
+    }
+    rv = -1;
+    goto cleanup;
 }
 
+/*
+ * Change the mode of a resource of a running domain, or acquire it
+ * if the domain does not hold it yet. A held lock is converted in
+ * place, so the resource stays protected if the conversion fails.
+ *
+ * The device lock of a region may be shared with other regions of
+ * the domain, it is strengthened before the region but never
+ * weakened here, that waits for the domain to release its locks.
+ * The chunks of a region are converted in turn, those done before
+ * a failure keep their new mode.
+ */
 static int
-virLockManagerDLMAddResource(virLockManagerPtr lock,
-                             unsigned int type,
-                             const char *name,
-                             size_t nparams,
-                             virLockManagerParamPtr params,
-                             unsigned int flags)
+virLockManagerDLMUpdateResource(virLockManagerPtr lock,
+                                unsigned int type,
+                                const char *name,
+                                size_t nparams,
+                                virLockManagerParamPtr params,
+                                unsigned int flags)
 {
     virLockManagerDLMPrivatePtr priv = lock->privateData;
-    char *newName = NULL;
+    virDLMProtocolBuffer args;
+    char **names = NULL;
+    size_t nnames = 0;
+    char *intentName = NULL;
+    unsigned int mode, intentMode;
+    ssize_t i;
+    size_t j;
     int rv = -1;
 
     virCheckFlags(VIR_LOCK_MANAGER_RESOURCE_READONLY |
                   VIR_LOCK_MANAGER_RESOURCE_SHARED, -1);
- 
-    if (flags & VIR_LOCK_MANAGER_RESOURCE_READONLY)
-        return 0;
-
-    switch (type) {
-    case VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK:
-        if (params || nparams) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("unexpected parameters for disk resource"));
-            return -1;
-        }
-
-        if (!driver->autoDiskLease) {
-            if (!(flags & (VIR_LOCK_MANAGER_RESOURCE_SHARED |
-                           VIR_LOCK_MANAGER_RESOURCE_READONLY))) {
-                priv->hasRWDisks = true;
-
-                return 0;
-            }
-        }
 
-        if (virCryptoHashString(VIR_CRYPTO_HASH_SHA256, name, &newName) < 0)
-            goto error;
+    memset(&args, 0, sizeof(args));
 
-        break;
+    if (driver->useDaemon) {
+        if (virDLMProtocolAddUInt32(&args, type) < 0 ||
+            virDLMProtocolAddString(&args, name) < 0 ||
+            virDLMProtocolAddParams(&args, nparams, params) < 0 ||
+            virDLMProtocolAddUInt32(&args, flags) < 0 ||
+            virLockManagerDLMDaemonCall(priv,
+                                        VIR_DLM_PROTOCOL_PROC_UPDATE_RESOURCE,
+                                        NULL, 0, 0, &args, NULL) < 0)
+            goto cleanup;
 
-    case VIR_LOCK_MANAGER_RESOURCE_TYPE_LEASE:
-        if (VIR_STRDUP(newName, name) < 0)
-            goto error;
+        /* Part of the context of the next calls, where it replaces
+         * the former mode of the resource */
+        if (virDLMProtocolAddUInt32(&priv->requests, type) < 0 ||
+            virDLMProtocolAddString(&priv->requests, name) < 0 ||
+            virDLMProtocolAddParams(&priv->requests, nparams, params) < 0 ||
+            virDLMProtocolAddUInt32(&priv->requests,
+                                    flags | VIR_LOCK_MANAGER_DLM_RESOURCE_UPDATE) < 0)
+            goto cleanup;
+        priv->nrequests++;
 
-        break;
+        rv = 0;
+        goto cleanup;
+    }
 
-    default:
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("unknown lock manager object type %d"),
-                       type);
+    if (!driver->lockspace) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("lockspace is not opened"));
         return -1;
     }
 
-    if (VIR_EXPAND_N(priv->resources, priv->nresources, 1) < 0)
-        goto error;
+    if (virLockManagerDLMResourceParse(priv, type, name, nparams, params,
+                                       flags, &names, &nnames, &mode,
+                                       &intentName, &intentMode) < 0)
+        return -1;
 
-    VIR_STEAL_PTR(priv->resources[priv->nresources-1].name, newName);
+    /* Nothing to hold, nor to let go */
+    if (nnames == 0) {
+        rv = 0;
+        goto cleanup;
+    }
 
-    if (flags & VIR_LOCK_MANAGER_RESOURCE_SHARED)
-        priv->resources[priv->nresources-1].mode = LKM_PRMODE;
-    else
-        priv->resources[priv->nresources-1].mode = LKM_EXMODE;
+    if (intentName && intentMode != LKM_NLMODE) {
+        i = virLockManagerDLMResourceFind(priv, intentName);
+        if ((i < 0 ||
+             (priv->resources[i].mode == LKM_CRMODE &&
+              intentMode != LKM_CRMODE)) &&
+            virLockManagerDLMUpdateOne(lock, &intentName, name,
+                                       intentMode) < 0)
+            goto cleanup;
+    }
+
+    for (j = 0; j < nnames; j++) {
+        if (virLockManagerDLMUpdateOne(lock, &names[j], name, mode) < 0)
+            goto cleanup;
+    }
 
     rv = 0;
- error:
-    VIR_FREE(newName);
+ cleanup:
+    virStringListFreeCount(names, nnames);
+    VIR_FREE(intentName);
+    virDLMProtocolBufferFree(&args);
     return rv;
 }
 
 static int
-virLockManagerDLMAcquire(virLockManagerPtr lock,
-                         const char *state ATTRIBUTE_UNUSED,
-                         unsigned int flags,
-                         virDomainLockFailureAction action ATTRIBUTE_UNUSED,
-                         int *fd)
+virLockManagerDLMInquire(virLockManagerPtr lock,
+                         char **state,
+                         unsigned int flags)
 {
     virLockManagerDLMPrivatePtr priv = lock->privateData;
-    virLockManagerDLMResourcePtr args = NULL;
-    virLockManagerDLMLockResourcePtr res = NULL;
-    struct dlm_lksb lksb;
-    int rv = -1;
-    size_t i, index;
 
-    virCheckFlags(VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY |
-                  VIR_LOCK_MANAGER_ACQUIRE_RESTRICT, -1);
+    virCheckFlags(0, -1);
 
-    if (priv->nresources == 0 &&
-        priv->hasRWDisks &&
-        driver->requireLeaseForDisks) {
-        virReportError(VIR_ERR_CONFIG_UNSUPPORTED, "%s",
-                       _("read/write, exclusive access, disk were present, but no leases specified"));
-        return -1;
-    }
+    if (state)
+        *state = NULL;
 
-    if (fd)
-        *fd = -1;
+    if (driver->useDaemon)
+        return virLockManagerDLMDaemonCall(priv, VIR_DLM_PROTOCOL_PROC_INQUIRE,
+                                           NULL, flags, 0, NULL, state);
 
-    if (!driver->lockspace) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("lockspace is not opened"));
-        return -1;
+    if (!state)
+        return 0;
+
+    return virLockManagerDLMStateFormat(priv, state);
+}
+
+/*
+ * With trace_file set, the entry points below append a record of
+ * every call to the trace, which bench/dlm_replay.c feeds back to
+ * the plugin. The record of an asynchronous call is written on its
+ * completion, so that it carries the outcome of the operation.
+ */
+typedef struct _virLockManagerDLMTraceAsync virLockManagerDLMTraceAsync;
+typedef virLockManagerDLMTraceAsync *virLockManagerDLMTraceAsyncPtr;
+struct _virLockManagerDLMTraceAsync {
+    virDLMTraceRecord record;
+    unsigned long long start;
+    virLockDriverCompletion cb;
+    void *opaque;
+};
+
+static bool
+virLockManagerDLMTracing(void)
+{
+    return driver && driver->trace;
+}
+
+static void
+virLockManagerDLMTraceDomain(virDLMTraceRecordPtr record,
+                             virLockManagerPtr lock)
+{
+    virLockManagerDLMPrivatePtr priv = lock->privateData;
+
+    if (priv) {
+        memcpy(record->uuid, priv->vm_uuid, VIR_UUID_BUFLEN);
+        record->id = priv->vm_id;
     }
+}
 
-    if (!(flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY)) {
-        VIR_DEBUG("Acquiring object %zu", priv->nresources);
-
-        for (i = 0; i < priv->nresources; i++) {
-            args = priv->resources + i;
-            memset(&lksb, 0, sizeof(lksb));
-
-            if (!(res = virHashLookup(driver->resources, args->name))) {
-                if (VIR_ALLOC(res) < 0)
-                    return -1;
-                if (VIR_STRDUP(res->name, args->name) < 0)
-                    return -1;
-
-                if (virHashAddEntry(driver->resources, args->name, res) < 0) {
-                    VIR_FREE(res->name);
-                    VIR_FREE(res);
-                    return -1;
-                }
-            }
+/*
+ * Returns the CLOCK_MONOTONIC start of the call, which times it
+ * whatever happens to the wall clock of record->time meanwhile.
+ */
+static unsigned long long
+virLockManagerDLMTraceBegin(virDLMTraceRecordPtr record,
+                            virDLMTraceCall call,
+                            virLockManagerPtr lock,
+                            unsigned int flags)
+{
+    memset(record, 0, sizeof(*record));
+    record->time = virDLMTraceNow();
+    record->call = call;
+    record->flags = flags;
 
-            if (res->nLocks == res->nHolders) {
-                rv = dlm_ls_lock_wait(driver->lockspace, LKM_NLMODE,
-                                      &lksb, LKF_EXPEDITE,
-                                      args->name, strlen(args->name),
-                                      0, NULL, NULL, NULL);
-                if ((rv < 0) || (lksb.sb_status != 0)) {
-                    virReportError(VIR_ERR_INTERNAL_ERROR,
-                                   _("unable to add NL lock, rv=%d, lockStatus=%d"),
-                                   rv, lksb.sb_status);
-                    return -1;
-                }
-                if (VIR_EXPAND_N(res->locks, res->nLocks, 1) < 0)
-                    return -1;
-            
-                index = res->nLocks - 1;
-                res->locks[index].vm_pid = 0;
-                res->locks[index].lkid = lksb.sb_lkid;
-            }
-            else {
-                for (index = 0; index < res->nLocks; index++) {
-                    if (res->locks[index].vm_pid == 0)
-                        break;
-                } 
-                lksb.sb_lkid = res->locks[index].lkid;
-            }
+    virLockManagerDLMTraceDomain(record, lock);
 
-            rv = dlm_ls_lock_wait(driver->lockspace, args->mode,
-                                  &lksb, LKF_CONVERT|LKF_NOQUEUE|LKF_PERSISTENT,
-                                  args->name, strlen(args->name),
-                                  0, NULL, NULL, NULL);
-            if ((rv < 0) || (lksb.sb_status != 0)) {
-                if (lksb.sb_status == EAGAIN)
-                    virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                                   _("failed to acquire lock: the lock could not be granted"));
-                else
-                    virReportError(errno,
-                                   _("failed to acquire lock: rv=%d lockStatus=%d"),
-                                   rv, lksb.sb_status);
-                return -1;
-            }
+    return virDLMStatsNow();
+}
 
-            res->locks[index].vm_pid = priv->vm_pid;
-            res->nHolders += 1;
-            res->mode = args->mode;
+static void
+virLockManagerDLMTraceEnd(virDLMTraceRecordPtr record,
+                          unsigned long long start,
+                          int result)
+{
+    unsigned long long elapsed = (virDLMStatsNow() - start) / 1000;
 
-            if (virLockManagerDLMWrite(res->locks+index, res->name) < 0) {
-                virReportSystemError(errno, "%s",
-                                     "unable to write lock information to file");
-                return -1;
-            }
-        }
+    record->result = result;
+    record->duration = MIN(elapsed, UINT32_MAX);
+
+    virDLMTraceWrite(driver->trace, record);
+}
+
+static void
+virLockManagerDLMTraceResource(virDLMTraceRecordPtr record,
+                               unsigned long long start,
+                               unsigned int type,
+                               const char *name,
+                               size_t nparams,
+                               virLockManagerParamPtr params,
+                               unsigned int flags,
+                               int result)
+{
+    unsigned long long offset, length;
+    bool isRegion;
+
+    record->type = type;
+    record->mode = virLockManagerDLMResourceMode(flags);
+
+    if (virDLMTraceDigest(name, record->digest) < 0)
+        virResetLastError();
+
+    /* The parameters were checked by the call if it succeeded */
+    if (result == 0 &&
+        type == VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK &&
+        virLockManagerDLMRegionParse(nparams, params, &isRegion,
+                                     &offset, &length) == 0) {
+        record->offset = offset;
+        record->length = length;
     }
 
-    if (flags & VIR_LOCK_MANAGER_ACQUIRE_RESTRICT) {
-        ignore_value(dlm_close_lockspace(driver->lockspace));
-        driver->lockspace = NULL;
+    virLockManagerDLMTraceEnd(record, start, result);
+}
+
+static void
+virLockManagerDLMTraceComplete(virLockManagerPtr man,
+                               int result,
+                               char *state,
+                               void *opaque)
+{
+    virLockManagerDLMTraceAsyncPtr async = opaque;
+    virLockDriverCompletion cb = async->cb;
+    void *cbOpaque = async->opaque;
+
+    if (virLockManagerDLMTracing()) {
+        if (async->record.call == VIR_DLM_TRACE_CALL_RELEASE_ASYNC)
+            async->record.state = !!state;
+        virLockManagerDLMTraceEnd(&async->record, async->start, result);
     }
 
-    return 0;
+    VIR_FREE(async);
+    cb(man, result, state, cbOpaque);
 }
 
 static int
-virLockManagerDLMRelease(virLockManagerPtr lock,
-                         char **state,
-                         unsigned int flags)
+virLockManagerDLMTraceNew(virLockManagerPtr lock,
+                          unsigned int type,
+                          size_t nparams,
+                          virLockManagerParamPtr params,
+                          unsigned int flags)
 {
-    virLockManagerDLMPrivatePtr priv = lock->privateData;
-    virLockManagerDLMResourcePtr args = NULL;
-    virLockManagerDLMLockResourcePtr res = NULL;
-    struct dlm_lksb lksb;
-    int rv = -1;
-    size_t i;
+    virDLMTraceRecord record;
+    unsigned long long start;
+    int rv;
 
-    virCheckFlags(0, -1);
+    if (!virLockManagerDLMTracing())
+        return virLockManagerDLMNew(lock, type, nparams, params, flags);
 
-    if (state)
-        *state = NULL;
+    start = virLockManagerDLMTraceBegin(&record, VIR_DLM_TRACE_CALL_NEW,
+                                        lock, flags);
+    rv = virLockManagerDLMNew(lock, type, nparams, params, flags);
 
-    if (!driver->lockspace) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("lockspace is not opened"));
-        return -1;
+    /* Only known once the parameters are parsed */
+    virLockManagerDLMTraceDomain(&record, lock);
+    record.type = type;
+    virLockManagerDLMTraceEnd(&record, start, rv);
+
+    return rv;
+}
+
+static void
+virLockManagerDLMTraceFree(virLockManagerPtr lock)
+{
+    virDLMTraceRecord record;
+    unsigned long long start;
+
+    if (!virLockManagerDLMTracing()) {
+        virLockManagerDLMFree(lock);
+        return;
     }
 
-    for (i = 0; i < priv->nresources; i++) {
-        args = priv->resources + i;
+    start = virLockManagerDLMTraceBegin(&record, VIR_DLM_TRACE_CALL_FREE,
+                                        lock, 0);
+    virLockManagerDLMFree(lock);
+    virLockManagerDLMTraceEnd(&record, start, 0);
+}
 
-        if (!(res = virHashLookup(driver->resources, args->name)))
-            continue;
+static int
+virLockManagerDLMTraceAddResource(virLockManagerPtr lock,
+                                  unsigned int type,
+                                  const char *name,
+                                  size_t nparams,
+                                  virLockManagerParamPtr params,
+                                  unsigned int flags)
+{
+    virDLMTraceRecord record;
+    unsigned long long start;
+    int rv;
 
-        if (res->nHolders == 0)
-            continue;
+    if (!virLockManagerDLMTracing())
+        return virLockManagerDLMAddResource(lock, type, name,
+                                            nparams, params, flags);
 
-        for (i = 0; i < res->nLocks; i++) {
-            if (priv->vm_pid == res->locks[i].vm_pid)
-                break;
-        }
+    start = virLockManagerDLMTraceBegin(&record,
+                                        VIR_DLM_TRACE_CALL_ADD_RESOURCE,
+                                        lock, flags);
+    rv = virLockManagerDLMAddResource(lock, type, name, nparams, params, flags);
+    virLockManagerDLMTraceResource(&record, start, type, name,
+                                   nparams, params, flags, rv);
 
-        if (i == res->nLocks)
-            continue;
+    return rv;
+}
 
-        memset(&lksb, 0, sizeof(lksb));
-        lksb.sb_lkid = res->locks[i].lkid;
-        rv = dlm_ls_lock_wait(driver->lockspace, LKM_NLMODE,
-                              &lksb, LKF_CONVERT,
-                              res->name, strlen(res->name), 
-                              0, NULL, NULL, NULL);
-        if ((rv < 0) || (lksb.sb_status != 0)) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                           _("failed to release lock: rv=%d lockStatus=%d"),
-                           rv, lksb.sb_status);
-            goto cleanup;
-        }
+static int
+virLockManagerDLMTraceUpdateResource(virLockManagerPtr lock,
+                                     unsigned int type,
+                                     const char *name,
+                                     size_t nparams,
+                                     virLockManagerParamPtr params,
+                                     unsigned int flags)
+{
+    virDLMTraceRecord record;
+    unsigned long long start;
+    int rv;
 
-        res->nHolders -= 1;
-        res->locks[i].vm_pid = 0;
-        if (virLockManagerDLMWrite(res->locks+i, res->name) < 0) {
-            virReportSystemError(errno, "%s",
-                                 "unable to write lock information to file");
-            return -1;
-        }
+    if (!virLockManagerDLMTracing())
+        return virLockManagerDLMUpdateResource(lock, type, name,
+                                               nparams, params, flags);
 
-        if (res->nHolders == 0)
-            virHashRemoveEntry(driver->resources, res->name);
+    start = virLockManagerDLMTraceBegin(&record,
+                                        VIR_DLM_TRACE_CALL_UPDATE_RESOURCE,
+                                        lock, flags);
+    rv = virLockManagerDLMUpdateResource(lock, type, name,
+                                         nparams, params, flags);
+    virLockManagerDLMTraceResource(&record, start, type, name,
+                                   nparams, params, flags, rv);
 
-    }
+    return rv;
+}
+
+static int
+virLockManagerDLMTraceAcquire(virLockManagerPtr lock,
+                              const char *state,
+                              unsigned int flags,
+                              virDomainLockFailureAction action,
+                              int *fd)
+{
+    virDLMTraceRecord record;
+    unsigned long long start;
+    int rv;
+
+    if (!virLockManagerDLMTracing())
+        return virLockManagerDLMAcquire(lock, state, flags, action, fd);
+
+    start = virLockManagerDLMTraceBegin(&record, VIR_DLM_TRACE_CALL_ACQUIRE,
+                                        lock, flags);
+    record.action = action;
+    record.state = !!state;
+    rv = virLockManagerDLMAcquire(lock, state, flags, action, fd);
+    virLockManagerDLMTraceEnd(&record, start, rv);
 
-    rv = 0;
- cleanup:
     return rv;
 }
 
 static int
-virLockManagerDLMInquire(virLockManagerPtr lock ATTRIBUTE_UNUSED,
-                         char **state,
-                         unsigned int flags)
+virLockManagerDLMTraceRelease(virLockManagerPtr lock,
+                              char **state,
+                              unsigned int flags)
 {
-    virCheckFlags(0, -1);
+    virDLMTraceRecord record;
+    unsigned long long start;
+    int rv;
 
-    if (state)
-        *state = NULL;
+    if (!virLockManagerDLMTracing())
+        return virLockManagerDLMRelease(lock, state, flags);
+
+    start = virLockManagerDLMTraceBegin(&record, VIR_DLM_TRACE_CALL_RELEASE,
+                                        lock, flags);
+    record.state = !!state;
+    rv = virLockManagerDLMRelease(lock, state, flags);
+    virLockManagerDLMTraceEnd(&record, start, rv);
+
+    return rv;
+}
+
+static int
+virLockManagerDLMTraceInquire(virLockManagerPtr lock,
+                              char **state,
+                              unsigned int flags)
+{
+    virDLMTraceRecord record;
+    unsigned long long start;
+    int rv;
+
+    if (!virLockManagerDLMTracing())
+        return virLockManagerDLMInquire(lock, state, flags);
+
+    start = virLockManagerDLMTraceBegin(&record, VIR_DLM_TRACE_CALL_INQUIRE,
+                                        lock, flags);
+    record.state = !!state;
+    rv = virLockManagerDLMInquire(lock, state, flags);
+    virLockManagerDLMTraceEnd(&record, start, rv);
+
+    return rv;
+}
+
+/*
+ * The completion may run before the call returns, so @async belongs
+ * to it unless the operation did not start.
+ */
+static int
+virLockManagerDLMTraceAcquireAsync(virLockManagerPtr lock,
+                                   const char *state,
+                                   unsigned int flags,
+                                   virDomainLockFailureAction action,
+                                   virLockDriverCompletion cb,
+                                   void *opaque)
+{
+    virLockManagerDLMTraceAsyncPtr async = NULL;
+
+    if (!virLockManagerDLMTracing() || VIR_ALLOC(async) < 0)
+        return virLockManagerDLMAcquireAsync(lock, state, flags, action,
+                                             cb, opaque);
+
+    async->start = virLockManagerDLMTraceBegin(&async->record,
+                                               VIR_DLM_TRACE_CALL_ACQUIRE_ASYNC,
+                                               lock, flags);
+    async->record.action = action;
+    async->record.state = !!state;
+    async->cb = cb;
+    async->opaque = opaque;
+
+    if (virLockManagerDLMAcquireAsync(lock, state, flags, action,
+                                      virLockManagerDLMTraceComplete,
+                                      async) < 0) {
+        virLockManagerDLMTraceEnd(&async->record, async->start, -1);
+        VIR_FREE(async);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+virLockManagerDLMTraceReleaseAsync(virLockManagerPtr lock,
+                                   unsigned int flags,
+                                   virLockDriverCompletion cb,
+                                   void *opaque)
+{
+    virLockManagerDLMTraceAsyncPtr async = NULL;
+
+    if (!virLockManagerDLMTracing() || VIR_ALLOC(async) < 0)
+        return virLockManagerDLMReleaseAsync(lock, flags, cb, opaque);
+
+    async->start = virLockManagerDLMTraceBegin(&async->record,
+                                               VIR_DLM_TRACE_CALL_RELEASE_ASYNC,
+                                               lock, flags);
+    async->cb = cb;
+    async->opaque = opaque;
+
+    if (virLockManagerDLMReleaseAsync(lock, flags,
+                                      virLockManagerDLMTraceComplete,
+                                      async) < 0) {
+        virLockManagerDLMTraceEnd(&async->record, async->start, -1);
+        VIR_FREE(async);
+        return -1;
+    }
 
     return 0;
 }
@@ -902,12 +6219,17 @@ virLockDriver virLockDriverImpl =
     .drvInit = virLockManagerDLMInit,
     .drvDeinit = virLockManagerDLMDeinit,
 
-    .drvNew = virLockManagerDLMNew,
-    .drvFree = virLockManagerDLMFree,
+    .drvNew = virLockManagerDLMTraceNew,
+    .drvFree = virLockManagerDLMTraceFree,
+
+    .drvAddResource = virLockManagerDLMTraceAddResource,
+
+    .drvAcquire = virLockManagerDLMTraceAcquire,
+    .drvRelease = virLockManagerDLMTraceRelease,
+    .drvInquire = virLockManagerDLMTraceInquire,
 
-    .drvAddResource = virLockManagerDLMAddResource,
+    .drvAcquireAsync = virLockManagerDLMTraceAcquireAsync,
+    .drvReleaseAsync = virLockManagerDLMTraceReleaseAsync,
 
-    .drvAcquire = virLockManagerDLMAcquire,
-    .drvRelease = virLockManagerDLMRelease,
-    .drvInquire = virLockManagerDLMInquire,
+    .drvUpdateResource = virLockManagerDLMTraceUpdateResource,
 };
@@ -0,0 +1,59 @@
+/*
+ * lock_driver_dlm.h: private interfaces of the DLM lock driver
+ *
+ * Copyright (C) 2018 SUSE LINUX Products, Beijing, China.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VIR_LOCK_DRIVER_DLM_H__
+# define __VIR_LOCK_DRIVER_DLM_H__
+
+# include "lock_driver.h"
+
+/*
+ * Flags only understood by the DLM driver, they are never passed
+ * by libvirtd itself but by programs embedding the driver.
+ */
+typedef enum {
+    /* The driver is hosted by virtdlmd, always own the lockspace
+     * in this process whatever the configuration file says */
+    VIR_LOCK_MANAGER_DLM_INIT_SERVER = (1 << 16),
+} virLockManagerDLMInitFlags;
+
+/*
+ * Optional virLockManagerNew parameters overriding, for the
+ * requests of one lock manager, the acquire_wait (string) and
+ * acquire_timeout (unsigned long, milliseconds) settings of the
+ * configuration file.
+ */
+# define VIR_LOCK_MANAGER_DLM_PARAM_ACQUIRE_WAIT "acquire_wait"
+# define VIR_LOCK_MANAGER_DLM_PARAM_ACQUIRE_TIMEOUT "acquire_timeout"
+
+/*
+ * Optional parameters of a disk resource restricting the lock to
+ * the region of @length bytes at @offset (unsigned long) of the
+ * device. Regions in different chunks of region_chunk_size bytes of
+ * a device can then be held by different domains at once, while
+ * overlapping regions conflict and any of them keeps out the domains
+ * locking the whole device.
+ */
+# define VIR_LOCK_MANAGER_DLM_PARAM_OFFSET "offset"
+# define VIR_LOCK_MANAGER_DLM_PARAM_LENGTH "length"
+
+extern virLockDriver virLockDriverImpl;
+
+#endif /* __VIR_LOCK_DRIVER_DLM_H__ */